@@ -1,9 +1,7 @@
 #include <libyuv.h>
 
-#include <chrono>
-#include <deque>
-#include <fstream>
-#include <thread>
+#include <atomic>
+#include <vector>
 
 #include "image_filter.h"
 #include "logger.h"
@@ -11,7 +9,7 @@
 #include "media_decoder_interface.h"
 #include "media_recorder_common.h"
 #include "media_recorder_interface.h"
-#include "ring_fifo.h"
+#include "pipeline.h"
 
 extern "C" {
 #include <libavutil/avutil.h>
@@ -25,6 +23,7 @@ int main(int argc, char **argv) {
     MediaDecoder *dec = MediaDecoder::CreateVideoDecoder();
     VideoDecoderStartParam dec_param;
     dec_param.filename = argv[1];
+    dec_param.worker_thread = false;
     MediaDecoderStartRet dec_ret = dec->Start(&dec_param);
     int width = dec_ret.width;
     int height = dec_ret.height;
@@ -35,41 +34,27 @@ int main(int argc, char **argv) {
     rec_param.height = height;
     rec_param.fps = dec_ret.fps;
     rec_param.filename = argv[2];
+    rec_param.worker_thread = false;
     recorder->Start(&rec_param);
 
-    AVFrame *frame_a = av_frame_alloc();
-    AVFrame *frame_b = av_frame_alloc();
-    frame_a->format = AV_PIX_FMT_RGB24;
-    frame_a->width = width;
-    frame_a->height = height;
-    av_frame_get_buffer(frame_a, 0);
-    frame_b->format = AV_PIX_FMT_RGB24;
-    frame_b->width = width;
-    frame_b->height = height;
-    av_frame_get_buffer(frame_b, 0);
-
     const char *strs = "      .~^,-*_+;!itlr?JTMW&$#@";
     int len_strs = strlen(strs);
     int width_reduction = 6;
     int height_reduction = 10;
-    char *row_char = new char[width / width_reduction + 1];
-
-    AVFrame *frame = nullptr;
-    dec->InitFrame(&frame);
-    int yuv_frame_size = width * height / 2 + width * height;
-    uint8_t *yuv_tmp = (uint8_t *)malloc(yuv_frame_size * sizeof(uint8_t));
+    std::atomic<int> cnt(0);
 
-    int cnt = 0;
+    // Every frame is rendered independently, so frames are drawn on all pool threads at once.
+    auto char_animation = [&](AVFrame *frame) -> AVFrame * {
+        std::vector<uint8_t> yuv_tmp(width * height / 2 + width * height);
+        std::vector<char> row_char(width / width_reduction + 1);
+        libyuv::RAWToI420(frame->data[0], frame->linesize[0], yuv_tmp.data(), width, yuv_tmp.data() + width * height,
+                          (width + 1) / 2, yuv_tmp.data() + width * height + ((width + 1) / 2) * ((height + 1) / 2),
+                          (width + 1) / 2, width, height);
 
-    while (true) {
-        if (!dec->ReadFrame(frame)) {
-            break;
-        }
-        libyuv::RAWToI420(frame->data[0], width * 3, yuv_tmp, width, yuv_tmp + width * height, (width + 1) / 2,
-                          yuv_tmp + width * height + ((width + 1) / 2) * ((height + 1) / 2), (width + 1) / 2, width,
-                          height);
+        AVFrame *frame_a = frame;
+        // Filled by the filter graph's sink, so it needs no buffers of its own.
+        AVFrame *frame_b = av_frame_alloc();
         memset(frame_a->data[0], 0, frame_a->linesize[0] * frame_a->height);
-        memset(frame_b->data[0], 0, frame_b->linesize[0] * frame_b->height);
         for (int row = 0; row < height / height_reduction; ++row) {
             for (int col = 0; col < width / width_reduction; ++col) {
                 int sum = 0;
@@ -83,21 +68,31 @@ int main(int argc, char **argv) {
                 row_char[col] = strs[index];
             }
             row_char[width / width_reduction] = '\0';
-            log_debug("row_char: %s", row_char);
+            log_debug("row_char: %s", row_char.data());
             ImageFilter::drawText(frame_a, frame_b, argv[3], width, height, 0, row * height_reduction, height_reduction,
-                                  row_char);
+                                  row_char.data());
             AVFrame *av_frame_tmp = frame_a;
             frame_a = frame_b;
             frame_b = av_frame_tmp;
         }
-        // ImageFilter::cropAndScale(frame_a, frame_b, 0, 0, height, height, width, height);
-        // AVFrame *av_frame_tmp = frame_a;
-        // frame_a = frame_b;
-        // frame_b = av_frame_tmp;
+        // The pipeline frees the input frame itself when another one is passed on.
+        if (frame_b != frame) av_frame_free(&frame_b);
         log_info("frame cnt: %d", cnt++);
-        recorder->SendVideoFrameBlock(frame_a->data[0], frame_a->linesize[0] * frame_a->height);
-    }
+        return frame_a;
+    };
+
+    WorkStealingPool *pool = WorkStealingPool::Shared();
+    Pipeline pipeline(pool);
+    int source = pipeline.AddSource(dec);
+    int transform = pipeline.AddTransform(char_animation, pool->ThreadCount());
+    int sink = pipeline.AddSink(recorder);
+    pipeline.Connect(source, transform, pool->ThreadCount() + 2);
+    pipeline.Connect(transform, sink, pool->ThreadCount() + 2);
+    pipeline.Start();
+    pipeline.Wait();
+
     recorder->Stop();
+    dec->Stop();
 
     return 0;
-}
\ No newline at end of file
+}
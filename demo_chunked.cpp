@@ -0,0 +1,110 @@
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "chunked_transcoder.h"
+#include "logger.h"
+
+extern char** environ;
+
+static int Work(const std::string& work_dir, int encoder_threads) {
+    ChunkWorkerParam param;
+    param.work_dir = work_dir;
+    param.encoder_threads = encoder_threads;
+    return ChunkedTranscoder::RunWorker(param).success ? 0 : 1;
+}
+
+// Chunks still missing by then are taken to have no worker left on them.
+static const int default_stitch_timeout_seconds = 3600;
+
+static int Stitch(const std::string& work_dir, const std::string& output, int timeout_seconds) {
+    ChunkStitchParam param;
+    param.work_dir = work_dir;
+    param.output_filename = output;
+    param.timeout_seconds = timeout_seconds;
+    ClipEditResult result = ChunkedTranscoder::Stitch(param);
+    if (!result.success) return 1;
+    printf("%.3fs joined in %.3fs: %d packets copied, %d frames re-encoded\n", result.duration_seconds,
+           result.elapsed_seconds, result.copied_packets, result.reencoded_frames);
+    return 0;
+}
+
+// The coordinator and the workers on one host: plans, starts |workers| copies of this program in work mode, and
+// stitches once they are done. On several hosts, run plan here, work on each host and stitch here instead.
+static int Local(const std::string& input, const std::string& output, const std::string& work_dir, int workers,
+                 double chunk_seconds) {
+    ChunkPlanParam plan;
+    plan.input_filename = input;
+    plan.work_dir = work_dir;
+    plan.chunk_seconds = chunk_seconds;
+    ChunkManifest manifest;
+    if (!ChunkedTranscoder::Plan(plan, &manifest)) return 1;
+
+    // The workers share the host's cores.
+    int cores = (int)std::thread::hardware_concurrency();
+    std::string threads = std::to_string(std::max(1, cores / std::max(1, workers)));
+    std::vector<pid_t> pids;
+    for (int i = 0; i < workers; ++i) {
+        const char* args[] = {"demo-chunked", "work", work_dir.c_str(), threads.c_str(), nullptr};
+        pid_t pid;
+        int ret = posix_spawn(&pid, "/proc/self/exe", nullptr, nullptr, (char* const*)args, environ);
+        if (ret != 0) {
+            log_error("Could not start worker %d: %s", i, strerror(ret));
+            continue;
+        }
+        pids.push_back(pid);
+    }
+    int failed_workers = 0;
+    for (pid_t pid : pids) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ++failed_workers;
+    }
+    if (pids.empty()) return 1;
+    if (failed_workers > 0) log_warn("%d of %zu workers failed", failed_workers, pids.size());
+    // No worker is left to encode a chunk that is missing now, the stitch would wait for it in vain.
+    int missing_chunks = 0;
+    for (const ChunkInfo& chunk : manifest.chunks) {
+        if (access(ChunkedTranscoder::ChunkFilename(work_dir, chunk.index).c_str(), F_OK) != 0) ++missing_chunks;
+    }
+    if (missing_chunks > 0) {
+        log_error("%d of %zu chunks were not encoded, run work on %s to finish them", missing_chunks,
+                  manifest.chunks.size(), work_dir.c_str());
+        return 1;
+    }
+    return Stitch(work_dir, output, default_stitch_timeout_seconds);
+}
+
+int main(int argc, char** argv) {
+    std::string mode = argc > 1 ? argv[1] : "";
+    if (mode == "plan" && argc >= 4) {
+        ChunkPlanParam param;
+        param.input_filename = argv[2];
+        param.work_dir = argv[3];
+        if (argc > 4) param.chunk_seconds = atof(argv[4]);
+        ChunkManifest manifest;
+        return ChunkedTranscoder::Plan(param, &manifest) ? 0 : 1;
+    }
+    if (mode == "work" && argc >= 3) {
+        return Work(argv[2], argc > 3 ? atoi(argv[3]) : 4);
+    }
+    if (mode == "stitch" && argc >= 4) {
+        return Stitch(argv[2], argv[3], argc > 4 ? atoi(argv[4]) : default_stitch_timeout_seconds);
+    }
+    if (mode == "local" && argc >= 6) {
+        return Local(argv[2], argv[3], argv[4], atoi(argv[5]), argc > 6 ? atof(argv[6]) : 10);
+    }
+    printf("usage %s plan input_file work_dir [chunk_seconds]\n", argv[0]);
+    printf("      %s work work_dir [encoder_threads]\n", argv[0]);
+    printf("      %s stitch work_dir output_file [timeout_seconds]\n", argv[0]);
+    printf("      %s local input_file output_file work_dir workers [chunk_seconds]\n", argv[0]);
+    exit(-1);
+}
@@ -0,0 +1,32 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include "clip_editor.h"
+#include "logger.h"
+
+int main(int argc, char** argv) {
+    if (argc < 5 || (argc - 2) % 3 != 0) {
+        printf("usage %s output_file input_file start_seconds end_seconds [input_file start_seconds end_seconds ...]\n",
+               argv[0]);
+        printf("a negative end_seconds runs to the end of its input\n");
+        exit(-1);
+    }
+    ClipConcatParam param;
+    param.output_filename = argv[1];
+    for (int i = 2; i + 2 < argc; i += 3) {
+        ClipSegment segment;
+        segment.filename = argv[i];
+        segment.start_seconds = atof(argv[i + 1]);
+        segment.end_seconds = atof(argv[i + 2]);
+        param.segments.push_back(segment);
+    }
+
+    ClipEditResult result = ClipEditor::Concat(param);
+    if (!result.success) {
+        log_error("Clip editing failed");
+        return 1;
+    }
+    printf("%.3fs written in %.3fs: %d packets copied, %d frames re-encoded\n", result.duration_seconds,
+           result.elapsed_seconds, result.copied_packets, result.reencoded_frames);
+    return 0;
+}
@@ -0,0 +1,248 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event_loop.h"
+#include "logger.h"
+#include "media_decoder_common.h"
+#include "media_decoder_interface.h"
+#include "media_recorder_common.h"
+#include "media_recorder_interface.h"
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// Transcodes the input in N sessions at once, first with a thread per session blocking in ReadFrame and
+// SendVideoFrameBlock, then with every session driven from one EventLoop thread through TryReadFrame and
+// TrySendVideoFrame. The decoders' and encoders' own threads are the same both ways, so the peak thread counts
+// printed differ by the N - 1 driver threads the loop saves, and the loop's count does not grow with sessions beyond
+// those.
+
+struct Session {
+    MediaDecoder* decoder = nullptr;
+    MediaRecorder* recorder = nullptr;
+    AVFrame* frame = nullptr;
+    std::vector<uint8_t> packed;
+    // Read from the decoder, not yet taken by the recorder.
+    bool pending = false;
+    // Readiness fd the session waits on, only one at a time: the other one may stay readable while it is not needed.
+    int watched_fd = -1;
+    int64_t frames = 0;
+};
+
+// Frames moved per callback before other sessions get a turn.
+static const int pump_batch = 8;
+
+static int ProcessThreads() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 8, "Threads:") == 0) return atoi(line.c_str() + 8);
+    }
+    return 0;
+}
+
+// Peak of ProcessThreads() while it is alive, polled from a thread of its own that is counted in both runs.
+class ThreadSampler {
+public:
+    ThreadSampler() : stop_(false), peak_(0) {
+        thread_ = std::thread([this]() {
+            while (!stop_) {
+                int threads = ProcessThreads();
+                if (threads > peak_) peak_ = threads;
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        });
+    }
+    int Stop() {
+        stop_ = true;
+        thread_.join();
+        return peak_;
+    }
+
+private:
+    std::atomic<bool> stop_;
+    std::atomic<int> peak_;
+    std::thread thread_;
+};
+
+static bool StartSession(const std::string& input, const std::string& output, Session* session) {
+    session->decoder = MediaDecoder::CreateVideoDecoder();
+    VideoDecoderStartParam dec_param;
+    dec_param.filename = input;
+    dec_param.decoder_threads = 1;
+    MediaDecoderStartRet ret = session->decoder->Start(&dec_param);
+    if (!ret.success || !session->decoder->InitFrame(&session->frame)) return false;
+
+    session->recorder = MediaRecorder::CreateMP4VideoRecorder();
+    MP4VideoRecorderStartParam rec_param;
+    rec_param.width = ret.width;
+    rec_param.height = ret.height;
+    rec_param.fps = ret.fps;
+    rec_param.encoder_threads = 1;
+    rec_param.preset = "ultrafast";
+    rec_param.filename = output;
+    return session->recorder->Start(&rec_param);
+}
+
+static void StopSession(Session* session) {
+    if (session->recorder != nullptr) session->recorder->Stop();
+    if (session->decoder != nullptr) session->decoder->Stop();
+    av_frame_free(&session->frame);
+    delete session->recorder;
+    delete session->decoder;
+    session->recorder = nullptr;
+    session->decoder = nullptr;
+}
+
+// The decoded frames may have padded rows, the recorder takes packed ones.
+static const uint8_t* PackedFrame(Session* session, int* size) {
+    AVFrame* frame = session->frame;
+    int row_size = frame->width * 3;
+    *size = row_size * frame->height;
+    if (frame->linesize[0] == row_size) return frame->data[0];
+    session->packed.resize(*size);
+    for (int y = 0; y < frame->height; ++y) {
+        memcpy(session->packed.data() + (size_t)y * row_size, frame->data[0] + (size_t)y * frame->linesize[0],
+               row_size);
+    }
+    return session->packed.data();
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        printf("usage %s input_file output_dir sessions\n", argv[0]);
+        exit(-1);
+    }
+    std::string input = argv[1];
+    std::string output_dir = argv[2];
+    int session_count = atoi(argv[3]);
+    if (session_count <= 0) {
+        printf("sessions must be positive\n");
+        exit(-1);
+    }
+    int idle_threads = ProcessThreads();
+
+    auto report = [&](const char* mode, const std::vector<Session>& sessions, int peak_threads, double seconds) {
+        int64_t frames = 0;
+        for (const Session& session : sessions) frames += session.frames;
+        printf("%-10s %d sessions, %ld frames in %.3fs, peak %d threads (%d idle)\n", mode, session_count, (long)frames,
+               seconds, peak_threads, idle_threads);
+    };
+
+    {
+        std::vector<Session> sessions(session_count);
+        ThreadSampler sampler;
+        auto begin = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (int i = 0; i < session_count; ++i) {
+            threads.emplace_back([&, i]() {
+                Session* session = &sessions[i];
+                std::string output = output_dir + "/blocking_" + std::to_string(i) + ".mp4";
+                if (StartSession(input, output, session)) {
+                    while (session->decoder->ReadFrame(session->frame)) {
+                        int size;
+                        const uint8_t* data = PackedFrame(session, &size);
+                        if (!session->recorder->SendVideoFrameBlock((void*)data, size)) break;
+                        ++session->frames;
+                    }
+                }
+                StopSession(session);
+            });
+        }
+        for (auto& thread : threads) thread.join();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        report("blocking", sessions, sampler.Stop(), seconds);
+    }
+
+    {
+        std::vector<Session> sessions(session_count);
+        ThreadSampler sampler;
+        auto begin = std::chrono::steady_clock::now();
+        EventLoop loop;
+        std::mutex mux;
+        std::condition_variable done_cond;
+        int running = 0;
+
+        auto finish = [&](Session* session) {
+            if (session->watched_fd >= 0) loop.Unwatch(session->watched_fd);
+            session->watched_fd = -1;
+            std::unique_lock<std::mutex> lock(mux);
+            if (--running == 0) done_cond.notify_one();
+        };
+        auto wait_on = [&](Session* session, int fd, const std::function<void()>& pump) {
+            if (session->watched_fd == fd) return;
+            if (session->watched_fd >= 0) loop.Unwatch(session->watched_fd);
+            session->watched_fd = -1;
+            if (loop.Watch(fd, pump)) {
+                session->watched_fd = fd;
+            } else {
+                finish(session);
+            }
+        };
+        // Runs on the loop thread once the loop is started. Stopping a session blocks, so that is left to main.
+        std::function<void(Session*)> pump_session = [&](Session* session) {
+            std::function<void()> pump = [&pump_session, session]() { pump_session(session); };
+            // Until something would block when no fd is watched yet, there is nothing to bring the loop back.
+            for (int i = 0; i < pump_batch || session->watched_fd < 0; ++i) {
+                if (!session->pending) {
+                    MediaIOStatus status = session->decoder->TryReadFrame(session->frame);
+                    if (status == MEDIA_IO_WOULD_BLOCK) {
+                        wait_on(session, session->decoder->ReadableFd(), pump);
+                        return;
+                    }
+                    if (status != MEDIA_IO_OK) {
+                        finish(session);
+                        return;
+                    }
+                    session->pending = true;
+                }
+                int size;
+                const uint8_t* data = PackedFrame(session, &size);
+                MediaIOStatus status = session->recorder->TrySendVideoFrame((void*)data, size);
+                if (status == MEDIA_IO_WOULD_BLOCK) {
+                    wait_on(session, session->recorder->WritableFd(), pump);
+                    return;
+                }
+                if (status != MEDIA_IO_OK) {
+                    finish(session);
+                    return;
+                }
+                session->pending = false;
+                ++session->frames;
+            }
+            // Batch used up with both sides ready, the watched fd is still readable and brings the loop back here.
+        };
+
+        // Each session is pumped once here until it first would block, which puts its fd on the loop.
+        for (int i = 0; i < session_count; ++i) {
+            std::string output = output_dir + "/event_loop_" + std::to_string(i) + ".mp4";
+            if (!StartSession(input, output, &sessions[i])) {
+                log_error("Session %d did not start", i);
+                continue;
+            }
+            ++running;
+            pump_session(&sessions[i]);
+        }
+        loop.Start();
+        {
+            std::unique_lock<std::mutex> lock(mux);
+            done_cond.wait(lock, [&]() { return running == 0; });
+        }
+        loop.Stop();
+        for (Session& session : sessions) StopSession(&session);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        report("event loop", sessions, sampler.Stop(), seconds);
+    }
+    return 0;
+}
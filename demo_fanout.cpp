@@ -0,0 +1,94 @@
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "logger.h"
+#include "media_recorder_common.h"
+#include "media_recorder_interface.h"
+#include "shared_video_source.h"
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// One decode of the input feeds a full quality transcode, a fast proxy and a brightness analysis at the same time.
+// The analysis may drop frames, so it never slows the encodes down.
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        printf("usage %s input_file output_dir\n", argv[0]);
+        exit(-1);
+    }
+    std::string output_dir = argv[2];
+
+    SharedVideoSource source;
+    SharedVideoSubscriber* transcode = source.Subscribe("transcode");
+    SharedVideoSubscriber* proxy = source.Subscribe("proxy");
+    SharedVideoSubscriber* analysis = source.Subscribe("analysis", true);
+
+    SharedVideoSourceParam param;
+    param.decoder.filename = argv[1];
+    MediaDecoderStartRet ret = source.Start(param);
+    if (!ret.success) {
+        return 1;
+    }
+
+    auto encode = [&](SharedVideoSubscriber* subscriber, const char* preset) {
+        MediaRecorder* recorder = MediaRecorder::CreateMP4VideoRecorder();
+        MP4VideoRecorderStartParam rec_param;
+        rec_param.width = ret.width;
+        rec_param.height = ret.height;
+        rec_param.fps = ret.fps;
+        rec_param.preset = preset;
+        rec_param.filename = output_dir + "/" + subscriber->Name() + ".mp4";
+        if (!recorder->Start(&rec_param)) {
+            subscriber->Close();
+            delete recorder;
+            return;
+        }
+        std::vector<uint8_t> packed(ret.width * ret.height * 3);
+        AVFrame* frame = av_frame_alloc();
+        while (subscriber->ReadFrame(frame)) {
+            // The shared frames may have padded rows, the recorder takes packed ones.
+            for (int y = 0; y < ret.height; ++y) {
+                memcpy(packed.data() + y * ret.width * 3, frame->data[0] + y * frame->linesize[0], ret.width * 3);
+            }
+            recorder->SendVideoFrameBlock(packed.data(), packed.size());
+        }
+        av_frame_free(&frame);
+        recorder->Stop();
+        delete recorder;
+    };
+
+    double brightness_sum = 0;
+    int analysed = 0;
+    auto analyse = [&]() {
+        AVFrame* frame = av_frame_alloc();
+        while (analysis->ReadFrame(frame)) {
+            uint64_t sum = 0;
+            for (int y = 0; y < ret.height; y += 4) {
+                const uint8_t* row = frame->data[0] + y * frame->linesize[0];
+                for (int x = 0; x < ret.width * 3; x += 12) sum += row[x] + row[x + 1] + row[x + 2];
+            }
+            brightness_sum += sum / (3.0 * ((ret.height + 3) / 4) * ((ret.width + 3) / 4));
+            ++analysed;
+        }
+        av_frame_free(&frame);
+    };
+
+    std::thread transcode_thread(encode, transcode, "");
+    std::thread proxy_thread(encode, proxy, "ultrafast");
+    std::thread analysis_thread(analyse);
+    transcode_thread.join();
+    proxy_thread.join();
+    analysis_thread.join();
+
+    PipelineMetricsSnapshot metrics = source.GetMetrics();
+    source.Stop();
+    printf("decoded %" PRIu64 " frames once, analysis saw %d (dropped %" PRIu64 "), mean brightness %.1f\n",
+           metrics.frames_in, analysed, analysis->DroppedFrames(), analysed > 0 ? brightness_sum / analysed : 0);
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "logger.h"
+#include "media_recorder_common.h"
+#include "media_recorder_interface.h"
+#include "raw_video_stream.h"
+
+// Encodes frames piped in on stdin and pipes the result out on stdout, e.g.
+//   ffmpeg -i in.mp4 -f yuv4mpegpipe - | demo-pipe fmp4 | ffplay -
+int main(int argc, char** argv) {
+    if (argc != 2 && argc != 6) {
+        fprintf(stderr, "usage %s fmp4|h264 [width height fps rgb|i420], Y4M is detected\n", argv[0]);
+        exit(-1);
+    }
+    // stdout carries the video.
+    LogToStderr(true);
+
+    RawVideoStreamParam src_param;
+    if (argc == 6) {
+        src_param.width = atoi(argv[2]);
+        src_param.height = atoi(argv[3]);
+        src_param.fps = atoi(argv[4]);
+        src_param.format = std::string(argv[5]) == "i420" ? RAW_VIDEO_I420 : RAW_VIDEO_RGB24;
+    }
+    RawVideoStream source;
+    if (!source.Open(src_param)) {
+        exit(-1);
+    }
+
+    MediaRecorder* recorder = MediaRecorder::CreateMP4VideoRecorder();
+    MP4VideoRecorderStartParam param;
+    param.width = source.Width();
+    param.height = source.Height();
+    param.fps = source.Fps();
+    param.input_format = source.PixelFormat() == RAW_VIDEO_I420 ? RECORDER_INPUT_I420 : RECORDER_INPUT_RAW;
+    param.filename = "-";
+    param.container = std::string(argv[1]) == "h264" ? RECORDER_CONTAINER_ANNEXB : RECORDER_CONTAINER_FRAGMENTED_MP4;
+    if (!recorder->Start(&param)) {
+        exit(-1);
+    }
+
+    // The frame is copied into the recorder's ring before the next read reuses its buffer.
+    const uint8_t* frame;
+    while ((frame = source.ReadFrame()) != nullptr) {
+        recorder->SendVideoFrameBlock((void*)frame, source.FrameSize());
+    }
+    recorder->Stop();
+    log_info("Encoded %ld frames", (long)source.FramesRead());
+    delete recorder;
+    return 0;
+}
@@ -1,50 +1,51 @@
 #include <chrono>
-#include <fstream>
+#include <string>
 #include <thread>
 
 #include "logger.h"
 #include "media_recorder_common.h"
 #include "media_recorder_interface.h"
-#include "ring_fifo.h"
+#include "raw_video_source.h"
 
 int main(int argc, char** argv) {
     if (argc != 5) {
-        printf("usage %s input_file width height output_file\n", argv[0]);
+        printf("usage %s input_file(.rgb/.yuv/.y4m) width height output_file\n", argv[0]);
         exit(-1);
     }
 
-    int width = atoi(argv[2]);
-    int height = atoi(argv[3]);
-
-    int frame_size = width * height * 3;
-    char* src = (char*)malloc(frame_size * sizeof(char));
+    std::string input = argv[1];
+    RawVideoSourceParam src_param;
+    src_param.filename = input;
+    src_param.width = atoi(argv[2]);
+    src_param.height = atoi(argv[3]);
+    if (input.size() > 4 && input.compare(input.size() - 4, 4, ".yuv") == 0) {
+        src_param.format = RAW_VIDEO_I420;
+    }
+    RawVideoSource source;
+    if (!source.Open(src_param)) {
+        printf("read file failed\n");
+        exit(-1);
+    }
 
     MediaRecorder* recorder = MediaRecorder::CreateMP4VideoRecorder();
     MP4VideoRecorderStartParam param;
-    param.width = width;
-    param.height = height;
-    param.fps = 30;
+    param.width = source.Width();
+    param.height = source.Height();
+    param.fps = source.Fps();
+    param.input_format = source.PixelFormat() == RAW_VIDEO_I420 ? RECORDER_INPUT_I420 : RECORDER_INPUT_RAW;
     param.filename = argv[4];
     recorder->Start(&param);
 
+    // Frames go to the recorder straight from the mapping, forwards and then backwards.
     for (int i = 0; i < 5; ++i) {
-        int j = -1;
-        std::ifstream ifs;
-        ifs.open(argv[1], std::ios::in | std::ios::binary);
-        if (!ifs.is_open()) {
-            printf("read file failed\n");
-            exit(-1);
-        }
-        while (ifs.read(src, frame_size).gcount() == frame_size) {
+        int j = 0;
+        for (; j < source.FrameCount(); ++j) {
             std::this_thread::sleep_for(std::chrono::milliseconds(15));
-            recorder->SendVideoFrame(src, frame_size);
-            j++;
+            recorder->SendVideoFrame((void*)source.Frame(j), source.FrameSize());
         }
-        ifs.clear();
+        j--;
         while (--j > 0) {
-            ifs.seekg(j * frame_size, std::ios::beg);
-            ifs.read(src, frame_size);
-            recorder->SendVideoFrame(src, frame_size);
+            recorder->SendVideoFrame((void*)source.Frame(j), source.FrameSize());
             std::this_thread::sleep_for(std::chrono::milliseconds(15));
         }
     }
@@ -0,0 +1,27 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include "logger.h"
+#include "resumable_transcoder.h"
+
+// Kill it part way through and run it again with the same arguments: it picks up from the last checkpoint.
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        printf("usage %s input_file output_file [checkpoint_seconds] [preset]\n", argv[0]);
+        exit(-1);
+    }
+    ResumableTranscodeParam param;
+    param.input_filename = argv[1];
+    param.output_filename = argv[2];
+    if (argc > 3) param.checkpoint_seconds = atof(argv[3]);
+    if (argc > 4) param.preset = argv[4];
+
+    ResumableTranscodeResult result = ResumableTranscoder::Run(param);
+    if (!result.success) {
+        log_error("Transcode failed, run again to resume");
+        return 1;
+    }
+    printf("%ld frames from the checkpoint, %ld encoded in %.3fs with %d checkpoint(s)\n", (long)result.resumed_frames,
+           (long)result.encoded_frames, result.elapsed_seconds, result.checkpoints);
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#include "frame_scrubber.h"
+#include "logger.h"
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// Plays back the way a user scrubs a timeline: drags forward and back over the same stretch, steps frame by frame,
+// then jumps somewhere else, and reports how often the cache answered and how fast.
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("usage %s input_file [preview_width preview_height]\n", argv[0]);
+        exit(-1);
+    }
+
+    FrameScrubberParam param;
+    param.filename = argv[1];
+    if (argc >= 4) {
+        param.output_width = atoi(argv[2]);
+        param.output_height = atoi(argv[3]);
+    }
+    FrameScrubber scrubber;
+    if (!scrubber.Open(param) || scrubber.Duration() <= 0) {
+        return 1;
+    }
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> anywhere(0, scrubber.Duration());
+    AVFrame* frame = av_frame_alloc();
+    for (int jump = 0; jump < 20; ++jump) {
+        double at = anywhere(rng);
+        // Drag two seconds forward and back, then step a few frames.
+        for (int pass = 0; pass < 3; ++pass) {
+            for (int i = 0; i <= 40; ++i) {
+                double offset = (pass % 2 == 0 ? i : 40 - i) * 0.05;
+                scrubber.GetFrame(at + offset, frame);
+            }
+        }
+        for (int i = 0; i < 10; ++i) {
+            scrubber.GetFrame(at + i / 30.0, frame);
+        }
+    }
+    av_frame_free(&frame);
+
+    FrameScrubberStats stats = scrubber.Stats();
+    printf("%.1f%% hits, hit p50 %.3fms p99 %.3fms, miss p50 %.1fms p99 %.1fms, %" PRIu64 " prefetched, %zu cached\n",
+           stats.HitRate() * 100, stats.hit_latency.p50_ns / 1e6, stats.hit_latency.p99_ns / 1e6,
+           stats.miss_latency.p50_ns / 1e6, stats.miss_latency.p99_ns / 1e6, stats.prefetched_frames,
+           stats.cached_frames);
+    scrubber.Close();
+    return 0;
+}
@@ -8,6 +8,7 @@
 #include "media_decoder_interface.h"
 #include "media_recorder_common.h"
 #include "media_recorder_interface.h"
+#include "ring_depth.h"
 #include "ring_fifo.h"
 
 const double darkness_threshold = 0.99;
@@ -15,9 +16,13 @@ const int frame_threshold = 150;
 
 int main(int argc, char** argv) {
     if (argc < 3) {
-        printf("usage %s input_file output_dir [frames]\n", argv[0]);
+        printf("usage %s input_file output_dir [frames] [memory_cap_mb]\n", argv[0]);
         exit(-1);
     }
+    // Caps the decoder's and recorder's rings together with the lookahead below.
+    if (argc > 4) {
+        FrameMemoryBudget::Instance()->SetLimit((size_t)atoi(argv[4]) << 20);
+    }
     MediaDecoder* dec = MediaDecoder::CreateVideoDecoder();
     VideoDecoderStartParam dec_param;
     dec_param.filename = argv[1];
@@ -29,7 +34,17 @@ int main(int argc, char** argv) {
     }
     std::deque<AVFrame*> que_frame_empty;
     std::deque<AVFrame*> que_frame_full;
+    size_t frame_bytes = (size_t)dec_ret.width * dec_ret.height * 3;
+    int reserved_frames = 0;
     for (int i = 0; i < buffer_size; ++i) {
+        // The first frame is needed whatever the budget says.
+        if (i == 0) {
+            FrameMemoryBudget::Instance()->Reserve(frame_bytes);
+        } else if (!FrameMemoryBudget::Instance()->TryReserve(frame_bytes)) {
+            log_warn("Frame memory budget allows a lookahead of %d frames instead of %d", i, buffer_size);
+            break;
+        }
+        ++reserved_frames;
         AVFrame* frame = nullptr;
         dec->InitFrame(&frame);
         que_frame_empty.push_back(frame);
@@ -93,6 +108,9 @@ int main(int argc, char** argv) {
         que_frame_full.pop_front();
         recorder->SendVideoFrameBlock(frame->data[0], frame->linesize[0] * frame->height);
     }
+    log_info("Frame memory pinned at the end: %zu bytes", FrameMemoryBudget::Instance()->Pinned());
     recorder->Stop();
+    dec->Stop();
+    FrameMemoryBudget::Instance()->Release(reserved_frames * frame_bytes);
     return 0;
 }
\ No newline at end of file
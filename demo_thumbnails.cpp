@@ -0,0 +1,28 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include "logger.h"
+#include "thumbnail_generator.h"
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        printf("usage %s input_file output_dir [interval_seconds] [tile_width] [workers]\n", argv[0]);
+        exit(-1);
+    }
+    ThumbnailParam param;
+    param.filename = argv[1];
+    param.output_dir = argv[2];
+    if (argc > 3) param.interval_seconds = atof(argv[3]);
+    if (argc > 4) param.tile_width = atoi(argv[4]);
+    if (argc > 5) param.workers = atoi(argv[5]);
+
+    ThumbnailResult result = ThumbnailGenerator::Generate(param);
+    if (!result.success) {
+        log_error("Thumbnail generation failed");
+        return 1;
+    }
+    printf("%d thumbnails on %d sheets, %.2fs for %.1fs of video (%.2f%% of real time)\n", result.thumbnails,
+           result.sheets, result.elapsed_seconds, result.duration_seconds,
+           100.0 * result.elapsed_seconds / result.duration_seconds);
+    return 0;
+}
@@ -0,0 +1,528 @@
+#include "chunked_transcoder.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <set>
+#include <thread>
+
+#include "logger.h"
+#include "media_recorder_common.h"
+#include "media_recorder_interface.h"
+#include "pipeline_metrics.h"
+#include "poca_str.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libswscale/swscale.h>
+}
+
+namespace {
+
+const char* const kManifestName = "manifest.txt";
+// How often a worker with nothing to claim looks again, for chunks finished or abandoned by others.
+const int kPollMs = 1000;
+
+std::string ChunkPath(const std::string& work_dir, int index, const char* suffix) {
+    char name[64];
+    snprintf(name, sizeof(name), "/chunk_%05d%s", index, suffix);
+    return work_dir + name;
+}
+
+bool FileExists(const std::string& path) { return access(path.c_str(), F_OK) == 0; }
+
+// Unique across the hosts sharing the work directory.
+std::string WorkerId() {
+    char host[256] = {0};
+    if (gethostname(host, sizeof(host) - 1) != 0) snprintf(host, sizeof(host), "unknown");
+    return std::string(host) + "." + std::to_string(getpid());
+}
+
+double SecondsSince(std::chrono::steady_clock::time_point begin) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+// The input's video stream and a decoder for it, scaling into the packed I420 frames MP4VideoRecorder takes.
+struct ChunkSource {
+    AVFormatContext* fmt_ctx = nullptr;
+    AVStream* stream = nullptr;
+    AVCodecContext* dec_ctx = nullptr;
+    AVPacket* pkt = nullptr;
+    AVFrame* frame = nullptr;
+    SwsContext* sws_ctx = nullptr;
+
+    bool Open(const std::string& filename) {
+        if (avformat_open_input(&fmt_ctx, filename.c_str(), NULL, NULL) < 0) {
+            log_error("Could not open source file %s", filename.c_str());
+            return false;
+        }
+        if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+            log_error("Could not find stream information");
+            return false;
+        }
+        int idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        if (idx < 0) {
+            log_error("Could not find video stream in input file '%s'", filename.c_str());
+            return false;
+        }
+        stream = fmt_ctx->streams[idx];
+        for (unsigned i = 0; i < fmt_ctx->nb_streams; ++i) {
+            if ((int)i != idx) fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+        pkt = av_packet_alloc();
+        frame = av_frame_alloc();
+        return pkt != nullptr && frame != nullptr;
+    }
+
+    bool OpenDecoder() {
+        const AVCodec* decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+        if (!decoder) {
+            log_error("Failed to find video codec");
+            return false;
+        }
+        dec_ctx = avcodec_alloc_context3(decoder);
+        if (!dec_ctx || avcodec_parameters_to_context(dec_ctx, stream->codecpar) < 0) {
+            log_error("Failed to set up the video codec context");
+            return false;
+        }
+        dec_ctx->pkt_timebase = stream->time_base;
+        if (avcodec_open2(dec_ctx, decoder, NULL) < 0) {
+            log_error("Failed to open video codec");
+            return false;
+        }
+        return true;
+    }
+
+    void Close() {
+        sws_freeContext(sws_ctx);
+        sws_ctx = nullptr;
+        av_frame_free(&frame);
+        av_packet_free(&pkt);
+        avcodec_free_context(&dec_ctx);
+        avformat_close_input(&fmt_ctx);
+    }
+
+    // Converts and resizes frame into |dst| in one pass.
+    bool ToI420(int width, int height, uint8_t* dst) {
+        sws_ctx = sws_getCachedContext(sws_ctx, frame->width, frame->height, (AVPixelFormat)frame->format, width,
+                                       height, AV_PIX_FMT_YUV420P, SWS_BILINEAR, nullptr, nullptr, nullptr);
+        if (sws_ctx == nullptr) {
+            log_error("Could not create the chunk scaler");
+            return false;
+        }
+        uint8_t* planes[4];
+        int linesizes[4];
+        av_image_fill_arrays(planes, linesizes, dst, AV_PIX_FMT_YUV420P, width, height, 1);
+        sws_scale(sws_ctx, frame->data, frame->linesize, 0, frame->height, planes, linesizes);
+        return true;
+    }
+};
+
+// Decodes the chunk's frames and encodes them into |filename|, refreshing the lock's mtime on the way.
+bool EncodeChunk(const ChunkManifest& manifest, const ChunkInfo& chunk, const ChunkWorkerParam& param, int lock_fd,
+                 const std::string& filename, int64_t* frames) {
+    ChunkSource source;
+    if (!source.Open(manifest.input_filename) || !source.OpenDecoder()) {
+        source.Close();
+        return false;
+    }
+    int64_t origin = source.stream->start_time != AV_NOPTS_VALUE ? source.stream->start_time : 0;
+    // The seek index is by dts, which never trails the keyframe's pts, so this lands on the chunk's first keyframe.
+    if (chunk.start_ts > origin &&
+        av_seek_frame(source.fmt_ctx, source.stream->index, chunk.start_ts, AVSEEK_FLAG_BACKWARD) < 0) {
+        log_error("Seek to %s failed", poca_ts2str(chunk.start_ts).c_str());
+        source.Close();
+        return false;
+    }
+
+    MediaRecorder* recorder = MediaRecorder::CreateMP4VideoRecorder();
+    MP4VideoRecorderStartParam rec_param;
+    rec_param.width = manifest.width;
+    rec_param.height = manifest.height;
+    rec_param.fps = manifest.fps;
+    rec_param.input_format = RECORDER_INPUT_I420;
+    rec_param.gop_size = manifest.gop_size;
+    rec_param.preset = manifest.preset;
+    rec_param.encoder_threads = param.encoder_threads;
+    rec_param.filename = filename;
+    // Write errors come back from the Send call instead of stopping a worker thread.
+    rec_param.worker_thread = false;
+    if (!recorder->Start(&rec_param)) {
+        delete recorder;
+        source.Close();
+        return false;
+    }
+
+    std::vector<uint8_t> i420(av_image_get_buffer_size(AV_PIX_FMT_YUV420P, manifest.width, manifest.height, 1));
+    const double heartbeat_seconds = std::max(1, param.stale_lock_seconds / 4);
+    auto last_heartbeat = std::chrono::steady_clock::now();
+    bool ok = true;
+    bool eof = false;
+    *frames = 0;
+    while (ok && !eof) {
+        int ret = av_read_frame(source.fmt_ctx, source.pkt);
+        if (ret >= 0) {
+            int64_t pts = source.pkt->pts != AV_NOPTS_VALUE ? source.pkt->pts : source.pkt->dts;
+            bool next_chunk = (source.pkt->flags & AV_PKT_FLAG_KEY) && pts >= chunk.end_ts;
+            if (source.pkt->stream_index != source.stream->index || next_chunk) {
+                av_packet_unref(source.pkt);
+                if (!next_chunk) continue;
+                ret = AVERROR_EOF;
+            }
+        }
+        eof = ret < 0;
+        if (eof && ret != AVERROR_EOF) {
+            log_error("Error reading the input: %s", poca_err2str(ret).c_str());
+            ok = false;
+            break;
+        }
+        // At the end the decoder is drained.
+        ret = avcodec_send_packet(source.dec_ctx, eof ? nullptr : source.pkt);
+        av_packet_unref(source.pkt);
+        if (ret < 0) {
+            log_error("Error submitting a packet for decoding: %s", poca_err2str(ret).c_str());
+            ok = false;
+            break;
+        }
+        while (ok && (ret = avcodec_receive_frame(source.dec_ctx, source.frame)) >= 0) {
+            int64_t pts = source.frame->best_effort_timestamp;
+            if (pts != AV_NOPTS_VALUE && pts >= chunk.start_ts && pts < chunk.end_ts) {
+                ok = source.ToI420(manifest.width, manifest.height, i420.data()) &&
+                     recorder->SendVideoFrameBlock(i420.data(), (int)i420.size());
+                ++*frames;
+            }
+            av_frame_unref(source.frame);
+        }
+        if (ok && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+            log_error("Error during decoding: %s", poca_err2str(ret).c_str());
+            ok = false;
+        }
+        if (SecondsSince(last_heartbeat) >= heartbeat_seconds) {
+            futimens(lock_fd, nullptr);
+            last_heartbeat = std::chrono::steady_clock::now();
+        }
+    }
+    recorder->Stop();
+    // The trailer is written in Stop, which does not report failures; every frame having been muxed is the check.
+    PipelineMetricsSnapshot metrics = recorder->GetMetrics();
+    if (ok && (int64_t)metrics.frames_out < *frames) {
+        log_error("Chunk %d: %" PRIu64 " of %" PRId64 " frames written", chunk.index, metrics.frames_out, *frames);
+        ok = false;
+    }
+    delete recorder;
+    source.Close();
+    return ok && *frames > 0;
+}
+
+// Where a lock held by someone else was last seen to change.
+struct LockWatch {
+    ino_t ino = 0;
+    struct timespec mtime = {0, 0};
+    std::chrono::steady_clock::time_point seen;
+};
+
+int CreateLock(const std::string& path) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    std::string owner = WorkerId() + "\n";
+    if (write(fd, owner.data(), owner.size()) < 0) {
+        log_warn("Could not write the owner into %s: %s", path.c_str(), strerror(errno));
+    }
+    return fd;
+}
+
+bool SameLock(const struct stat& st, const LockWatch& watch) {
+    return st.st_ino == watch.ino && st.st_mtim.tv_sec == watch.mtime.tv_sec &&
+           st.st_mtim.tv_nsec == watch.mtime.tv_nsec;
+}
+
+// Returns the lock's fd, or -1 when the chunk is someone else's. A lock that has not changed for stale_lock_seconds
+// is renamed away and claimed afresh. Workers that watched the same stale lock can take turns at this, the later one
+// would move aside the lock the earlier one just created; so the lock is checked to still be the watched one before
+// the rename, and the file renamed is put back when it turns out not to be. That leaves only the moment between the
+// two, in which a chunk can end up encoded twice.
+int ClaimChunk(const std::string& work_dir, int index, const ChunkWorkerParam& param,
+               std::map<int, LockWatch>& watches) {
+    std::string path = ChunkPath(work_dir, index, ".lock");
+    int fd = CreateLock(path);
+    if (fd >= 0 || errno != EEXIST) {
+        if (fd < 0) log_error("Could not create %s: %s", path.c_str(), strerror(errno));
+        return fd;
+    }
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return -1;
+    auto now = std::chrono::steady_clock::now();
+    auto it = watches.find(index);
+    if (it == watches.end() || !SameLock(st, it->second)) {
+        watches[index] = {st.st_ino, st.st_mtim, now};
+        return -1;
+    }
+    double unchanged = std::chrono::duration<double>(now - it->second.seen).count();
+    if (unchanged < param.stale_lock_seconds) return -1;
+
+    char owner[300] = {0};
+    FILE* file = fopen(path.c_str(), "r");
+    if (file != nullptr) {
+        if (fgets(owner, sizeof(owner), file) != nullptr) owner[strcspn(owner, "\n")] = '\0';
+        fclose(file);
+    }
+    LockWatch watched = it->second;
+    if (stat(path.c_str(), &st) != 0 || !SameLock(st, watched)) return -1;
+    std::string stale_path = path + ".stale." + WorkerId();
+    if (rename(path.c_str(), stale_path.c_str()) != 0) return -1;
+    if (stat(stale_path.c_str(), &st) != 0 || st.st_ino != watched.ino) {
+        // Another worker took the chunk over since the check, its lock goes back unless a newer one is there.
+        if (link(stale_path.c_str(), path.c_str()) != 0) {
+            log_warn("Could not put back the lock of chunk %d: %s", index, strerror(errno));
+        }
+        unlink(stale_path.c_str());
+        watches.erase(index);
+        return -1;
+    }
+    unlink(stale_path.c_str());
+    watches.erase(index);
+    log_warn("Taking over chunk %d from %s, its lock has not changed for %.0fs", index, owner, unchanged);
+    return CreateLock(path);
+}
+
+}  // namespace
+
+std::string ChunkedTranscoder::ChunkFilename(const std::string& work_dir, int index) {
+    return ChunkPath(work_dir, index, ".mp4");
+}
+
+bool ChunkManifest::Save(const std::string& work_dir) const {
+    // Written aside and renamed, so a worker never reads half a manifest.
+    std::string path = work_dir + "/" + kManifestName;
+    std::string tmp_path = path + "." + WorkerId() + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "w");
+    if (file == nullptr) {
+        log_error("Could not open %s: %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+    fprintf(file, "input %s\n", input_filename.c_str());
+    fprintf(file, "time_base %d %d\n", time_base_num, time_base_den);
+    fprintf(file, "fps %d\n", fps);
+    fprintf(file, "size %d %d\n", width, height);
+    fprintf(file, "preset %s\n", preset.c_str());
+    fprintf(file, "gop %d\n", gop_size);
+    for (const ChunkInfo& chunk : chunks) {
+        fprintf(file, "chunk %d %lld %lld\n", chunk.index, (long long)chunk.start_ts,
+                chunk.end_ts == INT64_MAX ? -1LL : (long long)chunk.end_ts);
+    }
+    bool ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        log_error("Could not write %s: %s", path.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool ChunkManifest::Load(const std::string& work_dir) {
+    std::string path = work_dir + "/" + kManifestName;
+    FILE* file = fopen(path.c_str(), "r");
+    if (file == nullptr) {
+        log_error("Could not open %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    *this = ChunkManifest();
+    char line[4096];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file) != nullptr) {
+        line[strcspn(line, "\n")] = '\0';
+        long long start, end;
+        ChunkInfo chunk;
+        if (strncmp(line, "input ", 6) == 0) {
+            input_filename = line + 6;
+        } else if (strncmp(line, "preset", 6) == 0) {
+            preset = line[6] == ' ' ? line + 7 : "";
+        } else if (sscanf(line, "chunk %d %lld %lld", &chunk.index, &start, &end) == 3) {
+            chunk.start_ts = start;
+            chunk.end_ts = end < 0 ? INT64_MAX : end;
+            ok = chunk.index == (int)chunks.size();
+            chunks.push_back(chunk);
+        } else {
+            ok = sscanf(line, "time_base %d %d", &time_base_num, &time_base_den) == 2 ||
+                 sscanf(line, "fps %d", &fps) == 1 || sscanf(line, "size %d %d", &width, &height) == 2 ||
+                 sscanf(line, "gop %d", &gop_size) == 1;
+        }
+        if (!ok) log_error("Bad line in %s: %s", path.c_str(), line);
+    }
+    fclose(file);
+    if (ok && (input_filename.empty() || chunks.empty() || fps <= 0 || width <= 0 || height <= 0)) {
+        log_error("%s is incomplete", path.c_str());
+        ok = false;
+    }
+    return ok;
+}
+
+bool ChunkedTranscoder::Plan(const ChunkPlanParam& param, ChunkManifest* manifest) {
+    auto begin = std::chrono::steady_clock::now();
+    if (mkdir(param.work_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        log_error("Could not create %s: %s", param.work_dir.c_str(), strerror(errno));
+        return false;
+    }
+    ChunkSource source;
+    if (!source.Open(param.input_filename)) {
+        source.Close();
+        return false;
+    }
+    AVStream* stream = source.stream;
+    AVRational rate = stream->avg_frame_rate.num > 0 ? stream->avg_frame_rate : stream->r_frame_rate;
+    *manifest = ChunkManifest();
+    manifest->input_filename = param.input_filename;
+    manifest->time_base_num = stream->time_base.num;
+    manifest->time_base_den = stream->time_base.den;
+    manifest->fps = rate.num > 0 && rate.den > 0 ? (int)lround(av_q2d(rate)) : 0;
+    manifest->width = param.output_width > 0 ? param.output_width : stream->codecpar->width;
+    manifest->height = param.output_height > 0 ? param.output_height : stream->codecpar->height;
+    manifest->preset = param.preset;
+    manifest->gop_size = param.gop_size;
+    if (manifest->fps <= 0) {
+        log_error("%s has no frame rate to encode the chunks at", param.input_filename.c_str());
+        source.Close();
+        return false;
+    }
+
+    // Only packet headers are read, nothing is decoded.
+    int64_t chunk_ticks = std::max<int64_t>(1, (int64_t)(param.chunk_seconds / av_q2d(stream->time_base)));
+    int ret;
+    while ((ret = av_read_frame(source.fmt_ctx, source.pkt)) >= 0) {
+        AVPacket* pkt = source.pkt;
+        int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+        if (pkt->stream_index == stream->index && (pkt->flags & AV_PKT_FLAG_KEY) && pts != AV_NOPTS_VALUE) {
+            std::vector<ChunkInfo>& chunks = manifest->chunks;
+            if (chunks.empty() || pts - chunks.back().start_ts >= chunk_ticks) {
+                if (!chunks.empty()) chunks.back().end_ts = pts;
+                ChunkInfo chunk;
+                chunk.index = (int)chunks.size();
+                chunk.start_ts = pts;
+                chunks.push_back(chunk);
+            }
+        }
+        av_packet_unref(pkt);
+    }
+    source.Close();
+    if (ret != AVERROR_EOF) {
+        log_error("Error reading %s: %s", param.input_filename.c_str(), poca_err2str(ret).c_str());
+        return false;
+    }
+    if (manifest->chunks.empty()) {
+        log_error("No keyframe in %s", param.input_filename.c_str());
+        return false;
+    }
+    if (!manifest->Save(param.work_dir)) return false;
+    log_info("%s split into %d chunk(s) of about %.1fs in %.3fs", param.input_filename.c_str(),
+             (int)manifest->chunks.size(), param.chunk_seconds, SecondsSince(begin));
+    return true;
+}
+
+ChunkWorkerResult ChunkedTranscoder::RunWorker(const ChunkWorkerParam& param) {
+    ChunkWorkerResult result;
+    auto begin = std::chrono::steady_clock::now();
+    ChunkManifest manifest;
+    if (!manifest.Load(param.work_dir)) return result;
+
+    std::string worker_id = WorkerId();
+    std::map<int, LockWatch> watches;
+    // Chunks this worker failed at are left to the others rather than retried.
+    std::set<int> failed;
+    while (true) {
+        bool pending = false;
+        bool claimed = false;
+        for (const ChunkInfo& chunk : manifest.chunks) {
+            std::string output = ChunkFilename(param.work_dir, chunk.index);
+            if (FileExists(output) || failed.count(chunk.index)) continue;
+            pending = true;
+            int lock_fd = ClaimChunk(param.work_dir, chunk.index, param, watches);
+            if (lock_fd < 0) continue;
+            claimed = true;
+            std::string lock_path = ChunkPath(param.work_dir, chunk.index, ".lock");
+            // Finished between the check above and the claim.
+            if (FileExists(output)) {
+                close(lock_fd);
+                unlink(lock_path.c_str());
+                continue;
+            }
+
+            auto chunk_begin = std::chrono::steady_clock::now();
+            std::string tmp_output = ChunkPath(param.work_dir, chunk.index, ("." + worker_id + ".tmp").c_str());
+            int64_t frames = 0;
+            bool ok = EncodeChunk(manifest, chunk, param, lock_fd, tmp_output, &frames);
+            if (ok && rename(tmp_output.c_str(), output.c_str()) != 0) {
+                log_error("Could not rename %s: %s", tmp_output.c_str(), strerror(errno));
+                ok = false;
+            }
+            if (ok) {
+                result.encoded_chunks++;
+                result.encoded_frames += frames;
+                log_info("Chunk %d: %ld frames in %.3fs", chunk.index, (long)frames, SecondsSince(chunk_begin));
+            } else {
+                unlink(tmp_output.c_str());
+                failed.insert(chunk.index);
+                result.failed_chunks++;
+                log_error("Chunk %d failed, leaving it to other workers", chunk.index);
+            }
+            close(lock_fd);
+            unlink(lock_path.c_str());
+        }
+        if (!pending) break;
+        // Everything left is being encoded elsewhere: wait for it to finish, or for its worker to die.
+        if (!claimed) std::this_thread::sleep_for(std::chrono::milliseconds(kPollMs));
+    }
+
+    result.success = result.failed_chunks == 0;
+    result.elapsed_seconds = SecondsSince(begin);
+    log_info("Worker %s: %d chunk(s), %ld frames in %.3fs, %d failed", worker_id.c_str(), result.encoded_chunks,
+             (long)result.encoded_frames, result.elapsed_seconds, result.failed_chunks);
+    return result;
+}
+
+ClipEditResult ChunkedTranscoder::Stitch(const ChunkStitchParam& param) {
+    ClipEditResult result;
+    auto begin = std::chrono::steady_clock::now();
+    ChunkManifest manifest;
+    if (!manifest.Load(param.work_dir)) return result;
+
+    size_t done = 0;
+    while (true) {
+        size_t count = 0;
+        for (const ChunkInfo& chunk : manifest.chunks) {
+            if (FileExists(ChunkFilename(param.work_dir, chunk.index))) ++count;
+        }
+        if (count == manifest.chunks.size()) break;
+        if (count != done) {
+            log_info("%zu of %zu chunks done", count, manifest.chunks.size());
+            done = count;
+        }
+        if (param.timeout_seconds > 0 && SecondsSince(begin) > param.timeout_seconds) {
+            log_error("%zu of %zu chunks still missing after %ds", manifest.chunks.size() - count,
+                      manifest.chunks.size(), param.timeout_seconds);
+            return result;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(kPollMs));
+    }
+
+    // Each chunk starts on a keyframe, so every GOP is copied and nothing is re-encoded.
+    ClipConcatParam concat;
+    concat.output_filename = param.output_filename;
+    for (const ChunkInfo& chunk : manifest.chunks) {
+        ClipSegment segment;
+        segment.filename = ChunkFilename(param.work_dir, chunk.index);
+        concat.segments.push_back(segment);
+    }
+    return ClipEditor::Concat(concat);
+}
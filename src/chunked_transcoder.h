@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "clip_editor.h"
+
+struct ChunkPlanParam {
+    // Read by every worker, so the same path has to work on each host.
+    std::string input_filename;
+    // Manifest, locks and chunk outputs. Shared by the coordinator and all workers, e.g. an NFS mount.
+    std::string work_dir;
+    // A chunk ends at the first keyframe at least this far past its start.
+    double chunk_seconds = 10;
+    // Encoder settings every chunk is written with, they have to match for the chunks to be joined. 0 keeps the
+    // source size.
+    int output_width = 0;
+    int output_height = 0;
+    std::string preset;
+    int gop_size = 0;
+};
+
+struct ChunkWorkerParam {
+    std::string work_dir;
+    // x264 threads per chunk. Several workers on one host want fewer each.
+    int encoder_threads = 4;
+    // A chunk whose lock has not been refreshed for this long, as seen from this worker, is taken over: its worker
+    // is assumed dead. Compared against this host's clock only, so clock skew between hosts does not matter.
+    int stale_lock_seconds = 60;
+};
+
+struct ChunkStitchParam {
+    std::string work_dir;
+    std::string output_filename;
+    // Give up when chunks are still missing after this long, 0 to wait for as long as it takes.
+    int timeout_seconds = 0;
+};
+
+// A GOP-aligned range of the input, in the video stream's time base, end exclusive.
+struct ChunkInfo {
+    int index = 0;
+    int64_t start_ts = 0;
+    // INT64_MAX for the last chunk, which runs to the end of the input.
+    int64_t end_ts = INT64_MAX;
+};
+
+// What the coordinator hands the workers, as manifest.txt in the work directory.
+struct ChunkManifest {
+    std::string input_filename;
+    int time_base_num = 1;
+    int time_base_den = 1;
+    int fps = 0;
+    int width = 0;
+    int height = 0;
+    std::string preset;
+    int gop_size = 0;
+    std::vector<ChunkInfo> chunks;
+
+    bool Save(const std::string& work_dir) const;
+    bool Load(const std::string& work_dir);
+};
+
+struct ChunkWorkerResult {
+    bool success = false;
+    int encoded_chunks = 0;
+    int failed_chunks = 0;
+    int64_t encoded_frames = 0;
+    double elapsed_seconds = 0;
+};
+
+// Transcodes one file on many processes. The coordinator splits the input at keyframes into chunks and writes a
+// manifest; any number of workers, on any host that sees the work directory, claim chunks through lock files and
+// encode them with MP4VideoRecorder; the coordinator then joins the chunk outputs by stream copy (see ClipEditor).
+//
+// A lock is created with O_EXCL, holds its owner's host and pid, and has its mtime refreshed while the chunk is
+// encoded. A chunk is done once its output has been renamed into place, so a worker dying midway leaves only a lock
+// that goes stale and a temporary file. Two workers racing to take over the same stale lock can at worst encode the
+// chunk twice, the outputs are identical and the rename keeps one. Closed GOPs are assumed, as everywhere else.
+class ChunkedTranscoder {
+public:
+    static bool Plan(const ChunkPlanParam& param, ChunkManifest* manifest);
+    // Encodes chunks until none are left to claim, taking over chunks whose worker died on the way.
+    static ChunkWorkerResult RunWorker(const ChunkWorkerParam& param);
+    // Waits for every chunk, then joins them into the output.
+    static ClipEditResult Stitch(const ChunkStitchParam& param);
+
+    static std::string ChunkFilename(const std::string& work_dir, int index);
+};
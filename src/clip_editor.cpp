@@ -0,0 +1,563 @@
+#include "clip_editor.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+
+#include "logger.h"
+#include "poca_str.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+namespace {
+
+// Parameter sets in params_owner_ that came from the encoder rather than a source.
+const int kEncoderParams = -1;
+
+int64_t PacketPts(const AVPacket* pkt) { return pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts; }
+
+void FreePackets(std::vector<AVPacket*>& packets) {
+    for (AVPacket*& pkt : packets) {
+        av_packet_free(&pkt);
+    }
+    packets.clear();
+}
+
+void AppendNal(std::vector<uint8_t>& out, const uint8_t* nal, size_t size, int length_size) {
+    for (int shift = 8 * (length_size - 1); shift >= 0; shift -= 8) {
+        out.push_back((uint8_t)(size >> shift));
+    }
+    out.insert(out.end(), nal, nal + size);
+}
+
+// The encoder writes Annex B, the container wants every NAL behind a big-endian length.
+void AnnexBToLengthPrefixed(const uint8_t* data, size_t size, int length_size, std::vector<uint8_t>& out) {
+    auto next_start_code = [&](size_t from) {
+        for (size_t i = from; i + 3 <= size; ++i) {
+            if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) return i;
+        }
+        return size;
+    };
+    out.clear();
+    size_t start = next_start_code(0);
+    while (start < size) {
+        size_t nal = start + 3;
+        size_t next = next_start_code(nal);
+        // Drops trailing zero bytes, including the leading zero of a four byte start code.
+        size_t end = next;
+        while (end > nal && data[end - 1] == 0) --end;
+        if (end > nal) AppendNal(out, data + nal, end - nal, length_size);
+        start = next;
+    }
+}
+
+// avcC: version, profile, compatibility, level, 0xfc | length size - 1, 0xe0 | SPS count, SPS, PPS count, PPS.
+bool ParseAvcC(const uint8_t* data, int size, int* length_size, std::vector<uint8_t>* param_sets) {
+    if (data == nullptr || size < 7 || data[0] != 1) return false;
+    *length_size = (data[4] & 3) + 1;
+    param_sets->clear();
+    int pos = 5;
+    for (int list = 0; list < 2; ++list) {
+        if (pos >= size) return false;
+        int count = list == 0 ? data[pos] & 0x1f : data[pos];
+        pos++;
+        for (int i = 0; i < count; ++i) {
+            if (pos + 2 > size) return false;
+            int nal_size = (data[pos] << 8) | data[pos + 1];
+            pos += 2;
+            if (pos + nal_size > size) return false;
+            AppendNal(*param_sets, data + pos, nal_size, *length_size);
+            pos += nal_size;
+        }
+    }
+    return true;
+}
+
+// x264's name for the source profile, empty when x264 has none (it then picks one itself).
+std::string X264Profile(int profile) {
+    const char* name = avcodec_profile_name(AV_CODEC_ID_H264, profile);
+    if (name == nullptr) return "";
+    std::string x264_name;
+    for (const char* c = name; *c; ++c) {
+        if (*c != ' ') x264_name += (char)tolower(*c);
+    }
+    if (x264_name == "constrainedbaseline") x264_name = "baseline";
+    if (x264_name != "baseline" && x264_name != "main" && x264_name != "high" && x264_name != "high10") return "";
+    return x264_name;
+}
+
+// One segment's input. The decoder is only opened once a GOP has to be re-encoded.
+struct ClipSource {
+    AVFormatContext* fmt_ctx = nullptr;
+    AVStream* stream = nullptr;
+    AVCodecContext* dec_ctx = nullptr;
+    int length_size = 4;
+    // The avcC SPS and PPS as length-prefixed NALs.
+    std::vector<uint8_t> param_sets;
+    // Range in stream time base, end exclusive.
+    int64_t start_ts = 0;
+    int64_t end_ts = INT64_MAX;
+    int64_t frame_ticks = 1;
+
+    bool Open(const ClipSegment& segment) {
+        if (avformat_open_input(&fmt_ctx, segment.filename.c_str(), NULL, NULL) < 0) {
+            log_error("Could not open source file %s", segment.filename.c_str());
+            return false;
+        }
+        if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+            log_error("Could not find stream information");
+            return false;
+        }
+        int idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        if (idx < 0) {
+            log_error("Could not find video stream in input file '%s'", segment.filename.c_str());
+            return false;
+        }
+        stream = fmt_ctx->streams[idx];
+        AVCodecParameters* par = stream->codecpar;
+        if (par->codec_id != AV_CODEC_ID_H264 || !ParseAvcC(par->extradata, par->extradata_size, &length_size,
+                                                             &param_sets)) {
+            log_error("%s needs H.264 video with avcC parameter sets (MP4, MOV or MKV)", segment.filename.c_str());
+            return false;
+        }
+
+        double tb = av_q2d(stream->time_base);
+        int64_t origin = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+        start_ts = origin + (int64_t)(std::max(0.0, segment.start_seconds) / tb + 0.5);
+        if (segment.end_seconds >= 0) end_ts = origin + (int64_t)(segment.end_seconds / tb + 0.5);
+        if (end_ts <= start_ts) {
+            log_error("Empty range %.3f-%.3f in %s", segment.start_seconds, segment.end_seconds,
+                      segment.filename.c_str());
+            return false;
+        }
+        AVRational rate = stream->avg_frame_rate;
+        if (rate.num > 0 && rate.den > 0) {
+            frame_ticks = std::max<int64_t>(1, av_rescale_q(1, av_inv_q(rate), stream->time_base));
+        }
+        return true;
+    }
+
+    bool OpenDecoder() {
+        if (dec_ctx != nullptr) return true;
+        const AVCodec* decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+        if (!decoder) {
+            log_error("Failed to find video codec");
+            return false;
+        }
+        dec_ctx = avcodec_alloc_context3(decoder);
+        if (!dec_ctx || avcodec_parameters_to_context(dec_ctx, stream->codecpar) < 0) {
+            log_error("Failed to set up the video codec context");
+            return false;
+        }
+        dec_ctx->pkt_timebase = stream->time_base;
+        if (avcodec_open2(dec_ctx, decoder, NULL) < 0) {
+            log_error("Failed to open video codec");
+            return false;
+        }
+        return true;
+    }
+
+    void Close() {
+        avcodec_free_context(&dec_ctx);
+        avformat_close_input(&fmt_ctx);
+    }
+
+    int ReadPacket(AVPacket* pkt) {
+        int ret;
+        while ((ret = av_read_frame(fmt_ctx, pkt)) >= 0) {
+            if (pkt->stream_index == stream->index) return ret;
+            av_packet_unref(pkt);
+        }
+        return ret;
+    }
+
+    // Leaves the keyframe at or before start_ts in pkt. Seeking goes by dts, which trails pts when there are
+    // B-frames, so the seek steps back until the keyframe it lands on starts early enough.
+    bool SeekToKeyframe(AVPacket* pkt) {
+        int64_t target = start_ts;
+        int64_t previous_target = start_ts;
+        int64_t previous_pts = AV_NOPTS_VALUE;
+        const int kMaxAttempts = 8;
+        for (int attempt = 1; attempt <= kMaxAttempts; ++attempt) {
+            bool fallback = false;
+            if (av_seek_frame(fmt_ctx, stream->index, target, AVSEEK_FLAG_BACKWARD) < 0) {
+                // Nothing before the first keyframe, which is where the previous seek went.
+                fallback = attempt > 1;
+                if (!fallback || av_seek_frame(fmt_ctx, stream->index, previous_target, AVSEEK_FLAG_BACKWARD) < 0) {
+                    log_error("Seek to %s failed", poca_ts2str(target).c_str());
+                    return false;
+                }
+            }
+            int ret;
+            while ((ret = ReadPacket(pkt)) >= 0 && !(pkt->flags & AV_PKT_FLAG_KEY)) {
+                av_packet_unref(pkt);
+            }
+            if (ret < 0) {
+                log_error("No keyframe at or after %s", poca_ts2str(target).c_str());
+                return false;
+            }
+            int64_t pts = PacketPts(pkt);
+            // Also done when the seek cannot go back any further.
+            if (pts <= start_ts || pts == previous_pts || fallback || attempt == kMaxAttempts) return true;
+            previous_pts = pts;
+            previous_target = target;
+            target = (pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pts) - 1;
+            av_packet_unref(pkt);
+        }
+        return false;
+    }
+};
+
+class ClipWriter {
+public:
+    ClipWriter(const ClipConcatParam& param, ClipEditResult& result) : param_(param), result_(result) {}
+
+    bool Open(ClipSource& first);
+    bool AddSegment(int index, ClipSource& source);
+    bool Finish();
+    void Close();
+
+    double Duration() const { return segment_end_ * av_q2d(out_tb_); }
+
+private:
+    const ClipConcatParam& param_;
+    ClipEditResult& result_;
+
+    AVFormatContext* out_ctx_ = nullptr;
+    AVStream* out_stream_ = nullptr;
+    AVRational out_tb_;
+    int length_size_ = 4;
+    AVPacket* pkt_ = nullptr;
+    std::vector<uint8_t> nal_buffer_;
+
+    // Segment being added, and where its start lands in the output.
+    ClipSource* source_ = nullptr;
+    int index_ = 0;
+    int64_t offset_ = 0;
+    // How far the source's dts trails its pts, in output time base.
+    int64_t delay_ = 0;
+    int64_t frame_ticks_ = 1;
+
+    // End of the last frame written, where the next segment starts.
+    int64_t segment_end_ = 0;
+    int64_t last_dts_ = AV_NOPTS_VALUE;
+    // Segment whose SPS and PPS the decoder would currently hold, or kEncoderParams.
+    int params_owner_ = 0;
+
+    int64_t ToOutput(int64_t ts) const {
+        return av_rescale_q(ts - source_->start_ts, source_->stream->time_base, out_tb_) + offset_;
+    }
+
+    bool CopyGop(std::vector<AVPacket*>& gop);
+    bool ReencodeGop(std::vector<AVPacket*>& gop);
+    AVCodecContext* OpenEncoder();
+    bool Encode(AVCodecContext* enc, AVFrame* frame);
+    bool WritePacket(AVPacket* pkt);
+};
+
+bool ClipWriter::Open(ClipSource& first) {
+    const std::string& filename = param_.output_filename;
+    if (avformat_alloc_output_context2(&out_ctx_, nullptr, nullptr, filename.c_str()) < 0) {
+        log_error("Alloc avformat output ctx failed");
+        return false;
+    }
+    out_stream_ = avformat_new_stream(out_ctx_, NULL);
+    pkt_ = av_packet_alloc();
+    if (!out_stream_ || !pkt_ || avcodec_parameters_copy(out_stream_->codecpar, first.stream->codecpar) < 0) {
+        log_error("Alloc output stream failed");
+        return false;
+    }
+    out_stream_->codecpar->codec_tag = 0;
+    out_stream_->time_base = first.stream->time_base;
+    out_stream_->avg_frame_rate = first.stream->avg_frame_rate;
+    length_size_ = first.length_size;
+
+    if (!(out_ctx_->oformat->flags & AVFMT_NOFILE)) {
+        int ret = avio_open(&out_ctx_->pb, filename.c_str(), AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            log_error("Could not open '%s': %s", filename.c_str(), poca_err2str(ret).c_str());
+            return false;
+        }
+    }
+    int ret = avformat_write_header(out_ctx_, nullptr);
+    if (ret < 0) {
+        log_error("Error occurred when opening output file: %s", poca_err2str(ret).c_str());
+        return false;
+    }
+    // The muxer may have picked its own time base.
+    out_tb_ = out_stream_->time_base;
+    return true;
+}
+
+bool ClipWriter::AddSegment(int index, ClipSource& source) {
+    AVCodecParameters* first = out_stream_->codecpar;
+    AVCodecParameters* par = source.stream->codecpar;
+    if (par->width != first->width || par->height != first->height || par->format != first->format ||
+        source.length_size != length_size_) {
+        log_error("Segment %d is %dx%d, the output is %dx%d; segments need the same size and format", index,
+                  par->width, par->height, first->width, first->height);
+        return false;
+    }
+    source_ = &source;
+    index_ = index;
+    offset_ = segment_end_;
+    frame_ticks_ = std::max<int64_t>(1, av_rescale_q(source.frame_ticks, source.stream->time_base, out_tb_));
+
+    AVPacket* pkt = av_packet_alloc();
+    if (!source.SeekToKeyframe(pkt)) {
+        av_packet_free(&pkt);
+        return false;
+    }
+    delay_ = 0;
+    if (pkt->pts != AV_NOPTS_VALUE && pkt->dts != AV_NOPTS_VALUE && pkt->pts > pkt->dts) {
+        delay_ = av_rescale_q(pkt->pts - pkt->dts, source.stream->time_base, out_tb_);
+    }
+
+    // Packets are gathered a GOP at a time; the next keyframe (or the end of the file) tells where it ends.
+    std::vector<AVPacket*> gop;
+    int64_t gop_pts = 0;
+    int64_t gop_end = 0;
+    bool ok = true;
+    while (ok) {
+        bool eof = pkt == nullptr;
+        if (eof || ((pkt->flags & AV_PKT_FLAG_KEY) && !gop.empty())) {
+            int64_t next_pts = eof ? gop_end : PacketPts(pkt);
+            if (next_pts > source.start_ts) {
+                bool whole = gop_pts >= source.start_ts && next_pts <= source.end_ts;
+                ok = whole ? CopyGop(gop) : ReencodeGop(gop);
+            }
+            FreePackets(gop);
+            if (eof || next_pts >= source.end_ts) break;
+        }
+        int64_t pts = PacketPts(pkt);
+        if (gop.empty()) {
+            gop_pts = pts;
+            gop_end = pts;
+        }
+        gop_end = std::max(gop_end, pts + (pkt->duration > 0 ? pkt->duration : source.frame_ticks));
+        gop.push_back(pkt);
+        pkt = av_packet_alloc();
+        if (source.ReadPacket(pkt) < 0) av_packet_free(&pkt);
+    }
+    av_packet_free(&pkt);
+    FreePackets(gop);
+    return ok;
+}
+
+bool ClipWriter::CopyGop(std::vector<AVPacket*>& gop) {
+    for (size_t i = 1; i < gop.size(); ++i) {
+        if (PacketPts(gop[i]) < PacketPts(gop[0])) {
+            log_warn("Open GOP at %s, its leading frames may not decode", poca_ts2str(PacketPts(gop[0])).c_str());
+            break;
+        }
+    }
+    for (size_t i = 0; i < gop.size(); ++i) {
+        AVPacket* pkt = gop[i];
+        int64_t pts = pkt->pts;
+        int64_t dts = pkt->dts;
+        pkt->pts = pts != AV_NOPTS_VALUE ? ToOutput(pts) : AV_NOPTS_VALUE;
+        pkt->dts = dts != AV_NOPTS_VALUE ? ToOutput(dts) : AV_NOPTS_VALUE;
+        pkt->duration = av_rescale_q(pkt->duration, source_->stream->time_base, out_tb_);
+
+        if (i > 0 || params_owner_ == index_) {
+            if (!WritePacket(pkt)) return false;
+            continue;
+        }
+        // The decoder holds another segment's (or the encoder's) SPS and PPS, this keyframe brings back its own.
+        if (av_new_packet(pkt_, (int)source_->param_sets.size() + pkt->size) < 0) {
+            log_error("Could not allocate a packet");
+            return false;
+        }
+        av_packet_copy_props(pkt_, pkt);
+        memcpy(pkt_->data, source_->param_sets.data(), source_->param_sets.size());
+        memcpy(pkt_->data + source_->param_sets.size(), pkt->data, pkt->size);
+        if (!WritePacket(pkt_)) return false;
+        params_owner_ = index_;
+    }
+    result_.copied_packets += (int)gop.size();
+    return true;
+}
+
+AVCodecContext* ClipWriter::OpenEncoder() {
+    const AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
+    if (!encoder) {
+        log_error("Necessary encoder not found");
+        return nullptr;
+    }
+    AVCodecContext* enc = avcodec_alloc_context3(encoder);
+    if (!enc) {
+        log_error("Failed to allocate the encoder context");
+        return nullptr;
+    }
+    // Size, profile, level, colour properties and bit rate all follow the source. Its extradata does not: without a
+    // global header x264 repeats its own SPS and PPS in front of every keyframe.
+    avcodec_parameters_to_context(enc, source_->stream->codecpar);
+    av_freep(&enc->extradata);
+    enc->extradata_size = 0;
+    enc->pix_fmt = source_->dec_ctx->pix_fmt;
+    enc->time_base = out_tb_;
+    enc->framerate = source_->stream->avg_frame_rate;
+    // Keeps dts equal to pts, so it can be shifted into step with the copied packets (see Encode).
+    enc->max_b_frames = 0;
+
+    AVDictionary* opt = nullptr;
+    av_dict_set_int(&opt, "threads", param_.encoder_threads, 0);
+    std::string profile = X264Profile(enc->profile);
+    if (!profile.empty()) av_dict_set(&opt, "profile", profile.c_str(), 0);
+    int ret = avcodec_open2(enc, encoder, &opt);
+    av_dict_free(&opt);
+    if (ret < 0) {
+        log_error("Could not open video codec: %s", poca_err2str(ret).c_str());
+        avcodec_free_context(&enc);
+        return nullptr;
+    }
+    return enc;
+}
+
+// Decodes the whole GOP and re-encodes the frames inside the range, as a GOP of its own.
+bool ClipWriter::ReencodeGop(std::vector<AVPacket*>& gop) {
+    if (!source_->OpenDecoder()) return false;
+    AVCodecContext* enc = OpenEncoder();
+    if (!enc) return false;
+    AVCodecContext* dec = source_->dec_ctx;
+    avcodec_flush_buffers(dec);
+
+    AVFrame* frame = av_frame_alloc();
+    bool ok = frame != nullptr;
+    // One past the last packet drains the decoder.
+    for (size_t i = 0; ok && i <= gop.size(); ++i) {
+        int ret = avcodec_send_packet(dec, i < gop.size() ? gop[i] : nullptr);
+        if (ret < 0) {
+            log_error("Error submitting a packet for decoding: %s", poca_err2str(ret).c_str());
+            ok = false;
+            break;
+        }
+        while (ok && (ret = avcodec_receive_frame(dec, frame)) >= 0) {
+            int64_t pts = frame->best_effort_timestamp;
+            if (pts != AV_NOPTS_VALUE && pts >= source_->start_ts && pts < source_->end_ts) {
+                frame->pts = ToOutput(pts);
+                frame->pict_type = AV_PICTURE_TYPE_NONE;
+                ok = Encode(enc, frame);
+                result_.reencoded_frames++;
+            }
+            av_frame_unref(frame);
+        }
+        if (ok && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+            log_error("Error during decoding: %s", poca_err2str(ret).c_str());
+            ok = false;
+        }
+    }
+    ok = ok && Encode(enc, nullptr);
+    av_frame_free(&frame);
+    avcodec_free_context(&enc);
+    params_owner_ = kEncoderParams;
+    return ok;
+}
+
+bool ClipWriter::Encode(AVCodecContext* enc, AVFrame* frame) {
+    int ret = avcodec_send_frame(enc, frame);
+    if (ret < 0) {
+        log_error("Error sending a frame to the encoder: %s", poca_err2str(ret).c_str());
+        return false;
+    }
+    while ((ret = avcodec_receive_packet(enc, pkt_)) >= 0) {
+        // dts trails pts by the source's delay, as in the copied packets either side.
+        pkt_->dts = pkt_->pts - delay_;
+        if (pkt_->duration <= 0) pkt_->duration = frame_ticks_;
+        AnnexBToLengthPrefixed(pkt_->data, pkt_->size, length_size_, nal_buffer_);
+        if (av_grow_packet(pkt_, std::max(0, (int)nal_buffer_.size() - pkt_->size)) < 0) {
+            log_error("Could not allocate a packet");
+            return false;
+        }
+        memcpy(pkt_->data, nal_buffer_.data(), nal_buffer_.size());
+        pkt_->size = (int)nal_buffer_.size();
+        if (!WritePacket(pkt_)) return false;
+    }
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+        log_error("Error encoding a frame: %s", poca_err2str(ret).c_str());
+        return false;
+    }
+    return true;
+}
+
+bool ClipWriter::WritePacket(AVPacket* pkt) {
+    pkt->stream_index = out_stream_->index;
+    if (pkt->dts != AV_NOPTS_VALUE && last_dts_ != AV_NOPTS_VALUE && pkt->dts <= last_dts_) {
+        log_warn("Non-monotonic dts %s after %s at a splice", poca_ts2str(pkt->dts).c_str(),
+                 poca_ts2str(last_dts_).c_str());
+        pkt->dts = last_dts_ + 1;
+    }
+    if (pkt->dts != AV_NOPTS_VALUE) last_dts_ = pkt->dts;
+    if (pkt->pts != AV_NOPTS_VALUE) {
+        segment_end_ = std::max(segment_end_, pkt->pts + (pkt->duration > 0 ? pkt->duration : frame_ticks_));
+    }
+    int ret = av_interleaved_write_frame(out_ctx_, pkt);
+    if (ret < 0) {
+        log_error("Error while writing output packet: %s", poca_err2str(ret).c_str());
+        return false;
+    }
+    return true;
+}
+
+bool ClipWriter::Finish() { return av_write_trailer(out_ctx_) == 0; }
+
+void ClipWriter::Close() {
+    av_packet_free(&pkt_);
+    if (out_ctx_ != nullptr) {
+        if (!(out_ctx_->oformat->flags & AVFMT_NOFILE)) {
+            avio_closep(&out_ctx_->pb);
+        }
+        avformat_free_context(out_ctx_);
+        out_ctx_ = nullptr;
+    }
+}
+
+}  // namespace
+
+ClipEditResult ClipEditor::Trim(const ClipTrimParam& param) {
+    ClipConcatParam concat;
+    ClipSegment segment;
+    segment.filename = param.filename;
+    segment.start_seconds = param.start_seconds;
+    segment.end_seconds = param.end_seconds;
+    concat.segments.push_back(segment);
+    concat.output_filename = param.output_filename;
+    concat.encoder_threads = param.encoder_threads;
+    return Concat(concat);
+}
+
+ClipEditResult ClipEditor::Concat(const ClipConcatParam& param) {
+    ClipEditResult result;
+    auto begin = std::chrono::steady_clock::now();
+    if (param.segments.empty()) {
+        log_error("Nothing to concat");
+        return result;
+    }
+
+    ClipWriter writer(param, result);
+    bool ok = true;
+    bool opened = false;
+    // One source open at a time, the output takes its stream parameters from the first.
+    for (size_t i = 0; ok && i < param.segments.size(); ++i) {
+        ClipSource source;
+        ok = source.Open(param.segments[i]);
+        if (ok && !opened) ok = opened = writer.Open(source);
+        ok = ok && writer.AddSegment((int)i, source);
+        source.Close();
+    }
+    if (opened) ok = writer.Finish() && ok;
+    writer.Close();
+
+    result.success = ok;
+    result.duration_seconds = opened ? writer.Duration() : 0;
+    result.elapsed_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    log_info("%s: %.3fs of video from %d segment(s), %d packets copied and %d frames re-encoded in %.3fs",
+             param.output_filename.c_str(), result.duration_seconds, (int)param.segments.size(),
+             result.copied_packets, result.reencoded_frames, result.elapsed_seconds);
+    return result;
+}
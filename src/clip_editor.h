@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// A range of one input file, in seconds from the start of its video stream.
+struct ClipSegment {
+    std::string filename;
+    double start_seconds = 0;
+    // Negative runs to the end of the file.
+    double end_seconds = -1;
+};
+
+struct ClipConcatParam {
+    // Joined in order. Every segment needs H.264 video of the same size and pixel format, muxed with out-of-band
+    // parameter sets (MP4, MOV or MKV).
+    std::vector<ClipSegment> segments;
+    std::string output_filename;
+    // x264 threads for the boundary GOPs, 0 lets x264 pick.
+    int encoder_threads = 4;
+};
+
+struct ClipTrimParam {
+    std::string filename;
+    double start_seconds = 0;
+    double end_seconds = -1;
+    std::string output_filename;
+    int encoder_threads = 4;
+};
+
+struct ClipEditResult {
+    bool success = false;
+    // Source packets written as they were, and frames that went through the encoder.
+    int copied_packets = 0;
+    int reencoded_frames = 0;
+    double duration_seconds = 0;
+    double elapsed_seconds = 0;
+};
+
+// Frame-accurate cutting and joining without a full transcode. Every GOP that lies wholly inside a range is stream
+// copied; only the GOPs a cut point falls into are decoded, and their in-range frames re-encoded with the source's
+// size, profile, level, colour and bit rate so they splice with the copied packets. The re-encoded parts carry their
+// own SPS/PPS in-band and the source's are put back in front of the next copied keyframe.
+//
+// Closed GOPs are assumed (x264's default, and what MP4VideoRecorder writes). Only the video stream is written.
+class ClipEditor {
+public:
+    static ClipEditResult Trim(const ClipTrimParam& param);
+    static ClipEditResult Concat(const ClipConcatParam& param);
+};
@@ -0,0 +1,180 @@
+#include "frame_pool.h"
+
+#include <sys/mman.h>
+
+#include <cstdlib>
+
+#include "logger.h"
+#include "thread_placement.h"
+
+extern "C" {
+#include <libavutil/cpu.h>
+#include <libavutil/imgutils.h>
+}
+
+static const size_t huge_page_size = 2 * 1024 * 1024;
+static const size_t page_size = 4096;
+// Same over-allocation av_frame_get_buffer does, so SIMD code may read a little past the last line.
+static const int padded_height_align = 32;
+static const size_t tail_padding = 64;
+
+FramePool* FramePool::Instance() {
+    static FramePool* instance = new FramePool();
+    return instance;
+}
+
+FramePool::FramePool() : arena_(FRAME_POOL_ARENA_HEAP) {}
+
+void FramePool::SetArena(FramePoolArena arena) {
+    std::unique_lock<std::mutex> lock(mux_);
+    arena_ = arena;
+}
+
+AVBufferRef* FramePool::AllocBuffer(void* opaque, size_t size) {
+    Bucket* bucket = reinterpret_cast<Bucket*>(opaque);
+    uint8_t* data = nullptr;
+
+    switch (bucket->arena) {
+        case FRAME_POOL_ARENA_HUGEPAGE: {
+            size_t mapped_size = FFALIGN(size, huge_page_size);
+            void* ptr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                             -1, 0);
+            if (ptr == MAP_FAILED) {
+                ptr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (ptr == MAP_FAILED) return nullptr;
+                madvise(ptr, mapped_size, MADV_HUGEPAGE);
+            }
+            data = reinterpret_cast<uint8_t*>(ptr);
+            break;
+        }
+        case FRAME_POOL_ARENA_ALIGNED: {
+            void* ptr = nullptr;
+            if (posix_memalign(&ptr, page_size, size) != 0) return nullptr;
+            data = reinterpret_cast<uint8_t*>(ptr);
+            break;
+        }
+        default:
+            data = reinterpret_cast<uint8_t*>(av_malloc(size));
+            break;
+    }
+    if (data == nullptr) return nullptr;
+    if (bucket->numa_node >= 0) {
+        // Before the frame is first written, so the pages are faulted in on the node rather than moved there.
+        BindToNumaNode(data, size, bucket->numa_node);
+    }
+
+    AVBufferRef* buf = av_buffer_create(data, size, &FramePool::FreeBuffer, bucket, 0);
+    if (buf == nullptr) FreeBuffer(bucket, data);
+    return buf;
+}
+
+void FramePool::FreeBuffer(void* opaque, uint8_t* data) {
+    Bucket* bucket = reinterpret_cast<Bucket*>(opaque);
+    switch (bucket->arena) {
+        case FRAME_POOL_ARENA_HUGEPAGE:
+            munmap(data, FFALIGN(bucket->buffer_size, huge_page_size));
+            break;
+        case FRAME_POOL_ARENA_ALIGNED:
+            free(data);
+            break;
+        default:
+            av_free(data);
+            break;
+    }
+}
+
+FramePool::Bucket* FramePool::GetBucket(AVPixelFormat format, int width, int height, int numa_node) {
+    std::unique_lock<std::mutex> lock(mux_);
+    BucketKey key(format, width, height, numa_node);
+    auto it = buckets_.find(key);
+    if (it != buckets_.end()) return it->second;
+
+    // Linesizes are aligned the way av_frame_get_buffer(frame, 0) aligns them.
+    int align = av_cpu_max_align();
+    int linesize[4] = {0};
+    int ret = -1;
+    for (int i = 1; i <= align; i += i) {
+        ret = av_image_fill_linesizes(linesize, format, FFALIGN(width, i));
+        if (ret < 0) break;
+        if (!(linesize[0] & (align - 1))) break;
+    }
+    if (ret < 0) {
+        log_error("Unsupported frame geometry, format: %d, size: %dx%d", format, width, height);
+        return nullptr;
+    }
+
+    ptrdiff_t linesizes[4];
+    for (int i = 0; i < 4; ++i) {
+        if (linesize[i]) linesize[i] = FFALIGN(linesize[i], align);
+        linesizes[i] = linesize[i];
+    }
+    size_t plane_sizes[4];
+    if (av_image_fill_plane_sizes(plane_sizes, format, FFALIGN(height, padded_height_align), linesizes) < 0) {
+        log_error("Could not compute plane sizes, format: %d, size: %dx%d", format, width, height);
+        return nullptr;
+    }
+
+    Bucket* bucket = new Bucket();
+    bucket->format = format;
+    bucket->width = width;
+    bucket->height = height;
+    // Binding needs a page aligned start, av_malloc only aligns to the SIMD width.
+    bucket->arena = numa_node >= 0 && arena_ == FRAME_POOL_ARENA_HEAP ? FRAME_POOL_ARENA_ALIGNED : arena_;
+    bucket->numa_node = numa_node;
+    size_t offset = 0;
+    for (int i = 0; i < 4; ++i) {
+        bucket->linesize[i] = linesize[i];
+        bucket->plane_offset[i] = offset;
+        offset += linesize[i] ? plane_sizes[i] : 0;
+    }
+    bucket->buffer_size = offset + tail_padding;
+    bucket->pool = av_buffer_pool_init2(bucket->buffer_size, bucket, &FramePool::AllocBuffer, nullptr);
+    if (bucket->pool == nullptr) {
+        log_error("Could not create buffer pool");
+        delete bucket;
+        return nullptr;
+    }
+
+    log_info("New frame pool bucket, format: %d, size: %dx%d, buffer size: %zu, arena: %d, numa node: %d", format,
+             width, height, bucket->buffer_size, bucket->arena, bucket->numa_node);
+    buckets_[key] = bucket;
+    return bucket;
+}
+
+bool FramePool::Lease(AVFrame* frame, int numa_node) {
+    if (frame->buf[0] != nullptr) {
+        log_error("Frame already has buffers");
+        return false;
+    }
+
+    Bucket* bucket = GetBucket((AVPixelFormat)frame->format, frame->width, frame->height, numa_node);
+    if (bucket == nullptr) return false;
+
+    AVBufferRef* buf = av_buffer_pool_get(bucket->pool);
+    if (buf == nullptr) {
+        log_error("Could not get a buffer from the frame pool");
+        return false;
+    }
+
+    frame->buf[0] = buf;
+    for (int i = 0; i < 4; ++i) {
+        frame->linesize[i] = bucket->linesize[i];
+        frame->data[i] = bucket->linesize[i] ? buf->data + bucket->plane_offset[i] : nullptr;
+    }
+    frame->extended_data = frame->data;
+    return true;
+}
+
+AVFrame* FramePool::Lease(AVPixelFormat format, int width, int height, int numa_node) {
+    AVFrame* frame = av_frame_alloc();
+    if (frame == nullptr) return nullptr;
+
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    if (!Lease(frame, numa_node)) {
+        av_frame_free(&frame);
+        return nullptr;
+    }
+    return frame;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <tuple>
+
+extern "C" {
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+}
+
+// Where the pooled frame buffers come from.
+enum FramePoolArena {
+    FRAME_POOL_ARENA_HEAP = 0,  // av_malloc
+    FRAME_POOL_ARENA_ALIGNED,   // page aligned
+    FRAME_POOL_ARENA_HUGEPAGE,  // explicit 2MB huge pages, falls back to transparent huge pages
+};
+
+// Process-wide pool of frame buffers keyed by (format, width, height). A leased frame owns a reference to a pooled
+// buffer, av_frame_unref/av_frame_free hands it back, so sessions that start and stop repeatedly, or many sessions
+// at the same resolution, reuse the same memory instead of going through the allocator and faulting in fresh pages.
+class FramePool {
+public:
+    static FramePool* Instance();
+
+    // Must be called before the first lease to take effect for all buckets.
+    void SetArena(FramePoolArena arena);
+
+    // Allocates buffers for a frame whose format, width and height are already set. Drop-in for
+    // av_frame_get_buffer(frame, 0). With a |numa_node|, the buffers come from a separate bucket whose pages are bound
+    // to that node (see ThreadPlacement).
+    bool Lease(AVFrame* frame, int numa_node = -1);
+    // Allocates the frame itself too. Returns nullptr on failure.
+    AVFrame* Lease(AVPixelFormat format, int width, int height, int numa_node = -1);
+
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+
+private:
+    struct Bucket {
+        AVPixelFormat format;
+        int width;
+        int height;
+        int linesize[4];
+        size_t plane_offset[4];
+        size_t buffer_size;
+        FramePoolArena arena;
+        // -1 for no binding.
+        int numa_node;
+        AVBufferPool* pool;
+    };
+
+    typedef std::tuple<int, int, int, int> BucketKey;
+
+    std::mutex mux_;
+    std::map<BucketKey, Bucket*> buckets_;
+    FramePoolArena arena_;
+
+    FramePool();
+
+    Bucket* GetBucket(AVPixelFormat format, int width, int height, int numa_node);
+
+    static AVBufferRef* AllocBuffer(void* opaque, size_t size);
+    static void FreeBuffer(void* opaque, uint8_t* data);
+};
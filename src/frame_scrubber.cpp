@@ -0,0 +1,564 @@
+#include "frame_scrubber.h"
+
+#include <libyuv.h>
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+#include "frame_pool.h"
+#include "fused_convert.h"
+#include "logger.h"
+#include "poca_str.h"
+#include "ring_depth.h"
+
+namespace {
+
+int64_t PacketPts(const AVPacket* pkt) { return pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts; }
+
+}  // namespace
+
+bool FrameScrubber::Open(const FrameScrubberParam& param) {
+    Close();
+
+    if (avformat_open_input(&fmt_ctx_, param.filename.c_str(), NULL, NULL) < 0) {
+        log_error("Could not open source file %s", param.filename.c_str());
+        return false;
+    }
+    if (avformat_find_stream_info(fmt_ctx_, NULL) < 0) {
+        log_error("Could not find stream information");
+        return false;
+    }
+    int idx = av_find_best_stream(fmt_ctx_, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (idx < 0) {
+        log_error("Could not find video stream in input file '%s'", param.filename.c_str());
+        return false;
+    }
+    stream_ = fmt_ctx_->streams[idx];
+
+    const AVCodec* decoder = avcodec_find_decoder(stream_->codecpar->codec_id);
+    if (decoder == nullptr) {
+        log_error("Failed to find video codec");
+        return false;
+    }
+    dec_ctx_ = avcodec_alloc_context3(decoder);
+    if (dec_ctx_ == nullptr || avcodec_parameters_to_context(dec_ctx_, stream_->codecpar) < 0) {
+        log_error("Failed to set up the video codec context");
+        return false;
+    }
+    if (param.decoder_threads > 0) {
+        dec_ctx_->thread_count = param.decoder_threads;
+    }
+    if (avcodec_open2(dec_ctx_, decoder, NULL) < 0) {
+        log_error("Failed to open video codec");
+        return false;
+    }
+    if (dec_ctx_->pix_fmt != AV_PIX_FMT_YUV420P && dec_ctx_->pix_fmt != AV_PIX_FMT_YUVJ420P) {
+        log_error("Scrubbing needs 4:2:0 video, %s is %s", param.filename.c_str(),
+                  av_get_pix_fmt_name(dec_ctx_->pix_fmt));
+        return false;
+    }
+    pkt_ = av_packet_alloc();
+    decoded_ = av_frame_alloc();
+    if (pkt_ == nullptr || decoded_ == nullptr) {
+        log_error("Could not allocate frame data.");
+        return false;
+    }
+
+    output_width_ = param.output_width > 0 ? param.output_width : dec_ctx_->width;
+    output_height_ = param.output_height > 0 ? param.output_height : dec_ctx_->height;
+    if (output_width_ != dec_ctx_->width || output_height_ != dec_ctx_->height) {
+        FusedConvertParam convert_param;
+        convert_param.direction = FUSED_I420_TO_RGB;
+        convert_param.rgb_order = FUSED_RGB_RAW;
+        convert_param.filter = FUSED_FILTER_BOX;
+        convert_param.src_width = dec_ctx_->width;
+        convert_param.src_height = dec_ctx_->height;
+        convert_param.dst_width = output_width_;
+        convert_param.dst_height = output_height_;
+        converter_ = new FusedConverter();
+        if (!converter_->Init(convert_param)) {
+            return false;
+        }
+    }
+    frame_bytes_ = (size_t)output_width_ * output_height_ * 3;
+    cache_bytes_limit_ = std::max(param.cache_bytes, frame_bytes_);
+    prefetch_gops_ = std::max(0, param.prefetch_gops);
+
+    AVRational rate = stream_->avg_frame_rate.num > 0 ? stream_->avg_frame_rate : stream_->r_frame_rate;
+    frame_ticks_ = 1;
+    if (rate.num > 0 && rate.den > 0) {
+        frame_ticks_ = std::max<int64_t>(1, av_rescale_q(1, av_inv_q(rate), stream_->time_base));
+    }
+    duration_seconds_ = fmt_ctx_->duration != AV_NOPTS_VALUE ? fmt_ctx_->duration / (double)AV_TIME_BASE : 0;
+
+    // Leaves the first keyframe packet waiting, it starts the GOP the first miss most likely decodes.
+    int ret;
+    while ((ret = ReadVideoPacket()) >= 0 && !(pkt_->flags & AV_PKT_FLAG_KEY)) {
+        av_packet_unref(pkt_);
+    }
+    if (ret < 0) {
+        log_error("No keyframe in %s", param.filename.c_str());
+        return false;
+    }
+    first_key_pts_ = PacketPts(pkt_);
+    have_next_key_ = true;
+    in_gop_ = false;
+    last_decoded_pts_ = AV_NOPTS_VALUE;
+    previous_pts_ = AV_NOPTS_VALUE;
+
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        time_base_ = stream_->time_base;
+        start_pts_ = stream_->start_time != AV_NOPTS_VALUE ? stream_->start_time : first_key_pts_;
+        open_ = true;
+        round_ = 0;
+        hits_ = 0;
+        misses_ = 0;
+        prefetched_frames_ = 0;
+        evicted_frames_ = 0;
+    }
+    {
+        std::lock_guard<std::mutex> lock(prefetch_mutex_);
+        stopping_ = false;
+        requested_ = 0;
+        handled_ = 0;
+    }
+    prefetch_thread_ = std::thread(&FrameScrubber::Prefetch, this);
+
+    log_info("Scrubbing %s, %dx%d frames, cache %zu frames", param.filename.c_str(), output_width_, output_height_,
+             cache_bytes_limit_ / frame_bytes_);
+    return true;
+}
+
+void FrameScrubber::Close() {
+    {
+        std::lock_guard<std::mutex> lock(prefetch_mutex_);
+        stopping_ = true;
+    }
+    prefetch_cv_.notify_all();
+    if (prefetch_thread_.joinable()) {
+        prefetch_thread_.join();
+    }
+
+    if (fmt_ctx_ != nullptr) {
+        FrameScrubberStats stats = Stats();
+        log_info("Scrubber: %llu hits, %llu misses (%.1f%% hit), %llu prefetched, %llu evicted",
+                 (unsigned long long)stats.hits, (unsigned long long)stats.misses, stats.HitRate() * 100,
+                 (unsigned long long)stats.prefetched_frames, (unsigned long long)stats.evicted_frames);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        open_ = false;
+        for (auto& entry : frames_) {
+            av_frame_free(&entry.second.frame);
+        }
+        frames_.clear();
+        lru_.clear();
+        gops_.clear();
+        FrameMemoryBudget::Instance()->Release(cached_bytes_);
+        cached_bytes_ = 0;
+    }
+
+    // A GetFrame still decoding holds decode_mutex_.
+    std::lock_guard<std::mutex> decode_lock(decode_mutex_);
+    delete converter_;
+    converter_ = nullptr;
+    av_frame_free(&decoded_);
+    av_packet_free(&pkt_);
+    avcodec_free_context(&dec_ctx_);
+    avformat_close_input(&fmt_ctx_);
+    stream_ = nullptr;
+    have_next_key_ = false;
+    in_gop_ = false;
+}
+
+bool FrameScrubber::GetFrame(double seconds, AVFrame* frame) {
+    if (frame == nullptr) return false;
+    int64_t begin_ns = MetricsNowNs();
+    int64_t target;
+
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        if (!open_) return false;
+        target = std::max<int64_t>(start_pts_, start_pts_ + llrint(seconds / av_q2d(time_base_)));
+        if (LookupLocked(target, frame)) {
+            ++hits_;
+            hit_latency_.Record(MetricsNowNs() - begin_ns);
+            return true;
+        }
+        ++misses_;
+        // Everything cached from here on, and everything hit, belongs to this miss and is off limits to prefetching.
+        ++round_;
+    }
+
+    foreground_waiting_.fetch_add(1);
+    std::unique_lock<std::mutex> decode_lock(decode_mutex_);
+    foreground_waiting_.fetch_sub(1);
+    if (fmt_ctx_ == nullptr) return false;
+
+    bool found;
+    {
+        // Prefetching may have decoded it while this call waited for the decoder.
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        found = LookupLocked(target, frame);
+    }
+    if (!found) {
+        // Decoding on is cheaper than seeking back to the keyframe when the frame is a little further on in the GOP.
+        if (!in_gop_ || last_decoded_pts_ == AV_NOPTS_VALUE || last_decoded_pts_ >= target ||
+            target - last_decoded_pts_ > frame_ticks_ * decode_on_frames_) {
+            SeekTo(target);
+        }
+        bool stepped_back = false;
+        while (true) {
+            int64_t stop_pts = target;
+            if (stepped_back && have_next_key_) {
+                // Seeking back landed on the same keyframe again, settle for its first frame.
+                stop_pts = std::max(target, PacketPts(pkt_));
+            }
+            GopResult result = DecodeGop(stop_pts, false);
+            if (result == GOP_PAST) {
+                if (!stepped_back) {
+                    // The seek index is by dts and reordering put the keyframe's pts after the frame: it belongs to
+                    // the previous GOP.
+                    stepped_back = true;
+                    SeekTo((pkt_->dts != AV_NOPTS_VALUE ? pkt_->dts : PacketPts(pkt_)) - 1);
+                }
+                continue;
+            }
+            // GOP_DONE without the frame means it is in a later GOP, unless there is a gap in the stream.
+            if (result != GOP_DONE) break;
+            if (!have_next_key_ || PacketPts(pkt_) > target) break;
+        }
+
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        found = LookupLocked(target, frame);
+        if (!found && !frames_.empty()) {
+            // Before the first frame or in a gap, the next frame; past the last one, the last.
+            auto it = frames_.lower_bound(target);
+            if (it == frames_.end()) --it;
+            found = LookupLocked(it->first, frame);
+        }
+    }
+    int64_t key_pts = gop_key_pts_;
+    decode_lock.unlock();
+
+    if (found && prefetch_gops_ > 0) {
+        {
+            std::lock_guard<std::mutex> lock(prefetch_mutex_);
+            prefetch_key_pts_ = key_pts;
+            ++requested_;
+        }
+        prefetch_cv_.notify_one();
+    }
+
+    miss_latency_.Record(MetricsNowNs() - begin_ns);
+    return found;
+}
+
+FrameScrubberStats FrameScrubber::Stats() {
+    FrameScrubberStats stats;
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    stats.hits = hits_;
+    stats.misses = misses_;
+    stats.prefetched_frames = prefetched_frames_;
+    stats.evicted_frames = evicted_frames_;
+    stats.cached_frames = frames_.size();
+    stats.cached_bytes = cached_bytes_;
+    stats.hit_latency = hit_latency_.Snapshot();
+    stats.miss_latency = miss_latency_.Snapshot();
+    return stats;
+}
+
+bool FrameScrubber::LookupLocked(int64_t pts, AVFrame* frame) {
+    auto it = frames_.upper_bound(pts);
+    if (it == frames_.begin()) return false;
+    --it;
+    CacheEntry& entry = it->second;
+    if (pts >= entry.end_pts) return false;
+
+    lru_.splice(lru_.begin(), lru_, entry.lru);
+    entry.round = round_;
+    av_frame_unref(frame);
+    return av_frame_ref(frame, entry.frame) >= 0;
+}
+
+bool FrameScrubber::GopCachedLocked(int64_t key_pts) {
+    auto gop = gops_.find(key_pts);
+    if (gop == gops_.end()) return false;
+    auto begin = frames_.lower_bound(key_pts);
+    auto end = frames_.lower_bound(gop->second.next_key_pts);
+    return std::distance(begin, end) >= gop->second.frames;
+}
+
+bool FrameScrubber::Insert(AVFrame* decoded, bool prefetch) {
+    int64_t pts = decoded->best_effort_timestamp;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        if (previous_pts_ != AV_NOPTS_VALUE && previous_pts_ < pts) {
+            auto previous = frames_.find(previous_pts_);
+            if (previous != frames_.end()) previous->second.end_pts = pts;
+        }
+        previous_pts_ = pts;
+        if (!open_) return false;
+        if (frames_.count(pts) > 0) return true;
+
+        while (cached_bytes_ + frame_bytes_ > cache_bytes_limit_ && !lru_.empty()) {
+            auto victim = frames_.find(lru_.back());
+            if (prefetch && victim->second.round == round_) return false;
+            av_frame_free(&victim->second.frame);
+            frames_.erase(victim);
+            lru_.pop_back();
+            cached_bytes_ -= frame_bytes_;
+            FrameMemoryBudget::Instance()->Release(frame_bytes_);
+            ++evicted_frames_;
+        }
+        if (prefetch) {
+            if (!FrameMemoryBudget::Instance()->TryReserve(frame_bytes_)) return false;
+        } else {
+            FrameMemoryBudget::Instance()->Reserve(frame_bytes_);
+        }
+        // Held while converting outside the lock, so hits are served meanwhile.
+        cached_bytes_ += frame_bytes_;
+    }
+
+    AVFrame* rgb = FramePool::Instance()->Lease(AV_PIX_FMT_RGB24, output_width_, output_height_);
+    if (rgb == nullptr) {
+        log_error("Could not allocate frame data.");
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        if (open_) {
+            cached_bytes_ -= frame_bytes_;
+            FrameMemoryBudget::Instance()->Release(frame_bytes_);
+        }
+        return false;
+    }
+    if (converter_ != nullptr) {
+        converter_->I420ToRgb(decoded->data[0], decoded->linesize[0], decoded->data[1], decoded->linesize[1],
+                              decoded->data[2], decoded->linesize[2], rgb->data[0], rgb->linesize[0]);
+    } else {
+        libyuv::I420ToRAW(decoded->data[0], decoded->linesize[0], decoded->data[1], decoded->linesize[1],
+                          decoded->data[2], decoded->linesize[2], rgb->data[0], rgb->linesize[0], output_width_,
+                          output_height_);
+    }
+    rgb->pts = pts;
+    rgb->time_base = time_base_;
+
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    if (!open_) {
+        // Close emptied the cache meanwhile and released this frame's bytes along with the rest.
+        av_frame_free(&rgb);
+        return false;
+    }
+    lru_.push_front(pts);
+    CacheEntry entry;
+    entry.frame = rgb;
+    entry.end_pts = pts + frame_ticks_;
+    entry.round = round_;
+    entry.lru = lru_.begin();
+    frames_[pts] = entry;
+    if (prefetch) ++prefetched_frames_;
+    return true;
+}
+
+void FrameScrubber::SeekTo(int64_t pts) {
+    if (have_next_key_) av_packet_unref(pkt_);
+    have_next_key_ = false;
+    in_gop_ = false;
+    last_decoded_pts_ = AV_NOPTS_VALUE;
+    previous_pts_ = AV_NOPTS_VALUE;
+    avcodec_flush_buffers(dec_ctx_);
+    int ret = av_seek_frame(fmt_ctx_, stream_->index, std::max(pts, first_key_pts_), AVSEEK_FLAG_BACKWARD);
+    if (ret < 0) {
+        log_warn("Seek to %s failed (%s), back to the start", poca_ts2str(pts).c_str(), poca_err2str(ret).c_str());
+        av_seek_frame(fmt_ctx_, stream_->index, first_key_pts_, AVSEEK_FLAG_BACKWARD);
+    }
+}
+
+int FrameScrubber::ReadVideoPacket() {
+    int ret;
+    while ((ret = av_read_frame(fmt_ctx_, pkt_)) >= 0) {
+        if (pkt_->stream_index == stream_->index) return 0;
+        av_packet_unref(pkt_);
+    }
+    return ret;
+}
+
+FrameScrubber::GopResult FrameScrubber::DecodeGop(int64_t stop_pts, bool prefetch) {
+    while (true) {
+        if (prefetch && ShouldYield()) return GOP_ABORTED;
+
+        if (have_next_key_ && !in_gop_) {
+            have_next_key_ = false;
+        } else if (ReadVideoPacket() < 0) {
+            if (!in_gop_) return GOP_END;
+            int64_t key_pts = gop_key_pts_;
+            GopResult result = DrainGop(prefetch);
+            if (result != GOP_DONE) return result;
+            std::lock_guard<std::mutex> lock(cache_mutex_);
+            if (gop_complete_) gops_[key_pts] = GopInfo{gop_key_dts_, INT64_MAX, gop_frames_};
+            // The last frame stays on screen to the end.
+            if (last_decoded_pts_ != AV_NOPTS_VALUE) {
+                auto last = frames_.find(last_decoded_pts_);
+                if (last != frames_.end()) last->second.end_pts = INT64_MAX;
+            }
+            return GOP_END;
+        }
+
+        int64_t pts = PacketPts(pkt_);
+        bool key = (pkt_->flags & AV_PKT_FLAG_KEY) != 0;
+        if (key && in_gop_) {
+            have_next_key_ = true;
+            int64_t key_pts = gop_key_pts_;
+            GopResult result = DrainGop(prefetch);
+            if (result == GOP_DONE && gop_complete_) {
+                std::lock_guard<std::mutex> lock(cache_mutex_);
+                gops_[key_pts] = GopInfo{gop_key_dts_, pts, gop_frames_};
+            }
+            return result;
+        }
+        if (!in_gop_) {
+            if (!key) {
+                // The seek did not land on a keyframe.
+                av_packet_unref(pkt_);
+                continue;
+            }
+            if (!prefetch && pts > stop_pts && pts > first_key_pts_) {
+                have_next_key_ = true;
+                return GOP_PAST;
+            }
+            in_gop_ = true;
+            gop_key_pts_ = pts;
+            gop_key_dts_ = pkt_->dts != AV_NOPTS_VALUE ? pkt_->dts : pts;
+            gop_frames_ = 0;
+            gop_complete_ = true;
+        }
+
+        int ret = avcodec_send_packet(dec_ctx_, pkt_);
+        av_packet_unref(pkt_);
+        if (ret < 0) {
+            log_warn("Error submitting a packet for decoding (%s)", poca_err2str(ret).c_str());
+            gop_complete_ = false;
+            continue;
+        }
+        GopResult result = ReceiveFrames(stop_pts, prefetch);
+        if (result != GOP_DONE) return result;
+    }
+}
+
+// Takes the frames the decoder still holds at the end of a GOP and resets it for the next one.
+FrameScrubber::GopResult FrameScrubber::DrainGop(bool prefetch) {
+    avcodec_send_packet(dec_ctx_, nullptr);
+    GopResult result = ReceiveFrames(INT64_MAX, prefetch);
+    avcodec_flush_buffers(dec_ctx_);
+    in_gop_ = false;
+    return result == GOP_END ? GOP_DONE : result;
+}
+
+// Caches every frame the decoder has ready. GOP_DONE when it needs more input, GOP_STOPPED when one of them covers
+// stop_pts, GOP_END once drained.
+FrameScrubber::GopResult FrameScrubber::ReceiveFrames(int64_t stop_pts, bool prefetch) {
+    GopResult result = GOP_DONE;
+    while (true) {
+        int ret = avcodec_receive_frame(dec_ctx_, decoded_);
+        if (ret == AVERROR(EAGAIN)) return result;
+        if (ret == AVERROR_EOF) return GOP_END;
+        if (ret < 0) {
+            log_error("Error during decoding (%s)", poca_err2str(ret).c_str());
+            return GOP_ERROR;
+        }
+        int64_t pts = decoded_->best_effort_timestamp;
+        if (pts == AV_NOPTS_VALUE) {
+            av_frame_unref(decoded_);
+            continue;
+        }
+        ++gop_frames_;
+        last_decoded_pts_ = pts;
+        // A refused frame is dropped, the decoder still has to be emptied before it takes more packets.
+        if (result != GOP_ABORTED && !Insert(decoded_, prefetch)) {
+            gop_complete_ = false;
+            result = GOP_ABORTED;
+        }
+        av_frame_unref(decoded_);
+        if (result == GOP_DONE && pts + frame_ticks_ > stop_pts) result = GOP_STOPPED;
+    }
+}
+
+bool FrameScrubber::ShouldYield() {
+    if (foreground_waiting_.load() > 0) return true;
+    std::lock_guard<std::mutex> lock(prefetch_mutex_);
+    return stopping_ || handled_ != requested_;
+}
+
+void FrameScrubber::Prefetch() {
+    while (true) {
+        int64_t key_pts;
+        {
+            std::unique_lock<std::mutex> lock(prefetch_mutex_);
+            prefetch_cv_.wait(lock, [this] { return stopping_ || handled_ != requested_; });
+            if (stopping_) return;
+            handled_ = requested_;
+            key_pts = prefetch_key_pts_;
+        }
+        std::lock_guard<std::mutex> decode_lock(decode_mutex_);
+        PrefetchAround(key_pts);
+    }
+}
+
+// Finishes the GOP a miss stopped in, then decodes prefetch_gops_ GOPs after it and as many before it, skipping the
+// ones still cached.
+void FrameScrubber::PrefetchAround(int64_t key_pts) {
+    if (in_gop_ && gop_key_pts_ == key_pts) {
+        GopResult result = DecodeGop(INT64_MAX, true);
+        if (result != GOP_DONE && result != GOP_END) return;
+    }
+
+    int64_t next = AV_NOPTS_VALUE;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        auto gop = gops_.find(key_pts);
+        if (gop != gops_.end()) next = gop->second.next_key_pts;
+    }
+    for (int i = 0; i < prefetch_gops_ && next != AV_NOPTS_VALUE && next != INT64_MAX; ++i) {
+        int64_t key = next;
+        bool cached;
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex_);
+            cached = GopCachedLocked(key);
+        }
+        if (!cached) {
+            if (!(have_next_key_ && !in_gop_ && PacketPts(pkt_) == key)) {
+                SeekTo(key);
+            }
+            GopResult result = DecodeGop(INT64_MAX, true);
+            if (result != GOP_DONE && result != GOP_END) return;
+        }
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        auto gop = gops_.find(key);
+        next = gop != gops_.end() ? gop->second.next_key_pts : AV_NOPTS_VALUE;
+    }
+
+    int64_t key = key_pts;
+    for (int i = 0; i < prefetch_gops_ && key > first_key_pts_; ++i) {
+        int64_t previous = AV_NOPTS_VALUE;
+        int64_t key_dts = AV_NOPTS_VALUE;
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex_);
+            auto gop = gops_.find(key);
+            if (gop == gops_.end()) return;
+            key_dts = gop->second.key_dts;
+            auto before = gops_.lower_bound(key);
+            if (before != gops_.begin() && (--before)->second.next_key_pts == key) {
+                previous = before->first;
+                if (GopCachedLocked(previous)) {
+                    key = previous;
+                    continue;
+                }
+            }
+        }
+        // The index is by dts, just before this keyframe's lands on the previous one.
+        SeekTo(key_dts - 1);
+        if (DecodeGop(INT64_MAX, true) != GOP_DONE || gop_key_pts_ >= key) return;
+        key = gop_key_pts_;
+    }
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "pipeline_metrics.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+class FusedConverter;
+
+struct FrameScrubberParam {
+    std::string filename;
+    // Size of the RGB frames handed out, 0 for the stream's. A preview size fits many more frames into the cache.
+    int output_width = 0;
+    int output_height = 0;
+    // Decoded frames kept at most, about 85 frames at 1080p. Also reserved against the FrameMemoryBudget as the cache
+    // fills.
+    size_t cache_bytes = (size_t)512 << 20;
+    // GOPs after and before the one a miss decoded, decoded on a background thread.
+    int prefetch_gops = 1;
+    // libavcodec threads, 0 lets libavcodec pick.
+    int decoder_threads = 0;
+};
+
+struct FrameScrubberStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t prefetched_frames = 0;
+    uint64_t evicted_frames = 0;
+    size_t cached_frames = 0;
+    size_t cached_bytes = 0;
+    // GetFrame latency by outcome.
+    LatencySnapshot hit_latency;
+    LatencySnapshot miss_latency;
+
+    double HitRate() const { return hits + misses > 0 ? (double)hits / (hits + misses) : 0; }
+};
+
+// Random access to decoded frames for scrubbing, through an LRU cache of RGB frames keyed by pts. A hit hands out a
+// reference to the cached frame without touching the demuxer or the codec. A miss seeks to the keyframe before the
+// frame (or keeps decoding when the frame is further on in the GOP being decoded) and decodes up to it, caching every
+// frame on the way. Then a background thread finishes that GOP and decodes prefetch_gops GOPs on either side.
+//
+// Prefetching never evicts frames decoded or hit since the last miss, so it cannot push out the neighbourhood being
+// scrubbed. Closed GOPs are assumed, which is what x264 and MP4VideoRecorder write.
+class FrameScrubber {
+public:
+    bool Open(const FrameScrubberParam& param);
+    void Close();
+
+    // Makes |frame| a reference to the frame on screen at |seconds| from the start of the stream, that is the last
+    // one starting at or before it, clamped to the first and last frames. Shared with the cache, read only.
+    bool GetFrame(double seconds, AVFrame* frame);
+    FrameScrubberStats Stats();
+
+    int Width() const { return output_width_; }
+    int Height() const { return output_height_; }
+    double Duration() const { return duration_seconds_; }
+
+    FrameScrubber() : foreground_waiting_(0) {}
+    ~FrameScrubber() { Close(); }
+
+    FrameScrubber(const FrameScrubber&) = delete;
+    FrameScrubber& operator=(const FrameScrubber&) = delete;
+
+private:
+    enum GopResult {
+        GOP_STOPPED = 0,  // the frame asked for is cached, the rest of the GOP is not decoded yet
+        GOP_DONE,         // the next GOP's keyframe packet is read and waiting
+        GOP_END,          // end of the stream
+        GOP_ABORTED,      // prefetch gave way, or the cache has no room it may take
+        GOP_PAST,         // the GOP starts after the frame asked for, its keyframe packet is waiting
+        GOP_ERROR,
+    };
+
+    struct GopInfo {
+        int64_t key_dts;
+        // INT64_MAX for the last GOP.
+        int64_t next_key_pts;
+        int frames;
+    };
+
+    struct CacheEntry {
+        AVFrame* frame;
+        // pts of the next frame, or one frame duration on when that is not known.
+        int64_t end_pts;
+        // Miss round the frame was decoded or last hit in.
+        uint64_t round;
+        std::list<int64_t>::iterator lru;
+    };
+
+    // A miss further on than this from the last decoded frame seeks instead of decoding on.
+    static const int decode_on_frames_ = 60;
+
+    int output_width_ = 0;
+    int output_height_ = 0;
+    double duration_seconds_ = 0;
+    size_t cache_bytes_limit_ = 0;
+    size_t frame_bytes_ = 0;
+    int prefetch_gops_ = 0;
+
+    // Demuxer and decoder state, guarded by decode_mutex_.
+    std::mutex decode_mutex_;
+    AVFormatContext* fmt_ctx_ = nullptr;
+    AVStream* stream_ = nullptr;
+    AVCodecContext* dec_ctx_ = nullptr;
+    AVPacket* pkt_ = nullptr;
+    AVFrame* decoded_ = nullptr;
+    FusedConverter* converter_ = nullptr;
+    int64_t frame_ticks_ = 1;
+    int64_t first_key_pts_ = 0;
+    // pkt_ holds the keyframe packet that starts the next GOP.
+    bool have_next_key_ = false;
+    // Packets of gop_key_pts_'s GOP are being sent and more may follow.
+    bool in_gop_ = false;
+    int64_t gop_key_pts_ = AV_NOPTS_VALUE;
+    int64_t gop_key_dts_ = AV_NOPTS_VALUE;
+    int gop_frames_ = 0;
+    bool gop_complete_ = true;
+    int64_t last_decoded_pts_ = AV_NOPTS_VALUE;
+    // Cached just before, in the same run of decoding, for fixing up its end_pts.
+    int64_t previous_pts_ = AV_NOPTS_VALUE;
+
+    // Guarded by cache_mutex_.
+    std::mutex cache_mutex_;
+    // Between Open and Close. A GetFrame racing Close finds it cleared and caches nothing more.
+    bool open_ = false;
+    // Of the stream, set before open_ and left alone by Close.
+    AVRational time_base_ = {1, 1};
+    int64_t start_pts_ = 0;
+    std::map<int64_t, CacheEntry> frames_;
+    // Most recently used first.
+    std::list<int64_t> lru_;
+    size_t cached_bytes_ = 0;
+    // Completely decoded GOPs by keyframe pts.
+    std::map<int64_t, GopInfo> gops_;
+    uint64_t round_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    uint64_t prefetched_frames_ = 0;
+    uint64_t evicted_frames_ = 0;
+    LatencyHistogram hit_latency_;
+    LatencyHistogram miss_latency_;
+
+    // Prefetch requests, guarded by prefetch_mutex_.
+    std::mutex prefetch_mutex_;
+    std::condition_variable prefetch_cv_;
+    std::thread prefetch_thread_;
+    bool stopping_ = false;
+    uint64_t requested_ = 0;
+    uint64_t handled_ = 0;
+    int64_t prefetch_key_pts_ = AV_NOPTS_VALUE;
+    // GetFrame calls waiting for decode_mutex_, prefetching gives way to them between frames.
+    std::atomic<int> foreground_waiting_;
+
+    bool LookupLocked(int64_t pts, AVFrame* frame);
+    bool GopCachedLocked(int64_t key_pts);
+    bool Insert(AVFrame* decoded, bool prefetch);
+    void SeekTo(int64_t pts);
+    int ReadVideoPacket();
+    GopResult DecodeGop(int64_t stop_pts, bool prefetch);
+    GopResult DrainGop(bool prefetch);
+    GopResult ReceiveFrames(int64_t stop_pts, bool prefetch);
+    bool ShouldYield();
+    void Prefetch();
+    void PrefetchAround(int64_t key_pts);
+};
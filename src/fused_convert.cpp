@@ -0,0 +1,180 @@
+#include "fused_convert.h"
+
+#include "fused_convert_kernels.h"
+#include "logger.h"
+
+namespace {
+
+const FusedKernelTable kScalarKernels = MakeFusedKernelTable<ScalarOps>();
+
+// Vertical box sums are kept in 16 bits.
+const int kMaxBoxRows = 65535 / 255;
+// Box reciprocals are exact up to 2^21.
+const size_t kMaxBoxArea = 1 << 20;
+
+void BuildAxis(FusedAxis& axis, FusedScaleFilter filter, int src_size, int dst_size) {
+    axis.start.resize(dst_size);
+    axis.count.resize(dst_size);
+    axis.next.resize(dst_size);
+    axis.frac.resize(dst_size);
+    axis.max_count = 1;
+    for (int i = 0; i < dst_size; ++i) {
+        if (filter == FUSED_FILTER_BOX) {
+            // Upscaling leaves some outputs without a whole source pixel, they take the nearest one.
+            int start = (int)((int64_t)i * src_size / dst_size);
+            int end = std::max(start + 1, (int)((int64_t)(i + 1) * src_size / dst_size));
+            axis.start[i] = start;
+            axis.count[i] = end - start;
+            axis.max_count = std::max(axis.max_count, end - start);
+            axis.uniform_count = i == 0 || axis.uniform_count == end - start ? end - start : 0;
+        } else {
+            // Pixel centres line up: source position (i + 0.5) * src / dst - 0.5, in 1/256.
+            int64_t pos = ((int64_t)(2 * i + 1) * src_size * 256) / (2 * dst_size) - 128;
+            pos = std::min<int64_t>(std::max<int64_t>(pos, 0), (int64_t)(src_size - 1) * 256);
+            axis.start[i] = (int)(pos >> 8);
+            axis.frac[i] = (int)(pos & 255);
+            axis.next[i] = std::min(axis.start[i] + 1, src_size - 1);
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+bool CpuHas(FusedConvertIsa isa) {
+    switch (isa) {
+        case FUSED_ISA_SSE4:
+            return __builtin_cpu_supports("sse4.1");
+        case FUSED_ISA_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case FUSED_ISA_AVX512:
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+        default:
+            return true;
+    }
+}
+#else
+bool CpuHas(FusedConvertIsa isa) { return isa == FUSED_ISA_SCALAR; }
+#endif
+
+const FusedKernelTable* KernelsFor(FusedConvertIsa isa) {
+    switch (isa) {
+        case FUSED_ISA_SCALAR:
+            return FusedKernelsScalar();
+        case FUSED_ISA_SSE4:
+            return FusedKernelsSse4();
+        case FUSED_ISA_AVX2:
+            return FusedKernelsAvx2();
+        case FUSED_ISA_AVX512:
+            return FusedKernelsAvx512();
+        default:
+            return nullptr;
+    }
+}
+
+}  // namespace
+
+const FusedKernelTable* FusedKernelsScalar() { return &kScalarKernels; }
+
+FusedConverter::FusedConverter() {}
+
+FusedConverter::~FusedConverter() { delete state_; }
+
+bool FusedConverter::IsaSupported(FusedConvertIsa isa) { return KernelsFor(isa) != nullptr && CpuHas(isa); }
+
+FusedConvertIsa FusedConverter::BestIsa() {
+    for (int isa = FUSED_ISA_COUNT - 1; isa > FUSED_ISA_SCALAR; --isa) {
+        if (IsaSupported((FusedConvertIsa)isa)) return (FusedConvertIsa)isa;
+    }
+    return FUSED_ISA_SCALAR;
+}
+
+const char* FusedConverter::IsaName(FusedConvertIsa isa) {
+    switch (isa) {
+        case FUSED_ISA_SCALAR:
+            return "Scalar";
+        case FUSED_ISA_SSE4:
+            return "SSE4";
+        case FUSED_ISA_AVX2:
+            return "AVX2";
+        case FUSED_ISA_AVX512:
+            return "AVX512";
+        default:
+            return "Unknown";
+    }
+}
+
+bool FusedConverter::Init(const FusedConvertParam& param) {
+    if (param.src_width <= 0 || param.src_height <= 0 || param.dst_width <= 0 || param.dst_height <= 0) {
+        log_error("Invalid fused convert size %dx%d -> %dx%d", param.src_width, param.src_height, param.dst_width,
+                  param.dst_height);
+        return false;
+    }
+
+    FusedConvertState* state = new FusedConvertState();
+    state->param = param;
+    int chroma_src_width = (param.src_width + 1) / 2;
+    int chroma_src_height = (param.src_height + 1) / 2;
+    BuildAxis(state->luma_x, param.filter, param.src_width, param.dst_width);
+    BuildAxis(state->luma_y, param.filter, param.src_height, param.dst_height);
+    if (param.direction == FUSED_I420_TO_RGB) {
+        BuildAxis(state->chroma_x, param.filter, chroma_src_width, param.dst_width);
+        BuildAxis(state->chroma_y, param.filter, chroma_src_height, param.dst_height);
+    }
+
+    if (param.filter == FUSED_FILTER_BOX) {
+        int max_rows = std::max(state->luma_y.max_count, state->chroma_y.max_count);
+        size_t max_area = (size_t)max_rows * std::max(state->luma_x.max_count, state->chroma_x.max_count);
+        if (max_rows > kMaxBoxRows || max_area > kMaxBoxArea) {
+            log_error("Fused box downscale %dx%d -> %dx%d is too steep", param.src_width, param.src_height,
+                      param.dst_width, param.dst_height);
+            delete state;
+            return false;
+        }
+        state->reciprocal.resize(max_area + 1);
+        for (size_t n = 1; n <= max_area; ++n) {
+            state->reciprocal[n] = ((1ULL << kBoxReciprocalBits) + n - 1) / n;
+        }
+    }
+
+    bool to_i420 = param.direction == FUSED_RGB_TO_I420;
+    state->vertical.resize(to_i420 ? param.src_width * 3 : param.src_width);
+    for (auto& plane : state->planes) {
+        plane.resize(param.dst_width);
+    }
+    if (to_i420) {
+        for (auto& plane : state->chroma) {
+            plane.resize((param.dst_width + 1) / 2);
+        }
+    } else {
+        for (auto& plane : state->packed) {
+            plane.resize(param.dst_width);
+        }
+    }
+
+    delete state_;
+    state_ = state;
+    if (kernels_ == nullptr) {
+        SetIsa(BestIsa());
+    }
+    log_info("Fused %s %dx%d -> %dx%d using %s kernels", to_i420 ? "RGB to I420" : "I420 to RGB", param.src_width,
+             param.src_height, param.dst_width, param.dst_height, IsaName(isa_));
+    return true;
+}
+
+bool FusedConverter::SetIsa(FusedConvertIsa isa) {
+    if (!IsaSupported(isa)) return false;
+    isa_ = isa;
+    kernels_ = KernelsFor(isa);
+    return true;
+}
+
+void FusedConverter::RgbToI420(const uint8_t* rgb, int rgb_stride, uint8_t* y, int y_stride, uint8_t* u,
+                               int u_stride, uint8_t* v, int v_stride) {
+    const FusedConvertParam& p = state_->param;
+    kernels_->rgb_to_i420[p.rgb_order][p.filter](state_, rgb, rgb_stride, y, y_stride, u, u_stride, v, v_stride);
+}
+
+void FusedConverter::I420ToRgb(const uint8_t* y, int y_stride, const uint8_t* u, int u_stride, const uint8_t* v,
+                               int v_stride, uint8_t* rgb, int rgb_stride) {
+    const FusedConvertParam& p = state_->param;
+    kernels_->i420_to_rgb[p.rgb_order][p.filter](state_, y, y_stride, u, u_stride, v, v_stride, rgb, rgb_stride);
+}
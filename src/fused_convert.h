@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+
+// Byte order of packed 24-bit pixels, named as in libyuv.
+enum FusedRgbOrder {
+    FUSED_RGB_RAW = 0,  // R, G, B in memory, AV_PIX_FMT_RGB24
+    FUSED_RGB_RGB24,    // B, G, R in memory, AV_PIX_FMT_BGR24
+};
+
+enum FusedScaleFilter {
+    FUSED_FILTER_BOX = 0,  // average of the source area each output pixel covers, for downscaling
+    FUSED_FILTER_BILINEAR,
+};
+
+enum FusedConvertDirection {
+    FUSED_RGB_TO_I420 = 0,
+    FUSED_I420_TO_RGB,
+};
+
+// Kernel variants, best last. Every variant produces exactly the scalar one's output.
+enum FusedConvertIsa {
+    FUSED_ISA_SCALAR = 0,
+    FUSED_ISA_SSE4,
+    FUSED_ISA_AVX2,
+    FUSED_ISA_AVX512,
+    FUSED_ISA_COUNT,
+};
+
+struct FusedConvertParam {
+    FusedConvertDirection direction = FUSED_RGB_TO_I420;
+    FusedRgbOrder rgb_order = FUSED_RGB_RAW;
+    FusedScaleFilter filter = FUSED_FILTER_BOX;
+    int src_width = 0;
+    int src_height = 0;
+    int dst_width = 0;
+    int dst_height = 0;
+};
+
+struct FusedConvertState;
+struct FusedKernelTable;
+
+// Colour conversion and resize in a single pass: each output row is resampled from the source rows it covers into
+// a few line buffers and converted from there, so no full frame is ever written in between the way a convert
+// followed by a scale does it. BT.601 limited range, like libyuv's RAWToI420/I420ToRAW.
+//
+// Kernels are instantiated per pixel order and filter for every instruction set the build supports, and Init picks
+// the best one the CPU has. A converter keeps its line buffers between calls, so use one per thread.
+class FusedConverter {
+public:
+    bool Init(const FusedConvertParam& param);
+
+    // Selects a specific variant, for benchmarks and checking variants against the scalar one. Returns false if it
+    // was not compiled in or the CPU does not have it.
+    bool SetIsa(FusedConvertIsa isa);
+    FusedConvertIsa Isa() const { return isa_; }
+
+    // FUSED_RGB_TO_I420 only.
+    void RgbToI420(const uint8_t* rgb, int rgb_stride, uint8_t* y, int y_stride, uint8_t* u, int u_stride, uint8_t* v,
+                   int v_stride);
+    // FUSED_I420_TO_RGB only.
+    void I420ToRgb(const uint8_t* y, int y_stride, const uint8_t* u, int u_stride, const uint8_t* v, int v_stride,
+                   uint8_t* rgb, int rgb_stride);
+
+    static bool IsaSupported(FusedConvertIsa isa);
+    static FusedConvertIsa BestIsa();
+    static const char* IsaName(FusedConvertIsa isa);
+
+    FusedConverter();
+    ~FusedConverter();
+
+    FusedConverter(const FusedConverter&) = delete;
+    FusedConverter& operator=(const FusedConverter&) = delete;
+
+private:
+    FusedConvertState* state_ = nullptr;
+    FusedConvertIsa isa_ = FUSED_ISA_SCALAR;
+    const FusedKernelTable* kernels_ = nullptr;
+};
@@ -0,0 +1,45 @@
+#include "fused_convert_kernels.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+namespace {
+
+struct Avx2Ops {
+    typedef __m256i V;
+    static const int kLanes = 16;
+
+    static V Load8(const uint8_t* p) { return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p)); }
+    static V Load16(const int16_t* p) { return _mm256_loadu_si256((const __m256i*)p); }
+    static void Store16(int16_t* p, V v) { _mm256_storeu_si256((__m256i*)p, v); }
+    static void Store8(uint8_t* p, V v) {
+        // packus works within 128 bit halves, gather the two low quadwords.
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0xD8);
+        _mm_storeu_si128((__m128i*)p, _mm256_castsi256_si128(packed));
+    }
+    static V Set1(int x) { return _mm256_set1_epi16((short)x); }
+    static V Add(V a, V b) { return _mm256_add_epi16(a, b); }
+    static V Sub(V a, V b) { return _mm256_sub_epi16(a, b); }
+    static V Mullo(V a, V b) { return _mm256_mullo_epi16(a, b); }
+    static V AddSat(V a, V b) { return _mm256_adds_epi16(a, b); }
+    template <int kBits>
+    static V Srli(V a) {
+        return _mm256_srli_epi16(a, kBits);
+    }
+    template <int kBits>
+    static V Srai(V a) {
+        return _mm256_srai_epi16(a, kBits);
+    }
+};
+
+const FusedKernelTable kAvx2Kernels = MakeFusedKernelTable<Avx2Ops>();
+
+}  // namespace
+
+const FusedKernelTable* FusedKernelsAvx2() { return &kAvx2Kernels; }
+
+#else
+
+const FusedKernelTable* FusedKernelsAvx2() { return nullptr; }
+
+#endif
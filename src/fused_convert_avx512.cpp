@@ -0,0 +1,46 @@
+#include "fused_convert_kernels.h"
+
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+#include <immintrin.h>
+
+namespace {
+
+struct Avx512Ops {
+    typedef __m512i V;
+    static const int kLanes = 32;
+
+    static V Load8(const uint8_t* p) { return _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)p)); }
+    static V Load16(const int16_t* p) { return _mm512_loadu_si512((const void*)p); }
+    static void Store16(int16_t* p, V v) { _mm512_storeu_si512((void*)p, v); }
+    static void Store8(uint8_t* p, V v) {
+        // Unsigned saturating narrow after clamping negatives to 0. The all-ones mask form, because the unmasked one
+        // trips GCC 12's -Wmaybe-uninitialized.
+        __m512i clamped = _mm512_max_epi16(v, _mm512_setzero_si512());
+        _mm256_storeu_si256((__m256i*)p, _mm512_maskz_cvtusepi16_epi8((__mmask32)-1, clamped));
+    }
+    static V Set1(int x) { return _mm512_set1_epi16((short)x); }
+    static V Add(V a, V b) { return _mm512_add_epi16(a, b); }
+    static V Sub(V a, V b) { return _mm512_sub_epi16(a, b); }
+    static V Mullo(V a, V b) { return _mm512_mullo_epi16(a, b); }
+    static V AddSat(V a, V b) { return _mm512_adds_epi16(a, b); }
+    template <int kBits>
+    static V Srli(V a) {
+        return _mm512_srli_epi16(a, kBits);
+    }
+    template <int kBits>
+    static V Srai(V a) {
+        return _mm512_srai_epi16(a, kBits);
+    }
+};
+
+const FusedKernelTable kAvx512Kernels = MakeFusedKernelTable<Avx512Ops>();
+
+}  // namespace
+
+const FusedKernelTable* FusedKernelsAvx512() { return &kAvx512Kernels; }
+
+#else
+
+const FusedKernelTable* FusedKernelsAvx512() { return nullptr; }
+
+#endif
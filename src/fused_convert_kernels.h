@@ -0,0 +1,328 @@
+#pragma once
+
+// Internal to FusedConverter. Each fused_convert_*.cpp includes this with its own instruction set flags and
+// instantiates the kernels with its vector ops, so everything templated below lives in an anonymous namespace: with
+// external linkage the linker would keep a single copy of each instantiation, possibly one built for AVX-512, and
+// hand it to every variant.
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "fused_convert.h"
+
+// One axis of a resample. Box: output i averages source [start[i], start[i] + count[i]). Bilinear: output i blends
+// start[i] and next[i], frac[i] / 256 of the latter.
+struct FusedAxis {
+    std::vector<int> start;
+    std::vector<int> count;
+    std::vector<int> next;
+    std::vector<int> frac;
+    int max_count = 0;
+    // Box footprint shared by every output, 0 if they differ.
+    int uniform_count = 0;
+};
+
+// Fractional bits of the box reciprocals. Rounded up, a reciprocal's error over a sum of up to 255 * area stays below
+// the 1 / (2 * area) that separates an average from the next rounding step for areas up to 2^21, so box averages are
+// exactly rounded, and the products fit in 64 bits.
+const int kBoxReciprocalBits = 50;
+
+struct FusedConvertState {
+    FusedConvertParam param;
+
+    // RGB to I420: the RGB source onto the output. I420 to RGB: the Y plane and the U/V planes, each onto the full
+    // output grid.
+    FusedAxis luma_x;
+    FusedAxis luma_y;
+    FusedAxis chroma_x;
+    FusedAxis chroma_y;
+    // 2^kBoxReciprocalBits / n rounded up for every box area n.
+    std::vector<uint64_t> reciprocal;
+
+    // One source row after the vertical pass, interleaved channels, 16 bit sums or 8.8 blends.
+    std::vector<int16_t> vertical;
+    // dst_width each. RGB to I420: R, G, B of an output row pair. I420 to RGB: resampled Y, U, V of one row.
+    std::vector<int16_t> planes[6];
+    // RGB to I420: 2x2 averaged R, G, B, (dst_width + 1) / 2 each.
+    std::vector<int16_t> chroma[3];
+    // I420 to RGB: converted R, G, B before interleaving.
+    std::vector<uint8_t> packed[3];
+};
+
+typedef void (*FusedRgbToI420Kernel)(FusedConvertState* state, const uint8_t* rgb, int rgb_stride, uint8_t* y,
+                                     int y_stride, uint8_t* u, int u_stride, uint8_t* v, int v_stride);
+typedef void (*FusedI420ToRgbKernel)(FusedConvertState* state, const uint8_t* y, int y_stride, const uint8_t* u,
+                                     int u_stride, const uint8_t* v, int v_stride, uint8_t* rgb, int rgb_stride);
+
+struct FusedKernelTable {
+    // [FusedRgbOrder][FusedScaleFilter]
+    FusedRgbToI420Kernel rgb_to_i420[2][2];
+    FusedI420ToRgbKernel i420_to_rgb[2][2];
+};
+
+// nullptr when the variant was not compiled in.
+const FusedKernelTable* FusedKernelsScalar();
+const FusedKernelTable* FusedKernelsSse4();
+const FusedKernelTable* FusedKernelsAvx2();
+const FusedKernelTable* FusedKernelsAvx512();
+
+namespace {
+
+// The vector ops every variant provides, on kLanes 16 bit lanes. Add, Sub and Mullo wrap, AddSat saturates signed,
+// Store8 clamps signed values to 0..255. The scalar ops are the reference and also handle the tail of every row, so
+// they must match the vector ones bit for bit.
+struct ScalarOps {
+    typedef uint16_t V;
+    static const int kLanes = 1;
+
+    static V Load8(const uint8_t* p) { return *p; }
+    static V Load16(const int16_t* p) { return (uint16_t)*p; }
+    static void Store16(int16_t* p, V v) { *p = (int16_t)v; }
+    static void Store8(uint8_t* p, V v) { *p = (uint8_t)std::min(std::max((int)(int16_t)v, 0), 255); }
+    static V Set1(int x) { return (uint16_t)x; }
+    static V Add(V a, V b) { return (uint16_t)(a + b); }
+    static V Sub(V a, V b) { return (uint16_t)(a - b); }
+    static V Mullo(V a, V b) { return (uint16_t)((uint32_t)a * b); }
+    static V AddSat(V a, V b) { return (uint16_t)std::min(std::max((int16_t)a + (int16_t)b, -32768), 32767); }
+    template <int kBits>
+    static V Srli(V a) {
+        return (uint16_t)(a >> kBits);
+    }
+    template <int kBits>
+    static V Srai(V a) {
+        return (uint16_t)((int16_t)a >> kBits);
+    }
+};
+
+// Runs Step over [0, n) kLanes at a time and finishes the tail with the scalar ops.
+template <class Ops, template <class> class Step, class... Args>
+inline void ForEachLane(int n, Args... args) {
+    int i = 0;
+    for (; i + Ops::kLanes <= n; i += Ops::kLanes) {
+        Step<Ops>::Run(i, args...);
+    }
+    for (; i < n; ++i) {
+        Step<ScalarOps>::Run(i, args...);
+    }
+}
+
+template <class Ops>
+struct CopyRowStep {
+    static void Run(int i, int16_t* acc, const uint8_t* src) { Ops::Store16(acc + i, Ops::Load8(src + i)); }
+};
+
+template <class Ops>
+struct AccumulateRowStep {
+    static void Run(int i, int16_t* acc, const uint8_t* src) {
+        Ops::Store16(acc + i, Ops::Add(Ops::Load16(acc + i), Ops::Load8(src + i)));
+    }
+};
+
+// 8.8 fixed point blend of two rows.
+template <class Ops>
+struct LerpRowsStep {
+    static void Run(int i, int16_t* out, const uint8_t* a, const uint8_t* b, int frac) {
+        typename Ops::V va = Ops::Mullo(Ops::Load8(a + i), Ops::Set1(256 - frac));
+        typename Ops::V vb = Ops::Mullo(Ops::Load8(b + i), Ops::Set1(frac));
+        Ops::Store16(out + i, Ops::Add(va, vb));
+    }
+};
+
+// Y = (66 R + 129 G + 25 B + 16.5 * 256) >> 8, every term fits 16 unsigned bits.
+template <class Ops>
+struct RgbToYStep {
+    static void Run(int i, const int16_t* r, const int16_t* g, const int16_t* b, uint8_t* y) {
+        typename Ops::V sum = Ops::Add(Ops::Mullo(Ops::Load16(r + i), Ops::Set1(66)),
+                                       Ops::Mullo(Ops::Load16(g + i), Ops::Set1(129)));
+        sum = Ops::Add(sum, Ops::Mullo(Ops::Load16(b + i), Ops::Set1(25)));
+        Ops::Store8(y + i, Ops::template Srli<8>(Ops::Add(sum, Ops::Set1(0x1080))));
+    }
+};
+
+// U = (112 B - 74 G - 38 R + 128.5 * 256) >> 8, V = (112 R - 94 G - 18 B + 128.5 * 256) >> 8. The results are in
+// range before the shift, so the wrapping arithmetic lands on them.
+template <class Ops>
+struct RgbToUVStep {
+    static void Run(int i, const int16_t* r, const int16_t* g, const int16_t* b, uint8_t* u, uint8_t* v) {
+        typename Ops::V vr = Ops::Load16(r + i);
+        typename Ops::V vg = Ops::Load16(g + i);
+        typename Ops::V vb = Ops::Load16(b + i);
+        typename Ops::V bias = Ops::Set1(0x8080);
+        typename Ops::V pu = Ops::Add(Ops::Mullo(vb, Ops::Set1(112)), bias);
+        pu = Ops::Sub(pu, Ops::Add(Ops::Mullo(vg, Ops::Set1(74)), Ops::Mullo(vr, Ops::Set1(38))));
+        typename Ops::V pv = Ops::Add(Ops::Mullo(vr, Ops::Set1(112)), bias);
+        pv = Ops::Sub(pv, Ops::Add(Ops::Mullo(vg, Ops::Set1(94)), Ops::Mullo(vb, Ops::Set1(18))));
+        Ops::Store8(u + i, Ops::template Srli<8>(pu));
+        Ops::Store8(v + i, Ops::template Srli<8>(pv));
+    }
+};
+
+// 10.6 fixed point: R = 1.164 (Y - 16) + 1.596 (V - 128), G = 1.164 (Y - 16) - 0.391 (U - 128) - 0.813 (V - 128),
+// B = 1.164 (Y - 16) + 2.018 (U - 128). Only B can leave the int16 range, in its last add and only upwards, where
+// saturating still clamps to 255.
+template <class Ops>
+struct YuvToRgbStep {
+    static void Run(int i, const int16_t* y, const int16_t* u, const int16_t* v, uint8_t* r, uint8_t* g, uint8_t* b) {
+        typename Ops::V y1 = Ops::Mullo(Ops::Sub(Ops::Load16(y + i), Ops::Set1(16)), Ops::Set1(75));
+        y1 = Ops::Add(y1, Ops::Set1(32));
+        typename Ops::V vu = Ops::Sub(Ops::Load16(u + i), Ops::Set1(128));
+        typename Ops::V vv = Ops::Sub(Ops::Load16(v + i), Ops::Set1(128));
+        typename Ops::V vr = Ops::AddSat(y1, Ops::Mullo(vv, Ops::Set1(102)));
+        typename Ops::V vg = Ops::Sub(Ops::Sub(y1, Ops::Mullo(vu, Ops::Set1(25))), Ops::Mullo(vv, Ops::Set1(52)));
+        typename Ops::V vb = Ops::AddSat(y1, Ops::Mullo(vu, Ops::Set1(129)));
+        Ops::Store8(r + i, Ops::template Srai<6>(vr));
+        Ops::Store8(g + i, Ops::template Srai<6>(vg));
+        Ops::Store8(b + i, Ops::template Srai<6>(vb));
+    }
+};
+
+// Horizontal box pass over the vertical sums. kCount is the footprint of every column, 0 when it varies.
+template <int kChannels, int kCount>
+inline void BoxColumns(FusedConvertState* state, const FusedAxis& ax, const int16_t* vertical, int rows,
+                       int16_t* const* out) {
+    int dst_width = (int)ax.start.size();
+    for (int dx = 0; dx < dst_width; ++dx) {
+        const int16_t* p = vertical + ax.start[dx] * kChannels;
+        int count = kCount > 0 ? kCount : ax.count[dx];
+        uint32_t sum[kChannels] = {};
+        for (int k = 0; k < count; ++k) {
+            for (int c = 0; c < kChannels; ++c) {
+                sum[c] += (uint16_t)p[k * kChannels + c];
+            }
+        }
+        uint64_t reciprocal = state->reciprocal[rows * count];
+        for (int c = 0; c < kChannels; ++c) {
+            out[c][dx] = (int16_t)((sum[c] * reciprocal + (1ULL << (kBoxReciprocalBits - 1))) >> kBoxReciprocalBits);
+        }
+    }
+}
+
+// Resamples output row dy of a kChannels interleaved 8 bit source into one int16 plane per channel: the vertical
+// pass runs on whole source rows with the vector ops, the horizontal one gathers per output pixel.
+template <class Ops, int kChannels, FusedScaleFilter kFilter>
+void ResampleRow(FusedConvertState* state, const FusedAxis& ax, const FusedAxis& ay, const uint8_t* src,
+                 int src_stride, int src_width, int dy, int16_t* const* out) {
+    int n = src_width * kChannels;
+    int16_t* vertical = state->vertical.data();
+    int dst_width = (int)ax.start.size();
+
+    if (kFilter == FUSED_FILTER_BOX) {
+        int rows = ay.count[dy];
+        const uint8_t* row = src + (int64_t)ay.start[dy] * src_stride;
+        ForEachLane<Ops, CopyRowStep>(n, vertical, row);
+        for (int k = 1; k < rows; ++k) {
+            ForEachLane<Ops, AccumulateRowStep>(n, vertical, row + (int64_t)k * src_stride);
+        }
+        // Uniform 1:1 and 2:1 columns are by far the most common, give them loops with a constant footprint.
+        if (ax.uniform_count == 1) {
+            BoxColumns<kChannels, 1>(state, ax, vertical, rows, out);
+        } else if (ax.uniform_count == 2) {
+            BoxColumns<kChannels, 2>(state, ax, vertical, rows, out);
+        } else {
+            BoxColumns<kChannels, 0>(state, ax, vertical, rows, out);
+        }
+    } else {
+        const uint8_t* a = src + (int64_t)ay.start[dy] * src_stride;
+        const uint8_t* b = src + (int64_t)ay.next[dy] * src_stride;
+        ForEachLane<Ops, LerpRowsStep>(n, vertical, a, b, ay.frac[dy]);
+        for (int dx = 0; dx < dst_width; ++dx) {
+            const int16_t* p0 = vertical + ax.start[dx] * kChannels;
+            const int16_t* p1 = vertical + ax.next[dx] * kChannels;
+            uint32_t f = ax.frac[dx];
+            for (int c = 0; c < kChannels; ++c) {
+                uint32_t blend = (uint16_t)p0[c] * (256 - f) + (uint16_t)p1[c] * f;
+                out[c][dx] = (int16_t)((blend + 32768) >> 16);
+            }
+        }
+    }
+}
+
+template <class Ops, FusedRgbOrder kOrder, FusedScaleFilter kFilter>
+void RgbToI420Kernel(FusedConvertState* state, const uint8_t* rgb, int rgb_stride, uint8_t* y, int y_stride,
+                     uint8_t* u, int u_stride, uint8_t* v, int v_stride) {
+    const FusedConvertParam& p = state->param;
+    int chroma_width = (p.dst_width + 1) / 2;
+    // Memory order of the channels.
+    const int first = kOrder == FUSED_RGB_RAW ? 0 : 2;
+    const int last = 2 - first;
+
+    for (int dy = 0; dy < p.dst_height; dy += 2) {
+        int rows = std::min(2, p.dst_height - dy);
+        for (int r = 0; r < rows; ++r) {
+            std::vector<int16_t>* rgb_planes = state->planes + r * 3;
+            int16_t* out[3] = {rgb_planes[first].data(), rgb_planes[1].data(), rgb_planes[last].data()};
+            ResampleRow<Ops, 3, kFilter>(state, state->luma_x, state->luma_y, rgb, rgb_stride, p.src_width, dy + r,
+                                         out);
+            ForEachLane<Ops, RgbToYStep>(p.dst_width, rgb_planes[0].data(), rgb_planes[1].data(),
+                                         rgb_planes[2].data(), y + (int64_t)(dy + r) * y_stride);
+        }
+
+        // 2x2 average for the chroma sample, repeating the last row or column of odd sizes.
+        for (int c = 0; c < 3; ++c) {
+            const int16_t* top = state->planes[c].data();
+            const int16_t* bottom = state->planes[(rows - 1) * 3 + c].data();
+            int16_t* avg = state->chroma[c].data();
+            for (int cx = 0; cx < chroma_width; ++cx) {
+                int x0 = cx * 2;
+                int x1 = std::min(x0 + 1, p.dst_width - 1);
+                avg[cx] = (int16_t)((top[x0] + top[x1] + bottom[x0] + bottom[x1] + 2) >> 2);
+            }
+        }
+        int cy = dy / 2;
+        ForEachLane<Ops, RgbToUVStep>(chroma_width, state->chroma[0].data(), state->chroma[1].data(),
+                                      state->chroma[2].data(), u + (int64_t)cy * u_stride, v + (int64_t)cy * v_stride);
+    }
+}
+
+template <class Ops, FusedRgbOrder kOrder, FusedScaleFilter kFilter>
+void I420ToRgbKernel(FusedConvertState* state, const uint8_t* y, int y_stride, const uint8_t* u, int u_stride,
+                     const uint8_t* v, int v_stride, uint8_t* rgb, int rgb_stride) {
+    const FusedConvertParam& p = state->param;
+    int chroma_src_width = (p.src_width + 1) / 2;
+    const int first = kOrder == FUSED_RGB_RAW ? 0 : 2;
+    const int last = 2 - first;
+    int16_t* y_out[1] = {state->planes[0].data()};
+    int16_t* u_out[1] = {state->planes[1].data()};
+    int16_t* v_out[1] = {state->planes[2].data()};
+
+    for (int dy = 0; dy < p.dst_height; ++dy) {
+        ResampleRow<Ops, 1, kFilter>(state, state->luma_x, state->luma_y, y, y_stride, p.src_width, dy, y_out);
+        ResampleRow<Ops, 1, kFilter>(state, state->chroma_x, state->chroma_y, u, u_stride, chroma_src_width, dy,
+                                     u_out);
+        ResampleRow<Ops, 1, kFilter>(state, state->chroma_x, state->chroma_y, v, v_stride, chroma_src_width, dy,
+                                     v_out);
+        ForEachLane<Ops, YuvToRgbStep>(p.dst_width, y_out[0], u_out[0], v_out[0], state->packed[0].data(),
+                                       state->packed[1].data(), state->packed[2].data());
+
+        const uint8_t* c0 = state->packed[first].data();
+        const uint8_t* c1 = state->packed[1].data();
+        const uint8_t* c2 = state->packed[last].data();
+        uint8_t* row = rgb + (int64_t)dy * rgb_stride;
+        for (int dx = 0; dx < p.dst_width; ++dx) {
+            row[dx * 3 + 0] = c0[dx];
+            row[dx * 3 + 1] = c1[dx];
+            row[dx * 3 + 2] = c2[dx];
+        }
+    }
+}
+
+template <class Ops>
+FusedKernelTable MakeFusedKernelTable() {
+    FusedKernelTable table;
+    table.rgb_to_i420[FUSED_RGB_RAW][FUSED_FILTER_BOX] = RgbToI420Kernel<Ops, FUSED_RGB_RAW, FUSED_FILTER_BOX>;
+    table.rgb_to_i420[FUSED_RGB_RAW][FUSED_FILTER_BILINEAR] =
+        RgbToI420Kernel<Ops, FUSED_RGB_RAW, FUSED_FILTER_BILINEAR>;
+    table.rgb_to_i420[FUSED_RGB_RGB24][FUSED_FILTER_BOX] = RgbToI420Kernel<Ops, FUSED_RGB_RGB24, FUSED_FILTER_BOX>;
+    table.rgb_to_i420[FUSED_RGB_RGB24][FUSED_FILTER_BILINEAR] =
+        RgbToI420Kernel<Ops, FUSED_RGB_RGB24, FUSED_FILTER_BILINEAR>;
+    table.i420_to_rgb[FUSED_RGB_RAW][FUSED_FILTER_BOX] = I420ToRgbKernel<Ops, FUSED_RGB_RAW, FUSED_FILTER_BOX>;
+    table.i420_to_rgb[FUSED_RGB_RAW][FUSED_FILTER_BILINEAR] =
+        I420ToRgbKernel<Ops, FUSED_RGB_RAW, FUSED_FILTER_BILINEAR>;
+    table.i420_to_rgb[FUSED_RGB_RGB24][FUSED_FILTER_BOX] = I420ToRgbKernel<Ops, FUSED_RGB_RGB24, FUSED_FILTER_BOX>;
+    table.i420_to_rgb[FUSED_RGB_RGB24][FUSED_FILTER_BILINEAR] =
+        I420ToRgbKernel<Ops, FUSED_RGB_RGB24, FUSED_FILTER_BILINEAR>;
+    return table;
+}
+
+}  // namespace
@@ -0,0 +1,41 @@
+#include "fused_convert_kernels.h"
+
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+
+namespace {
+
+struct Sse4Ops {
+    typedef __m128i V;
+    static const int kLanes = 8;
+
+    static V Load8(const uint8_t* p) { return _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)p)); }
+    static V Load16(const int16_t* p) { return _mm_loadu_si128((const __m128i*)p); }
+    static void Store16(int16_t* p, V v) { _mm_storeu_si128((__m128i*)p, v); }
+    static void Store8(uint8_t* p, V v) { _mm_storel_epi64((__m128i*)p, _mm_packus_epi16(v, v)); }
+    static V Set1(int x) { return _mm_set1_epi16((short)x); }
+    static V Add(V a, V b) { return _mm_add_epi16(a, b); }
+    static V Sub(V a, V b) { return _mm_sub_epi16(a, b); }
+    static V Mullo(V a, V b) { return _mm_mullo_epi16(a, b); }
+    static V AddSat(V a, V b) { return _mm_adds_epi16(a, b); }
+    template <int kBits>
+    static V Srli(V a) {
+        return _mm_srli_epi16(a, kBits);
+    }
+    template <int kBits>
+    static V Srai(V a) {
+        return _mm_srai_epi16(a, kBits);
+    }
+};
+
+const FusedKernelTable kSse4Kernels = MakeFusedKernelTable<Sse4Ops>();
+
+}  // namespace
+
+const FusedKernelTable* FusedKernelsSse4() { return &kSse4Kernels; }
+
+#else
+
+const FusedKernelTable* FusedKernelsSse4() { return nullptr; }
+
+#endif
@@ -70,6 +70,8 @@ int ImageFilter::drawText(AVFrame *frame_in, AVFrame *frame_out, const char *fon
         return -5;
     }
 
+    // The sink overwrites frame_out without releasing what it held.
+    av_frame_unref(frame_out);
     if (av_buffersink_get_frame(buffersink_ctx, frame_out) < 0) {
         log_error("add sink frame failed");
         return -6;
@@ -136,6 +138,8 @@ int ImageFilter::cropAndScale(AVFrame *frame_in, AVFrame *frame_out, int l, int
         return -5;
     }
 
+    // The sink overwrites frame_out without releasing what it held.
+    av_frame_unref(frame_out);
     if (av_buffersink_get_frame(buffersink_ctx, frame_out) < 0) {
         log_error("add sink frame failed");
         return -6;
@@ -0,0 +1,139 @@
+#include "job_runner.h"
+
+#include <algorithm>
+#include <cinttypes>
+
+#include "logger.h"
+
+JobRunner::JobRunner(const JobBudget& budget) : budget_(budget) {
+    if (budget_.cores <= 0) {
+        budget_.cores = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+JobRunner::~JobRunner() { WaitAll(); }
+
+int64_t JobRunner::EstimateTranscodeMemory(int width, int height) {
+    int64_t yuv_frame = (int64_t)width * height * 3 / 2;
+    int64_t rgb_frame = (int64_t)width * height * 3;
+    // 10 frames in each ring, a couple of RGB frames in flight, about 40 frames of x264 lookahead and references,
+    // plus codec and muxer state that does not scale with the resolution.
+    return yuv_frame * (10 + 10 + 40) + rgb_frame * 2 + (32 << 20);
+}
+
+int JobRunner::Submit(const std::string& name, int64_t memory_bytes, JobFunction function) {
+    JoinFinished();
+    std::unique_lock<std::mutex> lock(mux_);
+    Job* job = new Job();
+    job->id = next_job_id_++;
+    job->name = name;
+    job->memory_bytes = memory_bytes;
+    job->function = function;
+    job->submit_ns = MetricsNowNs();
+    queue_.push_back(job);
+    if (budget_.memory_bytes > 0 && memory_bytes > budget_.memory_bytes) {
+        log_warn("Job %s needs %" PRId64 " bytes, more than the whole budget, it will only run alone", name.c_str(),
+                 memory_bytes);
+    }
+    AdmitLocked();
+    return job->id;
+}
+
+void JobRunner::AdmitLocked() {
+    while (!queue_.empty()) {
+        Job* job = queue_.front();
+        int free_cores = budget_.cores - cores_in_use_;
+        // An idle runner always takes the next job, however large, so it can not starve.
+        if (!running_.empty()) {
+            if (free_cores < min_job_cores_) break;
+            if (budget_.memory_bytes > 0 && memory_in_use_ + job->memory_bytes > budget_.memory_bytes) break;
+            if (budget_.max_running_jobs > 0 && (int)running_.size() >= budget_.max_running_jobs) break;
+        }
+
+        // Fair share between everything running or waiting, as far as that many jobs fit at once.
+        int max_concurrent = std::max(1, budget_.cores / min_job_cores_);
+        if (budget_.max_running_jobs > 0) max_concurrent = std::min(max_concurrent, budget_.max_running_jobs);
+        if (budget_.memory_bytes > 0 && job->memory_bytes > 0) {
+            int64_t fit = std::max<int64_t>(1, budget_.memory_bytes / job->memory_bytes);
+            max_concurrent = std::min<int64_t>(max_concurrent, fit);
+        }
+        int contenders = std::min<int>(running_.size() + queue_.size(), max_concurrent);
+        int share = budget_.cores / std::max(1, contenders);
+        if (budget_.max_job_cores > 0) share = std::min(share, budget_.max_job_cores);
+        share = std::max(min_job_cores_, std::min(share, std::max(min_job_cores_, free_cores)));
+        // The minimum share is more than a budget below it has.
+        share = std::min(share, budget_.cores);
+
+        // x264 costs several times what decoding does. With three cores or more, one goes to the job's own thread,
+        // which converts every frame between the decoder and the recorder.
+        JobResources& resources = job->resources;
+        resources.cores = share;
+        int worker_cores = share >= 3 ? share - 1 : share;
+        resources.encoder_threads = std::max(1, worker_cores * 2 / 3);
+        resources.decoder_threads = std::max(1, worker_cores - resources.encoder_threads);
+
+        queue_.pop_front();
+        cores_in_use_ += share;
+        memory_in_use_ += job->memory_bytes;
+        job->start_ns = MetricsNowNs();
+        queue_wait_.Record(job->start_ns - job->submit_ns);
+        running_[job->id] = job;
+        log_info("Job %s admitted with %d cores (decoder %d, encoder %d threads), %zu running, %zu waiting",
+                 job->name.c_str(), share, resources.decoder_threads, resources.encoder_threads, running_.size(),
+                 queue_.size());
+        job->thread = std::thread(&JobRunner::RunJob, this, job);
+    }
+}
+
+void JobRunner::RunJob(Job* job) {
+    bool ok = job->function(job->resources);
+
+    std::unique_lock<std::mutex> lock(mux_);
+    run_time_.Record(MetricsNowNs() - job->start_ns);
+    if (ok) {
+        completed_++;
+    } else {
+        failed_++;
+        log_warn("Job %s failed", job->name.c_str());
+    }
+    cores_in_use_ -= job->resources.cores;
+    memory_in_use_ -= job->memory_bytes;
+    running_.erase(job->id);
+    finished_.push_back(job);
+    AdmitLocked();
+    if (running_.empty() && queue_.empty()) idle_cond_.notify_all();
+}
+
+void JobRunner::JoinFinished() {
+    std::vector<Job*> finished;
+    {
+        std::unique_lock<std::mutex> lock(mux_);
+        finished.swap(finished_);
+    }
+    for (Job* job : finished) {
+        job->thread.join();
+        delete job;
+    }
+}
+
+void JobRunner::WaitAll() {
+    {
+        std::unique_lock<std::mutex> lock(mux_);
+        idle_cond_.wait(lock, [&]() { return running_.empty() && queue_.empty(); });
+    }
+    JoinFinished();
+}
+
+JobRunnerStats JobRunner::GetStats() {
+    std::unique_lock<std::mutex> lock(mux_);
+    JobRunnerStats stats;
+    stats.queued = queue_.size();
+    stats.running = running_.size();
+    stats.completed = completed_;
+    stats.failed = failed_;
+    stats.cores_in_use = cores_in_use_;
+    stats.memory_in_use = memory_in_use_;
+    stats.queue_wait = queue_wait_.Snapshot();
+    stats.run_time = run_time_.Snapshot();
+    return stats;
+}
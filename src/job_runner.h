@@ -0,0 +1,108 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pipeline_metrics.h"
+
+struct JobBudget {
+    // Cores the jobs may keep busy together.
+    int cores = 0;
+    // Sum of the jobs' memory estimates allowed at once, 0 for no limit.
+    int64_t memory_bytes = 0;
+    // 0 for no limit besides cores and memory.
+    int max_running_jobs = 0;
+    // Codec threads scale poorly past this, and a job admitted alone would otherwise take every core from the ones
+    // submitted right after it.
+    int max_job_cores = 8;
+};
+
+// What a job was admitted with. Pass the thread counts on to VideoDecoderStartParam::decoder_threads and
+// MP4VideoRecorderStartParam::encoder_threads.
+struct JobResources {
+    int cores = 0;
+    int decoder_threads = 1;
+    int encoder_threads = 1;
+};
+
+struct JobRunnerStats {
+    size_t queued = 0;
+    size_t running = 0;
+    uint64_t completed = 0;
+    uint64_t failed = 0;
+    int cores_in_use = 0;
+    int64_t memory_in_use = 0;
+    // Submit to admission, and admission to finish.
+    LatencySnapshot queue_wait;
+    LatencySnapshot run_time;
+};
+
+// Runs transcode jobs concurrently without oversubscribing the host. Jobs are admitted in submission order while
+// their memory estimate and a minimum share of cores fit the budget, and each gets its decoder and encoder thread
+// counts from a fair share of the cores between the jobs running and waiting. Codec thread counts are fixed once a
+// session is open, so rebalancing happens at admission: jobs admitted as others finish get the freed cores.
+class JobRunner {
+public:
+    // Runs on its own thread and returns whether the job succeeded.
+    typedef std::function<bool(const JobResources&)> JobFunction;
+
+    // memory_bytes is the job's estimate, see EstimateTranscodeMemory. Returns the job id.
+    int Submit(const std::string& name, int64_t memory_bytes, JobFunction job);
+    // Blocks until every submitted job has finished.
+    void WaitAll();
+    JobRunnerStats GetStats();
+
+    // Rough peak of one decoder -> recorder session at this resolution: the frames in both rings, the RGB frames in
+    // between and x264's lookahead.
+    static int64_t EstimateTranscodeMemory(int width, int height);
+
+    explicit JobRunner(const JobBudget& budget);
+    // Waits for all jobs.
+    ~JobRunner();
+
+    JobRunner(const JobRunner&) = delete;
+    JobRunner& operator=(const JobRunner&) = delete;
+
+private:
+    struct Job {
+        int id;
+        std::string name;
+        int64_t memory_bytes;
+        JobFunction function;
+        int64_t submit_ns;
+        int64_t start_ns = 0;
+        JobResources resources;
+        std::thread thread;
+    };
+
+    // One decoder and one encoder thread.
+    static const int min_job_cores_ = 2;
+
+    JobBudget budget_;
+
+    std::mutex mux_;
+    std::condition_variable idle_cond_;
+    std::deque<Job*> queue_;
+    std::map<int, Job*> running_;
+    // Finished jobs whose thread still has to be joined.
+    std::vector<Job*> finished_;
+    int next_job_id_ = 0;
+    int cores_in_use_ = 0;
+    int64_t memory_in_use_ = 0;
+    uint64_t completed_ = 0;
+    uint64_t failed_ = 0;
+
+    LatencyHistogram queue_wait_;
+    LatencyHistogram run_time_;
+
+    void AdmitLocked();
+    void RunJob(Job* job);
+    void JoinFinished();
+};
@@ -1,9 +1,55 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 
+#include "thread_placement.h"
+
 struct VideoDecoderStartParam {
+    // "-" for a stream on stdin.
     std::string filename;
+    // Decode on an internal thread ahead of ReadFrame. When false, ReadFrame demuxes and decodes on the calling
+    // thread, for callers that schedule the work themselves (see Pipeline).
+    bool worker_thread = true;
+    // libavcodec decoding threads, 0 lets libavcodec pick.
+    int decoder_threads = 0;
+    // Decoded frames queued ahead of ReadFrame. The depth starts at the minimum and grows towards the maximum while
+    // the caller stalls, within the process-wide FrameMemoryBudget (see RingDepthController).
+    int min_ring_depth = 2;
+    int max_ring_depth = 10;
+    // Size of the RGB frames ReadFrame returns, 0 for the stream's. Resizing happens in the same pass as the colour
+    // conversion (see FusedConverter).
+    int output_width = 0;
+    int output_height = 0;
+    // Chrome trace-event JSON of per-frame stage spans is written here on Stop() when set.
+    std::string trace_filename;
+    // Large or remote files: probe at most 1MB / 0.5s of the input, skip probing entirely when the container header
+    // already describes the video stream or the same unchanged file was probed before in this process, and open the
+    // decoder on the first read (on the worker thread when there is one) instead of in Start.
+    bool fast_open = false;
+    // Cores and NUMA node for the worker thread, libavcodec's threads and the frames InitFrame hands out.
+    ThreadPlacementParam placement;
+    // Starts decoding at the keyframe at or before this many seconds into the video stream. The frames between that
+    // keyframe and the time come out too, their pts (in milliseconds, as for every frame) tells where the wanted ones
+    // begin.
+    double seek_seconds = 0;
+};
+
+// Where startup time went. Phases that did not run are 0.
+struct DecoderStartupTiming {
+    // avformat_open_input.
+    int64_t open_ns = 0;
+    // avformat_find_stream_info.
+    int64_t probe_ns = 0;
+    // Decoder lookup and avcodec_open2.
+    int64_t codec_init_ns = 0;
+    // From the decoder being open to the first decoded frame.
+    int64_t first_frame_ns = 0;
+    // From Start being called to the first decoded frame.
+    int64_t total_ns = 0;
+    // fast_open only: the stream parameters came from the container header, or from an earlier probe of the file.
+    bool probe_skipped = false;
+    bool stream_info_cached = false;
 };
 
 struct MediaDecoderStartRet {
@@ -13,4 +59,8 @@ struct MediaDecoderStartRet {
     int width = 0;
     int height = 0;
     int fps = 0;
+
+    // As far as Start got. With fast_open the codec is opened later; MediaDecoder::GetStartupTiming has every phase
+    // once the first frame is decoded.
+    DecoderStartupTiming startup;
 };
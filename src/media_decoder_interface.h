@@ -2,6 +2,9 @@
 
 #include <string>
 
+#include "media_io_common.h"
+#include "pipeline_metrics.h"
+
 extern "C" {
 #include <libavutil/frame.h>
 }
@@ -13,6 +16,18 @@ public:
     virtual MediaDecoderStartRet Start(void* param) = 0;
     virtual bool InitFrame(AVFrame** frame) = 0;
     virtual bool ReadFrame(AVFrame* frame) = 0;
+    // ReadFrame that never waits for the decoder. After MEDIA_IO_WOULD_BLOCK, ReadableFd() turns readable once a
+    // frame is ready or the stream ended.
+    virtual MediaIOStatus TryReadFrame(AVFrame* frame) = 0;
+    // eventfd to poll/epoll for TryReadFrame, valid from Start until the decoder is deleted. -1 when decoding inline,
+    // TryReadFrame then never returns MEDIA_IO_WOULD_BLOCK.
+    virtual int ReadableFd() = 0;
+    // Stops decoding early or cleans up after the last frame. ReadFrame returns false afterwards.
+    virtual bool Stop() = 0;
+    // Counters and per-stage latencies since creation, plus current ring state. Not safe to call during Start.
+    virtual PipelineMetricsSnapshot GetMetrics() = 0;
+    // Start's timing completed with the phases after it, see DecoderStartupTiming.
+    virtual DecoderStartupTiming GetStartupTiming() = 0;
 
     MediaDecoder(){};
     virtual ~MediaDecoder(){};
@@ -0,0 +1,11 @@
+#pragma once
+
+// Outcome of the non-blocking TryReadFrame / TrySendVideoFrame calls.
+enum MediaIOStatus {
+    MEDIA_IO_OK = 0,
+    // Nothing to read or no room to send right now. The session's readiness fd becomes readable when that changes.
+    MEDIA_IO_WOULD_BLOCK,
+    // No more frames will be read, or the recorder no longer takes frames.
+    MEDIA_IO_END,
+    MEDIA_IO_ERROR,
+};
@@ -1,11 +1,71 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
 #include <string>
 
+#include "thread_placement.h"
+
+// Layout of the frames passed to the Send calls.
+enum RecorderInputFormat {
+    RECORDER_INPUT_RAW = 0,  // packed R, G, B, width * height * 3 bytes
+    RECORDER_INPUT_I420,     // Y, U and V planes back to back, no padding
+};
+
+// What the recorder writes.
+enum RecorderContainer {
+    RECORDER_CONTAINER_MP4 = 0,         // index at the end, needs an output it can seek back in
+    RECORDER_CONTAINER_FRAGMENTED_MP4,  // empty index up front and a fragment per keyframe, written front to back
+    RECORDER_CONTAINER_ANNEXB,          // raw H.264 with SPS/PPS in front of every keyframe
+};
+
 struct MP4VideoRecorderStartParam {
     int width;
     int height;
     int fps;
+    RecorderInputFormat input_format = RECORDER_INPUT_RAW;
+    // Frames between keyframes, 0 keeps the encoder default.
+    int gop_size = 0;
 
+    // "-" for stdout, where MP4 turns into fragmented MP4. The logs move to stderr then.
     std::string filename;
+    RecorderContainer container = RECORDER_CONTAINER_MP4;
+    // Asked for when the output is a pipe, capped by /proc/sys/fs/pipe-max-size.
+    size_t pipe_size = 4 << 20;
+    // Annex B packets go into the pipe with vmsplice, without being copied. Only for a reader that read()s the pipe,
+    // not one that splices or tees it onward (see PipeSink).
+    bool pipe_zero_copy = false;
+    // Encode and mux on an internal thread. When false, the Send calls convert, encode and mux on the calling thread
+    // and Stop flushes there, for callers that schedule the work themselves (see Pipeline).
+    bool worker_thread = true;
+    // x264 threads, 0 lets x264 pick.
+    int encoder_threads = 4;
+    // x264 preset, empty for its default (medium).
+    std::string preset;
+    // Talking heads and surveillance: attach region-of-interest hints from coarse per-macroblock motion, so x264
+    // spends its bits where the picture changes (see MotionRoi). Pairs well with a faster preset.
+    bool motion_roi = false;
+    // Frames queued for the worker. The depth starts at the minimum and grows towards the maximum while the encoder
+    // stalls, within the process-wide FrameMemoryBudget (see RingDepthController).
+    int min_ring_depth = 2;
+    int max_ring_depth = 10;
+    // Live capture: x264's zerolatency tune without B-frames or lookahead, intra refresh instead of keyframes,
+    // slice threads so every frame is split across encoder_threads rather than several frames being in flight, and
+    // at most two queued frames. Each frame is muxed before the next one arrives, at the cost of compression.
+    bool low_latency = false;
+    // Screen capture and slides: a frame identical to the previous one is neither converted nor encoded, the previous
+    // frame's duration is extended instead. One is still encoded after max_skipped_frames in a row (0 for fps), so
+    // keyframes and seek points keep coming while the picture stands still.
+    bool skip_duplicates = false;
+    int max_skipped_frames = 0;
+    // Chrome trace-event JSON of per-frame stage spans is written here on Stop() when set.
+    std::string trace_filename;
+    // Cores and NUMA node for the worker thread, x264's threads and the queued frames.
+    ThreadPlacementParam placement;
+    // Fragmented MP4 only: called on the encoding thread when a keyframe starts a new fragment, once the fragments
+    // before it are handed to the OS. |frames| is the number of frames encoded before the keyframe and |bytes| the
+    // output's size up to it; the output cut to that size plays those frames. With skip_duplicates they are fewer than
+    // the frames sent, a skipped frame lengthens the one before it instead. There are no keyframes to call it at with
+    // low_latency.
+    std::function<void(int64_t frames, int64_t bytes)> on_fragment;
 };
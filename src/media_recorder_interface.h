@@ -2,6 +2,9 @@
 
 #include <string>
 
+#include "media_io_common.h"
+#include "pipeline_metrics.h"
+
 class MediaRecorder {
 public:
     static MediaRecorder* CreateMP4VideoRecorder();
@@ -11,7 +14,15 @@ public:
     virtual bool SendAudioFrame(void* data, int size) = 0;
     virtual bool SendVideoFrameBlock(void* data, int size) = 0;
     virtual bool SendAudioFrameBlock(void* data, int size) = 0;
+    // SendVideoFrame that tells a full queue apart from a failure and does not count it as a dropped frame. After
+    // MEDIA_IO_WOULD_BLOCK, WritableFd() turns readable once there is room again or the recorder stopped.
+    virtual MediaIOStatus TrySendVideoFrame(void* data, int size) = 0;
+    // eventfd to poll/epoll for TrySendVideoFrame, valid from Start until the recorder is deleted. -1 when encoding
+    // inline, TrySendVideoFrame then never returns MEDIA_IO_WOULD_BLOCK.
+    virtual int WritableFd() = 0;
     virtual bool Stop() = 0;
+    // Counters and per-stage latencies since creation, plus current ring state. Not safe to call during Start/Stop.
+    virtual PipelineMetricsSnapshot GetMetrics() = 0;
 
     MediaRecorder(){};
     virtual ~MediaRecorder(){};
@@ -0,0 +1,110 @@
+#include "motion_roi.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "logger.h"
+
+void MotionRoi::Init(int width, int height) {
+    width_ = width;
+    height_ = height;
+    block_cols_ = (width + block_size_ - 1) / block_size_;
+    block_rows_ = (height + block_size_ - 1) / block_size_;
+    has_previous_ = false;
+    previous_y_.assign((size_t)width * height, 0);
+    hold_.assign((size_t)block_cols_ * block_rows_, 0);
+    regions_.clear();
+    regions_.reserve(hold_.size() / 2 + 1);
+    frames_ = 0;
+    moving_blocks_ = 0;
+}
+
+// Every other row is enough to tell motion from noise and halves the reads.
+int MotionRoi::BlockSad(const uint8_t* y, int linesize, int col, int row, int* pixels) const {
+    int x0 = col * block_size_;
+    int x1 = std::min(x0 + block_size_, width_);
+    int y0 = row * block_size_;
+    int y1 = std::min(y0 + block_size_, height_);
+    int sad = 0;
+    *pixels = 0;
+    for (int j = y0; j < y1; j += 2) {
+        const uint8_t* cur = y + (size_t)j * linesize;
+        const uint8_t* prev = previous_y_.data() + (size_t)j * width_;
+        for (int i = x0; i < x1; ++i) {
+            sad += abs(cur[i] - prev[i]);
+        }
+        *pixels += x1 - x0;
+    }
+    return sad;
+}
+
+bool MotionRoi::Attach(AVFrame* frame) {
+    av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    const uint8_t* y = frame->data[0];
+    int linesize = frame->linesize[0];
+
+    regions_.clear();
+    if (has_previous_) {
+        int moving = 0;
+        for (int row = 0; row < block_rows_; ++row) {
+            int run_begin = -1;
+            for (int col = 0; col <= block_cols_; ++col) {
+                bool active = false;
+                if (col < block_cols_) {
+                    uint8_t& hold = hold_[row * block_cols_ + col];
+                    int pixels;
+                    int sad = BlockSad(y, linesize, col, row, &pixels);
+                    hold = sad > motion_threshold_ * pixels ? hold_frames_ : (hold > 0 ? hold - 1 : 0);
+                    active = hold > 0;
+                    moving += active;
+                }
+                // One region per run of moving blocks in a row.
+                if (active && run_begin < 0) {
+                    run_begin = col;
+                } else if (!active && run_begin >= 0) {
+                    AVRegionOfInterest region;
+                    region.self_size = sizeof(AVRegionOfInterest);
+                    region.top = row * block_size_;
+                    region.bottom = std::min((row + 1) * block_size_, height_);
+                    region.left = run_begin * block_size_;
+                    region.right = std::min(col * block_size_, width_);
+                    region.qoffset = (AVRational){-1, 10};
+                    regions_.push_back(region);
+                    run_begin = -1;
+                }
+            }
+        }
+        // Static areas still get detail at keyframes, so they give up less than moving ones gain.
+        AVRegionOfInterest rest;
+        rest.self_size = sizeof(AVRegionOfInterest);
+        rest.top = 0;
+        rest.bottom = height_;
+        rest.left = 0;
+        rest.right = width_;
+        rest.qoffset = (AVRational){1, 25};
+        regions_.push_back(rest);
+        ++frames_;
+        moving_blocks_ += moving;
+    }
+
+    for (int j = 0; j < height_; ++j) {
+        memcpy(previous_y_.data() + (size_t)j * width_, y + (size_t)j * linesize, width_);
+    }
+    has_previous_ = true;
+
+    if (regions_.empty()) return true;
+    size_t size = regions_.size() * sizeof(AVRegionOfInterest);
+    AVFrameSideData* side_data = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, size);
+    if (side_data == nullptr) {
+        log_warn("Could not allocate %zu regions of interest", regions_.size());
+        return false;
+    }
+    memcpy(side_data->data, regions_.data(), size);
+    return true;
+}
+
+double MotionRoi::MovingPercent() const {
+    if (frames_ == 0) return 0;
+    return 100.0 * moving_blocks_ / ((double)frames_ * block_cols_ * block_rows_);
+}
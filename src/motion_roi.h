@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// Coarse motion analysis for region-of-interest encoding. Each 16x16 macroblock of the Y plane is compared with the
+// same block of the previous frame; blocks that changed, and stay changed for a few frames after, are listed first
+// with a negative quantizer offset, and the whole frame after them with a small positive one. x264 applies the first
+// region that covers a macroblock, so moving areas get the bits static ones give up.
+//
+// Needs adaptive quantization in the encoder, which x264 has on by default.
+class MotionRoi {
+public:
+    void Init(int width, int height);
+    // Analyses the frame's Y plane and replaces its AV_FRAME_DATA_REGIONS_OF_INTEREST side data. The first frame after
+    // Init gets none. False when the side data could not be allocated.
+    bool Attach(AVFrame* frame);
+
+    // Averaged over the frames analysed since Init, in percent of the macroblocks.
+    double MovingPercent() const;
+
+private:
+    static const int block_size_ = 16;
+    // Mean absolute difference per pixel above which a block counts as moving.
+    static const int motion_threshold_ = 3;
+    // Frames a block stays moving after it last changed, so regions do not flicker in and out with small motion.
+    static const int hold_frames_ = 8;
+
+    int width_ = 0;
+    int height_ = 0;
+    int block_cols_ = 0;
+    int block_rows_ = 0;
+    bool has_previous_ = false;
+    std::vector<uint8_t> previous_y_;
+    std::vector<uint8_t> hold_;
+    std::vector<AVRegionOfInterest> regions_;
+
+    uint64_t frames_ = 0;
+    uint64_t moving_blocks_ = 0;
+
+    int BlockSad(const uint8_t* y, int linesize, int col, int row, int* pixels) const;
+};
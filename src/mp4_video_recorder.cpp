@@ -1,16 +1,32 @@
 #include <libyuv.h>
-
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstring>
+#include <map>
+#include <mutex>
 #include <thread>
+#include <vector>
 
+#include "frame_pool.h"
 #include "logger.h"
 #include "media_recorder_common.h"
 #include "media_recorder_interface.h"
+#include "motion_roi.h"
+#include "pipe_io.h"
 #include "poca_str.h"
-#include "ring_fifo.h"
+#include "readiness_notifier.h"
+#include "ring_depth.h"
+#include "spsc_ring.h"
+#include "thread_placement.h"
+#include "trace_recorder.h"
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
 #include <libavutil/timestamp.h>
 }
 
@@ -21,7 +37,10 @@ public:
     virtual bool SendAudioFrame(void* data, int size) override;
     virtual bool SendVideoFrameBlock(void* data, int size) override;
     virtual bool SendAudioFrameBlock(void* data, int size) override;
+    virtual MediaIOStatus TrySendVideoFrame(void* data, int size) override;
+    virtual int WritableFd() override;
     virtual bool Stop() override;
+    virtual PipelineMetricsSnapshot GetMetrics() override;
 
     virtual ~MP4VideoRecorder() override;
 
@@ -29,16 +48,58 @@ private:
     int fps_;
     int width_;
     int height_;
+    int gop_size_;
+    RecorderInputFormat input_format_;
+    bool use_worker_thread_;
+    int encoder_threads_;
+    std::string preset_;
+    bool low_latency_;
+    bool motion_roi_enabled_;
+    bool skip_duplicates_;
+    int max_skipped_frames_;
 
     std::string filename_;
-
-    static const int buffer_size_;
+    RecorderContainer container_;
+    size_t pipe_size_;
+    bool pipe_zero_copy_;
+    // Set up when writing to stdout, the muxer writes through it.
+    PipeSink sink_;
+    std::function<void(int64_t, int64_t)> on_fragment_;
+    // Frames encoded and muxed so far, behind the pts once duplicates are skipped.
+    int64_t muxed_packets_;
+
+    static const int low_latency_max_ring_depth_;
+    static const int avio_buffer_size_;
+    // Takes without a stall before a spare frame is released.
+    static const int ring_idle_frames_;
+    // Submit times of the frames taken for encoding by pts, stamped by the sending thread and erased when the frame's
+    // packet is written. Skipped duplicates take a pts but no entry.
+    std::mutex submit_mux_;
+    std::map<int64_t, int64_t> submit_ns_;
     static const AVPixelFormat output_pix_fmt_;
     static const char* const format_name_;
     static const AVCodecID codec_id_;
 
-    RingFIFO<AVFrame*>* ring_fifo_av_frame_full_;
-    RingFIFO<AVFrame*>* ring_fifo_av_frame_empty_;
+    SpscRing<AVFrame*>* ring_fifo_av_frame_full_ = nullptr;
+    SpscRing<AVFrame*>* ring_fifo_av_frame_empty_ = nullptr;
+    RingDepthController ring_depth_;
+    ThreadPlacement placement_;
+    // Encoding thread only.
+    MotionRoi motion_roi_;
+    // Inline encoding only: the one frame every Send converts into.
+    AVFrame* inline_frame_ = nullptr;
+    // Sending thread: the pts the next frame gets, skipped duplicates count too. Hash and copy of the last frame taken
+    // and the duplicates of it skipped since.
+    int64_t next_pts_ = 0;
+    uint32_t last_input_hash_ = 0;
+    std::vector<uint8_t> last_input_;
+    bool has_last_input_ = false;
+    int skipped_run_ = 0;
+    // Worker, with skip_duplicates: the last frame encoded, held back from the empty ring.
+    AVFrame* repeat_frame_ = nullptr;
+    // Set by Stop before the worker is told to finish: when the input ended with skipped duplicates, the pts of the
+    // last one, at which the last frame is encoded once more so it lasts until there. -1 otherwise.
+    int64_t repeat_pts_ = -1;
 
     AVFormatContext* dst_fmt_ctx_;
     AVStream* dst_video_stream_;
@@ -47,12 +108,29 @@ private:
 
     std::thread worker_thread_;
 
+    PipelineMetrics metrics_;
+
+    std::string trace_filename_;
+    TraceRecorder* trace_ = nullptr;
+
+    // Signals TrySendVideoFrame callers that found the empty ring drained.
+    ReadinessNotifier writable_;
+
     bool InitAVContexts();
     void EncodeAndWriteFrame();
     bool WriteFrame(AVFrame* frame);
+    void FlushAndWriteTrailer(AVFrame* last_frame);
+    bool EncodeInline(void* data, uint32_t hash, int64_t submit_ns);
+    int InputFrameSize() const;
+    void ConvertInput(const void* data, AVFrame* frame);
+    bool SkipDuplicate(const void* data, int64_t submit_ns, uint32_t* hash);
+    int64_t TakeInput(const void* data, uint32_t hash, int64_t submit_ns);
+    bool TakeEmptyFrame(AVFrame*& frame);
 };
 
-const int MP4VideoRecorder::buffer_size_ = 10;
+const int MP4VideoRecorder::low_latency_max_ring_depth_ = 2;
+const int MP4VideoRecorder::avio_buffer_size_ = 256 * 1024;
+const int MP4VideoRecorder::ring_idle_frames_ = 60;
 const AVPixelFormat MP4VideoRecorder::output_pix_fmt_ = AV_PIX_FMT_YUV420P;
 const char* const MP4VideoRecorder::format_name_ = "mp4";
 const AVCodecID MP4VideoRecorder::codec_id_ = AV_CODEC_ID_H264;
@@ -67,7 +145,8 @@ bool MP4VideoRecorder::InitAVContexts() {
     AVDictionary* opt;
     log_info("Init av contexts begin");
 
-    if (avformat_alloc_output_context2(&dst_fmt_ctx_, nullptr, format_name_, filename_.c_str()) < 0) {
+    const char* format_name = container_ == RECORDER_CONTAINER_ANNEXB ? "h264" : format_name_;
+    if (avformat_alloc_output_context2(&dst_fmt_ctx_, nullptr, format_name, filename_.c_str()) < 0) {
         log_error("Alloc avformat output ctx failed");
         return false;
     }
@@ -101,16 +180,33 @@ bool MP4VideoRecorder::InitAVContexts() {
     encoder_ctx_->width = width_;
     encoder_ctx_->pix_fmt = output_pix_fmt_;
     encoder_ctx_->time_base = dst_video_stream_->time_base;
+    if (gop_size_ > 0) {
+        encoder_ctx_->gop_size = gop_size_;
+    }
     if (dst_fmt_ctx_->oformat->flags & AVFMT_GLOBALHEADER) {
         encoder_ctx_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     }
 
     opt = 0;
-    av_dict_set(&opt, "threads", "4", 0);
-    ret = avcodec_open2(encoder_ctx_, encoder, &opt);
+    av_dict_set_int(&opt, "threads", encoder_threads_, 0);
+    if (!preset_.empty()) {
+        av_dict_set(&opt, "preset", preset_.c_str(), 0);
+    }
+    if (low_latency_) {
+        encoder_ctx_->max_b_frames = 0;
+        encoder_ctx_->thread_type = FF_THREAD_SLICE;
+        av_dict_set(&opt, "tune", "zerolatency", 0);
+        // Spreads the intra macroblocks over gop_size frames, so there are no keyframe sized bursts to send.
+        av_dict_set(&opt, "intra-refresh", "1", 0);
+    }
+    {
+        // x264's threads are created here and keep the placement.
+        ScopedThreadPlacement pin(placement_);
+        ret = avcodec_open2(encoder_ctx_, encoder, &opt);
+    }
     av_dict_free(&opt);
     if (ret < 0) {
-        log_error("Could not open video codec: %s", poca_err2str(ret));
+        log_error("Could not open video codec: %s", poca_err2str(ret).c_str());
         return false;
     }
 
@@ -121,18 +217,34 @@ bool MP4VideoRecorder::InitAVContexts() {
 
     av_dump_format(dst_fmt_ctx_, 0, filename_.c_str(), 1);
 
-    if (!(dst_fmt_ctx_->flags & AVFMT_NOFILE)) {
+    if (filename_ == "-") {
+        if (!sink_.Open(STDOUT_FILENO, pipe_size_, pipe_zero_copy_)) return false;
+        uint8_t* buffer = (uint8_t*)av_malloc(avio_buffer_size_);
+        dst_fmt_ctx_->pb = buffer ? avio_alloc_context(buffer, avio_buffer_size_, 1, &sink_, nullptr,
+                                                       &PipeSink::AvioWrite, nullptr)
+                                  : nullptr;
+        if (dst_fmt_ctx_->pb == nullptr) {
+            av_free(buffer);
+            log_error("Could not allocate the output AVIO context");
+            return false;
+        }
+        dst_fmt_ctx_->flags |= AVFMT_FLAG_CUSTOM_IO;
+    } else if (!(dst_fmt_ctx_->flags & AVFMT_NOFILE)) {
         ret = avio_open(&dst_fmt_ctx_->pb, filename_.c_str(), AVIO_FLAG_WRITE);
         if (ret < 0) {
-            log_error("Could not open '%s': %s", filename_.c_str(), poca_err2str(ret));
+            log_error("Could not open '%s': %s", filename_.c_str(), poca_err2str(ret).c_str());
             return false;
         }
     }
 
+    if (container_ == RECORDER_CONTAINER_FRAGMENTED_MP4) {
+        av_dict_set(&opt, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    }
     /* Write the stream header, if any. */
     ret = avformat_write_header(dst_fmt_ctx_, &opt);
+    av_dict_free(&opt);
     if (ret < 0) {
-        log_error("Error occurred when opening output file: %s", poca_err2str(ret));
+        log_error("Error occurred when opening output file: %s", poca_err2str(ret).c_str());
         return false;
     }
 
@@ -151,55 +263,117 @@ bool MP4VideoRecorder::Start(void* param) {
     fps_ = start_param->fps;
     width_ = start_param->width;
     height_ = start_param->height;
+    gop_size_ = start_param->gop_size;
+    input_format_ = start_param->input_format;
+    use_worker_thread_ = start_param->worker_thread;
+    encoder_threads_ = start_param->encoder_threads;
+    preset_ = start_param->preset;
+    motion_roi_enabled_ = start_param->motion_roi;
+    if (motion_roi_enabled_) {
+        motion_roi_.Init(width_, height_);
+    }
+    low_latency_ = start_param->low_latency;
+    skip_duplicates_ = start_param->skip_duplicates;
+    max_skipped_frames_ = start_param->max_skipped_frames > 0 ? start_param->max_skipped_frames : fps_;
+    next_pts_ = 0;
+    has_last_input_ = false;
+    skipped_run_ = 0;
+    repeat_pts_ = -1;
+    submit_ns_.clear();
     filename_ = start_param->filename;
-
-    ring_fifo_av_frame_full_ = new RingFIFO<AVFrame*>(buffer_size_);
-    ring_fifo_av_frame_empty_ = new RingFIFO<AVFrame*>(buffer_size_);
-
-    for (int i = 0; i < buffer_size_; ++i) {
-        AVFrame* frame;
-        int ret;
-
-        frame = av_frame_alloc();
-        if (!frame) return false;
-
-        frame->format = output_pix_fmt_;
-        frame->width = width_;
-        frame->height = height_;
-
-        /* allocate the buffers for the frame data */
-        ret = av_frame_get_buffer(frame, 0);
-        if (ret < 0) {
+    container_ = start_param->container;
+    pipe_size_ = start_param->pipe_size;
+    pipe_zero_copy_ = start_param->pipe_zero_copy;
+    on_fragment_ = start_param->on_fragment;
+    muxed_packets_ = 0;
+    if (filename_ == "-" && container_ == RECORDER_CONTAINER_MP4) {
+        // Nothing to seek back in to write the index.
+        container_ = RECORDER_CONTAINER_FRAGMENTED_MP4;
+    }
+    trace_filename_ = start_param->trace_filename;
+    if (!trace_filename_.empty()) {
+        trace_ = new TraceRecorder("MP4VideoRecorder " + filename_);
+    }
+    if (!placement_.Init(start_param->placement)) {
+        return false;
+    }
+    log_info("%s encoding on %s", filename_.c_str(), placement_.Describe().c_str());
+
+    size_t frame_bytes = av_image_get_buffer_size(output_pix_fmt_, width_, height_, 1);
+    if (use_worker_thread_) {
+        int max_depth = start_param->max_ring_depth;
+        if (low_latency_) max_depth = std::min(max_depth, low_latency_max_ring_depth_);
+        int min_depth = std::min(start_param->min_ring_depth, max_depth);
+        if (skip_duplicates_) {
+            // One more for repeat_frame_.
+            ++min_depth;
+            ++max_depth;
+        }
+        ring_depth_.Init(min_depth, max_depth, ring_idle_frames_, frame_bytes);
+        // Sized for the deepest the ring can get, so Put never blocks on a frame that was just added.
+        ring_fifo_av_frame_full_ = new SpscRing<AVFrame*>(ring_depth_.MaxDepth());
+        ring_fifo_av_frame_empty_ = new SpscRing<AVFrame*>(ring_depth_.MaxDepth());
+
+        for (int i = 0; i < ring_depth_.Depth(); ++i) {
+            /* lease the buffers from the shared pool so restarts reuse them */
+            AVFrame* frame = FramePool::Instance()->Lease(output_pix_fmt_, width_, height_, placement_.NumaNode());
+            if (!frame) {
+                log_error("Could not allocate frame data.");
+                return false;
+            }
+            ring_fifo_av_frame_empty_->Put(frame);
+        }
+    } else {
+        ring_depth_.Init(1, 1, ring_idle_frames_, frame_bytes);
+        inline_frame_ = FramePool::Instance()->Lease(output_pix_fmt_, width_, height_, placement_.NumaNode());
+        if (!inline_frame_) {
             log_error("Could not allocate frame data.");
             return false;
         }
-        ring_fifo_av_frame_empty_->Put(frame);
     }
 
     if (!InitAVContexts()) return false;
 
-    worker_thread_ = std::thread(&MP4VideoRecorder::EncodeAndWriteFrame, this);
+    if (use_worker_thread_) {
+        worker_thread_ = std::thread(&MP4VideoRecorder::EncodeAndWriteFrame, this);
+    }
 
     return true;
 }
 
 bool MP4VideoRecorder::WriteFrame(AVFrame* frame) {
     int ret;
+    int64_t frame_index = frame ? frame->pts : -1;
+    int64_t encode_begin_ns = MetricsNowNs();
+    if (frame != nullptr && motion_roi_enabled_) {
+        // Counted as encoding, it only exists to make the encoder's job cheaper.
+        motion_roi_.Attach(frame);
+        if (trace_) trace_->Record("motion_roi", encode_begin_ns, MetricsNowNs(), frame_index);
+    }
     ret = avcodec_send_frame(encoder_ctx_, frame);
+    int64_t encode_end_ns = MetricsNowNs();
+    int64_t encode_ns = encode_end_ns - encode_begin_ns;
+    if (trace_) trace_->Record("send_frame", encode_begin_ns, encode_end_ns, frame_index);
     if (ret < 0) {
-        log_error("Error sending a frame to the encoder: %s", poca_err2str(ret));
+        log_error("Error sending a frame to the encoder: %s", poca_err2str(ret).c_str());
         return false;
     }
 
     while (ret >= 0) {
+        encode_begin_ns = MetricsNowNs();
         ret = avcodec_receive_packet(encoder_ctx_, dst_video_pkt_);
+        encode_end_ns = MetricsNowNs();
+        encode_ns += encode_end_ns - encode_begin_ns;
+        if (trace_) trace_->Record("receive_packet", encode_begin_ns, encode_end_ns, frame_index);
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
             break;
         else if (ret < 0) {
-            log_error("Error encoding a frame: %s", poca_err2str(ret));
+            log_error("Error encoding a frame: %s", poca_err2str(ret).c_str());
             return false;
         }
 
+        // Still the frame index, the encoder counts in frames.
+        int64_t packet_index = dst_video_pkt_->pts;
         /* rescale output packet timestamp values from codec to stream timebase */
         av_packet_rescale_ts(dst_video_pkt_, encoder_ctx_->time_base, dst_video_stream_->time_base);
         dst_video_pkt_->stream_index = dst_video_stream_->index;
@@ -209,30 +383,90 @@ bool MP4VideoRecorder::WriteFrame(AVFrame* frame) {
                   poca_ts2timestr(dst_video_pkt_->pts, time_base).c_str(), poca_ts2str(dst_video_pkt_->dts).c_str(),
                   poca_ts2timestr(dst_video_pkt_->dts, time_base).c_str(), dst_video_pkt_->stream_index);
 
-        ret = av_interleaved_write_frame(dst_fmt_ctx_, dst_video_pkt_);
+        // The muxer writes the previous fragment out when a keyframe arrives.
+        bool fragment_start = on_fragment_ && container_ == RECORDER_CONTAINER_FRAGMENTED_MP4 && muxed_packets_ > 0 &&
+                              (dst_video_pkt_->flags & AV_PKT_FLAG_KEY);
+        {
+            ScopedStage mux(&metrics_.stages[STAGE_MUX], trace_, "mux", frame_index);
+            if (container_ == RECORDER_CONTAINER_ANNEXB && sink_.IsOpen()) {
+                // The encoder's packets are the stream already, their buffers go into the pipe as they are.
+                ret = sink_.Splice(dst_video_pkt_->buf, dst_video_pkt_->data, dst_video_pkt_->size) ? 0 : AVERROR(EIO);
+                av_packet_unref(dst_video_pkt_);
+            } else {
+                ret = av_interleaved_write_frame(dst_fmt_ctx_, dst_video_pkt_);
+            }
+        }
         if (ret < 0) {
-            log_error("Error while writing output packet: %s", poca_err2str(ret));
+            log_error("Error while writing output packet: %s", poca_err2str(ret).c_str());
             return false;
         }
+        if (fragment_start) {
+            // The keyframe itself stays in the muxer's fragment buffer, everything in front of it is complete.
+            avio_flush(dst_fmt_ctx_->pb);
+            on_fragment_(muxed_packets_, avio_tell(dst_fmt_ctx_->pb));
+        }
+        ++muxed_packets_;
+        if (packet_index >= 0) {
+            // None for the last frame repeated at Stop, which was never submitted at that pts.
+            int64_t submit_ns = 0;
+            {
+                std::unique_lock<std::mutex> lock(submit_mux_);
+                auto it = submit_ns_.find(packet_index);
+                if (it != submit_ns_.end()) {
+                    submit_ns = it->second;
+                    submit_ns_.erase(it);
+                }
+            }
+            if (submit_ns != 0) metrics_.end_to_end.Record(MetricsNowNs() - submit_ns);
+        }
     }
+    metrics_.stages[STAGE_ENCODE].Record(encode_ns);
     return true;
 }
 
 void MP4VideoRecorder::EncodeAndWriteFrame() {
     int64_t next_pts = 0;
+    AVFrame* frame;
+    if (trace_) trace_->NameThread("encode worker");
+    placement_.Apply();
     while (true) {
-        AVFrame* frame = ring_fifo_av_frame_full_->Get();
-        if (frame == nullptr) {
-            log_info("Stop send frame");
-            break;
+        {
+            ScopedStage wait(&metrics_.full_ring.get_wait, trace_, "wait_full_ring", next_pts);
+            if (!ring_fifo_av_frame_full_->GetNoWait(frame)) {
+                ring_depth_.OnStarved();
+                if (!ring_fifo_av_frame_full_->Get(frame)) break;
+            }
         }
-        frame->pts = next_pts++;
         if (!WriteFrame(frame)) {
             log_warn("Something wrong when writing a frame");
             break;
         }
+        metrics_.frames_out.fetch_add(1, std::memory_order_relaxed);
+        next_pts = frame->pts + 1;
+        if (skip_duplicates_) {
+            std::swap(frame, repeat_frame_);
+            if (frame == nullptr) continue;
+        }
+
+        {
+            ScopedStage wait(&metrics_.empty_ring.put_wait, trace_, "put_empty_ring", frame->pts);
+            ring_fifo_av_frame_empty_->Put(frame);
+        }
+        writable_.NotifyIfArmed();
+    }
+    log_info("Stop send frame");
+    // Senders fail from here on instead of waiting for frames that will never come back.
+    ring_fifo_av_frame_empty_->Close();
+    writable_.Notify();
+    FlushAndWriteTrailer(repeat_frame_);
+}
 
-        ring_fifo_av_frame_empty_->Put(frame);
+void MP4VideoRecorder::FlushAndWriteTrailer(AVFrame* last_frame) {
+    if (last_frame != nullptr && repeat_pts_ >= 0) {
+        last_frame->pts = repeat_pts_;
+        if (!WriteFrame(last_frame)) {
+            log_warn("Something wrong when writing the last frame again");
+        }
     }
     if (!WriteFrame(nullptr)) {
         log_warn("Something wrong when flushing");
@@ -240,34 +474,210 @@ void MP4VideoRecorder::EncodeAndWriteFrame() {
     av_write_trailer(dst_fmt_ctx_);
 }
 
+int MP4VideoRecorder::InputFrameSize() const {
+    if (input_format_ == RECORDER_INPUT_I420) {
+        return width_ * height_ + 2 * ((width_ + 1) / 2) * ((height_ + 1) / 2);
+    }
+    return width_ * height_ * 3;
+}
+
+void MP4VideoRecorder::ConvertInput(const void* data, AVFrame* frame) {
+    const uint8_t* src = (const uint8_t*)data;
+    if (input_format_ == RECORDER_INPUT_I420) {
+        int chroma_width = (width_ + 1) / 2;
+        const uint8_t* src_u = src + width_ * height_;
+        const uint8_t* src_v = src_u + chroma_width * ((height_ + 1) / 2);
+        libyuv::I420Copy(src, width_, src_u, chroma_width, src_v, chroma_width, frame->data[0], frame->linesize[0],
+                         frame->data[1], frame->linesize[1], frame->data[2], frame->linesize[2], width_, height_);
+        return;
+    }
+    libyuv::RAWToI420(src, width_ * 3, frame->data[0], frame->linesize[0], frame->data[1], frame->linesize[1],
+                      frame->data[2], frame->linesize[2], width_, height_);
+}
+
+// True when the frame is the same as the last one taken and can be skipped. The skipped frame still takes a pts, so
+// the previous frame is shown until the next one that is encoded.
+bool MP4VideoRecorder::SkipDuplicate(const void* data, int64_t submit_ns, uint32_t* hash) {
+    if (!skip_duplicates_) return false;
+    // libyuv's djb2 is vectorized and reads the frame about as fast as memory delivers it. Changed frames can still
+    // collide in its 32 bits, so a match is confirmed against the last frame itself.
+    *hash = libyuv::HashDjb2((const uint8_t*)data, InputFrameSize(), 5381);
+    if (!has_last_input_ || *hash != last_input_hash_ || skipped_run_ >= max_skipped_frames_) return false;
+    if (memcmp(data, last_input_.data(), last_input_.size()) != 0) return false;
+    ++skipped_run_;
+    ++next_pts_;
+    metrics_.duplicate_frames.fetch_add(1, std::memory_order_relaxed);
+    if (trace_) trace_->Record("skip_duplicate", submit_ns, MetricsNowNs(), next_pts_ - 1);
+    return true;
+}
+
+// Records a frame that is going to be encoded and returns its pts.
+int64_t MP4VideoRecorder::TakeInput(const void* data, uint32_t hash, int64_t submit_ns) {
+    if (skip_duplicates_) {
+        const uint8_t* bytes = (const uint8_t*)data;
+        last_input_.assign(bytes, bytes + InputFrameSize());
+    }
+    last_input_hash_ = hash;
+    has_last_input_ = true;
+    skipped_run_ = 0;
+    {
+        std::unique_lock<std::mutex> lock(submit_mux_);
+        submit_ns_[next_pts_] = submit_ns;
+    }
+    return next_pts_++;
+}
+
+// Takes a free frame without waiting. When there is none and the depth may grow, leases a new one instead; when there
+// have been spare frames for a while, releases one.
+bool MP4VideoRecorder::TakeEmptyFrame(AVFrame*& frame) {
+    if (ring_fifo_av_frame_empty_->GetNoWait(frame)) {
+        AVFrame* spare;
+        if (ring_depth_.OnTake() && ring_fifo_av_frame_empty_->GetNoWait(spare)) {
+            av_frame_free(&spare);
+            ring_depth_.Shrink();
+        }
+        return true;
+    }
+    if (ring_fifo_av_frame_empty_->Closed() || !ring_depth_.OnStall()) return false;
+    frame = FramePool::Instance()->Lease(output_pix_fmt_, width_, height_, placement_.NumaNode());
+    if (frame == nullptr) {
+        ring_depth_.Shrink();
+        return false;
+    }
+    log_debug("Recorder ring grown to %d frames", ring_depth_.Depth());
+    return true;
+}
+
+bool MP4VideoRecorder::EncodeInline(void* data, uint32_t hash, int64_t submit_ns) {
+    if (inline_frame_ == nullptr) {
+        log_warn("Recorder stopped, frame dropped");
+        return false;
+    }
+    int64_t frame_index = TakeInput(data, hash, submit_ns);
+    {
+        ScopedStage convert(&metrics_.stages[STAGE_CONVERT], trace_, "convert", frame_index);
+        ConvertInput(data, inline_frame_);
+    }
+    metrics_.frames_in.fetch_add(1, std::memory_order_relaxed);
+
+    inline_frame_->pts = frame_index;
+    if (!WriteFrame(inline_frame_)) {
+        log_warn("Something wrong when writing a frame");
+        return false;
+    }
+    metrics_.frames_out.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
 bool MP4VideoRecorder::SendVideoFrame(void* data, int size) {
-    if (size != width_ * height_ * 3) {
-        log_warn("Video frame data size not match, need: %d, actual: %d", width_ * height_ * 3, size);
+    int64_t submit_ns = MetricsNowNs();
+    if (size != InputFrameSize()) {
+        log_warn("Video frame data size not match, need: %d, actual: %d", InputFrameSize(), size);
+    }
+
+    uint32_t hash = 0;
+    if (SkipDuplicate(data, submit_ns, &hash)) return true;
+
+    if (!use_worker_thread_) {
+        return EncodeInline(data, hash, submit_ns);
     }
 
     AVFrame* frame;
-    if (!ring_fifo_av_frame_empty_->GetNoWait(frame)) {
+    if (!TakeEmptyFrame(frame)) {
+        metrics_.dropped_frames.fetch_add(1, std::memory_order_relaxed);
         log_warn("Buffer full, please put frame slowly");
         return false;
     }
 
-    libyuv::RAWToI420((const uint8_t*)data, width_ * 3, frame->data[0], width_, frame->data[1], width_ >> 1,
-                      frame->data[2], width_ >> 1, width_, height_);
+    int64_t frame_index = TakeInput(data, hash, submit_ns);
+    {
+        ScopedStage convert(&metrics_.stages[STAGE_CONVERT], trace_, "convert", frame_index);
+        ConvertInput(data, frame);
+    }
 
+    frame->pts = frame_index;
     ring_fifo_av_frame_full_->PutNoWait(frame);
+    metrics_.frames_in.fetch_add(1, std::memory_order_relaxed);
 
     return true;
 }
+
+MediaIOStatus MP4VideoRecorder::TrySendVideoFrame(void* data, int size) {
+    int64_t submit_ns = MetricsNowNs();
+    if (size != InputFrameSize()) {
+        log_warn("Video frame data size not match, need: %d, actual: %d", InputFrameSize(), size);
+    }
+
+    if (use_worker_thread_ && ring_fifo_av_frame_empty_ == nullptr) {
+        return MEDIA_IO_END;
+    }
+    uint32_t hash = 0;
+    if (SkipDuplicate(data, submit_ns, &hash)) return MEDIA_IO_OK;
+
+    if (!use_worker_thread_) {
+        return EncodeInline(data, hash, submit_ns) ? MEDIA_IO_OK : MEDIA_IO_ERROR;
+    }
+
+    AVFrame* frame;
+    if (!TakeEmptyFrame(frame)) {
+        writable_.Arm();
+        // Read before the retry, so closed and still empty afterwards means the worker is gone.
+        bool closed = ring_fifo_av_frame_empty_->Closed();
+        if (!ring_fifo_av_frame_empty_->GetNoWait(frame)) {
+            return closed ? MEDIA_IO_END : MEDIA_IO_WOULD_BLOCK;
+        }
+    }
+
+    int64_t frame_index = TakeInput(data, hash, submit_ns);
+    {
+        ScopedStage convert(&metrics_.stages[STAGE_CONVERT], trace_, "convert", frame_index);
+        ConvertInput(data, frame);
+    }
+
+    // Never full, the full ring holds as many frames as there are.
+    frame->pts = frame_index;
+    ring_fifo_av_frame_full_->PutNoWait(frame);
+    metrics_.frames_in.fetch_add(1, std::memory_order_relaxed);
+    return MEDIA_IO_OK;
+}
+
+int MP4VideoRecorder::WritableFd() { return use_worker_thread_ ? writable_.Fd() : -1; }
+
 bool MP4VideoRecorder::SendVideoFrameBlock(void* data, int size) {
-    if (size != width_ * height_ * 3) {
-        log_warn("Video frame data size not match, need: %d, actual: %d", width_ * height_ * 3, size);
+    int64_t submit_ns = MetricsNowNs();
+    if (size != InputFrameSize()) {
+        log_warn("Video frame data size not match, need: %d, actual: %d", InputFrameSize(), size);
+    }
+
+    uint32_t hash = 0;
+    if (SkipDuplicate(data, submit_ns, &hash)) return true;
+
+    if (!use_worker_thread_) {
+        return EncodeInline(data, hash, submit_ns);
     }
 
-    AVFrame* frame = ring_fifo_av_frame_empty_->Get();
-    libyuv::RAWToI420((const uint8_t*)data, width_ * 3, frame->data[0], width_, frame->data[1], width_ >> 1,
-                      frame->data[2], width_ >> 1, width_, height_);
+    // Taken as input only once there is a frame for it, a dropped one must not count as the last input.
+    AVFrame* frame;
+    {
+        ScopedStage wait(&metrics_.empty_ring.get_wait, trace_, "wait_empty_ring", next_pts_);
+        if (!TakeEmptyFrame(frame) && !ring_fifo_av_frame_empty_->Get(frame)) {
+            metrics_.dropped_frames.fetch_add(1, std::memory_order_relaxed);
+            log_warn("Recorder stopped, frame dropped");
+            return false;
+        }
+    }
+    int64_t frame_index = TakeInput(data, hash, submit_ns);
+    {
+        ScopedStage convert(&metrics_.stages[STAGE_CONVERT], trace_, "convert", frame_index);
+        ConvertInput(data, frame);
+    }
 
-    ring_fifo_av_frame_full_->Put(frame);
+    frame->pts = frame_index;
+    {
+        ScopedStage wait(&metrics_.full_ring.put_wait, trace_, "wait_full_ring", frame_index);
+        ring_fifo_av_frame_full_->Put(frame);
+    }
+    metrics_.frames_in.fetch_add(1, std::memory_order_relaxed);
     return true;
 }
 
@@ -276,20 +686,36 @@ bool MP4VideoRecorder::SendAudioFrame(void* data, int size) { return false; }
 bool MP4VideoRecorder::SendAudioFrameBlock(void* data, int size) { return false; }
 
 bool MP4VideoRecorder::Stop() {
-    ring_fifo_av_frame_full_->Put(nullptr);
-    worker_thread_.join();
+    repeat_pts_ = skipped_run_ > 0 ? next_pts_ - 1 : -1;
+    has_last_input_ = false;
+    std::vector<uint8_t>().swap(last_input_);
+    if (use_worker_thread_) {
+        ring_fifo_av_frame_full_->Close();
+        worker_thread_.join();
+        av_frame_free(&repeat_frame_);
+    } else {
+        FlushAndWriteTrailer(inline_frame_);
+        av_frame_free(&inline_frame_);
+    }
 
     avcodec_free_context(&encoder_ctx_);
     AVFrame* frame;
-    while (ring_fifo_av_frame_full_->GetNoWait(frame)) {
+    while (ring_fifo_av_frame_full_ != nullptr && ring_fifo_av_frame_full_->GetNoWait(frame)) {
         av_frame_free(&frame);
     }
-    while (ring_fifo_av_frame_empty_->GetNoWait(frame)) {
+    while (ring_fifo_av_frame_empty_ != nullptr && ring_fifo_av_frame_empty_->GetNoWait(frame)) {
         av_frame_free(&frame);
     }
     av_packet_free(&dst_video_pkt_);
-
-    if (!(dst_fmt_ctx_->oformat->flags & AVFMT_NOFILE)) {
+    // Frames whose packet was never written.
+    submit_ns_.clear();
+
+    if (sink_.IsOpen()) {
+        avio_flush(dst_fmt_ctx_->pb);
+        av_freep(&dst_fmt_ctx_->pb->buffer);
+        avio_context_free(&dst_fmt_ctx_->pb);
+        sink_.Close();
+    } else if (!(dst_fmt_ctx_->oformat->flags & AVFMT_NOFILE)) {
         avio_closep(&dst_fmt_ctx_->pb);
     }
 
@@ -297,5 +723,43 @@ bool MP4VideoRecorder::Stop() {
 
     delete ring_fifo_av_frame_empty_;
     delete ring_fifo_av_frame_full_;
+    ring_fifo_av_frame_empty_ = nullptr;
+    ring_fifo_av_frame_full_ = nullptr;
+    ring_depth_.Reset();
+    placement_.Reset();
+
+    if (motion_roi_enabled_) {
+        log_info("%s moving macroblocks: %.1f%%", filename_.c_str(), motion_roi_.MovingPercent());
+    }
+
+    LatencySnapshot end_to_end = metrics_.end_to_end.Snapshot();
+    if (end_to_end.count > 0) {
+        log_info("%s submit to packet written over %" PRIu64 " frames: p50 %.2fms p90 %.2fms p99 %.2fms max %.2fms",
+                 filename_.c_str(), end_to_end.count, end_to_end.p50_ns / 1e6, end_to_end.p90_ns / 1e6,
+                 end_to_end.p99_ns / 1e6, end_to_end.max_ns / 1e6);
+    }
+
+    if (trace_ != nullptr) {
+        trace_->Dump(trace_filename_);
+        delete trace_;
+        trace_ = nullptr;
+    }
     return true;
+}
+
+PipelineMetricsSnapshot MP4VideoRecorder::GetMetrics() {
+    PipelineMetricsSnapshot snapshot = metrics_.Snapshot(filename_);
+    if (ring_fifo_av_frame_full_ != nullptr) {
+        snapshot.full_ring.capacity = ring_fifo_av_frame_full_->Capacity();
+        snapshot.full_ring.occupancy = ring_fifo_av_frame_full_->Size();
+    }
+    if (ring_fifo_av_frame_empty_ != nullptr) {
+        snapshot.empty_ring.capacity = ring_fifo_av_frame_empty_->Capacity();
+        snapshot.empty_ring.occupancy = ring_fifo_av_frame_empty_->Size();
+    }
+    snapshot.ring_depth = ring_depth_.Depth();
+    snapshot.pinned_bytes = ring_depth_.PinnedBytes();
+    snapshot.cores = placement_.CoreList();
+    snapshot.numa_node = placement_.NumaNode();
+    return snapshot;
 }
\ No newline at end of file
@@ -0,0 +1,144 @@
+#include "pipe_io.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include "logger.h"
+
+size_t GrowPipe(int fd, size_t size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode)) return 0;
+    long max_size = 0;
+    FILE* file = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (file != nullptr) {
+        if (fscanf(file, "%ld", &max_size) != 1) max_size = 0;
+        fclose(file);
+    }
+    long want = max_size > 0 && (long)size > max_size ? max_size : (long)size;
+    // Past the user's quota of pipe pages EPERM comes back, a smaller pipe is still better than the default one.
+    while (want >= 64 * 1024 && fcntl(fd, F_SETPIPE_SZ, (int)want) < 0 && errno == EPERM) {
+        want /= 2;
+    }
+    int actual = fcntl(fd, F_GETPIPE_SZ);
+    return actual > 0 ? actual : 0;
+}
+
+bool PipeSink::Open(int fd, size_t pipe_size, bool zero_copy) {
+    Close();
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        log_error("Output fd %d is not open: %s", fd, strerror(errno));
+        return false;
+    }
+    if (fd == STDOUT_FILENO) LogToStderr(true);
+    fd_ = fd;
+    pipe_ = S_ISFIFO(st.st_mode);
+    zero_copy_ = zero_copy;
+    written_ = 0;
+    spliced_ = 0;
+    if (pipe_) {
+        log_info("Writing to a pipe of %zu bytes", GrowPipe(fd, pipe_size));
+    }
+    return true;
+}
+
+void PipeSink::Close() {
+    if (fd_ < 0) return;
+    // The reader still maps the spliced pages until it has read them, freeing them earlier could hand it whatever
+    // reuses the memory.
+    while (!held_.empty()) {
+        ReleaseConsumed();
+        if (held_.empty()) break;
+        struct pollfd pfd = {fd_, 0, 0};
+        if (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLERR)) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    for (HeldBuffer& held : held_) {
+        av_buffer_unref(&held.buf);
+    }
+    held_.clear();
+    if (written_ > 0) {
+        log_info("Wrote %" PRIu64 " bytes, %" PRIu64 " of them spliced", written_, spliced_);
+    }
+    fd_ = -1;
+}
+
+// For an fd someone else put in non-blocking mode.
+bool PipeSink::WaitWritable() {
+    struct pollfd pfd = {fd_, POLLOUT, 0};
+    return poll(&pfd, 1, -1) > 0 && !(pfd.revents & (POLLERR | POLLHUP));
+}
+
+bool PipeSink::Write(const uint8_t* data, size_t size) {
+    if (fd_ < 0) return false;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd_, data + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN && WaitWritable()) continue;
+            log_error("Write to the output failed: %s", strerror(errno));
+            return false;
+        }
+        done += n;
+    }
+    written_ += size;
+    return true;
+}
+
+bool PipeSink::Splice(AVBufferRef* buf, const uint8_t* data, size_t size) {
+    if (fd_ < 0) return false;
+    AVBufferRef* held = pipe_ && zero_copy_ && buf != nullptr ? av_buffer_ref(buf) : nullptr;
+    if (held == nullptr) return Write(data, size);
+
+    struct iovec iov = {(void*)data, size};
+    while (iov.iov_len > 0) {
+        ssize_t n = vmsplice(fd_, &iov, 1, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN && WaitWritable()) continue;
+            log_error("vmsplice to the output pipe failed: %s", strerror(errno));
+            // Whatever went in may still be read, keep the buffer for Close.
+            written_ += size - iov.iov_len;
+            held_.push_back({held, written_});
+            return false;
+        }
+        iov.iov_base = (uint8_t*)iov.iov_base + n;
+        iov.iov_len -= n;
+    }
+    written_ += size;
+    spliced_ += size;
+    held_.push_back({held, written_});
+    ReleaseConsumed();
+    return true;
+}
+
+void PipeSink::ReleaseConsumed() {
+    int queued = 0;
+    if (ioctl(fd_, FIONREAD, &queued) != 0) return;
+    uint64_t consumed = written_ - queued;
+    while (!held_.empty() && held_.front().end <= consumed) {
+        av_buffer_unref(&held_.front().buf);
+        held_.pop_front();
+    }
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+int PipeSink::AvioWrite(void* opaque, const uint8_t* buf, int size) {
+#else
+int PipeSink::AvioWrite(void* opaque, uint8_t* buf, int size) {
+#endif
+    PipeSink* sink = reinterpret_cast<PipeSink*>(opaque);
+    return sink->Write(buf, size) ? size : AVERROR(EIO);
+}
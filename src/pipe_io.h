@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/buffer.h>
+}
+
+// Grows the pipe behind |fd| towards |size|, as far as /proc/sys/fs/pipe-max-size and the user's pipe quota allow.
+// Returns the pipe's size afterwards, 0 when |fd| is not a pipe.
+size_t GrowPipe(int fd, size_t size);
+
+// Byte stream out to a pipe, for chaining processes through stdout. Everything is written by default. With zero_copy,
+// data whose buffer is reference counted goes into the pipe with vmsplice instead: the pipe takes the pages themselves
+// rather than a copy of them. Each such buffer is kept referenced until the reader has taken its bytes (FIONREAD says
+// how much is still queued) and is reused after that, so the reader must read() the pipe. One that splices or tees
+// the pages onward still refers to them once they have left the pipe and would see them overwritten. Anything else is
+// written, and so is everything when the fd is a file or a socket.
+class PipeSink {
+public:
+    // |fd| stays the caller's. Moves the logs to stderr when it is stdout.
+    bool Open(int fd, size_t pipe_size, bool zero_copy = false);
+    // Waits until the reader has drained the spliced bytes (or gone away), then lets go of their buffers.
+    void Close();
+    bool IsOpen() const { return fd_ >= 0; }
+
+    bool Write(const uint8_t* data, size_t size);
+    // [data, data + size) must lie in |buf|, which may be nullptr to copy.
+    bool Splice(AVBufferRef* buf, const uint8_t* data, size_t size);
+
+    // For avio_alloc_context with the sink as opaque. The AVIO buffer is reused right away, so this copies.
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+    static int AvioWrite(void* opaque, const uint8_t* buf, int size);
+#else
+    static int AvioWrite(void* opaque, uint8_t* buf, int size);
+#endif
+
+    PipeSink() {}
+    ~PipeSink() { Close(); }
+
+    PipeSink(const PipeSink&) = delete;
+    PipeSink& operator=(const PipeSink&) = delete;
+
+private:
+    struct HeldBuffer {
+        AVBufferRef* buf;
+        // written_ once its last byte was in the pipe.
+        uint64_t end;
+    };
+
+    int fd_ = -1;
+    bool pipe_ = false;
+    bool zero_copy_ = false;
+    uint64_t written_ = 0;
+    uint64_t spliced_ = 0;
+    std::deque<HeldBuffer> held_;
+
+    bool WaitWritable();
+    void ReleaseConsumed();
+};
@@ -0,0 +1,248 @@
+#include "pipeline.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "logger.h"
+
+Pipeline::Pipeline(WorkStealingPool* pool) : pool_(pool), failed_(false) {}
+
+Pipeline::~Pipeline() {
+    if (started_) {
+        Cancel();
+        Wait();
+    }
+    for (Edge* edge : edges_) {
+        for (AVFrame* frame : edge->frames) {
+            av_frame_free(&frame);
+        }
+        delete edge;
+    }
+    for (Node* node : nodes_) {
+        delete node;
+    }
+}
+
+int Pipeline::AddNode(Node* node) {
+    std::unique_lock<std::mutex> lock(mux_);
+    if (started_) {
+        log_error("Pipeline already started, can not add nodes");
+        delete node;
+        return -1;
+    }
+    nodes_.push_back(node);
+    return nodes_.size() - 1;
+}
+
+int Pipeline::AddSource(MediaDecoder* decoder) {
+    if (decoder == nullptr) return -1;
+    Node* node = new Node();
+    node->type = NODE_SOURCE;
+    node->decoder = decoder;
+    return AddNode(node);
+}
+
+int Pipeline::AddTransform(PipelineTransform transform, int max_parallel) {
+    if (!transform) return -1;
+    Node* node = new Node();
+    node->type = NODE_TRANSFORM;
+    node->transform = transform;
+    node->max_parallel = std::max(1, max_parallel);
+    return AddNode(node);
+}
+
+int Pipeline::AddSink(MediaRecorder* recorder) {
+    if (recorder == nullptr) return -1;
+    Node* node = new Node();
+    node->type = NODE_SINK;
+    node->recorder = recorder;
+    return AddNode(node);
+}
+
+bool Pipeline::Connect(int from, int to, int queue_size) {
+    std::unique_lock<std::mutex> lock(mux_);
+    if (started_ || from < 0 || to < 0 || from >= (int)nodes_.size() || to >= (int)nodes_.size() || from == to) {
+        log_error("Invalid pipeline connection %d -> %d", from, to);
+        return false;
+    }
+    Node* producer = nodes_[from];
+    Node* consumer = nodes_[to];
+    if (producer->type == NODE_SINK || consumer->type == NODE_SOURCE || consumer->input != nullptr) {
+        log_error("Node %d can not feed node %d", from, to);
+        return false;
+    }
+    Edge* edge = new Edge();
+    edge->from = producer;
+    edge->to = consumer;
+    edge->capacity = std::max(1, queue_size);
+    producer->outputs.push_back(edge);
+    consumer->input = edge;
+    edges_.push_back(edge);
+    return true;
+}
+
+bool Pipeline::Start() {
+    std::unique_lock<std::mutex> lock(mux_);
+    if (started_) return false;
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+        Node* node = nodes_[i];
+        if (node->type != NODE_SOURCE && node->input == nullptr) {
+            log_error("Pipeline node %zu has no input", i);
+            return false;
+        }
+        if (node->type != NODE_SINK && node->outputs.empty()) {
+            log_error("Pipeline node %zu has no output", i);
+            return false;
+        }
+    }
+    started_ = true;
+    unfinished_nodes_ = nodes_.size();
+    for (Node* node : nodes_) {
+        if (node->type == NODE_SOURCE) Schedule(node);
+    }
+    return true;
+}
+
+bool Pipeline::Wait() {
+    std::unique_lock<std::mutex> lock(mux_);
+    done_cond_.wait(lock, [&]() { return unfinished_nodes_ == 0; });
+    return !failed_.load();
+}
+
+void Pipeline::Cancel() {
+    std::unique_lock<std::mutex> lock(mux_);
+    cancelled_ = true;
+    if (!started_) return;
+    for (Node* node : nodes_) {
+        if (node->type == NODE_SOURCE) Schedule(node);
+    }
+}
+
+// Launches as many tasks for the node as its input, the room left downstream and its parallelism allow. Called with
+// mux_ held whenever one of these may have changed.
+void Pipeline::Schedule(Node* node) {
+    if (node->finished) return;
+    bool took_input = false;
+    while (node->running < node->max_parallel) {
+        if (node->type == NODE_SOURCE) {
+            if (cancelled_) node->input_done = true;
+            if (node->input_done) break;
+        } else if (node->input->frames.empty()) {
+            if (node->input->closed) node->input_done = true;
+            break;
+        }
+
+        bool has_room = true;
+        for (Edge* edge : node->outputs) {
+            if (edge->reserved + edge->frames.size() >= edge->capacity) has_room = false;
+        }
+        if (!has_room) break;
+        for (Edge* edge : node->outputs) {
+            edge->reserved++;
+        }
+
+        AVFrame* frame = nullptr;
+        if (node->type != NODE_SOURCE) {
+            frame = node->input->frames.front();
+            node->input->frames.pop_front();
+            took_input = true;
+        }
+        int64_t seq = node->next_input_seq++;
+        node->running++;
+        pool_->Submit([this, node, seq, frame]() { RunTask(node, seq, frame); });
+    }
+    // Room was freed upstream.
+    if (took_input) Schedule(node->input->from);
+    CheckFinished(node);
+}
+
+static const uint8_t* PackedRGB(AVFrame* frame, std::vector<uint8_t>& packed) {
+    int row_size = frame->width * 3;
+    if (frame->linesize[0] == row_size) return frame->data[0];
+    packed.resize(row_size * frame->height);
+    for (int y = 0; y < frame->height; ++y) {
+        memcpy(packed.data() + y * row_size, frame->data[0] + y * frame->linesize[0], row_size);
+    }
+    return packed.data();
+}
+
+void Pipeline::RunTask(Node* node, int64_t seq, AVFrame* frame) {
+    bool source_end = false;
+    bool sink_failed = false;
+    AVFrame* out = nullptr;
+
+    switch (node->type) {
+        case NODE_SOURCE:
+            if (!node->decoder->InitFrame(&out) || !node->decoder->ReadFrame(out)) {
+                av_frame_free(&out);
+                source_end = true;
+            }
+            break;
+        case NODE_TRANSFORM:
+            // The frame may be shared with the other consumers of a node that feeds several.
+            if (node->input->from->outputs.size() > 1 && av_frame_make_writable(frame) < 0) {
+                log_error("Could not make frame writable, frame dropped");
+                av_frame_free(&frame);
+                break;
+            }
+            out = node->transform(frame);
+            if (out != frame) av_frame_free(&frame);
+            break;
+        case NODE_SINK:
+            if (!failed_.load()) {
+                const uint8_t* data = PackedRGB(frame, node->packed);
+                if (!node->recorder->SendVideoFrameBlock((void*)data, frame->width * frame->height * 3)) {
+                    log_error("Pipeline sink failed to send a frame");
+                    sink_failed = true;
+                }
+            }
+            av_frame_free(&frame);
+            break;
+    }
+
+    std::unique_lock<std::mutex> lock(mux_);
+    node->running--;
+    if (source_end) node->input_done = true;
+    if (sink_failed) {
+        // Set before the sink's next task is launched, it drops what is still queued.
+        failed_ = true;
+        cancelled_ = true;
+        for (Node* n : nodes_) {
+            if (n->type == NODE_SOURCE) Schedule(n);
+        }
+    }
+    if (!node->outputs.empty()) {
+        node->reorder[seq] = out;
+        Flush(node);
+    }
+    Schedule(node);
+    for (Edge* edge : node->outputs) {
+        Schedule(edge->to);
+    }
+}
+
+// Moves finished frames downstream in input order, each output edge gets its own reference.
+void Pipeline::Flush(Node* node) {
+    while (!node->reorder.empty() && node->reorder.begin()->first == node->next_output_seq) {
+        AVFrame* frame = node->reorder.begin()->second;
+        node->reorder.erase(node->reorder.begin());
+        node->next_output_seq++;
+        for (size_t i = 0; i < node->outputs.size(); ++i) {
+            Edge* edge = node->outputs[i];
+            edge->reserved--;
+            if (frame == nullptr) continue;
+            AVFrame* ref = i + 1 == node->outputs.size() ? frame : av_frame_clone(frame);
+            if (ref != nullptr) edge->frames.push_back(ref);
+        }
+    }
+}
+
+void Pipeline::CheckFinished(Node* node) {
+    if (node->finished || !node->input_done || node->running > 0 || !node->reorder.empty()) return;
+    node->finished = true;
+    for (Edge* edge : node->outputs) {
+        edge->closed = true;
+        Schedule(edge->to);
+    }
+    if (--unfinished_nodes_ == 0) done_cond_.notify_all();
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "media_decoder_common.h"
+#include "media_decoder_interface.h"
+#include "media_recorder_common.h"
+#include "media_recorder_interface.h"
+#include "work_stealing_pool.h"
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// Returns the frame to pass on: the input itself when it was changed in place, a new frame (the input is freed then),
+// or nullptr to drop the frame. Frames are RGB24 as they come out of MediaDecoder::ReadFrame.
+typedef std::function<AVFrame*(AVFrame* frame)> PipelineTransform;
+
+// Graph of sources (MediaDecoder), transforms and sinks (MediaRecorder) connected by bounded queues. Nodes run as
+// tasks on a shared WorkStealingPool, one frame per task, so any number of pipelines share a fixed set of threads.
+// Transforms that keep no state between frames may work on several frames at once; their output is put back in order
+// before it reaches the next node.
+//
+// Start decoders and recorders with worker_thread = false so decoding and encoding run on the pool as well.
+class Pipeline {
+public:
+    // Sources and sinks must be started already, the pipeline neither stops nor deletes them. Return the node id.
+    int AddSource(MediaDecoder* decoder);
+    // max_parallel above 1 is only safe for transforms without state between frames.
+    int AddTransform(PipelineTransform transform, int max_parallel = 1);
+    int AddSink(MediaRecorder* recorder);
+    // queue_size bounds the frames queued or in flight from one node to the next. A node can feed several nodes, each
+    // gets its own reference to the frame, but reads from one input only.
+    bool Connect(int from, int to, int queue_size = 4);
+
+    bool Start();
+    // Blocks until every source ran dry and every sink consumed its frames. Returns false if a sink failed. Must not
+    // be called from a pool thread.
+    bool Wait();
+    // Stops pulling from the sources, frames already read still reach the sinks.
+    void Cancel();
+
+    explicit Pipeline(WorkStealingPool* pool = WorkStealingPool::Shared());
+    // Cancels and waits if still running.
+    ~Pipeline();
+
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+private:
+    enum NodeType { NODE_SOURCE, NODE_TRANSFORM, NODE_SINK };
+
+    struct Node;
+
+    struct Edge {
+        Node* from;
+        Node* to;
+        size_t capacity;
+        // Slots held by frames the producer is still working on, so its output never overflows the queue.
+        size_t reserved = 0;
+        std::deque<AVFrame*> frames;
+        bool closed = false;
+    };
+
+    struct Node {
+        NodeType type;
+        MediaDecoder* decoder = nullptr;
+        MediaRecorder* recorder = nullptr;
+        PipelineTransform transform;
+        int max_parallel = 1;
+
+        Edge* input = nullptr;
+        std::vector<Edge*> outputs;
+
+        int running = 0;
+        bool input_done = false;
+        bool finished = false;
+        int64_t next_input_seq = 0;
+        int64_t next_output_seq = 0;
+        // Finished frames waiting for the ones before them, nullptr for dropped frames.
+        std::map<int64_t, AVFrame*> reorder;
+        // Sink only, rows of a padded frame packed for the recorder.
+        std::vector<uint8_t> packed;
+    };
+
+    WorkStealingPool* pool_;
+
+    // Guards the graph state, frames are processed outside of it.
+    std::mutex mux_;
+    std::condition_variable done_cond_;
+    std::vector<Node*> nodes_;
+    std::vector<Edge*> edges_;
+    bool started_ = false;
+    bool cancelled_ = false;
+    std::atomic<bool> failed_;
+    int unfinished_nodes_ = 0;
+
+    int AddNode(Node* node);
+    void Schedule(Node* node);
+    void RunTask(Node* node, int64_t seq, AVFrame* frame);
+    void Flush(Node* node);
+    void CheckFinished(Node* node);
+};
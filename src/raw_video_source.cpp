@@ -0,0 +1,174 @@
+#include "raw_video_source.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+#include "logger.h"
+
+RawVideoSource::~RawVideoSource() { Close(); }
+
+bool RawVideoSource::Open(const RawVideoSourceParam& param) {
+    Close();
+    int fd = open(param.filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("Could not open raw video file %s", param.filename.c_str());
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        log_error("Raw video file %s is empty", param.filename.c_str());
+        close(fd);
+        return false;
+    }
+    size_ = st.st_size;
+    void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file referenced.
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_error("Could not map raw video file %s", param.filename.c_str());
+        size_ = 0;
+        return false;
+    }
+    data_ = (uint8_t*)data;
+    madvise(data_, size_, MADV_RANDOM);
+
+    format_ = param.format;
+    width_ = param.width;
+    height_ = param.height;
+    fps_ = param.fps;
+    readahead_frames_ = std::max(0, param.readahead_frames);
+    if (size_ >= 10 && memcmp(data_, "YUV4MPEG2 ", 10) == 0) {
+        format_ = RAW_VIDEO_Y4M;
+    }
+
+    if (format_ == RAW_VIDEO_Y4M) {
+        if (!ParseY4M()) {
+            Close();
+            return false;
+        }
+    } else {
+        if (width_ <= 0 || height_ <= 0) {
+            log_error("Raw video file %s needs a size", param.filename.c_str());
+            Close();
+            return false;
+        }
+        frame_size_ = format_ == RAW_VIDEO_RGB24 ? width_ * height_ * 3
+                                                 : width_ * height_ + 2 * ((width_ + 1) / 2) * ((height_ + 1) / 2);
+        for (size_t offset = 0; offset + frame_size_ <= size_; offset += frame_size_) {
+            frame_offsets_.push_back(offset);
+        }
+        if (size_ % frame_size_ != 0) {
+            log_warn("Raw video file %s ends with a partial frame", param.filename.c_str());
+        }
+    }
+    log_info("Mapped %s: %d frames of %dx%d", param.filename.c_str(), FrameCount(), width_, height_);
+    return true;
+}
+
+// "YUV4MPEG2 W<w> H<h> F<num>:<den> ... C<colorspace>"
+bool ParseY4MHeader(const char* begin, const char* end, int* width, int* height, int* fps) {
+    if (end - begin < 9 || memcmp(begin, "YUV4MPEG2", 9) != 0) {
+        log_error("Not a Y4M stream");
+        return false;
+    }
+    int fps_num = 0;
+    int fps_den = 1;
+    *width = 0;
+    *height = 0;
+    for (const char* p = begin + 9; p < end; ++p) {
+        if (*p != ' ' || p + 1 >= end) continue;
+        char tag = p[1];
+        const char* value = p + 2;
+        if (tag == 'W') {
+            *width = atoi(value);
+        } else if (tag == 'H') {
+            *height = atoi(value);
+        } else if (tag == 'F') {
+            fps_num = atoi(value);
+            const char* colon = (const char*)memchr(value, ':', end - value);
+            if (colon != nullptr) fps_den = std::max(1, atoi(colon + 1));
+        } else if (tag == 'C' &&
+                   (strncmp(value, "420", 3) != 0 || (value[3] == 'p' && isdigit((unsigned char)value[4])))) {
+            // 420, 420jpeg, 420mpeg2 and 420paldv only differ in chroma siting, 420p10 and up are not 8 bit.
+            log_error("Only 8 bit 4:2:0 Y4M files are supported");
+            return false;
+        }
+    }
+    if (*width <= 0 || *height <= 0) {
+        log_error("Y4M header without a size");
+        return false;
+    }
+    if (fps_num > 0) *fps = (fps_num + fps_den / 2) / fps_den;
+    return true;
+}
+
+// The header line followed by frames, each "FRAME[ params]\n" and the planes.
+bool RawVideoSource::ParseY4M() {
+    const char* begin = (const char*)data_;
+    const char* end = begin + size_;
+    const char* header_end = (const char*)memchr(begin, '\n', size_);
+    if (header_end == nullptr) {
+        log_error("Truncated Y4M header");
+        return false;
+    }
+    if (!ParseY4MHeader(begin, header_end, &width_, &height_, &fps_)) return false;
+    frame_size_ = width_ * height_ + 2 * ((width_ + 1) / 2) * ((height_ + 1) / 2);
+
+    // Frame headers may carry parameters, so walk them rather than assume a fixed stride.
+    const char* p = header_end + 1;
+    while (end - p > 5 && memcmp(p, "FRAME", 5) == 0) {
+        const char* line_end = (const char*)memchr(p, '\n', end - p);
+        if (line_end == nullptr || end - (line_end + 1) < frame_size_) break;
+        frame_offsets_.push_back(line_end + 1 - begin);
+        p = line_end + 1 + frame_size_;
+    }
+    if (p != end) {
+        log_warn("Y4M file ends with %ld bytes that are not a whole frame", (long)(end - p));
+    }
+    return true;
+}
+
+void RawVideoSource::Prefetch(int index) {
+    bool backwards = index < last_index_;
+    last_index_ = index;
+    if (readahead_frames_ == 0) return;
+    // Issue the next window once the reader gets halfway into the current one.
+    int margin = readahead_frames_ / 2;
+    bool inside = index >= prefetched_begin_ && index < prefetched_end_;
+    if (inside && (backwards ? index - margin >= prefetched_begin_ : index + margin < prefetched_end_)) return;
+
+    int first = backwards ? std::max(0, index - readahead_frames_) : index;
+    int last = backwards ? index + 1 : std::min(FrameCount(), index + readahead_frames_ + 1);
+    prefetched_begin_ = first;
+    prefetched_end_ = last;
+
+    long page = sysconf(_SC_PAGESIZE);
+    size_t from = frame_offsets_[first] & ~(size_t)(page - 1);
+    size_t to = std::min(size_, frame_offsets_[last - 1] + frame_size_);
+    madvise(data_ + from, to - from, MADV_WILLNEED);
+}
+
+const uint8_t* RawVideoSource::Frame(int index) {
+    if (index < 0 || index >= FrameCount()) return nullptr;
+    Prefetch(index);
+    return data_ + frame_offsets_[index];
+}
+
+void RawVideoSource::Close() {
+    if (data_ != nullptr) {
+        munmap(data_, size_);
+        data_ = nullptr;
+    }
+    size_ = 0;
+    frame_offsets_.clear();
+    last_index_ = -1;
+    prefetched_begin_ = 0;
+    prefetched_end_ = 0;
+}
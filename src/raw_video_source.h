@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum RawVideoFormat {
+    RAW_VIDEO_RGB24 = 0,  // packed R, G, B
+    RAW_VIDEO_I420,       // Y, U and V planes back to back
+    RAW_VIDEO_Y4M,        // YUV4MPEG2 with 4:2:0 frames, size and rate come from its header
+};
+
+struct RawVideoSourceParam {
+    std::string filename;
+    RawVideoFormat format = RAW_VIDEO_RGB24;
+    // Ignored for Y4M.
+    int width = 0;
+    int height = 0;
+    int fps = 30;
+    // Frames prefetched ahead of the read position, in whichever direction reads are going.
+    int readahead_frames = 8;
+};
+
+// Parses a "YUV4MPEG2 ..." stream header, [begin, end) without the newline. Only 8 bit 4:2:0 is accepted. |fps| is
+// left alone when the header has no rate.
+bool ParseY4MHeader(const char* begin, const char* end, int* width, int* height, int* fps);
+
+// Raw video file mapped into memory. Frames are pointers into the mapping, valid until Close, and can go straight
+// to MediaRecorder::SendVideoFrame (with the matching RecorderInputFormat) without being read into a buffer first.
+//
+// The kernel's own readahead only goes forwards, so it is switched off for the mapping and the source prefetches the
+// next readahead_frames frames itself, backwards as well when the frame indices go down.
+class RawVideoSource {
+public:
+    bool Open(const RawVideoSourceParam& param);
+    void Close();
+
+    int FrameCount() const { return (int)frame_offsets_.size(); }
+    // nullptr when out of range.
+    const uint8_t* Frame(int index);
+
+    int Width() const { return width_; }
+    int Height() const { return height_; }
+    int Fps() const { return fps_; }
+    // RGB24 for RGB24 files, I420 for I420 and Y4M ones.
+    RawVideoFormat PixelFormat() const { return format_ == RAW_VIDEO_RGB24 ? RAW_VIDEO_RGB24 : RAW_VIDEO_I420; }
+    int FrameSize() const { return frame_size_; }
+
+    RawVideoSource() {}
+    ~RawVideoSource();
+
+    RawVideoSource(const RawVideoSource&) = delete;
+    RawVideoSource& operator=(const RawVideoSource&) = delete;
+
+private:
+    RawVideoFormat format_ = RAW_VIDEO_RGB24;
+    int width_ = 0;
+    int height_ = 0;
+    int fps_ = 0;
+    int frame_size_ = 0;
+    int readahead_frames_ = 0;
+
+    uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    std::vector<size_t> frame_offsets_;
+
+    // Last frame handed out, and the range already prefetched around it.
+    int last_index_ = -1;
+    int prefetched_begin_ = 0;
+    int prefetched_end_ = 0;
+
+    bool ParseY4M();
+    void Prefetch(int index);
+};
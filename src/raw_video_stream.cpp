@@ -0,0 +1,156 @@
+#include "raw_video_stream.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "logger.h"
+#include "pipe_io.h"
+
+bool RawVideoStream::Open(const RawVideoStreamParam& param) {
+    Close();
+    if (param.filename == "-") {
+        fd_ = STDIN_FILENO;
+        owns_fd_ = false;
+    } else {
+        fd_ = open(param.filename.c_str(), O_RDONLY | O_CLOEXEC);
+        owns_fd_ = true;
+        if (fd_ < 0) {
+            log_error("Could not open raw video stream %s", param.filename.c_str());
+            return false;
+        }
+    }
+    size_t pipe_size = GrowPipe(fd_, param.pipe_size);
+    staging_.resize(staging_size_);
+    staging_pos_ = 0;
+    staging_end_ = 0;
+    frames_read_ = 0;
+
+    format_ = param.format;
+    width_ = param.width;
+    height_ = param.height;
+    fps_ = param.fps;
+    // Peek at the first bytes for a Y4M signature without consuming them.
+    while (staging_end_ < 10 && FillStaging()) {
+    }
+    if (staging_end_ >= 10 && memcmp(staging_.data(), "YUV4MPEG2 ", 10) == 0) {
+        format_ = RAW_VIDEO_Y4M;
+    } else if (format_ == RAW_VIDEO_Y4M) {
+        log_error("%s does not start with a Y4M header", param.filename.c_str());
+        Close();
+        return false;
+    }
+
+    if (format_ == RAW_VIDEO_Y4M) {
+        std::string header;
+        if (!ReadLine(&header) || !ParseY4MHeader(header.data(), header.data() + header.size(), &width_, &height_,
+                                                  &fps_)) {
+            Close();
+            return false;
+        }
+    } else if (width_ <= 0 || height_ <= 0) {
+        log_error("Raw video stream %s needs a size", param.filename.c_str());
+        Close();
+        return false;
+    }
+    frame_size_ = format_ == RAW_VIDEO_RGB24 ? width_ * height_ * 3
+                                             : width_ * height_ + 2 * ((width_ + 1) / 2) * ((height_ + 1) / 2);
+    frame_.resize(frame_size_);
+    log_info("Streaming %s: %dx%d at %d fps, pipe of %zu bytes", param.filename.c_str(), width_, height_, fps_,
+             pipe_size);
+    return true;
+}
+
+void RawVideoStream::Close() {
+    if (owns_fd_ && fd_ >= 0) {
+        close(fd_);
+    }
+    fd_ = -1;
+    owns_fd_ = false;
+    frame_.clear();
+    frame_.shrink_to_fit();
+    staging_pos_ = 0;
+    staging_end_ = 0;
+}
+
+const uint8_t* RawVideoStream::ReadFrame() {
+    if (fd_ < 0) return nullptr;
+    if (format_ == RAW_VIDEO_Y4M) {
+        std::string line;
+        if (!ReadLine(&line)) return nullptr;
+        if (line.compare(0, 5, "FRAME") != 0) {
+            log_error("Expected a Y4M frame header after %ld frames", (long)frames_read_);
+            return nullptr;
+        }
+    }
+    if (!ReadExactly(frame_.data(), frame_size_)) return nullptr;
+    ++frames_read_;
+    return frame_.data();
+}
+
+long RawVideoStream::ReadSome(uint8_t* dst, size_t size) {
+    while (true) {
+        ssize_t n = read(fd_, dst, size);
+        if (n >= 0) return n;
+        if (errno == EINTR) continue;
+        log_error("Read from the raw video stream failed: %s", strerror(errno));
+        return -1;
+    }
+}
+
+// Appends whatever one read returns. False at the end of the stream or when staging is full.
+bool RawVideoStream::FillStaging() {
+    if (staging_pos_ == staging_end_) {
+        staging_pos_ = 0;
+        staging_end_ = 0;
+    }
+    if (staging_end_ == staging_.size()) return false;
+    long n = ReadSome(staging_.data() + staging_end_, staging_.size() - staging_end_);
+    if (n <= 0) return false;
+    staging_end_ += n;
+    return true;
+}
+
+bool RawVideoStream::ReadLine(std::string* line) {
+    line->clear();
+    while (true) {
+        const uint8_t* begin = staging_.data() + staging_pos_;
+        const uint8_t* newline = (const uint8_t*)memchr(begin, '\n', staging_end_ - staging_pos_);
+        if (newline != nullptr) {
+            line->append((const char*)begin, newline - begin);
+            staging_pos_ += newline - begin + 1;
+            return true;
+        }
+        line->append((const char*)begin, staging_end_ - staging_pos_);
+        staging_pos_ = staging_end_;
+        if (line->size() > max_header_line_) {
+            log_error("Y4M header line longer than %zu bytes", max_header_line_);
+            return false;
+        }
+        if (!FillStaging()) {
+            if (!line->empty()) log_warn("Y4M stream ends inside a header");
+            return false;
+        }
+    }
+}
+
+// Takes what staging holds first and reads the rest straight into |dst|, in as few reads as the pipe allows.
+bool RawVideoStream::ReadExactly(uint8_t* dst, size_t size) {
+    size_t done = std::min(size, staging_end_ - staging_pos_);
+    memcpy(dst, staging_.data() + staging_pos_, done);
+    staging_pos_ += done;
+    while (done < size) {
+        long n = ReadSome(dst + done, size - done);
+        if (n <= 0) {
+            if (n == 0 && done > 0) {
+                log_warn("Raw video stream ends with a partial frame of %zu bytes", done);
+            }
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
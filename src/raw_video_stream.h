@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "raw_video_source.h"
+
+struct RawVideoStreamParam {
+    // "-" for stdin. Anything that reads front to back works: a pipe, a FIFO, a socket or a file.
+    std::string filename = "-";
+    // A stream starting with a Y4M header is read as Y4M whatever this says.
+    RawVideoFormat format = RAW_VIDEO_Y4M;
+    // Ignored for Y4M.
+    int width = 0;
+    int height = 0;
+    int fps = 30;
+    // Asked for when the input is a pipe, capped by /proc/sys/fs/pipe-max-size. A frame or more lets the writer
+    // queue a whole frame without waiting for this side.
+    size_t pipe_size = 4 << 20;
+};
+
+// Raw or Y4M frames read one after the other from a pipe, for the streaming counterpart of RawVideoSource. Frame
+// payloads are read straight into the frame buffer, only headers go through a small staging buffer, so each byte is
+// copied once, out of the pipe.
+class RawVideoStream {
+public:
+    bool Open(const RawVideoStreamParam& param);
+    void Close();
+
+    // The next frame, valid until the next call. nullptr at the end of the stream, which a partial frame also ends.
+    const uint8_t* ReadFrame();
+    int64_t FramesRead() const { return frames_read_; }
+
+    int Width() const { return width_; }
+    int Height() const { return height_; }
+    int Fps() const { return fps_; }
+    // RGB24 for RGB24 streams, I420 for I420 and Y4M ones.
+    RawVideoFormat PixelFormat() const { return format_ == RAW_VIDEO_RGB24 ? RAW_VIDEO_RGB24 : RAW_VIDEO_I420; }
+    int FrameSize() const { return frame_size_; }
+
+    RawVideoStream() {}
+    ~RawVideoStream() { Close(); }
+
+    RawVideoStream(const RawVideoStream&) = delete;
+    RawVideoStream& operator=(const RawVideoStream&) = delete;
+
+private:
+    static const size_t staging_size_ = 64 * 1024;
+    static const size_t max_header_line_ = 4096;
+
+    int fd_ = -1;
+    bool owns_fd_ = false;
+    RawVideoFormat format_ = RAW_VIDEO_RGB24;
+    int width_ = 0;
+    int height_ = 0;
+    int fps_ = 0;
+    int frame_size_ = 0;
+    int64_t frames_read_ = 0;
+
+    std::vector<uint8_t> frame_;
+    // Bytes read ahead of what has been consumed, [staging_pos_, staging_end_).
+    std::vector<uint8_t> staging_;
+    size_t staging_pos_ = 0;
+    size_t staging_end_ = 0;
+
+    // Returns the bytes read, 0 at the end of the stream, -1 on error.
+    long ReadSome(uint8_t* dst, size_t size);
+    bool FillStaging();
+    bool ReadLine(std::string* line);
+    bool ReadExactly(uint8_t* dst, size_t size);
+};
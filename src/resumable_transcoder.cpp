@@ -0,0 +1,360 @@
+#include "resumable_transcoder.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+
+#include "clip_editor.h"
+#include "logger.h"
+#include "media_decoder_common.h"
+#include "media_decoder_interface.h"
+#include "media_recorder_common.h"
+#include "media_recorder_interface.h"
+#include "pipeline_metrics.h"
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+namespace {
+
+const char* const kCheckpointName = "checkpoint.txt";
+
+std::string SegmentPath(const std::string& resume_dir, int index) {
+    char name[64];
+    snprintf(name, sizeof(name), "/segment_%05d.mp4", index);
+    return resume_dir + name;
+}
+
+bool SyncDir(const std::string& dir) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// The segments of an earlier run cut back to what its checkpoint covers. False when one is shorter than that.
+bool TruncateSegments(const std::string& resume_dir, const std::vector<int64_t>& segment_bytes) {
+    for (size_t i = 0; i < segment_bytes.size(); ++i) {
+        std::string path = SegmentPath(resume_dir, (int)i);
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || st.st_size < segment_bytes[i]) {
+            log_warn("%s is missing or shorter than its checkpoint", path.c_str());
+            return false;
+        }
+        if (st.st_size > segment_bytes[i] && truncate(path.c_str(), segment_bytes[i]) != 0) {
+            log_error("Could not truncate %s: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+void RemoveSegments(const std::string& resume_dir, int segments) {
+    for (int i = 0; i < segments; ++i) {
+        unlink(SegmentPath(resume_dir, i).c_str());
+    }
+}
+
+// One run: decodes from the checkpoint on and appends a segment, checkpointing as keyframes go by.
+class TranscodeRun {
+public:
+    TranscodeRun(const ResumableTranscodeParam& param, const std::string& resume_dir, TranscodeCheckpoint& checkpoint,
+                 ResumableTranscodeResult& result)
+        : param_(param), resume_dir_(resume_dir), checkpoint_(checkpoint), result_(result) {}
+
+    bool Run();
+
+private:
+    const ResumableTranscodeParam& param_;
+    const std::string& resume_dir_;
+    TranscodeCheckpoint& checkpoint_;
+    ResumableTranscodeResult& result_;
+
+    int segment_ = 0;
+    // Read only to sync the segment, the recorder writes it.
+    int segment_fd_ = -1;
+    // Frames of earlier runs, and frames of this one between checkpoints.
+    int64_t base_frames_ = 0;
+    int64_t interval_frames_ = 1;
+    int64_t last_checkpoint_ = 0;
+
+    // Source pts of the frames sent to the recorder whose keyframe has not come by yet, by frame number in the
+    // segment.
+    std::deque<std::pair<int64_t, int64_t>> sent_pts_;
+
+    void OnFragment(int64_t frames, int64_t bytes);
+    bool Checkpoint(int64_t frames, int64_t bytes, int64_t next_pts_ms, bool complete);
+};
+
+bool TranscodeRun::Checkpoint(int64_t frames, int64_t bytes, int64_t next_pts_ms, bool complete) {
+    // The segment's bytes have to be on disk before a checkpoint points at them.
+    if (fdatasync(segment_fd_) != 0) {
+        log_error("Could not sync %s: %s", SegmentPath(resume_dir_, segment_).c_str(), strerror(errno));
+        return false;
+    }
+    TranscodeCheckpoint checkpoint = checkpoint_;
+    checkpoint.segment_bytes.resize(segment_ + 1);
+    checkpoint.segment_bytes[segment_] = bytes;
+    checkpoint.frames = base_frames_ + frames;
+    checkpoint.next_pts_ms = next_pts_ms;
+    checkpoint.complete = complete;
+    if (!checkpoint.Save(resume_dir_)) return false;
+    checkpoint_ = checkpoint;
+    result_.checkpoints++;
+    log_info("Checkpoint at frame %ld, %.1fMB in segment %d", (long)checkpoint.frames, bytes / 1e6, segment_);
+    return true;
+}
+
+// Called from within the Send call that got the keyframe out.
+void TranscodeRun::OnFragment(int64_t frames, int64_t bytes) {
+    while (!sent_pts_.empty() && sent_pts_.front().first < frames) {
+        sent_pts_.pop_front();
+    }
+    int64_t next_pts_ms = !sent_pts_.empty() && sent_pts_.front().first == frames ? sent_pts_.front().second : -1;
+    if (next_pts_ms < 0 || frames - last_checkpoint_ < interval_frames_) return;
+    // A failed checkpoint costs a longer redo, not the job.
+    if (Checkpoint(frames, bytes, next_pts_ms, false)) last_checkpoint_ = frames;
+}
+
+bool TranscodeRun::Run() {
+    bool resumed = checkpoint_.frames > 0;
+    MediaDecoder* dec = MediaDecoder::CreateVideoDecoder();
+    VideoDecoderStartParam dec_param;
+    dec_param.filename = param_.input_filename;
+    dec_param.decoder_threads = param_.decoder_threads;
+    dec_param.output_width = param_.output_width;
+    dec_param.output_height = param_.output_height;
+    if (resumed) dec_param.seek_seconds = (checkpoint_.next_pts_ms - checkpoint_.first_pts_ms) / 1000.0;
+    MediaDecoderStartRet dec_ret = dec->Start(&dec_param);
+    if (!dec_ret.success || dec_ret.fps <= 0) {
+        log_error("Could not start decoding %s", param_.input_filename.c_str());
+        dec->Stop();
+        delete dec;
+        return false;
+    }
+
+    segment_ = (int)checkpoint_.segment_bytes.size();
+    base_frames_ = checkpoint_.frames;
+    interval_frames_ = std::max<int64_t>(1, (int64_t)llround(param_.checkpoint_seconds * dec_ret.fps));
+    std::string segment_path = SegmentPath(resume_dir_, segment_);
+
+    MediaRecorder* recorder = MediaRecorder::CreateMP4VideoRecorder();
+    MP4VideoRecorderStartParam rec_param;
+    rec_param.width = dec_ret.width;
+    rec_param.height = dec_ret.height;
+    rec_param.fps = dec_ret.fps;
+    rec_param.gop_size = param_.gop_size;
+    rec_param.preset = param_.preset;
+    rec_param.encoder_threads = param_.encoder_threads;
+    rec_param.filename = segment_path;
+    rec_param.container = RECORDER_CONTAINER_FRAGMENTED_MP4;
+    rec_param.on_fragment = [this](int64_t frames, int64_t bytes) { OnFragment(frames, bytes); };
+    // Encodes and muxes in the Send calls, so checkpoints are taken on this thread and write errors come back here
+    // instead of stopping a worker thread.
+    rec_param.worker_thread = false;
+    if (!recorder->Start(&rec_param)) {
+        delete recorder;
+        dec->Stop();
+        delete dec;
+        return false;
+    }
+    segment_fd_ = open(segment_path.c_str(), O_RDONLY | O_CLOEXEC);
+    bool ok = segment_fd_ >= 0;
+    if (!ok) log_error("Could not open %s: %s", segment_path.c_str(), strerror(errno));
+    int64_t resume_pts_ms = checkpoint_.next_pts_ms;
+    if (resumed) {
+        log_info("Resuming %s at frame %ld, %.3fs", param_.input_filename.c_str(), (long)checkpoint_.frames,
+                 resume_pts_ms / 1000.0);
+    }
+
+    AVFrame* frame = nullptr;
+    std::vector<uint8_t> packed;
+    int64_t sent = 0;
+    int64_t last_pts_ms = 0;
+    ok = ok && dec->InitFrame(&frame);
+    while (ok && dec->ReadFrame(frame)) {
+        // The decoder starts at the source keyframe before the checkpoint.
+        if (resumed && frame->pts < resume_pts_ms) continue;
+        if (!resumed && sent == 0) checkpoint_.first_pts_ms = frame->pts;
+        sent_pts_.push_back(std::make_pair(sent, (int64_t)frame->pts));
+        const uint8_t* data = frame->data[0];
+        int row_size = frame->width * 3;
+        if (frame->linesize[0] != row_size) {
+            packed.resize((size_t)row_size * frame->height);
+            for (int y = 0; y < frame->height; ++y) {
+                memcpy(packed.data() + (size_t)y * row_size, frame->data[0] + (size_t)y * frame->linesize[0], row_size);
+            }
+            data = packed.data();
+        }
+        ok = recorder->SendVideoFrameBlock((void*)data, row_size * frame->height);
+        last_pts_ms = frame->pts;
+        ++sent;
+    }
+    av_frame_free(&frame);
+    dec->Stop();
+    delete dec;
+
+    recorder->Stop();
+    PipelineMetricsSnapshot metrics = recorder->GetMetrics();
+    delete recorder;
+    if (ok && (int64_t)metrics.frames_out < sent) {
+        log_error("%s: %" PRIu64 " of %" PRId64 " frames written", segment_path.c_str(), metrics.frames_out, sent);
+        ok = false;
+    }
+    result_.encoded_frames = sent;
+
+    // The whole segment is final now, the job only has the joining left. A run resumed at the very end has no frames
+    // in it, just a header.
+    struct stat st;
+    if (ok && fstat(segment_fd_, &st) != 0) ok = false;
+    ok = ok && Checkpoint(sent, sent > 0 ? st.st_size : 0, last_pts_ms + 1, true);
+    if (segment_fd_ >= 0) close(segment_fd_);
+    segment_fd_ = -1;
+    return ok;
+}
+
+}  // namespace
+
+bool TranscodeCheckpoint::Save(const std::string& resume_dir) const {
+    // Written aside, synced and renamed, so a crash leaves the old checkpoint or the new one.
+    std::string path = resume_dir + "/" + kCheckpointName;
+    std::string tmp_path = path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "w");
+    if (file == nullptr) {
+        log_error("Could not open %s: %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+    fprintf(file, "input %s\n", input_filename.c_str());
+    fprintf(file, "size %d %d\n", output_width, output_height);
+    fprintf(file, "gop %d\n", gop_size);
+    fprintf(file, "preset %s\n", preset.c_str());
+    for (int64_t bytes : segment_bytes) {
+        fprintf(file, "segment %lld\n", (long long)bytes);
+    }
+    fprintf(file, "position %lld %lld %lld\n", (long long)frames, (long long)next_pts_ms, (long long)first_pts_ms);
+    if (complete) fprintf(file, "complete\n");
+    bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        log_error("Could not write %s: %s", path.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    SyncDir(resume_dir);
+    return true;
+}
+
+bool TranscodeCheckpoint::Load(const std::string& resume_dir) {
+    std::string path = resume_dir + "/" + kCheckpointName;
+    FILE* file = fopen(path.c_str(), "r");
+    if (file == nullptr) return false;
+    *this = TranscodeCheckpoint();
+    char line[4096];
+    bool ok = true;
+    bool positioned = false;
+    while (ok && fgets(line, sizeof(line), file) != nullptr) {
+        line[strcspn(line, "\n")] = '\0';
+        long long a, b, c;
+        if (strncmp(line, "input ", 6) == 0) {
+            input_filename = line + 6;
+        } else if (strncmp(line, "preset", 6) == 0) {
+            preset = line[6] == ' ' ? line + 7 : "";
+        } else if (sscanf(line, "segment %lld", &a) == 1) {
+            segment_bytes.push_back(a);
+        } else if (sscanf(line, "position %lld %lld %lld", &a, &b, &c) == 3) {
+            frames = a;
+            next_pts_ms = b;
+            first_pts_ms = c;
+            positioned = true;
+        } else if (strcmp(line, "complete") == 0) {
+            complete = true;
+        } else {
+            ok = sscanf(line, "size %d %d", &output_width, &output_height) == 2 ||
+                 sscanf(line, "gop %d", &gop_size) == 1;
+        }
+    }
+    fclose(file);
+    if (!ok || !positioned || segment_bytes.empty()) {
+        log_warn("%s is damaged, starting over", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool TranscodeCheckpoint::SameJob(const TranscodeCheckpoint& other) const {
+    return input_filename == other.input_filename && output_width == other.output_width &&
+           output_height == other.output_height && gop_size == other.gop_size && preset == other.preset;
+}
+
+ResumableTranscodeResult ResumableTranscoder::Run(const ResumableTranscodeParam& param) {
+    ResumableTranscodeResult result;
+    auto begin = std::chrono::steady_clock::now();
+    std::string resume_dir = param.resume_dir.empty() ? param.output_filename + ".resume" : param.resume_dir;
+    if (mkdir(resume_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        log_error("Could not create %s: %s", resume_dir.c_str(), strerror(errno));
+        return result;
+    }
+
+    TranscodeCheckpoint job;
+    job.input_filename = param.input_filename;
+    job.output_width = param.output_width;
+    job.output_height = param.output_height;
+    job.gop_size = param.gop_size;
+    job.preset = param.preset;
+    TranscodeCheckpoint checkpoint;
+    bool loaded = checkpoint.Load(resume_dir);
+    if (loaded && !checkpoint.SameJob(job)) {
+        log_warn("The checkpoint in %s is for another job, starting over", resume_dir.c_str());
+        loaded = false;
+    }
+    if (loaded) loaded = TruncateSegments(resume_dir, checkpoint.segment_bytes);
+    if (!loaded) {
+        RemoveSegments(resume_dir, (int)checkpoint.segment_bytes.size());
+        checkpoint = job;
+    }
+    result.resumed_frames = checkpoint.frames;
+
+    bool ok = true;
+    if (!checkpoint.complete) {
+        TranscodeRun run(param, resume_dir, checkpoint, result);
+        ok = run.Run();
+    }
+
+    int segments = (int)checkpoint.segment_bytes.size();
+    if (ok) {
+        ClipConcatParam concat;
+        concat.output_filename = param.output_filename;
+        concat.encoder_threads = param.encoder_threads;
+        for (int i = 0; i < segments; ++i) {
+            // A run that died before its first checkpoint, or resumed at the very end, has nothing in its segment.
+            if (checkpoint.segment_bytes[i] == 0) continue;
+            ClipSegment segment;
+            segment.filename = SegmentPath(resume_dir, i);
+            concat.segments.push_back(segment);
+        }
+        ok = ClipEditor::Concat(concat).success;
+    }
+    if (ok) {
+        RemoveSegments(resume_dir, segments);
+        unlink((resume_dir + "/" + kCheckpointName).c_str());
+        rmdir(resume_dir.c_str());
+    }
+
+    result.success = ok;
+    result.elapsed_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    log_info("%s: %ld frames resumed from the checkpoint, %ld encoded, %d checkpoint(s) in %.3fs",
+             param.output_filename.c_str(), (long)result.resumed_frames, (long)result.encoded_frames,
+             result.checkpoints, result.elapsed_seconds);
+    return result;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct ResumableTranscodeParam {
+    std::string input_filename;
+    std::string output_filename;
+    // Checkpoint and the output written so far, output_filename + ".resume" when empty. Should live on storage that
+    // outlasts the machine, a job started again with the same input and settings picks up from here.
+    std::string resume_dir;
+    // Seconds of video between checkpoints, each taken at the first keyframe after the interval. Bounds the work lost
+    // when the job dies.
+    double checkpoint_seconds = 60;
+    // Part of the checkpoint, a job resumed with different ones starts over. 0 keeps the source size.
+    int output_width = 0;
+    int output_height = 0;
+    int gop_size = 0;
+    std::string preset;
+    // Not part of the checkpoint.
+    int encoder_threads = 4;
+    int decoder_threads = 0;
+};
+
+// Where a resumable transcode got to, checkpoint.txt in its resume directory.
+struct TranscodeCheckpoint {
+    // The job it belongs to.
+    std::string input_filename;
+    int output_width = 0;
+    int output_height = 0;
+    int gop_size = 0;
+    std::string preset;
+    // Bytes of each segment, one per run of the job, that hold complete fragments.
+    std::vector<int64_t> segment_bytes;
+    // Frames in those bytes, and the source pts in milliseconds of the frame after them. Decoder seeks count from the
+    // first frame's pts.
+    int64_t frames = 0;
+    int64_t next_pts_ms = 0;
+    int64_t first_pts_ms = 0;
+    // Every frame is encoded, only the segments are left to join.
+    bool complete = false;
+
+    bool Save(const std::string& resume_dir) const;
+    bool Load(const std::string& resume_dir);
+    bool SameJob(const TranscodeCheckpoint& other) const;
+};
+
+struct ResumableTranscodeResult {
+    bool success = false;
+    // Frames that came from the checkpoint rather than this run.
+    int64_t resumed_frames = 0;
+    int64_t encoded_frames = 0;
+    int checkpoints = 0;
+    double elapsed_seconds = 0;
+};
+
+// VideoDecoder -> MP4VideoRecorder transcode that survives being killed. Each run writes a fragmented MP4 segment
+// with a fragment per GOP, and every checkpoint_seconds, once a keyframe has pushed the fragments before it out, syncs
+// the segment and records its size in bytes, the frames done and the source position of the keyframe. A job started
+// again cuts its last segment back to the checkpointed size, seeks the decoder to the recorded position and appends a
+// new segment from there. Once every frame is encoded the segments are joined into the output by stream copy (see
+// ClipEditor) and the resume directory is removed.
+class ResumableTranscoder {
+public:
+    static ResumableTranscodeResult Run(const ResumableTranscodeParam& param);
+};
@@ -0,0 +1,163 @@
+#include "shared_video_source.h"
+
+#include <algorithm>
+#include <cinttypes>
+
+#include "frame_pool.h"
+#include "logger.h"
+#include "ring_depth.h"
+
+bool SharedVideoSubscriber::ReadFrame(AVFrame* frame) {
+    SharedVideoSource* source = source_;
+    std::unique_lock<std::mutex> lock(source->mutex_);
+    source->published_cv_.wait(lock, [&] { return closed_ || source->eof_ || cursor_ < source->published_; });
+    if (closed_) return false;
+    int64_t oldest = source->OldestFrame();
+    if (cursor_ < oldest) {
+        dropped_frames_ += oldest - cursor_;
+        cursor_ = oldest;
+    }
+    if (cursor_ >= source->published_) return false;
+
+    av_frame_unref(frame);
+    if (av_frame_ref(frame, source->window_[cursor_ % source->window_.size()]) < 0) {
+        log_error("Could not reference shared frame %" PRId64, cursor_);
+        return false;
+    }
+    ++cursor_;
+    ++read_frames_;
+    if (!may_drop_) source->consumed_cv_.notify_one();
+    return true;
+}
+
+void SharedVideoSubscriber::Close() {
+    std::lock_guard<std::mutex> lock(source_->mutex_);
+    closed_ = true;
+    source_->published_cv_.notify_all();
+    source_->consumed_cv_.notify_one();
+}
+
+uint64_t SharedVideoSubscriber::DroppedFrames() const {
+    std::lock_guard<std::mutex> lock(source_->mutex_);
+    return dropped_frames_;
+}
+
+SharedVideoSubscriber* SharedVideoSource::Subscribe(const std::string& name, bool may_drop) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    subscribers_.emplace_back(new SharedVideoSubscriber(this, name, may_drop));
+    subscribers_.back()->cursor_ = OldestFrame();
+    return subscribers_.back().get();
+}
+
+MediaDecoderStartRet SharedVideoSource::Start(const SharedVideoSourceParam& param) {
+    VideoDecoderStartParam decoder_param = param.decoder;
+    decoder_param.worker_thread = false;
+    decoder_ = MediaDecoder::CreateVideoDecoder();
+    MediaDecoderStartRet ret = decoder_->Start(&decoder_param);
+    if (!ret.success) {
+        log_error("Could not start the shared decoder for %s", param.decoder.filename.c_str());
+        std::lock_guard<std::mutex> lock(mutex_);
+        decoder_->Stop();
+        delete decoder_;
+        decoder_ = nullptr;
+        return ret;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        window_.assign(std::max(1, param.window_frames), nullptr);
+        published_ = 0;
+        eof_ = false;
+        stopping_ = false;
+        stalled_ns_ = 0;
+    }
+    // The window is the frame memory the source adds on top of the decoder's rings.
+    frame_bytes_ = (size_t)ret.width * ret.height * 3;
+    FrameMemoryBudget::Instance()->Reserve(window_.size() * frame_bytes_);
+
+    publish_thread_ = std::thread(&SharedVideoSource::Publish, this);
+    return ret;
+}
+
+int64_t SharedVideoSource::OldestFrame() const { return std::max<int64_t>(0, published_ - (int64_t)window_.size()); }
+
+// Position of the slowest subscriber that may not drop frames, published_ when there is none.
+int64_t SharedVideoSource::SlowestCursor() const {
+    int64_t slowest = published_;
+    for (const auto& subscriber : subscribers_) {
+        if (!subscriber->may_drop_ && !subscriber->closed_) slowest = std::min(slowest, subscriber->cursor_);
+    }
+    return slowest;
+}
+
+void SharedVideoSource::Publish() {
+    while (true) {
+        // A fresh frame every time, the previous ones may still be referenced by subscribers.
+        AVFrame* frame = nullptr;
+        if (!decoder_->InitFrame(&frame) || !decoder_->ReadFrame(frame)) {
+            av_frame_free(&frame);
+            break;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        int64_t wait_begin_ns = MetricsNowNs();
+        consumed_cv_.wait(lock, [&] { return stopping_ || published_ - SlowestCursor() < (int64_t)window_.size(); });
+        stalled_ns_ += MetricsNowNs() - wait_begin_ns;
+        if (stopping_) {
+            av_frame_free(&frame);
+            break;
+        }
+        // Nobody reads the frame that falls out any more; references taken from it stay valid.
+        AVFrame*& slot = window_[published_ % window_.size()];
+        av_frame_free(&slot);
+        slot = frame;
+        ++published_;
+        published_cv_.notify_all();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    eof_ = true;
+    published_cv_.notify_all();
+}
+
+void SharedVideoSource::Stop() {
+    if (decoder_ == nullptr) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        consumed_cv_.notify_one();
+    }
+    if (publish_thread_.joinable()) publish_thread_.join();
+
+    // GetMetrics reads the decoder under the same lock.
+    std::lock_guard<std::mutex> lock(mutex_);
+    decoder_->Stop();
+    delete decoder_;
+    decoder_ = nullptr;
+    log_info("Shared source published %" PRId64 " frames, %.1fms waiting for the slowest subscriber", published_,
+             stalled_ns_ / 1e6);
+    for (const auto& subscriber : subscribers_) {
+        log_info("Subscriber %s read %" PRIu64 " frames, dropped %" PRIu64, subscriber->name_.c_str(),
+                 subscriber->read_frames_, subscriber->dropped_frames_);
+        // Anyone still reading gets the end of the stream.
+        subscriber->closed_ = true;
+    }
+    published_cv_.notify_all();
+    for (AVFrame*& frame : window_) {
+        av_frame_free(&frame);
+    }
+    FrameMemoryBudget::Instance()->Release(window_.size() * frame_bytes_);
+    window_.clear();
+}
+
+PipelineMetricsSnapshot SharedVideoSource::GetMetrics() {
+    PipelineMetricsSnapshot snapshot;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (decoder_ != nullptr) snapshot = decoder_->GetMetrics();
+    for (const auto& subscriber : subscribers_) {
+        snapshot.dropped_frames += subscriber->dropped_frames_;
+    }
+    return snapshot;
+}
+
+SharedVideoSource::~SharedVideoSource() { Stop(); }
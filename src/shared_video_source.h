@@ -0,0 +1,103 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "media_decoder_common.h"
+#include "media_decoder_interface.h"
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+struct SharedVideoSourceParam {
+    // worker_thread is ignored, the source's own thread decodes.
+    VideoDecoderStartParam decoder;
+    // Frames kept for the subscribers. The slowest subscriber that may not drop frames holds decoding back once it is
+    // this many frames behind.
+    int window_frames = 8;
+};
+
+class SharedVideoSource;
+
+// One reader of a SharedVideoSource, with its own position in the stream. Only one thread reads a subscriber.
+class SharedVideoSubscriber {
+public:
+    // Waits for the next frame and makes |frame| a new reference to it, dropping whatever |frame| referenced. The
+    // RGB data is shared with the other subscribers and must not be written. False at the end of the stream or once
+    // closed.
+    bool ReadFrame(AVFrame* frame);
+    // Stops holding the source back. Thread safe.
+    void Close();
+
+    const std::string& Name() const { return name_; }
+    // Frames that left the window before a dropping subscriber got to them.
+    uint64_t DroppedFrames() const;
+
+private:
+    friend class SharedVideoSource;
+
+    SharedVideoSource* source_;
+    std::string name_;
+    bool may_drop_;
+    // Guarded by the source's mutex.
+    int64_t cursor_ = 0;
+    bool closed_ = false;
+    uint64_t read_frames_ = 0;
+    uint64_t dropped_frames_ = 0;
+
+    SharedVideoSubscriber(SharedVideoSource* source, const std::string& name, bool may_drop)
+        : source_(source), name_(name), may_drop_(may_drop) {}
+};
+
+// Decodes a file once for any number of consumers. Decoded RGB frames go into a window of window_frames frames;
+// every subscriber reads them at its own pace as references to the same pooled buffers, so a frame is converted once
+// and freed when the last reader lets go of it. Subscribers that may drop frames skip ahead when the window moves past
+// them, the others hold decoding back, by at most the window.
+class SharedVideoSource {
+public:
+    // Subscribers created before Start see the whole stream, later ones start at the oldest frame in the window.
+    // Owned by the source, valid until it is deleted.
+    SharedVideoSubscriber* Subscribe(const std::string& name, bool may_drop = false);
+
+    MediaDecoderStartRet Start(const SharedVideoSourceParam& param);
+    // Stops decoding and ends every subscriber's stream.
+    void Stop();
+
+    // The decoder's metrics, with dropped_frames counting the frames dropping subscribers skipped.
+    PipelineMetricsSnapshot GetMetrics();
+
+    SharedVideoSource() {}
+    ~SharedVideoSource();
+
+    SharedVideoSource(const SharedVideoSource&) = delete;
+    SharedVideoSource& operator=(const SharedVideoSource&) = delete;
+
+private:
+    friend class SharedVideoSubscriber;
+
+    MediaDecoder* decoder_ = nullptr;
+    std::thread publish_thread_;
+    size_t frame_bytes_ = 0;
+
+    std::mutex mutex_;
+    // Subscribers wait for published_ to move, the publisher for the slowest subscriber.
+    std::condition_variable published_cv_;
+    std::condition_variable consumed_cv_;
+    std::vector<std::unique_ptr<SharedVideoSubscriber>> subscribers_;
+    // Frame n is in window_[n % window_.size()] while n >= published_ - window_.size().
+    std::vector<AVFrame*> window_;
+    int64_t published_ = 0;
+    bool eof_ = false;
+    bool stopping_ = false;
+    int64_t stalled_ns_ = 0;
+
+    void Publish();
+    int64_t OldestFrame() const;
+    int64_t SlowestCursor() const;
+};
@@ -0,0 +1,356 @@
+#include "thumbnail_generator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "logger.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+}
+
+namespace {
+
+// One demuxer and decoder, used by one thread.
+struct ThumbnailWorker {
+    AVFormatContext* fmt_ctx = nullptr;
+    AVCodecContext* dec_ctx = nullptr;
+    AVStream* stream = nullptr;
+    AVPacket* pkt = nullptr;
+    AVFrame* frame = nullptr;
+    SwsContext* sws_ctx = nullptr;
+    // Timestamp of the keyframe in frame. Intervals shorter than the GOP seek back to the same keyframe, which is
+    // then reused rather than decoded again.
+    int64_t key_pts = AV_NOPTS_VALUE;
+
+    bool Open(const std::string& filename) {
+        if (avformat_open_input(&fmt_ctx, filename.c_str(), NULL, NULL) < 0) {
+            log_error("Could not open source file %s", filename.c_str());
+            return false;
+        }
+        if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+            log_error("Could not find stream information");
+            return false;
+        }
+        int idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        if (idx < 0) {
+            log_error("Could not find video stream in input file '%s'", filename.c_str());
+            return false;
+        }
+        stream = fmt_ctx->streams[idx];
+        const AVCodec* decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+        if (!decoder) {
+            log_error("Failed to find video codec");
+            return false;
+        }
+        dec_ctx = avcodec_alloc_context3(decoder);
+        if (!dec_ctx || avcodec_parameters_to_context(dec_ctx, stream->codecpar) < 0) {
+            log_error("Failed to set up the video codec context");
+            return false;
+        }
+        // Parallelism comes from the workers, and frame threading would hold every keyframe back by a few packets.
+        dec_ctx->thread_count = 1;
+        dec_ctx->skip_frame = AVDISCARD_NONKEY;
+        if (avcodec_open2(dec_ctx, decoder, NULL) < 0) {
+            log_error("Failed to open video codec");
+            return false;
+        }
+        pkt = av_packet_alloc();
+        frame = av_frame_alloc();
+        return pkt != nullptr && frame != nullptr;
+    }
+
+    void Close() {
+        sws_freeContext(sws_ctx);
+        av_frame_free(&frame);
+        av_packet_free(&pkt);
+        avcodec_free_context(&dec_ctx);
+        avformat_close_input(&fmt_ctx);
+    }
+
+    double Duration() const {
+        if (fmt_ctx->duration != AV_NOPTS_VALUE) return fmt_ctx->duration / (double)AV_TIME_BASE;
+        if (stream->duration != AV_NOPTS_VALUE) return stream->duration * av_q2d(stream->time_base);
+        return 0;
+    }
+
+    // Leaves the keyframe at or before seconds in frame.
+    bool DecodeKeyframe(double seconds) {
+        int64_t ts = (int64_t)(seconds / av_q2d(stream->time_base));
+        if (stream->start_time != AV_NOPTS_VALUE) ts += stream->start_time;
+        if (av_seek_frame(fmt_ctx, stream->index, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+            log_warn("Seek to %.3fs failed", seconds);
+            return false;
+        }
+        avcodec_flush_buffers(dec_ctx);
+
+        // The first keyframe read after the seek is the one wanted, later ones are only sent to push it out.
+        bool sent = false;
+        int64_t wanted_pts = AV_NOPTS_VALUE;
+        while (av_read_frame(fmt_ctx, pkt) >= 0) {
+            if (pkt->stream_index != stream->index || !(pkt->flags & AV_PKT_FLAG_KEY)) {
+                av_packet_unref(pkt);
+                continue;
+            }
+            if (!sent && pkt->pts != AV_NOPTS_VALUE && pkt->pts == key_pts && frame->data[0] != nullptr) {
+                av_packet_unref(pkt);
+                return true;
+            }
+            if (!sent) wanted_pts = pkt->pts;
+            sent = true;
+            int ret = avcodec_send_packet(dec_ctx, pkt);
+            av_packet_unref(pkt);
+            if (ret < 0) {
+                log_warn("Error submitting a packet for decoding at %.3fs", seconds);
+                return false;
+            }
+            if (ReceiveKeyframe(wanted_pts)) return true;
+        }
+        // Hit the end with the keyframe still inside the decoder.
+        avcodec_send_packet(dec_ctx, nullptr);
+        return ReceiveKeyframe(wanted_pts);
+    }
+
+    // A decoder with output delay may hand back another keyframe's picture first, so pictures are taken until the one
+    // with pts comes out, or the first one when the packet had none.
+    bool ReceiveKeyframe(int64_t pts) {
+        while (avcodec_receive_frame(dec_ctx, frame) == 0) {
+            if (pts == AV_NOPTS_VALUE || frame->best_effort_timestamp == pts) {
+                key_pts = frame->best_effort_timestamp;
+                return true;
+            }
+        }
+        // avcodec_receive_frame left frame empty.
+        key_pts = AV_NOPTS_VALUE;
+        return false;
+    }
+};
+
+struct SheetLayout {
+    int tile_width;
+    int tile_height;
+    int columns;
+    int per_sheet;
+};
+
+// Scales the worker's frame straight into its tile, converting to the full range JPEG expects on the way.
+bool DrawTile(ThumbnailWorker& worker, const SheetLayout& layout, AVFrame* sheet, int slot) {
+    AVFrame* frame = worker.frame;
+    worker.sws_ctx = sws_getCachedContext(worker.sws_ctx, frame->width, frame->height, (AVPixelFormat)frame->format,
+                                          layout.tile_width, layout.tile_height, AV_PIX_FMT_YUVJ420P, SWS_AREA,
+                                          nullptr, nullptr, nullptr);
+    if (worker.sws_ctx == nullptr) {
+        log_error("Could not create the tile scaler");
+        return false;
+    }
+    // Tiles sit on even offsets, so no two share a chroma sample.
+    int x = (slot % layout.columns) * layout.tile_width;
+    int y = (slot / layout.columns) * layout.tile_height;
+    uint8_t* dst[3] = {sheet->data[0] + y * sheet->linesize[0] + x,
+                       sheet->data[1] + y / 2 * sheet->linesize[1] + x / 2,
+                       sheet->data[2] + y / 2 * sheet->linesize[2] + x / 2};
+    sws_scale(worker.sws_ctx, frame->data, frame->linesize, 0, frame->height, dst, sheet->linesize);
+    return true;
+}
+
+bool WriteJpeg(AVFrame* sheet, int quality, const std::string& filename) {
+    const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    if (!codec) {
+        log_error("Could not find the MJPEG encoder");
+        return false;
+    }
+    AVCodecContext* ctx = avcodec_alloc_context3(codec);
+    AVPacket* pkt = av_packet_alloc();
+    bool ok = false;
+    ctx->width = sheet->width;
+    ctx->height = sheet->height;
+    ctx->pix_fmt = AV_PIX_FMT_YUVJ420P;
+    ctx->time_base = (AVRational){1, 1};
+    ctx->flags |= AV_CODEC_FLAG_QSCALE;
+    ctx->global_quality = FF_QP2LAMBDA * quality;
+    sheet->quality = ctx->global_quality;
+    if (avcodec_open2(ctx, codec, NULL) < 0) {
+        log_error("Could not open the MJPEG encoder");
+    } else if (avcodec_send_frame(ctx, sheet) < 0 || avcodec_receive_packet(ctx, pkt) < 0) {
+        log_error("Could not encode %s", filename.c_str());
+    } else {
+        FILE* file = fopen(filename.c_str(), "wb");
+        if (file == nullptr) {
+            log_error("Could not open %s", filename.c_str());
+        } else {
+            ok = fwrite(pkt->data, 1, pkt->size, file) == (size_t)pkt->size;
+            ok = fclose(file) == 0 && ok;
+        }
+    }
+    av_packet_free(&pkt);
+    avcodec_free_context(&ctx);
+    return ok;
+}
+
+std::string VttTime(double seconds) {
+    int64_t ms = (int64_t)llround(seconds * 1000);
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%02d:%02d:%02d.%03d", (int)(ms / 3600000), (int)(ms / 60000 % 60),
+             (int)(ms / 1000 % 60), (int)(ms % 1000));
+    return buf;
+}
+
+std::string SheetName(const ThumbnailParam& param, int sheet) {
+    return param.sheet_prefix + "_" + std::to_string(sheet) + ".jpg";
+}
+
+bool WriteIndex(const ThumbnailParam& param, const SheetLayout& layout, int count, double duration,
+                const std::vector<double>& keyframe_times) {
+    std::string vtt_filename = param.output_dir + "/thumbnails.vtt";
+    std::string json_filename = param.output_dir + "/thumbnails.json";
+    FILE* vtt = fopen(vtt_filename.c_str(), "w");
+    FILE* json = fopen(json_filename.c_str(), "w");
+    if (vtt == nullptr || json == nullptr) {
+        log_error("Could not open %s or %s", vtt_filename.c_str(), json_filename.c_str());
+        if (vtt) fclose(vtt);
+        if (json) fclose(json);
+        return false;
+    }
+
+    fprintf(vtt, "WEBVTT\n");
+    fprintf(json,
+            "{\n  \"interval\": %.3f,\n  \"duration\": %.3f,\n  \"tile_width\": %d,\n  \"tile_height\": %d,\n"
+            "  \"columns\": %d,\n  \"thumbnails\": [\n",
+            param.interval_seconds, duration, layout.tile_width, layout.tile_height, layout.columns);
+    for (int i = 0; i < count; ++i) {
+        int slot = i % layout.per_sheet;
+        int x = (slot % layout.columns) * layout.tile_width;
+        int y = (slot / layout.columns) * layout.tile_height;
+        double start = i * param.interval_seconds;
+        double end = std::min(duration, (i + 1) * param.interval_seconds);
+        std::string sheet = SheetName(param, i / layout.per_sheet);
+        fprintf(vtt, "\n%s --> %s\n%s#xywh=%d,%d,%d,%d\n", VttTime(start).c_str(), VttTime(end).c_str(),
+                sheet.c_str(), x, y, layout.tile_width, layout.tile_height);
+        fprintf(json,
+                "    {\"start\": %.3f, \"end\": %.3f, \"keyframe\": %.3f, \"sheet\": \"%s\", \"x\": %d, \"y\": %d}%s\n",
+                start, end, keyframe_times[i], sheet.c_str(), x, y, i + 1 < count ? "," : "");
+    }
+    fprintf(json, "  ]\n}\n");
+    bool ok = fclose(vtt) == 0;
+    ok = fclose(json) == 0 && ok;
+    return ok;
+}
+
+}  // namespace
+
+ThumbnailResult ThumbnailGenerator::Generate(const ThumbnailParam& param) {
+    ThumbnailResult result;
+    auto begin = std::chrono::steady_clock::now();
+    if (param.interval_seconds <= 0 || param.tile_width < 2 || param.columns <= 0 || param.rows <= 0) {
+        log_error("Invalid thumbnail parameters");
+        return result;
+    }
+
+    // The first worker's contexts double as the probe.
+    std::vector<ThumbnailWorker> workers(1);
+    if (!workers[0].Open(param.filename)) {
+        workers[0].Close();
+        return result;
+    }
+    double duration = workers[0].Duration();
+    int width = workers[0].dec_ctx->width;
+    int height = workers[0].dec_ctx->height;
+    if (duration <= 0 || width <= 0 || height <= 0) {
+        log_error("Could not determine the duration and size of %s", param.filename.c_str());
+        workers[0].Close();
+        return result;
+    }
+
+    SheetLayout layout;
+    layout.tile_width = param.tile_width & ~1;
+    layout.tile_height = param.tile_height > 0 ? param.tile_height : (int)((int64_t)layout.tile_width * height / width);
+    layout.tile_height = std::max(2, layout.tile_height & ~1);
+    layout.columns = param.columns;
+    layout.per_sheet = param.columns * param.rows;
+    int count = std::max(1, (int)ceil(duration / param.interval_seconds - 1e-9));
+    int sheet_count = (count + layout.per_sheet - 1) / layout.per_sheet;
+
+    // Black, in full range.
+    std::vector<AVFrame*> sheets;
+    for (int s = 0; s < sheet_count; ++s) {
+        int tiles = std::min(layout.per_sheet, count - s * layout.per_sheet);
+        AVFrame* sheet = av_frame_alloc();
+        sheet->format = AV_PIX_FMT_YUVJ420P;
+        sheet->width = std::min(tiles, layout.columns) * layout.tile_width;
+        sheet->height = (tiles + layout.columns - 1) / layout.columns * layout.tile_height;
+        if (av_frame_get_buffer(sheet, 0) < 0) {
+            log_error("Could not allocate a sprite sheet");
+            av_frame_free(&sheet);
+            break;
+        }
+        memset(sheet->data[0], 0, sheet->linesize[0] * sheet->height);
+        memset(sheet->data[1], 128, sheet->linesize[1] * (sheet->height / 2));
+        memset(sheet->data[2], 128, sheet->linesize[2] * (sheet->height / 2));
+        sheets.push_back(sheet);
+    }
+
+    int worker_count = param.workers > 0 ? param.workers : std::min(8, (int)std::thread::hardware_concurrency());
+    worker_count = std::max(1, std::min(worker_count, count));
+    workers.resize(worker_count);
+    std::vector<double> keyframe_times(count, -1);
+    std::vector<int> decoded(worker_count, 0);
+
+    // Contiguous ranges, so every worker seeks forwards through its part of the file.
+    auto work = [&](int w) {
+        ThumbnailWorker& worker = workers[w];
+        if (w > 0 && !worker.Open(param.filename)) return;
+        int first = (int64_t)count * w / worker_count;
+        int last = (int64_t)count * (w + 1) / worker_count;
+        for (int i = first; i < last; ++i) {
+            if (!worker.DecodeKeyframe(i * param.interval_seconds)) continue;
+            int64_t pts = worker.frame->best_effort_timestamp;
+            if (pts != AV_NOPTS_VALUE) {
+                if (worker.stream->start_time != AV_NOPTS_VALUE) pts -= worker.stream->start_time;
+                keyframe_times[i] = pts * av_q2d(worker.stream->time_base);
+            }
+            if (DrawTile(worker, layout, sheets[i / layout.per_sheet], i % layout.per_sheet)) decoded[w]++;
+        }
+    };
+    if (sheets.size() == (size_t)sheet_count) {
+        std::vector<std::thread> threads;
+        for (int w = 1; w < worker_count; ++w) {
+            threads.emplace_back(work, w);
+        }
+        work(0);
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+    for (ThumbnailWorker& worker : workers) {
+        worker.Close();
+    }
+
+    int total_decoded = 0;
+    for (int n : decoded) total_decoded += n;
+    bool ok = sheets.size() == (size_t)sheet_count;
+    for (size_t s = 0; s < sheets.size(); ++s) {
+        ok = WriteJpeg(sheets[s], param.jpeg_quality, param.output_dir + "/" + SheetName(param, s)) && ok;
+        av_frame_free(&sheets[s]);
+    }
+    ok = ok && WriteIndex(param, layout, count, duration, keyframe_times);
+
+    result.success = ok && total_decoded > 0;
+    result.thumbnails = total_decoded;
+    result.sheets = sheet_count;
+    result.duration_seconds = duration;
+    result.elapsed_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    if (total_decoded < count) {
+        log_warn("%d of %d thumbnails could not be decoded and stay black", count - total_decoded, count);
+    }
+    log_info("%d thumbnails on %d sheets from %.1fs of video in %.2fs with %d workers (%.2f%% of real time)",
+             total_decoded, sheet_count, duration, result.elapsed_seconds, worker_count,
+             100.0 * result.elapsed_seconds / duration);
+    return result;
+}
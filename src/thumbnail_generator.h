@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+
+struct ThumbnailParam {
+    std::string filename;
+    // One thumbnail per interval, from the keyframe at or before its start.
+    double interval_seconds = 10.0;
+    // Tile size, 0 for the height keeps the aspect ratio. Rounded down to even.
+    int tile_width = 160;
+    int tile_height = 0;
+    // Tiles per sprite sheet.
+    int columns = 10;
+    int rows = 10;
+    // Decoder instances seeking in parallel, 0 for one per core up to 8.
+    int workers = 0;
+    // MJPEG qscale, 2 (best) to 31.
+    int jpeg_quality = 4;
+
+    // Sheets are written as <output_dir>/<sheet_prefix>_<n>.jpg, the index as thumbnails.vtt and thumbnails.json.
+    std::string output_dir = ".";
+    std::string sheet_prefix = "sprite";
+};
+
+struct ThumbnailResult {
+    bool success = false;
+    int thumbnails = 0;
+    int sheets = 0;
+    double duration_seconds = 0;
+    double elapsed_seconds = 0;
+};
+
+// Scrubbing sprite sheets without decoding the whole file: every worker opens its own demuxer and decoder, seeks to
+// each of its thumbnail times and decodes just the keyframe there (the decoder discards everything else). Keyframes
+// are scaled straight from their decoded YUV into their tile of the sheet, which is then encoded as JPEG, and the
+// WebVTT and JSON index map every interval to its tile.
+class ThumbnailGenerator {
+public:
+    static ThumbnailResult Generate(const ThumbnailParam& param);
+};
@@ -1,16 +1,120 @@
 #include <libyuv.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <atomic>
+#include <map>
+#include <mutex>
 #include <thread>
 
+#include "frame_pool.h"
+#include "fused_convert.h"
 #include "logger.h"
 #include "media_decoder_common.h"
 #include "media_decoder_interface.h"
+#include "pipe_io.h"
 #include "poca_str.h"
-#include "ring_fifo.h"
+#include "readiness_notifier.h"
+#include "ring_depth.h"
+#include "spsc_ring.h"
+#include "thread_placement.h"
+#include "trace_recorder.h"
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+}
+
+// Video stream parameters avformat_find_stream_info worked out, by filename, so fast_open can skip probing a file
+// opened before. An entry only applies while the file's size and modification time are unchanged.
+class StreamInfoCache {
+public:
+    static StreamInfoCache* Instance();
+
+    // Fills in the stream's parameters. False when there is no entry for the file as it is now.
+    bool Lookup(const std::string& filename, AVFormatContext* fmt_ctx);
+    void Store(const std::string& filename, AVFormatContext* fmt_ctx);
+
+    StreamInfoCache(const StreamInfoCache&) = delete;
+    StreamInfoCache& operator=(const StreamInfoCache&) = delete;
+
+private:
+    struct Entry {
+        int64_t size;
+        int64_t mtime_ns;
+        unsigned int nb_streams;
+        int stream_index;
+        AVCodecParameters* codecpar;
+        AVRational time_base;
+        AVRational avg_frame_rate;
+        AVRational r_frame_rate;
+    };
+    static const size_t max_entries_ = 256;
+
+    std::mutex mutex_;
+    std::map<std::string, Entry> entries_;
+
+    StreamInfoCache() {}
+    static bool FileVersion(const std::string& filename, int64_t* size, int64_t* mtime_ns);
+};
+
+StreamInfoCache* StreamInfoCache::Instance() {
+    static StreamInfoCache* instance = new StreamInfoCache();
+    return instance;
+}
+
+// Only local files, anything stat can not see is probed every time.
+bool StreamInfoCache::FileVersion(const std::string& filename, int64_t* size, int64_t* mtime_ns) {
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    *size = st.st_size;
+    *mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+bool StreamInfoCache::Lookup(const std::string& filename, AVFormatContext* fmt_ctx) {
+    int64_t size;
+    int64_t mtime_ns;
+    if (!FileVersion(filename, &size, &mtime_ns)) return false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(filename);
+    if (it == entries_.end()) return false;
+    const Entry& entry = it->second;
+    if (entry.size != size || entry.mtime_ns != mtime_ns || entry.nb_streams != fmt_ctx->nb_streams) return false;
+    AVStream* st = fmt_ctx->streams[entry.stream_index];
+    if (st->codecpar->codec_id != entry.codecpar->codec_id) return false;
+    if (avcodec_parameters_copy(st->codecpar, entry.codecpar) < 0) return false;
+    st->time_base = entry.time_base;
+    st->avg_frame_rate = entry.avg_frame_rate;
+    st->r_frame_rate = entry.r_frame_rate;
+    return true;
+}
+
+void StreamInfoCache::Store(const std::string& filename, AVFormatContext* fmt_ctx) {
+    int64_t size;
+    int64_t mtime_ns;
+    if (!FileVersion(filename, &size, &mtime_ns)) return;
+    int stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (stream_index < 0) return;
+    AVStream* st = fmt_ctx->streams[stream_index];
+    AVCodecParameters* codecpar = avcodec_parameters_alloc();
+    if (codecpar == nullptr || avcodec_parameters_copy(codecpar, st->codecpar) < 0) {
+        avcodec_parameters_free(&codecpar);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(filename);
+    if (it != entries_.end()) {
+        avcodec_parameters_free(&it->second.codecpar);
+        entries_.erase(it);
+    } else if (entries_.size() >= max_entries_) {
+        avcodec_parameters_free(&entries_.begin()->second.codecpar);
+        entries_.erase(entries_.begin());
+    }
+    entries_[filename] = {size, mtime_ns, fmt_ctx->nb_streams, stream_index, codecpar, st->time_base,
+                          st->avg_frame_rate, st->r_frame_rate};
 }
 
 class VideoDecoder : public MediaDecoder {
@@ -18,6 +122,11 @@ public:
     virtual MediaDecoderStartRet Start(void* param) override;
     virtual bool ReadFrame(AVFrame* frame) override;
     virtual bool InitFrame(AVFrame** frame) override;
+    virtual MediaIOStatus TryReadFrame(AVFrame* frame) override;
+    virtual int ReadableFd() override;
+    virtual bool Stop() override;
+    virtual PipelineMetricsSnapshot GetMetrics() override;
+    virtual DecoderStartupTiming GetStartupTiming() override;
 
     virtual ~VideoDecoder() override;
 
@@ -25,28 +134,78 @@ private:
     int width_;
     int height_;
     enum AVPixelFormat src_pix_fmt_;
+    // Size of the frames handed out, the decoded size unless the start param asked for another.
+    int output_width_;
+    int output_height_;
+    // Converts and resizes in one pass when the output size differs.
+    FusedConverter* fused_converter_ = nullptr;
 
     std::string src_filename_;
-
-    static const int buffer_size_;
-
-    AVFormatContext* src_fmt_ctx_;
+    bool use_worker_thread_ = true;
+    int decoder_threads_ = 0;
+    // Inline decoding only: the demuxer hit the end and the decoder was sent the flush packet.
+    bool demux_eof_ = false;
+
+    // fast_open bounds for avformat_find_stream_info, the defaults are 5MB and 5s.
+    static const int64_t fast_probe_size_;
+    static const int64_t fast_analyze_duration_us_;
+    // Asked for when the source is stdin.
+    static const size_t stdin_pipe_size_;
+    // Opened in Start, or by the first read with fast_open. Only the decoding thread touches it after Start.
+    bool codec_opened_ = false;
+    int64_t start_begin_ns_ = 0;
+    int64_t codec_ready_ns_ = 0;
+    // Start's part of the timing, and the phases after it, written by the decoding thread.
+    DecoderStartupTiming startup_;
+    std::atomic<int64_t> codec_init_ns_{0};
+    std::atomic<int64_t> first_frame_ns_{0};
+    std::atomic<int64_t> total_ns_{0};
+
+    // Takes without a stall before a spare frame is released.
+    static const int ring_idle_frames_;
+
+    ThreadPlacement placement_;
+
+    AVFormatContext* src_fmt_ctx_ = nullptr;
     int video_stream_idx_;
     AVStream* video_stream_;
-    AVCodecContext* video_decode_ctx_;
-    AVPacket* src_video_pkt_;
+    AVCodecContext* video_decode_ctx_ = nullptr;
+    AVPacket* src_video_pkt_ = nullptr;
 
-    RingFIFO<AVFrame*>* ring_fifo_av_frame_full_;
-    RingFIFO<AVFrame*>* ring_fifo_av_frame_empty_;
+    SpscRing<AVFrame*>* ring_fifo_av_frame_full_ = nullptr;
+    SpscRing<AVFrame*>* ring_fifo_av_frame_empty_ = nullptr;
+    // Counts the decoded frames the shells can hold at once, the shells themselves are tiny.
+    RingDepthController ring_depth_;
+    // Frame the worker is currently decoding into, kept across packets so it never has to hand it back. Inline
+    // decoding reuses it for every frame.
+    AVFrame* decode_frame_ = nullptr;
 
     std::thread worker_thread_;
 
+    PipelineMetrics metrics_;
+    // Codec time spent on packets that have not produced a frame yet, charged to the next decoded frame.
+    int64_t pending_decode_ns_ = 0;
+
+    std::string trace_filename_;
+    TraceRecorder* trace_ = nullptr;
+
+    // Signals TryReadFrame callers that found the full ring empty.
+    ReadinessNotifier readable_;
+
     bool InitAVContexts();
+    bool OpenCodec();
+    void NoteFirstFrame();
     void ReadPacketAndDecode();
     int DecodePacket(AVCodecContext* dec, AVPacket* pkt);
+    bool DecodeInline(AVFrame* av_frame);
+    void DeliverFrame(AVFrame* av_frame, AVFrame* frame, int64_t frame_index);
+    bool TakeEmptyFrame();
 };
 
-const int VideoDecoder::buffer_size_ = 10;
+const int VideoDecoder::ring_idle_frames_ = 60;
+const int64_t VideoDecoder::fast_probe_size_ = 1 << 20;
+const int64_t VideoDecoder::fast_analyze_duration_us_ = 500000;
+const size_t VideoDecoder::stdin_pipe_size_ = 4 << 20;
 
 MediaDecoder* MediaDecoder::CreateVideoDecoder() { return new VideoDecoder(); }
 
@@ -59,21 +218,21 @@ bool VideoDecoder::InitFrame(AVFrame** frame) {
     }
 
     (*frame)->format = AV_PIX_FMT_RGB24;
-    (*frame)->width = width_;
-    (*frame)->height = height_;
+    (*frame)->width = output_width_;
+    (*frame)->height = output_height_;
 
-    /* allocate the buffers for the frame data */
-    if (av_frame_get_buffer(*frame, 0) < 0) {
+    /* lease the buffers for the frame data from the shared pool */
+    if (!FramePool::Instance()->Lease(*frame, placement_.NumaNode())) {
         log_error("Could not allocate frame data.");
         return false;
     }
     return true;
 }
 
+// Sets up the decoder context from the stream parameters. Opening it is left to OpenCodec.
 bool VideoDecoder::InitAVContexts() {
     int ret;
     AVStream* st;
-    const AVCodec* decoder = nullptr;
 
     log_info("Init av contexts begin");
 
@@ -87,13 +246,7 @@ bool VideoDecoder::InitAVContexts() {
     video_stream_idx_ = ret;
     st = src_fmt_ctx_->streams[video_stream_idx_];
 
-    decoder = avcodec_find_decoder(st->codecpar->codec_id);
-    if (!decoder) {
-        log_error("Failed to find video codec");
-        return false;
-    }
-
-    video_decode_ctx_ = avcodec_alloc_context3(decoder);
+    video_decode_ctx_ = avcodec_alloc_context3(nullptr);
     if (!video_decode_ctx_) {
         log_error("Failed to allocate the video codec context");
         return false;
@@ -104,9 +257,8 @@ bool VideoDecoder::InitAVContexts() {
         return false;
     }
 
-    if ((ret = avcodec_open2(video_decode_ctx_, decoder, NULL)) < 0) {
-        log_error("Failed to open video codec");
-        return false;
+    if (decoder_threads_ > 0) {
+        video_decode_ctx_->thread_count = decoder_threads_;
     }
 
     src_video_pkt_ = av_packet_alloc();
@@ -118,60 +270,177 @@ bool VideoDecoder::InitAVContexts() {
     video_stream_ = src_fmt_ctx_->streams[video_stream_idx_];
     width_ = video_decode_ctx_->width;
     height_ = video_decode_ctx_->height;
-    src_pix_fmt_ = video_decode_ctx_->pix_fmt;
+    // Only known up front after probing, the conversion assumes 4:2:0 anyway.
+    src_pix_fmt_ = video_decode_ctx_->pix_fmt != AV_PIX_FMT_NONE ? video_decode_ctx_->pix_fmt : AV_PIX_FMT_YUV420P;
 
     log_info("Init av contexts success");
 
     return true;
 }
 
+bool VideoDecoder::OpenCodec() {
+    int64_t begin_ns = MetricsNowNs();
+    const AVCodec* decoder = avcodec_find_decoder(video_stream_->codecpar->codec_id);
+    if (!decoder) {
+        log_error("Failed to find video codec");
+        return false;
+    }
+    int ret;
+    {
+        // libavcodec's frame and slice threads are created here and keep the placement.
+        ScopedThreadPlacement pin(placement_);
+        ret = avcodec_open2(video_decode_ctx_, decoder, NULL);
+    }
+    if (ret < 0) {
+        log_error("Failed to open video codec");
+        return false;
+    }
+    codec_opened_ = true;
+    codec_ready_ns_ = MetricsNowNs();
+    codec_init_ns_.store(codec_ready_ns_ - begin_ns, std::memory_order_relaxed);
+    if (trace_) trace_->Record("codec_init", begin_ns, codec_ready_ns_, -1);
+    return true;
+}
+
+void VideoDecoder::NoteFirstFrame() {
+    int64_t now_ns = MetricsNowNs();
+    first_frame_ns_.store(now_ns - codec_ready_ns_, std::memory_order_relaxed);
+    total_ns_.store(now_ns - start_begin_ns_, std::memory_order_relaxed);
+    DecoderStartupTiming timing = GetStartupTiming();
+    log_info("%s first frame after %.1fms: open %.1fms, probe %.1fms%s, codec init %.1fms, first frame %.1fms",
+             src_filename_.c_str(), timing.total_ns / 1e6, timing.open_ns / 1e6, timing.probe_ns / 1e6,
+             timing.stream_info_cached ? " (cached)" : (timing.probe_skipped ? " (skipped)" : ""),
+             timing.codec_init_ns / 1e6, timing.first_frame_ns / 1e6);
+}
+
 MediaDecoderStartRet VideoDecoder::Start(void* param) {
     MediaDecoderStartRet ret;
     if (param == nullptr) {
         log_error("Start param is nullptr");
         return ret;
     }
+    start_begin_ns_ = MetricsNowNs();
+    startup_ = DecoderStartupTiming();
+    codec_init_ns_.store(0, std::memory_order_relaxed);
+    first_frame_ns_.store(0, std::memory_order_relaxed);
+    total_ns_.store(0, std::memory_order_relaxed);
+    codec_opened_ = false;
     VideoDecoderStartParam* start_param = reinterpret_cast<VideoDecoderStartParam*>(param);
-
-    if (avformat_open_input(&src_fmt_ctx_, start_param->filename.c_str(), NULL, NULL) < 0) {
-        log_error("Could not open source file %s", start_param->filename.c_str());
+    src_filename_ = start_param->filename;
+    use_worker_thread_ = start_param->worker_thread;
+    decoder_threads_ = start_param->decoder_threads;
+    trace_filename_ = start_param->trace_filename;
+    if (!trace_filename_.empty()) {
+        trace_ = new TraceRecorder("VideoDecoder " + src_filename_);
+    }
+    if (!placement_.Init(start_param->placement)) {
         return ret;
     }
+    log_info("%s decoding on %s", src_filename_.c_str(), placement_.Describe().c_str());
 
-    if (avformat_find_stream_info(src_fmt_ctx_, NULL) < 0) {
-        log_error("Could not find stream information");
+    AVDictionary* format_opts = nullptr;
+    if (start_param->fast_open) {
+        // Bounds the format probe here and avformat_find_stream_info below.
+        av_dict_set_int(&format_opts, "probesize", fast_probe_size_, 0);
+        av_dict_set_int(&format_opts, "analyzeduration", fast_analyze_duration_us_, 0);
+    }
+    std::string url = start_param->filename;
+    if (url == "-") {
+        // A container streamed in on stdin, e.g. fragmented MP4 or Annex B from another process.
+        GrowPipe(STDIN_FILENO, stdin_pipe_size_);
+        url = "pipe:0";
+    }
+    int open_ret = avformat_open_input(&src_fmt_ctx_, url.c_str(), NULL, &format_opts);
+    av_dict_free(&format_opts);
+    if (open_ret < 0) {
+        log_error("Could not open source file %s", start_param->filename.c_str());
         return ret;
     }
+    int64_t opened_ns = MetricsNowNs();
+    startup_.open_ns = opened_ns - start_begin_ns_;
+    if (trace_) trace_->Record("open", start_begin_ns_, opened_ns, -1);
+
+    if (start_param->fast_open && StreamInfoCache::Instance()->Lookup(src_filename_, src_fmt_ctx_)) {
+        startup_.stream_info_cached = true;
+    } else if (start_param->fast_open) {
+        // MP4, MOV and MKV headers usually describe the stream completely, only elementary and transport streams
+        // need frames looked at.
+        int idx = av_find_best_stream(src_fmt_ctx_, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        AVStream* st = idx >= 0 ? src_fmt_ctx_->streams[idx] : nullptr;
+        startup_.probe_skipped = st != nullptr && st->codecpar->width > 0 && st->codecpar->height > 0 &&
+                                 st->avg_frame_rate.num > 0 && st->avg_frame_rate.den > 0;
+    }
+    if (!startup_.stream_info_cached && !startup_.probe_skipped) {
+        if (avformat_find_stream_info(src_fmt_ctx_, NULL) < 0) {
+            log_error("Could not find stream information");
+            return ret;
+        }
+        int64_t probed_ns = MetricsNowNs();
+        startup_.probe_ns = probed_ns - opened_ns;
+        if (trace_) trace_->Record("probe", opened_ns, probed_ns, -1);
+        StreamInfoCache::Instance()->Store(src_filename_, src_fmt_ctx_);
+    }
 
     if (!InitAVContexts()) {
         return ret;
     }
+    if (start_param->seek_seconds > 0) {
+        AVStream* st = src_fmt_ctx_->streams[video_stream_idx_];
+        int64_t origin = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+        int64_t ts = origin + (int64_t)(start_param->seek_seconds / av_q2d(st->time_base));
+        if (av_seek_frame(src_fmt_ctx_, video_stream_idx_, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+            log_error("Seek to %.3fs in %s failed", start_param->seek_seconds, src_filename_.c_str());
+            return ret;
+        }
+    }
+    if (!start_param->fast_open) {
+        if (!OpenCodec()) return ret;
+        startup_.codec_init_ns = codec_init_ns_.load(std::memory_order_relaxed);
+    }
 
-    ring_fifo_av_frame_full_ = new RingFIFO<AVFrame*>(buffer_size_);
-    ring_fifo_av_frame_empty_ = new RingFIFO<AVFrame*>(buffer_size_);
-
-    for (int i = 0; i < buffer_size_; ++i) {
-        AVFrame* frame;
-
-        frame = av_frame_alloc();
-        if (!frame) return ret;
-
-        frame->format = src_pix_fmt_;
-        frame->width = width_;
-        frame->height = height_;
-
-        /* allocate the buffers for the frame data */
-        if (av_frame_get_buffer(frame, 0) < 0) {
-            log_error("Could not allocate frame data.");
+    output_width_ = start_param->output_width > 0 ? start_param->output_width : width_;
+    output_height_ = start_param->output_height > 0 ? start_param->output_height : height_;
+    if (output_width_ != width_ || output_height_ != height_) {
+        FusedConvertParam convert_param;
+        convert_param.direction = FUSED_I420_TO_RGB;
+        convert_param.rgb_order = FUSED_RGB_RAW;
+        convert_param.filter = FUSED_FILTER_BOX;
+        convert_param.src_width = width_;
+        convert_param.src_height = height_;
+        convert_param.dst_width = output_width_;
+        convert_param.dst_height = output_height_;
+        fused_converter_ = new FusedConverter();
+        if (!fused_converter_->Init(convert_param)) {
             return ret;
         }
-        ring_fifo_av_frame_empty_->Put(frame);
     }
 
-    worker_thread_ = std::thread(&VideoDecoder::ReadPacketAndDecode, this);
-    ret.width = width_;
-    ret.height = height_;
+    size_t frame_bytes = av_image_get_buffer_size(src_pix_fmt_, width_, height_, 1);
+    if (use_worker_thread_) {
+        ring_depth_.Init(start_param->min_ring_depth, start_param->max_ring_depth, ring_idle_frames_, frame_bytes);
+        // Sized for the deepest the ring can get, so Put never blocks on a frame that was just added.
+        ring_fifo_av_frame_full_ = new SpscRing<AVFrame*>(ring_depth_.MaxDepth());
+        ring_fifo_av_frame_empty_ = new SpscRing<AVFrame*>(ring_depth_.MaxDepth());
+
+        // avcodec_receive_frame replaces whatever buffers a frame holds with ones from the codec's own pool, so the
+        // ring only carries empty frame shells.
+        for (int i = 0; i < ring_depth_.Depth(); ++i) {
+            AVFrame* frame = av_frame_alloc();
+            if (!frame) return ret;
+            ring_fifo_av_frame_empty_->Put(frame);
+        }
+
+        worker_thread_ = std::thread(&VideoDecoder::ReadPacketAndDecode, this);
+    } else {
+        ring_depth_.Init(1, 1, ring_idle_frames_, frame_bytes);
+        decode_frame_ = av_frame_alloc();
+        if (!decode_frame_) return ret;
+    }
+    ret.width = output_width_;
+    ret.height = output_height_;
     ret.fps = av_q2d(src_fmt_ctx_->streams[video_stream_idx_]->avg_frame_rate);
+    ret.startup = startup_;
+    ret.success = true;
 
     return ret;
 }
@@ -179,33 +448,89 @@ MediaDecoderStartRet VideoDecoder::Start(void* param) {
 int VideoDecoder::DecodePacket(AVCodecContext* dec, AVPacket* pkt) {
     int ret = 0;
 
+    int64_t frame_index = metrics_.frames_in.load(std::memory_order_relaxed);
+    int64_t codec_begin_ns = MetricsNowNs();
     ret = avcodec_send_packet(dec, pkt);
+    int64_t codec_end_ns = MetricsNowNs();
+    pending_decode_ns_ += codec_end_ns - codec_begin_ns;
+    if (trace_) trace_->Record("send_packet", codec_begin_ns, codec_end_ns, frame_index);
     if (ret < 0) {
-        log_error("Error submitting a packet for decoding (%s)", poca_err2str(ret));
+        log_error("Error submitting a packet for decoding (%s)", poca_err2str(ret).c_str());
         return ret;
     }
 
     while (ret >= 0) {
-        AVFrame* frame = ring_fifo_av_frame_empty_->Get();
-        ret = avcodec_receive_frame(dec, frame);
+        if (decode_frame_ == nullptr && !TakeEmptyFrame()) {
+            ScopedStage wait(&metrics_.empty_ring.get_wait, trace_, "wait_empty_ring", frame_index);
+            if (!ring_fifo_av_frame_empty_->Get(decode_frame_)) {
+                return AVERROR_EOF;
+            }
+        }
+        codec_begin_ns = MetricsNowNs();
+        ret = avcodec_receive_frame(dec, decode_frame_);
+        codec_end_ns = MetricsNowNs();
+        pending_decode_ns_ += codec_end_ns - codec_begin_ns;
+        if (trace_) trace_->Record("receive_frame", codec_begin_ns, codec_end_ns, frame_index);
         if (ret < 0) {
             if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
-                ring_fifo_av_frame_empty_->Put(frame);
                 return 0;
             }
-            log_error("Error during decoding (%s)", poca_err2str(ret));
+            log_error("Error during decoding (%s)", poca_err2str(ret).c_str());
             return ret;
         }
-        frame->time_base = src_fmt_ctx_->streams[video_stream_idx_]->time_base;
-        ring_fifo_av_frame_full_->Put(frame);
+        metrics_.stages[STAGE_DECODE].Record(pending_decode_ns_);
+        pending_decode_ns_ = 0;
+        if (metrics_.frames_in.fetch_add(1, std::memory_order_relaxed) == 0) NoteFirstFrame();
+
+        decode_frame_->time_base = src_fmt_ctx_->streams[video_stream_idx_]->time_base;
+        {
+            ScopedStage wait(&metrics_.full_ring.put_wait, trace_, "wait_full_ring", frame_index);
+            if (!ring_fifo_av_frame_full_->Put(decode_frame_)) {
+                // Stopped, the frame stays with us and is freed when the worker exits.
+                return AVERROR_EOF;
+            }
+        }
+        readable_.NotifyIfArmed();
+        decode_frame_ = nullptr;
+        frame_index++;
     }
     return 0;
 }
 
+// Takes a free shell into decode_frame_ without waiting. When there is none and the depth may grow, allocates a new
+// one instead; when there have been spare shells for a while, releases one.
+bool VideoDecoder::TakeEmptyFrame() {
+    if (ring_fifo_av_frame_empty_->GetNoWait(decode_frame_)) {
+        AVFrame* spare;
+        if (ring_depth_.OnTake() && ring_fifo_av_frame_empty_->GetNoWait(spare)) {
+            av_frame_free(&spare);
+            ring_depth_.Shrink();
+        }
+        return true;
+    }
+    if (ring_fifo_av_frame_empty_->Closed() || !ring_depth_.OnStall()) return false;
+    decode_frame_ = av_frame_alloc();
+    if (decode_frame_ == nullptr) {
+        ring_depth_.Shrink();
+        return false;
+    }
+    log_debug("Decoder ring grown to %d frames", ring_depth_.Depth());
+    return true;
+}
+
 void VideoDecoder::ReadPacketAndDecode() {
     int ret = 0;
     AVRational* time_base = &src_fmt_ctx_->streams[video_stream_idx_]->time_base;
-    while (av_read_frame(src_fmt_ctx_, src_video_pkt_) >= 0) {
+    if (trace_) trace_->NameThread("decode worker");
+    placement_.Apply();
+    // Nothing is decoded then, ReadFrame sees the closed ring.
+    bool opened = codec_opened_ || OpenCodec();
+    while (opened) {
+        {
+            ScopedStage demux(&metrics_.stages[STAGE_DEMUX], trace_, "demux");
+            if (av_read_frame(src_fmt_ctx_, src_video_pkt_) < 0) break;
+        }
+
         log_debug("pts:%s pts_time:%s stream_index:%d", poca_ts2str(src_video_pkt_->pts).c_str(),
                   poca_ts2timestr(src_video_pkt_->pts, time_base).c_str(), src_video_pkt_->stream_index);
         if (src_video_pkt_->stream_index == video_stream_idx_) {
@@ -214,9 +539,60 @@ void VideoDecoder::ReadPacketAndDecode() {
         av_packet_unref(src_video_pkt_);
         if (ret < 0) break;
     }
-    DecodePacket(video_decode_ctx_, nullptr);
+    if (opened && !ring_fifo_av_frame_full_->Closed()) {
+        DecodePacket(video_decode_ctx_, nullptr);
+    }
     log_info("Decode finished");
-    ring_fifo_av_frame_full_->Put(nullptr);
+    av_frame_free(&decode_frame_);
+    ring_fifo_av_frame_full_->Close();
+    readable_.Notify();
+}
+
+bool VideoDecoder::DecodeInline(AVFrame* av_frame) {
+    int ret;
+    int64_t frame_index = metrics_.frames_in.load(std::memory_order_relaxed);
+    while (true) {
+        int64_t codec_begin_ns = MetricsNowNs();
+        ret = avcodec_receive_frame(video_decode_ctx_, av_frame);
+        int64_t codec_end_ns = MetricsNowNs();
+        pending_decode_ns_ += codec_end_ns - codec_begin_ns;
+        if (trace_) trace_->Record("receive_frame", codec_begin_ns, codec_end_ns, frame_index);
+        if (ret >= 0) break;
+        if (ret == AVERROR_EOF) return false;
+        if (ret != AVERROR(EAGAIN)) {
+            log_error("Error during decoding (%s)", poca_err2str(ret).c_str());
+            return false;
+        }
+
+        // The decoder needs more input.
+        if (demux_eof_) return false;
+        {
+            ScopedStage demux(&metrics_.stages[STAGE_DEMUX], trace_, "demux");
+            ret = av_read_frame(src_fmt_ctx_, src_video_pkt_);
+        }
+        if (ret < 0) {
+            demux_eof_ = true;
+            avcodec_send_packet(video_decode_ctx_, nullptr);
+            continue;
+        }
+        if (src_video_pkt_->stream_index == video_stream_idx_) {
+            codec_begin_ns = MetricsNowNs();
+            ret = avcodec_send_packet(video_decode_ctx_, src_video_pkt_);
+            codec_end_ns = MetricsNowNs();
+            pending_decode_ns_ += codec_end_ns - codec_begin_ns;
+            if (trace_) trace_->Record("send_packet", codec_begin_ns, codec_end_ns, frame_index);
+        }
+        av_packet_unref(src_video_pkt_);
+        if (ret < 0) {
+            log_error("Error submitting a packet for decoding (%s)", poca_err2str(ret).c_str());
+            return false;
+        }
+    }
+    metrics_.stages[STAGE_DECODE].Record(pending_decode_ns_);
+    pending_decode_ns_ = 0;
+    if (metrics_.frames_in.fetch_add(1, std::memory_order_relaxed) == 0) NoteFirstFrame();
+    av_frame->time_base = src_fmt_ctx_->streams[video_stream_idx_]->time_base;
+    return true;
 }
 
 bool VideoDecoder::ReadFrame(AVFrame* frame) {
@@ -224,19 +600,150 @@ bool VideoDecoder::ReadFrame(AVFrame* frame) {
         return false;
     }
 
-    AVFrame* av_frame = ring_fifo_av_frame_full_->Get();
+    int64_t frame_index = metrics_.frames_out.load(std::memory_order_relaxed);
+    AVFrame* av_frame;
+    if (use_worker_thread_) {
+        if (ring_fifo_av_frame_full_ == nullptr) {
+            return false;
+        }
+        ScopedStage wait(&metrics_.full_ring.get_wait, trace_, "wait_full_ring", frame_index);
+        if (!ring_fifo_av_frame_full_->GetNoWait(av_frame)) {
+            ring_depth_.OnStarved();
+            if (!ring_fifo_av_frame_full_->Get(av_frame)) {
+                return false;
+            }
+        }
+    } else {
+        if (decode_frame_ == nullptr || (!codec_opened_ && !OpenCodec()) || !DecodeInline(decode_frame_)) {
+            return false;
+        }
+        av_frame = decode_frame_;
+    }
+    DeliverFrame(av_frame, frame, frame_index);
+    return true;
+}
 
-    if (av_frame == nullptr) {
-        return false;
+MediaIOStatus VideoDecoder::TryReadFrame(AVFrame* frame) {
+    if (frame == nullptr) {
+        return MEDIA_IO_ERROR;
+    }
+    if (!use_worker_thread_) {
+        return ReadFrame(frame) ? MEDIA_IO_OK : MEDIA_IO_END;
+    }
+    if (ring_fifo_av_frame_full_ == nullptr) {
+        return MEDIA_IO_END;
     }
 
-    libyuv::I420ToRAW(av_frame->data[0], width_, av_frame->data[1], width_ >> 1, av_frame->data[2], width_ >> 1,
-                      frame->data[0], width_ * 3, width_, height_);
+    AVFrame* av_frame;
+    if (!ring_fifo_av_frame_full_->GetNoWait(av_frame)) {
+        ring_depth_.OnStarved();
+        readable_.Arm();
+        // Read before the retry, so closed and still empty afterwards means drained.
+        bool closed = ring_fifo_av_frame_full_->Closed();
+        if (!ring_fifo_av_frame_full_->GetNoWait(av_frame)) {
+            return closed ? MEDIA_IO_END : MEDIA_IO_WOULD_BLOCK;
+        }
+    }
+    DeliverFrame(av_frame, frame, metrics_.frames_out.load(std::memory_order_relaxed));
+    return MEDIA_IO_OK;
+}
+
+int VideoDecoder::ReadableFd() { return use_worker_thread_ ? readable_.Fd() : -1; }
+
+// Converts a decoded frame into the caller's RGB frame and recycles the decoded one.
+void VideoDecoder::DeliverFrame(AVFrame* av_frame, AVFrame* frame, int64_t frame_index) {
+    {
+        ScopedStage convert(&metrics_.stages[STAGE_CONVERT], trace_, "convert", frame_index);
+        if (fused_converter_ != nullptr) {
+            fused_converter_->I420ToRgb(av_frame->data[0], av_frame->linesize[0], av_frame->data[1],
+                                        av_frame->linesize[1], av_frame->data[2], av_frame->linesize[2],
+                                        frame->data[0], frame->linesize[0]);
+        } else {
+            libyuv::I420ToRAW(av_frame->data[0], av_frame->linesize[0], av_frame->data[1], av_frame->linesize[1],
+                              av_frame->data[2], av_frame->linesize[2], frame->data[0], frame->linesize[0], width_,
+                              height_);
+        }
+    }
 
     frame->pts = av_frame->pts * 1000 * av_q2d(av_frame->time_base);
     frame->time_base = (AVRational){1, 1000};
 
-    ring_fifo_av_frame_empty_->Put(av_frame);
+    // Hand the decoded buffer back to the codec pool now rather than when the shell is reused.
+    av_frame_unref(av_frame);
+    if (use_worker_thread_) {
+        ScopedStage wait(&metrics_.empty_ring.put_wait, trace_, "put_empty_ring", frame_index);
+        ring_fifo_av_frame_empty_->Put(av_frame);
+    }
+    metrics_.frames_out.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool VideoDecoder::Stop() {
+    if (use_worker_thread_) {
+        if (ring_fifo_av_frame_full_ == nullptr) {
+            return false;
+        }
 
+        // Closing both rings unblocks the worker wherever it waits.
+        ring_fifo_av_frame_empty_->Close();
+        ring_fifo_av_frame_full_->Close();
+        worker_thread_.join();
+
+        AVFrame* frame;
+        while (ring_fifo_av_frame_full_->GetNoWait(frame)) {
+            av_frame_free(&frame);
+        }
+        while (ring_fifo_av_frame_empty_->GetNoWait(frame)) {
+            av_frame_free(&frame);
+        }
+        delete ring_fifo_av_frame_full_;
+        delete ring_fifo_av_frame_empty_;
+        ring_fifo_av_frame_full_ = nullptr;
+        ring_fifo_av_frame_empty_ = nullptr;
+    } else {
+        if (decode_frame_ == nullptr) {
+            return false;
+        }
+        av_frame_free(&decode_frame_);
+    }
+
+    ring_depth_.Reset();
+    placement_.Reset();
+
+    avcodec_free_context(&video_decode_ctx_);
+    av_packet_free(&src_video_pkt_);
+    avformat_close_input(&src_fmt_ctx_);
+    delete fused_converter_;
+    fused_converter_ = nullptr;
+
+    if (trace_ != nullptr) {
+        trace_->Dump(trace_filename_);
+        delete trace_;
+        trace_ = nullptr;
+    }
     return true;
+}
+
+DecoderStartupTiming VideoDecoder::GetStartupTiming() {
+    DecoderStartupTiming timing = startup_;
+    timing.codec_init_ns = codec_init_ns_.load(std::memory_order_relaxed);
+    timing.first_frame_ns = first_frame_ns_.load(std::memory_order_relaxed);
+    timing.total_ns = total_ns_.load(std::memory_order_relaxed);
+    return timing;
+}
+
+PipelineMetricsSnapshot VideoDecoder::GetMetrics() {
+    PipelineMetricsSnapshot snapshot = metrics_.Snapshot(src_filename_);
+    if (ring_fifo_av_frame_full_ != nullptr) {
+        snapshot.full_ring.capacity = ring_fifo_av_frame_full_->Capacity();
+        snapshot.full_ring.occupancy = ring_fifo_av_frame_full_->Size();
+    }
+    if (ring_fifo_av_frame_empty_ != nullptr) {
+        snapshot.empty_ring.capacity = ring_fifo_av_frame_empty_->Capacity();
+        snapshot.empty_ring.occupancy = ring_fifo_av_frame_empty_->Size();
+    }
+    snapshot.ring_depth = ring_depth_.Depth();
+    snapshot.pinned_bytes = ring_depth_.PinnedBytes();
+    snapshot.cores = placement_.CoreList();
+    snapshot.numa_node = placement_.NumaNode();
+    return snapshot;
 }
\ No newline at end of file
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Shared result format of the benchmarks: one JSON file per run, and a compare mode that flags cases whose p50
+// latency grew or whose throughput dropped by more than a threshold against a saved run.
+
+struct BenchmarkResult {
+    std::string name;
+    int64_t calls = 0;
+    int64_t min_ns = 0;
+    int64_t mean_ns = 0;
+    int64_t p50_ns = 0;
+    int64_t p90_ns = 0;
+    int64_t p99_ns = 0;
+    double fps = 0;
+    // Only written when set.
+    double cpu_seconds = -1;
+    int64_t peak_rss_kb = -1;
+};
+
+inline int64_t BenchmarkNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Fills the latency fields of result from per-call samples, sorting them in place.
+inline void SummarizeSamples(std::vector<int64_t>& samples, BenchmarkResult& result) {
+    result.calls = samples.size();
+    if (samples.empty()) return;
+    std::sort(samples.begin(), samples.end());
+    int64_t sum = 0;
+    for (int64_t s : samples) sum += s;
+    auto percentile = [&](double p) { return samples[std::min(samples.size() - 1, (size_t)(samples.size() * p))]; };
+    result.min_ns = samples.front();
+    result.mean_ns = sum / (int64_t)samples.size();
+    result.p50_ns = percentile(0.5);
+    result.p90_ns = percentile(0.9);
+    result.p99_ns = percentile(0.99);
+}
+
+inline bool WriteBenchmarkJson(const std::string& filename, const std::vector<BenchmarkResult>& results) {
+    std::ofstream ofs(filename);
+    if (!ofs.is_open()) {
+        printf("could not open %s\n", filename.c_str());
+        return false;
+    }
+    ofs << "{\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchmarkResult& r = results[i];
+        ofs << "    {\"name\": \"" << r.name << "\", \"calls\": " << r.calls << ", \"min_ns\": " << r.min_ns
+            << ", \"mean_ns\": " << r.mean_ns << ", \"p50_ns\": " << r.p50_ns << ", \"p90_ns\": " << r.p90_ns
+            << ", \"p99_ns\": " << r.p99_ns << ", \"fps\": " << r.fps;
+        if (r.cpu_seconds >= 0) ofs << ", \"cpu_seconds\": " << r.cpu_seconds;
+        if (r.peak_rss_kb >= 0) ofs << ", \"peak_rss_kb\": " << r.peak_rss_kb;
+        ofs << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    ofs << "  ]\n}\n";
+    return true;
+}
+
+// Reads back name -> (p50_ns, fps) from a file written by WriteBenchmarkJson. Not a general JSON parser.
+inline bool ReadBenchmarkBaseline(const std::string& filename, std::map<std::string, BenchmarkResult>& baseline) {
+    std::ifstream ifs(filename);
+    if (!ifs.is_open()) {
+        printf("could not open %s\n", filename.c_str());
+        return false;
+    }
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    std::string text = ss.str();
+    auto number_after = [&](const char* key, size_t from, size_t to) -> const char* {
+        size_t pos = text.find(key, from);
+        if (pos == std::string::npos || pos > to) return nullptr;
+        return text.c_str() + pos + strlen(key);
+    };
+    size_t pos = 0;
+    while ((pos = text.find("\"name\": \"", pos)) != std::string::npos) {
+        pos += strlen("\"name\": \"");
+        size_t end = text.find('"', pos);
+        if (end == std::string::npos) break;
+        size_t record_end = text.find('}', end);
+        BenchmarkResult r;
+        r.name = text.substr(pos, end - pos);
+        const char* p50 = number_after("\"p50_ns\": ", end, record_end);
+        const char* fps = number_after("\"fps\": ", end, record_end);
+        if (p50) r.p50_ns = atoll(p50);
+        if (fps) r.fps = atof(fps);
+        baseline[r.name] = r;
+        pos = end;
+    }
+    return true;
+}
+
+// Returns the number of regressed cases, or -1 when the baseline can not be read.
+inline int CompareBenchmarkResults(const std::vector<BenchmarkResult>& results, const std::string& baseline_file,
+                                   double threshold) {
+    std::map<std::string, BenchmarkResult> baseline;
+    if (!ReadBenchmarkBaseline(baseline_file, baseline)) return -1;
+
+    int regressions = 0;
+    for (const BenchmarkResult& r : results) {
+        auto it = baseline.find(r.name);
+        if (it == baseline.end() || it->second.p50_ns <= 0) {
+            printf("\033[0;33mNEW\033[0m        %s\n", r.name.c_str());
+            continue;
+        }
+        const BenchmarkResult& b = it->second;
+        double latency_change = (double)r.p50_ns / b.p50_ns - 1.0;
+        double fps_change = b.fps > 0 ? r.fps / b.fps - 1.0 : 0;
+        if (latency_change > threshold || fps_change < -threshold) {
+            regressions++;
+            printf("\033[0;31mREGRESSION\033[0m %s p50 %.1lfus -> %.1lfus (%+.1lf%%), %.1lf -> %.1lf fps (%+.1lf%%)\n",
+                   r.name.c_str(), b.p50_ns / 1e3, r.p50_ns / 1e3, latency_change * 100, b.fps, r.fps,
+                   fps_change * 100);
+        } else if (latency_change < -threshold) {
+            printf("\033[0;32mFASTER\033[0m     %s p50 %.1lfus -> %.1lfus (%+.1lf%%), %.1lf -> %.1lf fps (%+.1lf%%)\n",
+                   r.name.c_str(), b.p50_ns / 1e3, r.p50_ns / 1e3, latency_change * 100, b.fps, r.fps,
+                   fps_change * 100);
+        }
+    }
+    printf("%d regression(s) over %.0lf%% against %s\n", regressions, threshold * 100, baseline_file.c_str());
+    return regressions;
+}
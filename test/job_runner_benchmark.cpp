@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "job_runner.h"
+
+// JobRunner admission under several budgets, with jobs that only sleep, so no media is needed.
+//
+//   job-runner-benchmark
+//
+// Every job checks, once admitted, that its core share lies within the budget and max_job_cores, and that the cores,
+// memory and job count in use do not exceed the budget (memory only while more than one job runs, a job larger than
+// the whole budget runs alone). Reports the share range, the peak number of jobs running and the time to drain the
+// queue per budget; any violation exits with 2.
+
+struct Scenario {
+    const char* name;
+    JobBudget budget;
+    int jobs;
+    int width;
+    int height;
+};
+
+static const int job_ms = 20;
+
+static bool RunScenario(const Scenario& scenario) {
+    JobRunner runner(scenario.budget);
+    int64_t memory = JobRunner::EstimateTranscodeMemory(scenario.width, scenario.height);
+    std::mutex mux;
+    int min_share = 1 << 30;
+    int max_share = 0;
+    size_t peak_running = 0;
+    std::atomic<int> violations(0);
+
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < scenario.jobs; ++i) {
+        runner.Submit("job" + std::to_string(i), memory, [&](const JobResources& resources) {
+            const JobBudget& budget = scenario.budget;
+            JobRunnerStats stats = runner.GetStats();
+            bool ok = resources.cores >= 1 && resources.cores <= budget.cores;
+            ok = ok && (budget.max_job_cores <= 0 || resources.cores <= std::max(2, budget.max_job_cores));
+            ok = ok && resources.decoder_threads >= 1 && resources.encoder_threads >= 1;
+            ok = ok && stats.cores_in_use <= budget.cores;
+            ok = ok && (budget.max_running_jobs <= 0 || (int)stats.running <= budget.max_running_jobs);
+            ok = ok && (budget.memory_bytes <= 0 || stats.running <= 1 || stats.memory_in_use <= budget.memory_bytes);
+            if (!ok) {
+                printf("  \033[0;31m%s: %d cores admitted, %d of %d in use, %zu running\033[0m\n", scenario.name,
+                       resources.cores, stats.cores_in_use, budget.cores, stats.running);
+                violations++;
+            }
+            {
+                std::unique_lock<std::mutex> lock(mux);
+                min_share = std::min(min_share, resources.cores);
+                max_share = std::max(max_share, resources.cores);
+                peak_running = std::max(peak_running, stats.running);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(job_ms));
+            return true;
+        });
+    }
+    runner.WaitAll();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    JobRunnerStats stats = runner.GetStats();
+    if (stats.completed != (uint64_t)scenario.jobs || stats.cores_in_use != 0 || stats.memory_in_use != 0) {
+        violations++;
+    }
+    printf("\033[1;33mBudget\033[0m [\033[0;32;34m%s\033[0m] %d jobs, %d-%d cores each, peak %zu running, "
+           "queue wait p99 %.1fms, drained in \033[0;36m%.3lfs\033[0m%s\n",
+           scenario.name, scenario.jobs, min_share, max_share, peak_running, stats.queue_wait.p99_ns / 1e6, seconds,
+           violations > 0 ? " \033[0;31mBUDGET EXCEEDED\033[0m" : "");
+    return violations == 0;
+}
+
+int main() {
+    std::vector<Scenario> scenarios;
+    JobBudget budget;
+    budget.cores = 1;
+    scenarios.push_back({"1 core", budget, 4, 1280, 720});
+    budget.cores = 3;
+    scenarios.push_back({"3 cores", budget, 6, 1280, 720});
+    budget.cores = 16;
+    scenarios.push_back({"16 cores", budget, 12, 1920, 1080});
+    budget.max_running_jobs = 3;
+    scenarios.push_back({"16 cores, 3 jobs", budget, 12, 1920, 1080});
+    budget.max_running_jobs = 0;
+    budget.memory_bytes = JobRunner::EstimateTranscodeMemory(3840, 2160) * 2;
+    scenarios.push_back({"16 cores, 2 4K jobs of memory", budget, 8, 3840, 2160});
+    budget.memory_bytes = JobRunner::EstimateTranscodeMemory(1920, 1080) / 2;
+    scenarios.push_back({"16 cores, memory below one job", budget, 4, 1920, 1080});
+
+    bool ok = true;
+    for (const Scenario& scenario : scenarios) {
+        ok = RunScenario(scenario) && ok;
+    }
+    return ok ? 0 : 2;
+}
@@ -0,0 +1,106 @@
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include "ring_fifo.h"
+#include "spsc_ring.h"
+
+// Moves |count| pointers from one producer thread to one consumer thread and reports the throughput.
+// Pointers are what the decoder and recorder hand over, so that is what we measure with.
+
+typedef uint8_t *Item;
+
+const int64_t item_count = 10000000;
+const int batch_size = 16;
+
+int64_t RingFIFOTransfer(int ring_size) {
+    RingFIFO<Item> ring(ring_size);
+    int64_t sum = 0;
+    std::thread consumer([&] {
+        while (true) {
+            Item item = ring.Get();
+            if (item == nullptr) break;
+            sum += reinterpret_cast<intptr_t>(item);
+        }
+    });
+    for (int64_t i = 1; i <= item_count; ++i) {
+        ring.Put(reinterpret_cast<Item>(i));
+    }
+    ring.Put(nullptr);
+    consumer.join();
+    return sum;
+}
+
+int64_t SpscRingTransfer(int ring_size) {
+    SpscRing<Item> ring(ring_size);
+    int64_t sum = 0;
+    std::thread consumer([&] {
+        Item item;
+        while (ring.Get(item)) {
+            sum += reinterpret_cast<intptr_t>(item);
+        }
+    });
+    for (int64_t i = 1; i <= item_count; ++i) {
+        ring.Put(reinterpret_cast<Item>(i));
+    }
+    ring.Close();
+    consumer.join();
+    return sum;
+}
+
+int64_t SpscRingBatchTransfer(int ring_size) {
+    SpscRing<Item> ring(ring_size);
+    int64_t sum = 0;
+    std::thread consumer([&] {
+        Item items[batch_size];
+        size_t n;
+        while ((n = ring.GetBatch(items, batch_size)) > 0) {
+            for (size_t i = 0; i < n; ++i) {
+                sum += reinterpret_cast<intptr_t>(items[i]);
+            }
+        }
+    });
+    Item items[batch_size];
+    for (int64_t i = 1; i <= item_count; i += batch_size) {
+        int n = 0;
+        for (; n < batch_size && i + n <= item_count; ++n) {
+            items[n] = reinterpret_cast<Item>(i + n);
+        }
+        ring.PutBatch(items, n);
+    }
+    ring.Close();
+    consumer.join();
+    return sum;
+}
+
+int main() {
+    const int64_t expected = item_count * (item_count + 1) / 2;
+
+    std::function<void(int, std::function<int64_t(int)>, std::string)> benchMark =
+        [&](int ring_size, std::function<int64_t(int)> function, std::string func_name) {
+            auto t1 = std::chrono::steady_clock::now();
+            int64_t sum = function(ring_size);
+            auto t2 = std::chrono::steady_clock::now();
+
+            double seconds = std::chrono::duration<double>(t2 - t1).count();
+            printf(
+                "\033[1;33mFunction\033[0m [\033[0;32;34m%s\033[0m] ring size [\033[0;32m%d\033[0m] "
+                "moved %" PRId64 " items in \033[0;36m%.3lfs\033[0m (%.1lf Mops/s)%s\n",
+                func_name.c_str(), ring_size, item_count, seconds, item_count / seconds / 1e6,
+                sum == expected ? "" : " \033[0;31mCHECKSUM MISMATCH\033[0m");
+        };
+#define RunBenchMark(size, f) benchMark(size, f, #f);
+
+    // 10 is what the decoder and recorder use, 1024 shows the uncontended cost.
+    RunBenchMark(10, RingFIFOTransfer);
+    RunBenchMark(10, SpscRingTransfer);
+    RunBenchMark(10, SpscRingBatchTransfer);
+    RunBenchMark(1024, RingFIFOTransfer);
+    RunBenchMark(1024, SpscRingTransfer);
+    RunBenchMark(1024, SpscRingBatchTransfer);
+    return 0;
+}
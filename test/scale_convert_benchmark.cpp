@@ -1,200 +1,532 @@
 #include <libyuv.h>
 
-#include <chrono>
-#include <cmath>
-#include <functional>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <vector>
+
+#include "benchmark_report.h"
+#include "fused_convert.h"
 
 extern "C" {
-#include <libavcodec/avcodec.h>
-#include <libavformat/avformat.h>
-#include <libavutil/timestamp.h>
+#include <libavutil/avutil.h>
 #include <libswscale/swscale.h>
 }
 
-typedef void (*BenchmarkFunction)(uint8_t *, int, int, uint8_t *, int, int);
-
-void LibyuvRawToI420(uint8_t *src, int src_width, int src_height, uint8_t *dst,
-                     int dst_width, int dst_height) {
-    if (src_width == dst_width && src_height == dst_height) {
-        libyuv::RAWToI420(
-            src, src_width * 3, dst, src_width, dst + src_width * src_height,
-            src_width >> 1,
-            dst + src_width * src_height + (src_width >> 1) * (src_height >> 1),
-            src_width >> 1, src_width, src_height);
-    } else {
-        static uint8_t *tmp_buf = new uint8_t[3840 * 2160 * 4];
-        libyuv::RAWToI420(
-            src, src_width * 3, tmp_buf, src_width, tmp_buf + src_width * src_height,
-            src_width >> 1,
-            tmp_buf + src_width * src_height + (src_width >> 1) * (src_height >> 1),
-            src_width >> 1, src_width, src_height);
-        libyuv::I420Scale(
-            tmp_buf, src_width, tmp_buf + src_width * src_height, src_width >> 1,
-            tmp_buf + src_width * src_height + (src_width >> 1) * (src_height >> 1),
-            src_width >> 1, src_width, src_height, dst, dst_width,
-            dst + dst_width * dst_height, dst_width >> 1,
-            dst + dst_width * dst_height + (dst_height >> 1) * (dst_width >> 1),
-            dst_width >> 1, dst_width, dst_height, libyuv::kFilterNone);
-    }
-}
-
-void LibyuvI420ToRaw(uint8_t *src, int src_width, int src_height, uint8_t *dst,
-                     int dst_width, int dst_height) {
-    if (src_width == dst_width && src_height == dst_height) {
-        libyuv::I420ToRAW(
-            src, src_width, src + src_width * src_height, src_width >> 1,
-            src + src_width * src_height + (src_width >> 1) * (src_height >> 1),
-            src_width >> 1, dst, dst_width * 3, src_width, src_height);
-    } else {
-        static uint8_t *tmp_buf = new uint8_t[3840 * 2160 * 4];
-        libyuv::I420Scale(
-            src, src_width, src + src_width * src_height, src_width >> 1,
-            src + src_width * src_height + (src_width >> 1) * (src_height >> 1),
-            src_width >> 1, src_width, src_height, tmp_buf, dst_width,
-            tmp_buf + dst_width * dst_height, dst_width >> 1,
-            tmp_buf + dst_width * dst_height + (dst_height >> 1) * (dst_width >> 1),
-            dst_width >> 1, dst_width, dst_height, libyuv::kFilterNone);
-        libyuv::I420ToRAW(
-            tmp_buf, dst_width, tmp_buf + dst_width * dst_height, dst_width >> 1,
-            tmp_buf + dst_width * dst_height + (dst_height >> 1) * (dst_width >> 1),
-            dst_width >> 1, dst, dst_width * 3, dst_width, dst_height);
-    }
-}
-
-void FFmpegRGB24ToYUV420P(uint8_t *src, int src_width, int src_height, uint8_t *dst,
-                          int dst_width, int dst_height) {
-    SwsContext *sws_ctx =
-        sws_getContext(src_width, src_height, AV_PIX_FMT_RGB24, dst_width, dst_height,
-                       AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR, 0, 0, 0);
-
-    uint8_t *srcSlice[1] = {src};
-    int srcStride[1] = {src_width * 3};
-
-    uint8_t *dstSlice[3] = {
-        dst, dst + dst_width * dst_height,
-        dst + dst_width * dst_height + (dst_height >> 1) * (dst_width >> 1)};
-    int dstStride[3] = {dst_width, dst_width >> 1, dst_width >> 1};
-
-    sws_scale(sws_ctx, srcSlice, srcStride, 0, src_height, dstSlice, dstStride);
-
-    sws_freeContext(sws_ctx);
-}
-
-void FFmpegYUV420PToRGB24(uint8_t *src, int src_width, int src_height, uint8_t *dst,
-                          int dst_width, int dst_height) {
-    SwsContext *sws_ctx =
-        sws_getContext(src_width, src_height, AV_PIX_FMT_YUV420P, dst_width, dst_height,
-                       AV_PIX_FMT_RGB24, SWS_FAST_BILINEAR, 0, 0, 0);
-
-    uint8_t *dstSlice[1] = {dst};
-    int dstStride[1] = {dst_width * 3};
-
-    uint8_t *srcSlice[3] = {
-        src, src + src_width * src_height,
-        src + src_width * src_height + (src_height >> 1) * (src_width >> 1)};
-    int srcStride[3] = {src_width, src_width >> 1, src_width >> 1};
-
-    sws_scale(sws_ctx, srcSlice, srcStride, 0, src_height, dstSlice, dstStride);
-
-    sws_freeContext(sws_ctx);
+// Colour conversion / scaling benchmark.
+//
+//   scale-convert-benchmark [--json out.json] [--compare baseline.json] [--threshold 0.1] [--filter substr]
+//                           [--warmup n] [--iterations n] [--min-time seconds] [--threads 1,2,4]
+//
+// Every case converts one frame per call. With N threads, N workers convert their own frames concurrently, which is
+// what N sessions on one host look like; per-call percentiles are over all workers, fps is the aggregate.
+// --compare exits with 1 if any case's p50 or fps got worse than the baseline by more than the threshold.
+//
+// Before timing anything, every fused kernel variant the CPU supports is checked against the scalar one, which must
+// match exactly, the scalar one against libyuv at the same size, and steep box downscales against exact averages; a
+// mismatch exits with 2.
+
+struct ConvertState {
+    int src_width;
+    int src_height;
+    int dst_width;
+    int dst_height;
+    // Intermediate I420 frame for the two-pass libyuv variants, sized for this case.
+    std::vector<uint8_t> tmp;
+    // Created once per worker, reused by every call.
+    SwsContext *sws_ctx = nullptr;
+    FusedConverter *fused = nullptr;
+};
+
+typedef void (*ConvertFunction)(ConvertState &, const uint8_t *, uint8_t *);
+
+static int I420Size(int width, int height) { return width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2); }
+
+struct I420Planes {
+    uint8_t *y;
+    uint8_t *u;
+    uint8_t *v;
+    int stride_y;
+    int stride_uv;
+};
+
+static I420Planes I420Layout(const uint8_t *buf, int width, int height) {
+    I420Planes p;
+    p.stride_y = width;
+    p.stride_uv = (width + 1) / 2;
+    p.y = const_cast<uint8_t *>(buf);
+    p.u = p.y + width * height;
+    p.v = p.u + p.stride_uv * ((height + 1) / 2);
+    return p;
 }
 
-int main(int argc, char **argv) {
-    int width = 1920;
-    int height = 1080;
+template <libyuv::FilterMode kFilter>
+void LibyuvRawToI420(ConvertState &s, const uint8_t *src, uint8_t *dst) {
+    I420Planes d = I420Layout(dst, s.dst_width, s.dst_height);
+    if (s.src_width == s.dst_width && s.src_height == s.dst_height) {
+        libyuv::RAWToI420(src, s.src_width * 3, d.y, d.stride_y, d.u, d.stride_uv, d.v, d.stride_uv, s.src_width,
+                          s.src_height);
+        return;
+    }
+    I420Planes t = I420Layout(s.tmp.data(), s.src_width, s.src_height);
+    libyuv::RAWToI420(src, s.src_width * 3, t.y, t.stride_y, t.u, t.stride_uv, t.v, t.stride_uv, s.src_width,
+                      s.src_height);
+    libyuv::I420Scale(t.y, t.stride_y, t.u, t.stride_uv, t.v, t.stride_uv, s.src_width, s.src_height, d.y, d.stride_y,
+                      d.u, d.stride_uv, d.v, d.stride_uv, s.dst_width, s.dst_height, kFilter);
+}
 
-    uint8_t *src = new uint8_t[width * height * 3];
-    uint8_t *dst = new uint8_t[3840 * 2160 * 4];
+template <libyuv::FilterMode kFilter>
+void LibyuvI420ToRaw(ConvertState &s, const uint8_t *src, uint8_t *dst) {
+    I420Planes p = I420Layout(src, s.src_width, s.src_height);
+    if (s.src_width == s.dst_width && s.src_height == s.dst_height) {
+        libyuv::I420ToRAW(p.y, p.stride_y, p.u, p.stride_uv, p.v, p.stride_uv, dst, s.dst_width * 3, s.src_width,
+                          s.src_height);
+        return;
+    }
+    I420Planes t = I420Layout(s.tmp.data(), s.dst_width, s.dst_height);
+    libyuv::I420Scale(p.y, p.stride_y, p.u, p.stride_uv, p.v, p.stride_uv, s.src_width, s.src_height, t.y, t.stride_y,
+                      t.u, t.stride_uv, t.v, t.stride_uv, s.dst_width, s.dst_height, kFilter);
+    libyuv::I420ToRAW(t.y, t.stride_y, t.u, t.stride_uv, t.v, t.stride_uv, dst, s.dst_width * 3, s.dst_width,
+                      s.dst_height);
+}
 
-    std::function<void(int, int, BenchmarkFunction, std::string)> benchMark =
-        [&](int dst_width, int dst_height, BenchmarkFunction function,
-            std::string func_name) {
-            int64_t t1 = std::chrono::duration_cast<std::chrono::milliseconds>(
-                             std::chrono::system_clock::now().time_since_epoch())
-                             .count();
+template <FusedConvertIsa kIsa, FusedScaleFilter kFilter>
+void FusedRawToI420(ConvertState &s, const uint8_t *src, uint8_t *dst) {
+    if (s.fused == nullptr) {
+        FusedConvertParam param;
+        param.direction = FUSED_RGB_TO_I420;
+        param.filter = kFilter;
+        param.src_width = s.src_width;
+        param.src_height = s.src_height;
+        param.dst_width = s.dst_width;
+        param.dst_height = s.dst_height;
+        s.fused = new FusedConverter();
+        s.fused->Init(param);
+        s.fused->SetIsa(kIsa);
+    }
+    I420Planes d = I420Layout(dst, s.dst_width, s.dst_height);
+    s.fused->RgbToI420(src, s.src_width * 3, d.y, d.stride_y, d.u, d.stride_uv, d.v, d.stride_uv);
+}
 
-            for (int i = 0; i < 1000; i++) {
-                function(src, width, height, dst, dst_width, dst_height);
-            }
+template <FusedConvertIsa kIsa, FusedScaleFilter kFilter>
+void FusedI420ToRaw(ConvertState &s, const uint8_t *src, uint8_t *dst) {
+    if (s.fused == nullptr) {
+        FusedConvertParam param;
+        param.direction = FUSED_I420_TO_RGB;
+        param.filter = kFilter;
+        param.src_width = s.src_width;
+        param.src_height = s.src_height;
+        param.dst_width = s.dst_width;
+        param.dst_height = s.dst_height;
+        s.fused = new FusedConverter();
+        s.fused->Init(param);
+        s.fused->SetIsa(kIsa);
+    }
+    I420Planes p = I420Layout(src, s.src_width, s.src_height);
+    s.fused->I420ToRgb(p.y, p.stride_y, p.u, p.stride_uv, p.v, p.stride_uv, dst, s.dst_width * 3);
+}
 
-            int64_t t2 = std::chrono::duration_cast<std::chrono::milliseconds>(
-                             std::chrono::system_clock::now().time_since_epoch())
-                             .count();
-            printf(
-                "\033[1;33mFunction\033[0m [\033[0;32;34m%s\033[0m] from "
-                "[\033[0;32m%dx%d\033[0m] to [\033[0;32m%dx%d\033[0m] used "
-                "\033[0;36m%.3lfs\033[0m\n",
-                func_name.c_str(), width, height, dst_width, dst_height,
-                (t2 - t1) / 1000.0);
-        };
-#define RunBenchMark(dw, dh, f) benchMark(dw, dh, f, #f);
+void FFmpegRGB24ToYUV420P(ConvertState &s, const uint8_t *src, uint8_t *dst) {
+    s.sws_ctx = sws_getCachedContext(s.sws_ctx, s.src_width, s.src_height, AV_PIX_FMT_RGB24, s.dst_width, s.dst_height,
+                                     AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+    const uint8_t *src_slice[1] = {src};
+    int src_stride[1] = {s.src_width * 3};
+    I420Planes d = I420Layout(dst, s.dst_width, s.dst_height);
+    uint8_t *dst_slice[3] = {d.y, d.u, d.v};
+    int dst_stride[3] = {d.stride_y, d.stride_uv, d.stride_uv};
+    sws_scale(s.sws_ctx, src_slice, src_stride, 0, s.src_height, dst_slice, dst_stride);
+}
 
-    // init rgb24 buffer
+void FFmpegYUV420PToRGB24(ConvertState &s, const uint8_t *src, uint8_t *dst) {
+    s.sws_ctx = sws_getCachedContext(s.sws_ctx, s.src_width, s.src_height, AV_PIX_FMT_YUV420P, s.dst_width,
+                                     s.dst_height, AV_PIX_FMT_RGB24, SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+    I420Planes p = I420Layout(src, s.src_width, s.src_height);
+    const uint8_t *src_slice[3] = {p.y, p.u, p.v};
+    int src_stride[3] = {p.stride_y, p.stride_uv, p.stride_uv};
+    uint8_t *dst_slice[1] = {dst};
+    int dst_stride[1] = {s.dst_width * 3};
+    sws_scale(s.sws_ctx, src_slice, src_stride, 0, s.src_height, dst_slice, dst_stride);
+}
+
+enum FrameFormat { FORMAT_RGB24, FORMAT_I420 };
+
+struct ConvertCase {
+    const char *name;
+    ConvertFunction function;
+    FrameFormat src_format;
+    FrameFormat dst_format;
+    // Skipped when the CPU lacks it.
+    FusedConvertIsa isa;
+};
+
+static int FrameSize(FrameFormat format, int width, int height) {
+    return format == FORMAT_RGB24 ? width * height * 3 : I420Size(width, height);
+}
+
+// Same four-quadrant pictures the benchmark always used, so content dependent paths stay comparable.
+static void FillFrame(FrameFormat format, int width, int height, uint8_t *buf) {
+    if (format == FORMAT_RGB24) {
+        for (int i = 0; i < width * height; i++) {
+            int x = i % width;
+            int y = i / width;
+            bool left = x < width / 2;
+            bool top = y < height / 2;
+            uint8_t r = left ? (top ? 12 : 233) : (top ? 233 : 12);
+            uint8_t g = left ? (top ? 233 : 12) : (top ? 12 : 233);
+            uint8_t b = left ? 12 : 233;
+            buf[i * 3 + 0] = r;
+            buf[i * 3 + 1] = g;
+            buf[i * 3 + 2] = b;
+        }
+        return;
+    }
+    I420Planes p = I420Layout(buf, width, height);
     for (int i = 0; i < width * height; i++) {
         int x = i % width;
         int y = i / width;
-        if (x < width / 2) {
-            if (y < height / 2) {
-                src[i * 3 + 0] = 12;
-                src[i * 3 + 1] = 233;
-                src[i * 3 + 2] = 12;
-            } else {
-                src[i * 3 + 0] = 233;
-                src[i * 3 + 1] = 12;
-                src[i * 3 + 2] = 12;
-            }
-        } else if (x) {
-            if (y < height / 2) {
-                src[i * 3 + 0] = 233;
-                src[i * 3 + 1] = 12;
-                src[i * 3 + 2] = 233;
-            } else {
-                src[i * 3 + 0] = 12;
-                src[i * 3 + 1] = 233;
-                src[i * 3 + 2] = 233;
-            }
+        p.y[i] = x < width / 2 ? (y < height / 2 ? 25 : 178) : (y < height / 2 ? 234 : 75);
+    }
+    int chroma_height = (height + 1) / 2;
+    for (int j = 0; j < chroma_height; ++j) {
+        for (int i = 0; i < p.stride_uv; ++i) {
+            p.u[j * p.stride_uv + i] = 254 * i / p.stride_uv;
+            p.v[j * p.stride_uv + i] = 254 * j / chroma_height;
         }
     }
+}
 
-    // RGB24 To YUV420P
-    RunBenchMark(width, height, LibyuvRawToI420);
-    RunBenchMark(width, height, FFmpegRGB24ToYUV420P);
-    RunBenchMark(width / 4, height / 4, LibyuvRawToI420);
-    RunBenchMark(width / 4, height / 4, FFmpegRGB24ToYUV420P);
+// Every fused variant must reproduce the scalar kernels exactly. The scalar kernels themselves are checked against
+// libyuv at 1:1, where the two may only differ by rounding.
+static bool VerifyFusedKernels() {
+    const int sizes[][4] = {
+        {1920, 1080, 1920, 1080}, {1920, 1080, 960, 540}, {1281, 721, 427, 241}, {640, 360, 1280, 720}};
+    const int max_libyuv_diff = 8;
+    bool ok = true;
+    srand(1);
+    for (const auto &size : sizes) {
+        for (int direction = FUSED_RGB_TO_I420; direction <= FUSED_I420_TO_RGB; ++direction) {
+            for (int filter = FUSED_FILTER_BOX; filter <= FUSED_FILTER_BILINEAR; ++filter) {
+                FusedConvertParam param;
+                param.direction = (FusedConvertDirection)direction;
+                param.filter = (FusedScaleFilter)filter;
+                param.src_width = size[0];
+                param.src_height = size[1];
+                param.dst_width = size[2];
+                param.dst_height = size[3];
+                bool to_i420 = direction == FUSED_RGB_TO_I420;
+                std::vector<uint8_t> src(FrameSize(to_i420 ? FORMAT_RGB24 : FORMAT_I420, size[0], size[1]));
+                for (uint8_t &b : src) b = rand();
 
-    // init yuv420p buffer
-    for (int i = 0; i < width * height; i++) {
-        int x = i % width;
-        int y = i / width;
-        if (x < width / 2) {
-            if (y < height / 2) {
-                src[i] = 25;
-            } else {
-                src[i] = 178;
+                auto convert = [&](FusedConvertIsa isa, std::vector<uint8_t> &dst) {
+                    dst.assign(FrameSize(to_i420 ? FORMAT_I420 : FORMAT_RGB24, size[2], size[3]), 0);
+                    FusedConverter converter;
+                    converter.Init(param);
+                    converter.SetIsa(isa);
+                    if (to_i420) {
+                        I420Planes d = I420Layout(dst.data(), size[2], size[3]);
+                        converter.RgbToI420(src.data(), size[0] * 3, d.y, d.stride_y, d.u, d.stride_uv, d.v,
+                                            d.stride_uv);
+                    } else {
+                        I420Planes p = I420Layout(src.data(), size[0], size[1]);
+                        converter.I420ToRgb(p.y, p.stride_y, p.u, p.stride_uv, p.v, p.stride_uv, dst.data(),
+                                            size[2] * 3);
+                    }
+                };
+                std::vector<uint8_t> reference;
+                convert(FUSED_ISA_SCALAR, reference);
+
+                for (int isa = FUSED_ISA_SCALAR + 1; isa < FUSED_ISA_COUNT; ++isa) {
+                    if (!FusedConverter::IsaSupported((FusedConvertIsa)isa)) continue;
+                    std::vector<uint8_t> dst;
+                    convert((FusedConvertIsa)isa, dst);
+                    if (dst != reference) {
+                        printf("\033[0;31mMISMATCH\033[0m fused %s %s %dx%d->%dx%d differs from scalar\n",
+                               FusedConverter::IsaName((FusedConvertIsa)isa), to_i420 ? "RawToI420" : "I420ToRaw",
+                               size[0], size[1], size[2], size[3]);
+                        ok = false;
+                    }
+                }
+
+                if (filter != FUSED_FILTER_BOX || size[0] != size[2] || size[1] != size[3]) continue;
+                ConvertState state;
+                state.src_width = state.dst_width = size[0];
+                state.src_height = state.dst_height = size[1];
+                std::vector<uint8_t> libyuv_dst(reference.size());
+                if (to_i420) {
+                    LibyuvRawToI420<libyuv::kFilterNone>(state, src.data(), libyuv_dst.data());
+                } else {
+                    LibyuvI420ToRaw<libyuv::kFilterNone>(state, src.data(), libyuv_dst.data());
+                }
+                int max_diff = 0;
+                for (size_t i = 0; i < reference.size(); ++i) {
+                    max_diff = std::max(max_diff, abs(reference[i] - libyuv_dst[i]));
+                }
+                if (max_diff > max_libyuv_diff) {
+                    printf("\033[0;31mMISMATCH\033[0m fused %s %dx%d differs from libyuv by up to %d\n",
+                           to_i420 ? "RawToI420" : "I420ToRaw", size[0], size[1], max_diff);
+                    ok = false;
+                }
             }
-        } else if (x) {
-            if (y < height / 2) {
-                src[i] = 234;
-            } else {
-                src[i] = 75;
+        }
+    }
+    return ok;
+}
+
+// Steep box downscales against averages taken by exact division: converting the downscale must give the same
+// frame as converting, at 1:1, the source averaged exactly over the same footprints.
+static bool VerifyBoxDownscale() {
+    const int sizes[][4] = {{3840, 2160, 32, 9}, {1921, 1081, 7, 5}, {8192, 2048, 2, 8}};
+    bool ok = true;
+    srand(2);
+    for (const auto &size : sizes) {
+        int src_width = size[0];
+        int src_height = size[1];
+        int dst_width = size[2];
+        int dst_height = size[3];
+        std::vector<uint8_t> src(FrameSize(FORMAT_RGB24, src_width, src_height));
+        for (uint8_t &b : src) b = rand();
+
+        // Same footprints as the fused box axes.
+        std::vector<uint8_t> averaged(FrameSize(FORMAT_RGB24, dst_width, dst_height));
+        for (int dy = 0; dy < dst_height; ++dy) {
+            int y0 = (int)((int64_t)dy * src_height / dst_height);
+            int y1 = std::max(y0 + 1, (int)((int64_t)(dy + 1) * src_height / dst_height));
+            for (int dx = 0; dx < dst_width; ++dx) {
+                int x0 = (int)((int64_t)dx * src_width / dst_width);
+                int x1 = std::max(x0 + 1, (int)((int64_t)(dx + 1) * src_width / dst_width));
+                int64_t area = (int64_t)(y1 - y0) * (x1 - x0);
+                for (int c = 0; c < 3; ++c) {
+                    int64_t sum = 0;
+                    for (int y = y0; y < y1; ++y) {
+                        for (int x = x0; x < x1; ++x) sum += src[((int64_t)y * src_width + x) * 3 + c];
+                    }
+                    averaged[(dy * dst_width + dx) * 3 + c] = (uint8_t)((2 * sum + area) / (2 * area));
+                }
             }
         }
+
+        auto convert = [&](const std::vector<uint8_t> &rgb, int width, int height, std::vector<uint8_t> &dst) {
+            FusedConvertParam param;
+            param.direction = FUSED_RGB_TO_I420;
+            param.filter = FUSED_FILTER_BOX;
+            param.src_width = width;
+            param.src_height = height;
+            param.dst_width = dst_width;
+            param.dst_height = dst_height;
+            dst.assign(FrameSize(FORMAT_I420, dst_width, dst_height), 0);
+            FusedConverter converter;
+            if (!converter.Init(param)) return false;
+            I420Planes d = I420Layout(dst.data(), dst_width, dst_height);
+            converter.RgbToI420(rgb.data(), width * 3, d.y, d.stride_y, d.u, d.stride_uv, d.v, d.stride_uv);
+            return true;
+        };
+        std::vector<uint8_t> fused;
+        std::vector<uint8_t> reference;
+        if (!convert(src, src_width, src_height, fused) || !convert(averaged, dst_width, dst_height, reference) ||
+            fused != reference) {
+            printf("\033[0;31mMISMATCH\033[0m fused box %dx%d->%dx%d differs from exact averages\n", src_width,
+                   src_height, dst_width, dst_height);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+struct BenchmarkOptions {
+    int warmup = 10;
+    int iterations = 1000;
+    double min_time = 0.3;
+    std::vector<int> threads;
+    std::string filter;
+    std::string json_file;
+    std::string compare_file;
+    double threshold = 0.1;
+};
+
+static BenchmarkResult RunCase(const ConvertCase &c, int src_width, int src_height, int dst_width, int dst_height,
+                               int thread_count, const BenchmarkOptions &options) {
+    struct Worker {
+        ConvertState state;
+        std::vector<uint8_t> src;
+        std::vector<uint8_t> dst;
+        std::vector<int64_t> samples;
+    };
+    std::vector<Worker> workers(thread_count);
+    for (Worker &w : workers) {
+        w.state.src_width = src_width;
+        w.state.src_height = src_height;
+        w.state.dst_width = dst_width;
+        w.state.dst_height = dst_height;
+        w.state.tmp.resize(I420Size(std::max(src_width, dst_width), std::max(src_height, dst_height)));
+        w.src.resize(FrameSize(c.src_format, src_width, src_height));
+        w.dst.resize(FrameSize(c.dst_format, dst_width, dst_height));
+        FillFrame(c.src_format, src_width, src_height, w.src.data());
+        w.samples.reserve(options.iterations);
+    }
+
+    auto work = [&](Worker &w) {
+        // Warmup also creates the cached swscale context and faults in every buffer.
+        for (int i = 0; i < options.warmup; ++i) {
+            c.function(w.state, w.src.data(), w.dst.data());
+        }
+        int64_t deadline_ns = BenchmarkNowNs() + (int64_t)(options.min_time * 1e9);
+        for (int i = 0; i < options.iterations; ++i) {
+            int64_t t1 = BenchmarkNowNs();
+            c.function(w.state, w.src.data(), w.dst.data());
+            int64_t t2 = BenchmarkNowNs();
+            w.samples.push_back(t2 - t1);
+            // At least a handful of samples per worker, then stop at the time budget.
+            if (i >= 10 && t2 > deadline_ns) break;
+        }
+    };
+
+    int64_t begin_ns = BenchmarkNowNs();
+    std::vector<std::thread> threads;
+    for (int i = 1; i < thread_count; ++i) {
+        threads.emplace_back(work, std::ref(workers[i]));
+    }
+    work(workers[0]);
+    for (auto &t : threads) {
+        t.join();
+    }
+    int64_t wall_ns = BenchmarkNowNs() - begin_ns;
+
+    std::vector<int64_t> samples;
+    for (Worker &w : workers) {
+        samples.insert(samples.end(), w.samples.begin(), w.samples.end());
+        sws_freeContext(w.state.sws_ctx);
+        delete w.state.fused;
+    }
+
+    BenchmarkResult result;
+    char name[256];
+    snprintf(name, sizeof(name), "%s/%dx%d->%dx%d/t%d", c.name, src_width, src_height, dst_width, dst_height,
+             thread_count);
+    result.name = name;
+    SummarizeSamples(samples, result);
+    // Workers that finished early idle until the slowest is done, so this slightly understates peak throughput.
+    result.fps = samples.size() / (wall_ns / 1e9);
+    return result;
+}
+
+static void PrintResult(const BenchmarkResult &r) {
+    printf(
+        "\033[1;33mFunction\033[0m [\033[0;32;34m%s\033[0m] p50 \033[0;36m%.1lfus\033[0m p90 %.1lfus p99 %.1lfus "
+        "min %.1lfus, %.1lf fps\n",
+        r.name.c_str(), r.p50_ns / 1e3, r.p90_ns / 1e3, r.p99_ns / 1e3, r.min_ns / 1e3, r.fps);
+}
+
+static std::vector<int> ParseIntList(const char *str) {
+    std::vector<int> values;
+    std::stringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (atoi(item.c_str()) > 0) values.push_back(atoi(item.c_str()));
+    }
+    return values;
+}
+
+int main(int argc, char **argv) {
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--json" && has_value) {
+            options.json_file = argv[++i];
+        } else if (arg == "--compare" && has_value) {
+            options.compare_file = argv[++i];
+        } else if (arg == "--threshold" && has_value) {
+            options.threshold = atof(argv[++i]);
+        } else if (arg == "--filter" && has_value) {
+            options.filter = argv[++i];
+        } else if (arg == "--warmup" && has_value) {
+            options.warmup = atoi(argv[++i]);
+        } else if (arg == "--iterations" && has_value) {
+            options.iterations = atoi(argv[++i]);
+        } else if (arg == "--min-time" && has_value) {
+            options.min_time = atof(argv[++i]);
+        } else if (arg == "--threads" && has_value) {
+            options.threads = ParseIntList(argv[++i]);
+        } else {
+            printf(
+                "usage %s [--json out.json] [--compare baseline.json] [--threshold 0.1] [--filter substr] "
+                "[--warmup n] [--iterations n] [--min-time seconds] [--threads 1,2,4]\n",
+                argv[0]);
+            return 2;
+        }
+    }
+    if (options.threads.empty()) {
+        options.threads = {1, 2, 4};
+        int hardware_threads = std::thread::hardware_concurrency();
+        if (hardware_threads > 4) options.threads.push_back(hardware_threads);
     }
-    for (int i = 0; i < (width >> 1); ++i) {
-        for (int j = 0; j < (height >> 1); ++j) {
-            // u
-            src[width * height + j * (width >> 1) + i] = 254 * i / (width >> 1);
-            // // v
-            src[width * height + (width >> 1) * (height >> 1) + j * (width >> 1) + i] =
-                254 * j / (height >> 1);
+
+    if (!VerifyFusedKernels() || !VerifyBoxDownscale()) return 2;
+    printf("Fused kernels verified, best variant %s\n", FusedConverter::IsaName(FusedConverter::BestIsa()));
+
+    // The libyuv and fused box cases are the like for like comparison when scaling, the FFmpeg ones use bilinear.
+    const ConvertCase cases[] = {
+        {"LibyuvRawToI420", LibyuvRawToI420<libyuv::kFilterNone>, FORMAT_RGB24, FORMAT_I420, FUSED_ISA_SCALAR},
+        {"LibyuvRawToI420Box", LibyuvRawToI420<libyuv::kFilterBox>, FORMAT_RGB24, FORMAT_I420, FUSED_ISA_SCALAR},
+        {"FFmpegRGB24ToYUV420P", FFmpegRGB24ToYUV420P, FORMAT_RGB24, FORMAT_I420, FUSED_ISA_SCALAR},
+        {"FusedRawToI420Box/Scalar", FusedRawToI420<FUSED_ISA_SCALAR, FUSED_FILTER_BOX>, FORMAT_RGB24, FORMAT_I420,
+         FUSED_ISA_SCALAR},
+        {"FusedRawToI420Box/SSE4", FusedRawToI420<FUSED_ISA_SSE4, FUSED_FILTER_BOX>, FORMAT_RGB24, FORMAT_I420,
+         FUSED_ISA_SSE4},
+        {"FusedRawToI420Box/AVX2", FusedRawToI420<FUSED_ISA_AVX2, FUSED_FILTER_BOX>, FORMAT_RGB24, FORMAT_I420,
+         FUSED_ISA_AVX2},
+        {"FusedRawToI420Box/AVX512", FusedRawToI420<FUSED_ISA_AVX512, FUSED_FILTER_BOX>, FORMAT_RGB24, FORMAT_I420,
+         FUSED_ISA_AVX512},
+        {"FusedRawToI420Bilinear/AVX2", FusedRawToI420<FUSED_ISA_AVX2, FUSED_FILTER_BILINEAR>, FORMAT_RGB24,
+         FORMAT_I420, FUSED_ISA_AVX2},
+        {"LibyuvI420ToRaw", LibyuvI420ToRaw<libyuv::kFilterNone>, FORMAT_I420, FORMAT_RGB24, FUSED_ISA_SCALAR},
+        {"LibyuvI420ToRawBox", LibyuvI420ToRaw<libyuv::kFilterBox>, FORMAT_I420, FORMAT_RGB24, FUSED_ISA_SCALAR},
+        {"FFmpegYUV420PToRGB24", FFmpegYUV420PToRGB24, FORMAT_I420, FORMAT_RGB24, FUSED_ISA_SCALAR},
+        {"FusedI420ToRawBox/Scalar", FusedI420ToRaw<FUSED_ISA_SCALAR, FUSED_FILTER_BOX>, FORMAT_I420, FORMAT_RGB24,
+         FUSED_ISA_SCALAR},
+        {"FusedI420ToRawBox/SSE4", FusedI420ToRaw<FUSED_ISA_SSE4, FUSED_FILTER_BOX>, FORMAT_I420, FORMAT_RGB24,
+         FUSED_ISA_SSE4},
+        {"FusedI420ToRawBox/AVX2", FusedI420ToRaw<FUSED_ISA_AVX2, FUSED_FILTER_BOX>, FORMAT_I420, FORMAT_RGB24,
+         FUSED_ISA_AVX2},
+        {"FusedI420ToRawBox/AVX512", FusedI420ToRaw<FUSED_ISA_AVX512, FUSED_FILTER_BOX>, FORMAT_I420, FORMAT_RGB24,
+         FUSED_ISA_AVX512},
+        {"FusedI420ToRawBilinear/AVX2", FusedI420ToRaw<FUSED_ISA_AVX2, FUSED_FILTER_BILINEAR>, FORMAT_I420,
+         FORMAT_RGB24, FUSED_ISA_AVX2},
+    };
+    const int resolutions[][2] = {{640, 360}, {1280, 720}, {1920, 1080}, {3840, 2160}};
+    const int scale_divisors[] = {1, 2, 4};
+
+    std::vector<BenchmarkResult> results;
+    for (const auto &resolution : resolutions) {
+        for (int divisor : scale_divisors) {
+            for (const ConvertCase &c : cases) {
+                if (!FusedConverter::IsaSupported(c.isa)) continue;
+                for (int thread_count : options.threads) {
+                    int src_width = resolution[0];
+                    int src_height = resolution[1];
+                    int dst_width = src_width / divisor;
+                    int dst_height = src_height / divisor;
+                    char name[256];
+                    snprintf(name, sizeof(name), "%s/%dx%d->%dx%d/t%d", c.name, src_width, src_height, dst_width,
+                             dst_height, thread_count);
+                    if (!options.filter.empty() && strstr(name, options.filter.c_str()) == nullptr) continue;
+
+                    results.push_back(
+                        RunCase(c, src_width, src_height, dst_width, dst_height, thread_count, options));
+                    PrintResult(results.back());
+                }
+            }
         }
     }
 
-    // YUV420P To RGB24
-    RunBenchMark(width, height, LibyuvI420ToRaw);
-    RunBenchMark(width, height, FFmpegYUV420PToRGB24);
-    RunBenchMark(width / 4, height / 4, LibyuvI420ToRaw);
-    RunBenchMark(width / 4, height / 4, FFmpegYUV420PToRGB24);
+    if (!options.json_file.empty() && !WriteBenchmarkJson(options.json_file, results)) return 2;
+    if (!options.compare_file.empty()) {
+        int regressions = CompareBenchmarkResults(results, options.compare_file, options.threshold);
+        if (regressions != 0) return regressions < 0 ? 2 : 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,463 @@
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "benchmark_report.h"
+#include "media_decoder_common.h"
+#include "media_decoder_interface.h"
+#include "media_recorder_common.h"
+#include "media_recorder_interface.h"
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavutil/frame.h>
+#include <libavutil/log.h>
+}
+
+// End-to-end VideoDecoder -> MP4VideoRecorder benchmark on synthetic clips generated locally, no test assets needed.
+//
+//   transcode-benchmark [--workdir dir] [--frames n] [--regenerate] [--filter substr]
+//                       [--json out.json] [--compare baseline.json] [--threshold 0.1]
+//
+// For every clip it runs decode only (ReadFrame until EOF), encode only (SendVideoFrameBlock of prepared frames) and
+// the full transcode, and reports fps, per-frame latency at the API boundary, CPU time and peak RSS. Clips are encoded
+// with the recorder itself on first use and kept in the work directory, so later runs decode identical input.
+//
+// The live runs feed the recorder at the clip's frame rate, with default and with low_latency settings, and report
+// the recorder's own submit to packet written latency instead (bucketed, so within a factor of two).
+//
+// The slides runs are encode only with every frame held for two seconds, like a slide deck or a mostly idle screen,
+// once encoded in full and once with the recorder skipping duplicates; compare their cpu times.
+//
+// The open runs start the decoder repeatedly on the same clip and report the time from Start to the first decoded
+// frame, with default settings and with fast_open.
+
+struct ClipSpec {
+    int width;
+    int height;
+    int fps;
+    int gop_size;
+};
+
+struct TranscodeOptions {
+    std::string workdir = "transcode_benchmark_media";
+    int frames = 300;
+    bool regenerate = false;
+    std::string filter;
+    std::string json_file;
+    std::string compare_file;
+    double threshold = 0.1;
+};
+
+// Number of distinct frames the encode-only run cycles through, prepared up front so pattern generation is not
+// measured.
+static const int prepared_frame_count = 8;
+
+// Scrolling texture, a diagonal gradient and a bouncing box: enough detail and motion that the encoder does real work,
+// without being noise it can not predict at all.
+static void FillPattern(uint8_t *rgb, int width, int height, int frame_index) {
+    int box_size = height / 4;
+    int box_x = (frame_index * 7) % (2 * (width - box_size));
+    int box_y = (frame_index * 5) % (2 * (height - box_size));
+    if (box_x >= width - box_size) box_x = 2 * (width - box_size) - box_x;
+    if (box_y >= height - box_size) box_y = 2 * (height - box_size) - box_y;
+
+    for (int y = 0; y < height; ++y) {
+        uint8_t *row = rgb + y * width * 3;
+        for (int x = 0; x < width; ++x) {
+            int tx = (x + frame_index * 2) >> 3;
+            int ty = (y + frame_index) >> 3;
+            uint32_t hash = (tx * 73856093u) ^ (ty * 19349663u);
+            int texture = (hash >> 13) & 63;
+            int gradient = ((x + y + frame_index * 4) * 255 / (width + height)) & 255;
+            bool in_box = x >= box_x && x < box_x + box_size && y >= box_y && y < box_y + box_size;
+            row[x * 3 + 0] = in_box ? 240 : (uint8_t)(gradient / 2 + texture);
+            row[x * 3 + 1] = in_box ? 240 : (uint8_t)(255 - gradient / 2 - texture);
+            row[x * 3 + 2] = in_box ? 32 : (uint8_t)(texture * 3);
+        }
+    }
+}
+
+static std::string ClipName(const ClipSpec &clip) {
+    char name[128];
+    snprintf(name, sizeof(name), "%dx%d@%dg%d", clip.width, clip.height, clip.fps, clip.gop_size);
+    return name;
+}
+
+static std::string ClipFilename(const ClipSpec &clip, const TranscodeOptions &options) {
+    char name[256];
+    snprintf(name, sizeof(name), "/synthetic_%dx%d_%dfps_gop%d_%df.mp4", clip.width, clip.height, clip.fps,
+             clip.gop_size, options.frames);
+    return options.workdir + name;
+}
+
+static bool GenerateClip(const ClipSpec &clip, const TranscodeOptions &options, const std::string &filename) {
+    printf("Generating %s\n", filename.c_str());
+    MediaRecorder *recorder = MediaRecorder::CreateMP4VideoRecorder();
+    MP4VideoRecorderStartParam param;
+    param.width = clip.width;
+    param.height = clip.height;
+    param.fps = clip.fps;
+    param.gop_size = clip.gop_size;
+    param.filename = filename;
+    bool started = recorder->Start(&param);
+    bool ok = started;
+    std::vector<uint8_t> rgb(clip.width * clip.height * 3);
+    for (int i = 0; ok && i < options.frames; ++i) {
+        FillPattern(rgb.data(), clip.width, clip.height, i);
+        ok = recorder->SendVideoFrameBlock(rgb.data(), rgb.size());
+    }
+    if (started) recorder->Stop();
+    delete recorder;
+    if (!ok) {
+        printf("could not generate %s\n", filename.c_str());
+        remove(filename.c_str());
+    }
+    return ok;
+}
+
+// CPU time and peak resident memory of one run. Peak RSS is reset through /proc/self/clear_refs where the kernel
+// supports it, otherwise it is the process lifetime peak.
+class ResourceProbe {
+public:
+    ResourceProbe() {
+        std::ofstream clear_refs("/proc/self/clear_refs");
+        if (clear_refs.is_open()) clear_refs << "5";
+        cpu_begin_ = CpuSeconds();
+        wall_begin_ns_ = BenchmarkNowNs();
+    }
+
+    void Finish(BenchmarkResult &result) const {
+        double wall_seconds = (BenchmarkNowNs() - wall_begin_ns_) / 1e9;
+        result.cpu_seconds = CpuSeconds() - cpu_begin_;
+        result.fps = wall_seconds > 0 ? result.calls / wall_seconds : 0;
+        result.peak_rss_kb = PeakRssKb();
+    }
+
+private:
+    double cpu_begin_;
+    int64_t wall_begin_ns_;
+
+    static double CpuSeconds() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+
+    static int64_t PeakRssKb() {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, 6, "VmHWM:") == 0) return atoll(line.c_str() + 6);
+        }
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+};
+
+// Copies a decoded frame into a tightly packed buffer when its rows are padded, since the recorder takes width * 3
+// byte rows.
+static const uint8_t *PackedRGB(AVFrame *frame, std::vector<uint8_t> &packed) {
+    int row_size = frame->width * 3;
+    if (frame->linesize[0] == row_size) return frame->data[0];
+    packed.resize(row_size * frame->height);
+    for (int y = 0; y < frame->height; ++y) {
+        memcpy(packed.data() + y * row_size, frame->data[0] + y * frame->linesize[0], row_size);
+    }
+    return packed.data();
+}
+
+static bool RunDecode(const std::string &clip_file, BenchmarkResult &result) {
+    std::vector<int64_t> samples;
+    ResourceProbe probe;
+    MediaDecoder *dec = MediaDecoder::CreateVideoDecoder();
+    VideoDecoderStartParam param;
+    param.filename = clip_file;
+    MediaDecoderStartRet ret = dec->Start(&param);
+    AVFrame *frame = nullptr;
+    if (ret.success && dec->InitFrame(&frame)) {
+        while (true) {
+            int64_t begin_ns = BenchmarkNowNs();
+            if (!dec->ReadFrame(frame)) break;
+            samples.push_back(BenchmarkNowNs() - begin_ns);
+        }
+    }
+    dec->Stop();
+    av_frame_free(&frame);
+    delete dec;
+
+    SummarizeSamples(samples, result);
+    probe.Finish(result);
+    return ret.success && !samples.empty();
+}
+
+// Decoder starts per open run.
+static const int open_count = 10;
+
+static bool RunOpen(const std::string &clip_file, bool fast_open, BenchmarkResult &result) {
+    std::vector<int64_t> samples;
+    ResourceProbe probe;
+    bool ok = true;
+    for (int i = 0; ok && i < open_count; ++i) {
+        MediaDecoder *dec = MediaDecoder::CreateVideoDecoder();
+        VideoDecoderStartParam param;
+        param.filename = clip_file;
+        param.fast_open = fast_open;
+        AVFrame *frame = nullptr;
+        ok = dec->Start(&param).success && dec->InitFrame(&frame) && dec->ReadFrame(frame);
+        if (ok) samples.push_back(dec->GetStartupTiming().total_ns);
+        dec->Stop();
+        av_frame_free(&frame);
+        delete dec;
+    }
+
+    SummarizeSamples(samples, result);
+    probe.Finish(result);
+    return ok;
+}
+
+// hold_frames is how many times in a row each prepared frame is sent.
+static bool RunEncode(const ClipSpec &clip, const TranscodeOptions &options, int hold_frames, bool skip_duplicates,
+                      BenchmarkResult &result) {
+    std::vector<std::vector<uint8_t>> prepared(prepared_frame_count);
+    for (int i = 0; i < prepared_frame_count; ++i) {
+        prepared[i].resize(clip.width * clip.height * 3);
+        FillPattern(prepared[i].data(), clip.width, clip.height, i * 4);
+    }
+
+    std::vector<int64_t> samples;
+    ResourceProbe probe;
+    MediaRecorder *recorder = MediaRecorder::CreateMP4VideoRecorder();
+    MP4VideoRecorderStartParam param;
+    param.width = clip.width;
+    param.height = clip.height;
+    param.fps = clip.fps;
+    param.gop_size = clip.gop_size;
+    param.skip_duplicates = skip_duplicates;
+    param.filename = options.workdir + (hold_frames > 1 ? "/slides_" : "/encode_") + ClipName(clip) + ".mp4";
+    bool started = recorder->Start(&param);
+    bool ok = started;
+    for (int i = 0; ok && i < options.frames; ++i) {
+        std::vector<uint8_t> &rgb = prepared[i / hold_frames % prepared_frame_count];
+        int64_t begin_ns = BenchmarkNowNs();
+        ok = recorder->SendVideoFrameBlock(rgb.data(), rgb.size());
+        samples.push_back(BenchmarkNowNs() - begin_ns);
+    }
+    // Stop drains the encoder, it belongs to the run.
+    if (started) recorder->Stop();
+    delete recorder;
+
+    SummarizeSamples(samples, result);
+    probe.Finish(result);
+    return ok;
+}
+
+static bool RunLive(const ClipSpec &clip, const TranscodeOptions &options, bool low_latency,
+                    BenchmarkResult &result) {
+    std::vector<std::vector<uint8_t>> prepared(prepared_frame_count);
+    for (int i = 0; i < prepared_frame_count; ++i) {
+        prepared[i].resize(clip.width * clip.height * 3);
+        FillPattern(prepared[i].data(), clip.width, clip.height, i * 4);
+    }
+
+    ResourceProbe probe;
+    MediaRecorder *recorder = MediaRecorder::CreateMP4VideoRecorder();
+    MP4VideoRecorderStartParam param;
+    param.width = clip.width;
+    param.height = clip.height;
+    param.fps = clip.fps;
+    param.gop_size = clip.gop_size;
+    param.low_latency = low_latency;
+    param.filename = options.workdir + (low_latency ? "/live_low_latency_" : "/live_") + ClipName(clip) + ".mp4";
+    bool started = recorder->Start(&param);
+    bool ok = started;
+    // Paced like a capture device, a few seconds are enough for the latency to settle.
+    int frames = std::min(options.frames, 3 * clip.fps);
+    auto next = std::chrono::steady_clock::now();
+    for (int i = 0; ok && i < frames; ++i) {
+        std::this_thread::sleep_until(next);
+        next += std::chrono::microseconds(1000000 / clip.fps);
+        std::vector<uint8_t> &rgb = prepared[i % prepared_frame_count];
+        ok = recorder->SendVideoFrameBlock(rgb.data(), rgb.size());
+    }
+    if (started) recorder->Stop();
+    LatencySnapshot latency = recorder->GetMetrics().end_to_end;
+    delete recorder;
+
+    result.calls = latency.count;
+    result.mean_ns = latency.count > 0 ? latency.sum_ns / latency.count : 0;
+    result.p50_ns = latency.p50_ns;
+    result.p90_ns = latency.p90_ns;
+    result.p99_ns = latency.p99_ns;
+    probe.Finish(result);
+    return ok && latency.count > 0;
+}
+
+static bool RunTranscode(const ClipSpec &clip, const TranscodeOptions &options, const std::string &clip_file,
+                         BenchmarkResult &result) {
+    std::vector<int64_t> samples;
+    std::vector<uint8_t> packed;
+    ResourceProbe probe;
+    MediaDecoder *dec = MediaDecoder::CreateVideoDecoder();
+    VideoDecoderStartParam dec_param;
+    dec_param.filename = clip_file;
+    MediaDecoderStartRet dec_ret = dec->Start(&dec_param);
+    bool ok = dec_ret.success;
+
+    MediaRecorder *recorder = MediaRecorder::CreateMP4VideoRecorder();
+    MP4VideoRecorderStartParam rec_param;
+    rec_param.width = dec_ret.width;
+    rec_param.height = dec_ret.height;
+    rec_param.fps = dec_ret.fps;
+    rec_param.gop_size = clip.gop_size;
+    rec_param.filename = options.workdir + "/transcode_" + ClipName(clip) + ".mp4";
+    bool recorder_started = ok && recorder->Start(&rec_param);
+    ok = recorder_started;
+
+    AVFrame *frame = nullptr;
+    ok = ok && dec->InitFrame(&frame);
+    while (ok) {
+        int64_t begin_ns = BenchmarkNowNs();
+        if (!dec->ReadFrame(frame)) break;
+        ok = recorder->SendVideoFrameBlock((void *)PackedRGB(frame, packed), frame->width * frame->height * 3);
+        samples.push_back(BenchmarkNowNs() - begin_ns);
+    }
+    if (recorder_started) recorder->Stop();
+    dec->Stop();
+    av_frame_free(&frame);
+    delete recorder;
+    delete dec;
+
+    SummarizeSamples(samples, result);
+    probe.Finish(result);
+    return ok && !samples.empty();
+}
+
+static void PrintResult(const BenchmarkResult &r) {
+    printf(
+        "\033[1;33mPipeline\033[0m [\033[0;32;34m%s\033[0m] %" PRId64 " frames, \033[0;36m%.1lf fps\033[0m, "
+        "p50 %.2lfms p90 %.2lfms p99 %.2lfms, cpu %.2lfs, peak rss %.1lfMB\n",
+        r.name.c_str(), r.calls, r.fps, r.p50_ns / 1e6, r.p90_ns / 1e6, r.p99_ns / 1e6, r.cpu_seconds,
+        r.peak_rss_kb / 1024.0);
+}
+
+int main(int argc, char **argv) {
+    TranscodeOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--workdir" && has_value) {
+            options.workdir = argv[++i];
+        } else if (arg == "--frames" && has_value) {
+            options.frames = atoi(argv[++i]);
+        } else if (arg == "--regenerate") {
+            options.regenerate = true;
+        } else if (arg == "--filter" && has_value) {
+            options.filter = argv[++i];
+        } else if (arg == "--json" && has_value) {
+            options.json_file = argv[++i];
+        } else if (arg == "--compare" && has_value) {
+            options.compare_file = argv[++i];
+        } else if (arg == "--threshold" && has_value) {
+            options.threshold = atof(argv[++i]);
+        } else {
+            printf(
+                "usage %s [--workdir dir] [--frames n] [--regenerate] [--filter substr] [--json out.json] "
+                "[--compare baseline.json] [--threshold 0.1]\n",
+                argv[0]);
+            return 2;
+        }
+    }
+    if (options.frames <= 0) options.frames = 300;
+    if (mkdir(options.workdir.c_str(), 0755) != 0 && errno != EEXIST) {
+        printf("could not create %s\n", options.workdir.c_str());
+        return 2;
+    }
+    av_log_set_level(AV_LOG_ERROR);
+
+    // Widths are multiples of 64 so decoded RGB rows are unpadded and the transcode path does not repack.
+    const ClipSpec clips[] = {
+        {640, 360, 30, 30},
+        {1280, 720, 30, 60},
+        {1280, 720, 60, 250},
+        {1920, 1080, 30, 60},
+    };
+
+    std::vector<BenchmarkResult> results;
+    bool ok = true;
+    for (const ClipSpec &clip : clips) {
+        std::string name = ClipName(clip);
+        if (!options.filter.empty() && name.find(options.filter) == std::string::npos) continue;
+
+        std::string clip_file = ClipFilename(clip, options);
+        struct stat st;
+        if ((options.regenerate || stat(clip_file.c_str(), &st) != 0) && !GenerateClip(clip, options, clip_file)) {
+            ok = false;
+            continue;
+        }
+
+        BenchmarkResult decode;
+        decode.name = "decode/" + name;
+        ok = RunDecode(clip_file, decode) && ok;
+        PrintResult(decode);
+        results.push_back(decode);
+
+        for (bool fast_open : {false, true}) {
+            BenchmarkResult open;
+            open.name = (fast_open ? "open-fast/" : "open/") + name;
+            ok = RunOpen(clip_file, fast_open, open) && ok;
+            PrintResult(open);
+            results.push_back(open);
+        }
+
+        BenchmarkResult encode;
+        encode.name = "encode/" + name;
+        ok = RunEncode(clip, options, 1, false, encode) && ok;
+        PrintResult(encode);
+        results.push_back(encode);
+
+        for (bool skip_duplicates : {false, true}) {
+            BenchmarkResult slides;
+            slides.name = (skip_duplicates ? "slides-skip/" : "slides/") + name;
+            ok = RunEncode(clip, options, 2 * clip.fps, skip_duplicates, slides) && ok;
+            PrintResult(slides);
+            results.push_back(slides);
+        }
+
+        BenchmarkResult transcode;
+        transcode.name = "transcode/" + name;
+        ok = RunTranscode(clip, options, clip_file, transcode) && ok;
+        PrintResult(transcode);
+        results.push_back(transcode);
+
+        for (bool low_latency : {false, true}) {
+            BenchmarkResult live;
+            live.name = (low_latency ? "live-low-latency/" : "live/") + name;
+            ok = RunLive(clip, options, low_latency, live) && ok;
+            PrintResult(live);
+            results.push_back(live);
+        }
+    }
+
+    if (!options.json_file.empty() && !WriteBenchmarkJson(options.json_file, results)) return 2;
+    if (!ok) {
+        printf("some pipelines failed, see the log above\n");
+        return 2;
+    }
+    if (!options.compare_file.empty()) {
+        int regressions = CompareBenchmarkResults(results, options.compare_file, options.threshold);
+        if (regressions != 0) return regressions < 0 ? 2 : 1;
+    }
+    return 0;
+}
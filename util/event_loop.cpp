@@ -0,0 +1,103 @@
+#include "event_loop.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+
+#include "logger.h"
+
+EventLoop::EventLoop() : running_(false) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd_ < 0 || wake_fd_ < 0) {
+        log_error("Could not create event loop fds");
+        return;
+    }
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = wake_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event);
+}
+
+EventLoop::~EventLoop() {
+    Stop();
+    if (epoll_fd_ >= 0) close(epoll_fd_);
+    if (wake_fd_ >= 0) close(wake_fd_);
+}
+
+bool EventLoop::Start() {
+    if (epoll_fd_ < 0 || wake_fd_ < 0 || running_.exchange(true)) return false;
+    // A loop stopped while busy with other fds exits without reading the last wake-up.
+    uint64_t value;
+    if (read(wake_fd_, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        log_warn("Could not drain event loop wake fd");
+    }
+    thread_ = std::thread(&EventLoop::Run, this);
+    return true;
+}
+
+void EventLoop::Stop() {
+    if (!running_.exchange(false)) return;
+    uint64_t value = 1;
+    if (write(wake_fd_, &value, sizeof(value)) != sizeof(value)) {
+        log_warn("Could not wake event loop");
+    }
+    thread_.join();
+}
+
+bool EventLoop::Watch(int fd, std::function<void()> callback) {
+    if (fd < 0 || !callback) return false;
+    std::unique_lock<std::mutex> lock(mux_);
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0) {
+        log_error("Could not watch fd %d", fd);
+        return false;
+    }
+    callbacks_[fd] = std::make_shared<Callback>(std::move(callback));
+    return true;
+}
+
+void EventLoop::Unwatch(int fd) {
+    std::unique_lock<std::mutex> lock(mux_);
+    if (callbacks_.erase(fd) > 0) {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    }
+}
+
+void EventLoop::Run() {
+    const int max_events = 64;
+    struct epoll_event events[max_events];
+    while (running_.load()) {
+        int n = epoll_wait(epoll_fd_, events, max_events, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_error("epoll_wait failed");
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == wake_fd_) {
+                // Drained, or it stays readable and a restarted loop would never block again.
+                uint64_t value;
+                if (read(wake_fd_, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                    log_warn("Could not drain event loop wake fd");
+                }
+                continue;
+            }
+            // Looked up per event, a callback earlier in this batch may have unwatched the fd.
+            std::shared_ptr<Callback> callback;
+            {
+                std::unique_lock<std::mutex> lock(mux_);
+                auto it = callbacks_.find(fd);
+                if (it == callbacks_.end()) continue;
+                callback = it->second;
+            }
+            (*callback)();
+        }
+    }
+}
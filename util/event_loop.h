@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// One epoll thread serving any number of sessions. A watched fd's callback runs on the loop thread for as long as the
+// fd is readable, so callbacks must not block. For the readiness fds of MediaDecoder and MediaRecorder the callback
+// calls TryReadFrame/TrySendVideoFrame until it returns MEDIA_IO_WOULD_BLOCK, which rearms the fd, or stops after a
+// batch and is called again.
+class EventLoop {
+public:
+    bool Start();
+    // Joins the loop thread. Must not be called from a callback.
+    void Stop();
+
+    bool Watch(int fd, std::function<void()> callback);
+    // Safe from inside any callback, including the fd's own; the callback is not called again afterwards. From other
+    // threads a call already in progress may still be running when this returns.
+    void Unwatch(int fd);
+
+    EventLoop();
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+private:
+    typedef std::function<void()> Callback;
+
+    int epoll_fd_;
+    int wake_fd_;
+    std::atomic<bool> running_;
+    std::thread thread_;
+
+    std::mutex mux_;
+    std::map<int, std::shared_ptr<Callback>> callbacks_;
+
+    void Run();
+};
@@ -1,28 +1,243 @@
 #include "logger.h"
 
 #include <atomic>
+#include <chrono>
+#include <cinttypes>
 #include <cstdarg>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <thread>
 
 const int log_level = INFO;
 
 const char *LogLevel2Str[] = {"DEBUG", "INFO", "WARN", "ERROR"};
 
+static std::atomic<bool> log_to_stderr(false);
+
+static FILE *LogOutput() { return log_to_stderr.load(std::memory_order_relaxed) ? stderr : stdout; }
+
+namespace {
+
+struct LogRecord {
+    int64_t time_us;
+    const char *func;
+    const char *filename;
+    int line;
+    int level;
+    char message[MAX_LOG_STR_SIZE];
+};
+
+// Bounded multi-producer single-consumer queue. Every slot carries a sequence number telling producers and the
+// consumer whose turn it is, so claiming a slot is a single CAS and nobody ever waits on a lock.
+class LogQueue {
+public:
+    static const size_t capacity_ = 1024;
+
+    LogQueue() : enqueue_pos_(0), dequeue_pos_(0) {
+        for (size_t i = 0; i < capacity_; ++i) {
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns nullptr when full. The claimed record must be handed back with Publish.
+    LogRecord *Claim(size_t &pos) {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+        while (true) {
+            Slot &slot = slots_[pos & (capacity_ - 1)];
+            intptr_t diff = (intptr_t)slot.seq.load(std::memory_order_acquire) - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) return &slot.record;
+            } else if (diff < 0) {
+                return nullptr;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void Publish(size_t pos) { slots_[pos & (capacity_ - 1)].seq.store(pos + 1, std::memory_order_release); }
+
+    // Consumer side only.
+    LogRecord *Front() {
+        Slot &slot = slots_[dequeue_pos_ & (capacity_ - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != dequeue_pos_ + 1) return nullptr;
+        return &slot.record;
+    }
+
+    void Pop() {
+        slots_[dequeue_pos_ & (capacity_ - 1)].seq.store(dequeue_pos_ + capacity_, std::memory_order_release);
+        ++dequeue_pos_;
+    }
+
+    size_t EnqueuePos() const { return enqueue_pos_.load(std::memory_order_acquire); }
+
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        LogRecord record;
+    };
+
+    Slot slots_[capacity_];
+    alignas(64) std::atomic<size_t> enqueue_pos_;
+    alignas(64) size_t dequeue_pos_;
+};
+
+// Set once the background writer has been torn down by static destruction. Records logged after that are written
+// synchronously.
+std::atomic<bool> async_logger_destroyed(false);
+
+int64_t NowMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+class AsyncLogger {
+public:
+    AsyncLogger() : stop_(false), written_pos_(0), dropped_(0), cached_second_(-1) {
+        worker_thread_ = std::thread(&AsyncLogger::WriteLoop, this);
+    }
+
+    ~AsyncLogger() {
+        async_logger_destroyed.store(true, std::memory_order_release);
+        stop_.store(true, std::memory_order_release);
+        worker_thread_.join();
+    }
+
+    void Push(const char *func, const char *filename, int line, int level, const char *format, va_list ap) {
+        size_t pos;
+        LogRecord *record = queue_.Claim(pos);
+        if (record == nullptr) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        record->time_us = NowMicros();
+        record->func = func;
+        record->filename = filename;
+        record->line = line;
+        record->level = level;
+        vsnprintf(record->message, sizeof(record->message), format, ap);
+        queue_.Publish(pos);
+    }
+
+    void Flush() {
+        size_t target = queue_.EnqueuePos();
+        while (written_pos_.load(std::memory_order_acquire) < target) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    // Formats one line, caching the rendered date until the second changes.
+    int Format(const LogRecord &record, char *out, size_t size) {
+        int64_t second = record.time_us / 1000000;
+        if (second != cached_second_) {
+            time_t now = second;
+            struct tm tm_now;
+            localtime_r(&now, &tm_now);
+            strftime(cached_time_str_, sizeof(cached_time_str_), "[%Y-%m-%d %H:%M:%S]", &tm_now);
+            cached_second_ = second;
+        }
+        int len = snprintf(out, size, "%s[%s][%s:%d][%s]%s\n", cached_time_str_, LogLevel2Str[record.level],
+                           record.filename, record.line, record.func, record.message);
+        return len < (int)size ? len : (int)size - 1;
+    }
+
+private:
+    LogQueue queue_;
+    std::thread worker_thread_;
+    std::atomic<bool> stop_;
+    std::atomic<size_t> written_pos_;
+    std::atomic<uint64_t> dropped_;
+
+    int64_t cached_second_;
+    char cached_time_str_[32];
+
+    void WriteLoop() {
+        static const size_t out_buffer_size = 64 * 1024;
+        char *out = new char[out_buffer_size];
+        size_t pos = 0;
+        size_t consumed = 0;
+        while (true) {
+            bool stopping = stop_.load(std::memory_order_acquire);
+            bool wrote = false;
+            LogRecord *record;
+            while ((record = queue_.Front()) != nullptr) {
+                if (out_buffer_size - pos < MAX_LOG_STR_SIZE * 2) {
+                    fwrite(out, 1, pos, LogOutput());
+                    pos = 0;
+                }
+                pos += Format(*record, out + pos, out_buffer_size - pos);
+                queue_.Pop();
+                ++consumed;
+                wrote = true;
+            }
+
+            uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0) {
+                LogRecord note = {NowMicros(), __func__, __FILENAME__, __LINE__, WARN, {0}};
+                snprintf(note.message, sizeof(note.message), "%" PRIu64 " log records dropped, queue full", dropped);
+                pos += Format(note, out + pos, out_buffer_size - pos);
+                wrote = true;
+            }
+
+            if (wrote) {
+                FILE *output = LogOutput();
+                fwrite(out, 1, pos, output);
+                fflush(output);
+                pos = 0;
+                written_pos_.store(consumed, std::memory_order_release);
+            } else if (stopping) {
+                break;
+            } else {
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            }
+        }
+        delete[] out;
+    }
+};
+
+AsyncLogger &GetAsyncLogger() {
+    static AsyncLogger logger;
+    return logger;
+}
+
+}  // namespace
+
+bool LogEnabled(int level) { return level >= log_level; }
+
 void LOG(const char *func, const char *filename, int line, int level, const char *format, ...) {
     if (level < log_level) return;
 
+    va_list ap;
+    va_start(ap, format);
+    if (!async_logger_destroyed.load(std::memory_order_acquire)) {
+        GetAsyncLogger().Push(func, filename, line, level, format, ap);
+        va_end(ap);
+        return;
+    }
+
     char log_buffer[MAX_LOG_STR_SIZE];
 
     time_t now = time(0);
-    strftime(log_buffer, sizeof(log_buffer), "[%Y-%m-%d %H:%M:%S]", localtime(&now));
+    struct tm tm_now;
+    strftime(log_buffer, sizeof(log_buffer), "[%Y-%m-%d %H:%M:%S]", localtime_r(&now, &tm_now));
 
-    sprintf(log_buffer + strlen(log_buffer), "[%s][%s:%d][%s]", LogLevel2Str[level], filename, line, func);
+    size_t len = strlen(log_buffer);
+    snprintf(log_buffer + len, sizeof(log_buffer) - len, "[%s][%s:%d][%s]", LogLevel2Str[level], filename, line, func);
 
-    va_list ap;
-    va_start(ap, format);
-    vsnprintf(log_buffer + strlen(log_buffer), MAX_LOG_STR_SIZE, format, ap);
+    len = strlen(log_buffer);
+    vsnprintf(log_buffer + len, sizeof(log_buffer) - len, format, ap);
+    va_end(ap);
+
+    fprintf(LogOutput(), "%s\n", log_buffer);
+}
+
+void LogFlush() {
+    if (!async_logger_destroyed.load(std::memory_order_acquire)) {
+        GetAsyncLogger().Flush();
+    }
+    fflush(LogOutput());
+}
 
-    printf("%s\n", log_buffer);
-}
\ No newline at end of file
+void LogToStderr(bool enable) { log_to_stderr.store(enable, std::memory_order_relaxed); }
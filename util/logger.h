@@ -10,11 +10,34 @@ enum LogLevel {
     ERROR,
 };
 
+// Levels below LOG_COMPILE_LEVEL (0 = DEBUG ... 3 = ERROR) are compiled out and their arguments are never evaluated.
+// Build with -DLOG_COMPILE_LEVEL=0 to get debug logs back.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL 1
+#endif
+
 #define MAX_LOG_STR_SIZE 1024
 #define __FILENAME__ (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
-#define log_debug(format, ...) LOG(__func__, __FILENAME__, __LINE__, DEBUG, format, ##__VA_ARGS__)
-#define log_info(format, ...) LOG(__func__, __FILENAME__, __LINE__, INFO, format, ##__VA_ARGS__)
-#define log_warn(format, ...) LOG(__func__, __FILENAME__, __LINE__, WARN, format, ##__VA_ARGS__)
-#define log_error(format, ...) LOG(__func__, __FILENAME__, __LINE__, ERROR, format, ##__VA_ARGS__)
+#define LOG_IF_ENABLED(level, format, ...)                                               \
+    do {                                                                                 \
+        if ((level) >= LOG_COMPILE_LEVEL && LogEnabled(level)) {                         \
+            LOG(__func__, __FILENAME__, __LINE__, level, format, ##__VA_ARGS__);         \
+        }                                                                                \
+    } while (0)
+#define log_debug(format, ...) LOG_IF_ENABLED(DEBUG, format, ##__VA_ARGS__)
+#define log_info(format, ...) LOG_IF_ENABLED(INFO, format, ##__VA_ARGS__)
+#define log_warn(format, ...) LOG_IF_ENABLED(WARN, format, ##__VA_ARGS__)
+#define log_error(format, ...) LOG_IF_ENABLED(ERROR, format, ##__VA_ARGS__)
+
+bool LogEnabled(int level);
+
+// Only the message itself is formatted on the calling thread. Timestamp and prefix formatting and the actual output
+// happen on a background thread; when its queue is full the record is dropped rather than blocking the caller.
+void LOG(const char *func, const char *filename, int line, int level, const char *format, ...)
+    __attribute__((format(printf, 5, 6)));
+
+// Blocks until every record queued so far has been written.
+void LogFlush();
 
-void LOG(const char *func, const char *filename, int line, int level, const char *format, ...);
\ No newline at end of file
+// Log lines go to stdout unless this moves them to stderr, for processes whose stdout carries a media stream.
+void LogToStderr(bool enable);
@@ -0,0 +1,296 @@
+#include "pipeline_metrics.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+
+#include "logger.h"
+#include "ring_depth.h"
+
+const char* PipelineStage2Str(int stage) {
+    static const char* names[] = {"demux", "decode", "convert", "encode", "mux"};
+    if (stage < 0 || stage >= STAGE_COUNT) return "unknown";
+    return names[stage];
+}
+
+uint64_t LatencySnapshot::BucketUpperBoundNs(int i) {
+    if (i >= bucket_count - 1) return 0;
+    return 1ULL << (i + 10);
+}
+
+LatencyHistogram::LatencyHistogram() : count_(0), sum_ns_(0), max_ns_(0) {
+    for (int i = 0; i < LatencySnapshot::bucket_count; ++i) {
+        buckets_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void LatencyHistogram::Record(int64_t ns) {
+    if (ns < 0) ns = 0;
+    uint64_t value = ns;
+    int bucket = 0;
+    if (value >= 1024) {
+        bucket = 63 - __builtin_clzll(value) - 9;
+        if (bucket >= LatencySnapshot::bucket_count) bucket = LatencySnapshot::bucket_count - 1;
+    }
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_ns_.fetch_add(value, std::memory_order_relaxed);
+    uint64_t max = max_ns_.load(std::memory_order_relaxed);
+    while (value > max && !max_ns_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+LatencySnapshot LatencyHistogram::Snapshot() const {
+    LatencySnapshot snapshot;
+    snapshot.count = 0;
+    for (int i = 0; i < LatencySnapshot::bucket_count; ++i) {
+        snapshot.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+        snapshot.count += snapshot.buckets[i];
+    }
+    snapshot.sum_ns = sum_ns_.load(std::memory_order_relaxed);
+    snapshot.max_ns = max_ns_.load(std::memory_order_relaxed);
+
+    auto percentile = [&](double p) -> uint64_t {
+        if (snapshot.count == 0) return 0;
+        uint64_t rank = snapshot.count * p;
+        uint64_t seen = 0;
+        for (int i = 0; i < LatencySnapshot::bucket_count; ++i) {
+            seen += snapshot.buckets[i];
+            if (seen > rank) {
+                uint64_t upper = LatencySnapshot::BucketUpperBoundNs(i);
+                return upper == 0 || upper > snapshot.max_ns ? snapshot.max_ns : upper;
+            }
+        }
+        return snapshot.max_ns;
+    };
+    snapshot.p50_ns = percentile(0.5);
+    snapshot.p90_ns = percentile(0.9);
+    snapshot.p99_ns = percentile(0.99);
+    return snapshot;
+}
+
+PipelineMetrics::PipelineMetrics() : frames_in(0), frames_out(0), dropped_frames(0), duplicate_frames(0) {}
+
+PipelineMetricsSnapshot PipelineMetrics::Snapshot(const std::string& session) const {
+    PipelineMetricsSnapshot snapshot;
+    snapshot.session = session;
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        snapshot.stages[i] = stages[i].Snapshot();
+    }
+    snapshot.frames_in = frames_in.load(std::memory_order_relaxed);
+    snapshot.frames_out = frames_out.load(std::memory_order_relaxed);
+    snapshot.dropped_frames = dropped_frames.load(std::memory_order_relaxed);
+    snapshot.duplicate_frames = duplicate_frames.load(std::memory_order_relaxed);
+    snapshot.end_to_end = end_to_end.Snapshot();
+    snapshot.full_ring.put_wait = full_ring.put_wait.Snapshot();
+    snapshot.full_ring.get_wait = full_ring.get_wait.Snapshot();
+    snapshot.empty_ring.put_wait = empty_ring.put_wait.Snapshot();
+    snapshot.empty_ring.get_wait = empty_ring.get_wait.Snapshot();
+    return snapshot;
+}
+
+// Label values are quoted in the text format, so backslash, double quote and newline have to be escaped.
+static std::string EscapeLabelValue(const std::string& value) {
+    std::string escaped;
+    escaped.reserve(value.size());
+    for (char c : value) {
+        if (c == '\\') {
+            escaped += "\\\\";
+        } else if (c == '"') {
+            escaped += "\\\"";
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+// Appends a printf-formatted line, however long the labels make it.
+static void AppendF(std::string& out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+static void AppendF(std::string& out, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    va_list copy;
+    va_copy(copy, args);
+    int size = vsnprintf(nullptr, 0, format, copy);
+    va_end(copy);
+    if (size > 0) {
+        size_t offset = out.size();
+        out.resize(offset + size + 1);
+        vsnprintf(&out[offset], size + 1, format, args);
+        out.resize(offset + size);
+    }
+    va_end(args);
+}
+
+static void AppendHistogram(std::string& out, const std::string& name, const std::string& labels,
+                            const LatencySnapshot& histogram) {
+    uint64_t cumulative = 0;
+    for (int i = 0; i < LatencySnapshot::bucket_count; ++i) {
+        cumulative += histogram.buckets[i];
+        uint64_t upper = LatencySnapshot::BucketUpperBoundNs(i);
+        if (upper == 0) {
+            AppendF(out, "%s_bucket{%s,le=\"+Inf\"} %" PRIu64 "\n", name.c_str(), labels.c_str(), cumulative);
+        } else {
+            AppendF(out, "%s_bucket{%s,le=\"%.9g\"} %" PRIu64 "\n", name.c_str(), labels.c_str(), upper / 1e9,
+                    cumulative);
+        }
+    }
+    AppendF(out, "%s_sum{%s} %.9g\n%s_count{%s} %" PRIu64 "\n", name.c_str(), labels.c_str(), histogram.sum_ns / 1e9,
+            name.c_str(), labels.c_str(), cumulative);
+}
+
+std::string MetricsToPrometheus(const std::vector<PipelineMetricsSnapshot>& snapshots) {
+    std::string out;
+
+    auto session_label = [](const PipelineMetricsSnapshot& s) {
+        return "session=\"" + EscapeLabelValue(s.session) + "\"";
+    };
+    auto counter = [&](const char* name, const char* help, std::function<uint64_t(const PipelineMetricsSnapshot&)> get) {
+        AppendF(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+        for (const auto& s : snapshots) {
+            AppendF(out, "%s{%s} %" PRIu64 "\n", name, session_label(s).c_str(), get(s));
+        }
+    };
+
+    counter("media_frames_in_total", "Frames accepted by the pipeline.",
+            [](const PipelineMetricsSnapshot& s) { return s.frames_in; });
+    counter("media_frames_out_total", "Frames delivered by the pipeline.",
+            [](const PipelineMetricsSnapshot& s) { return s.frames_out; });
+    counter("media_dropped_frames_total", "Frames dropped because the pipeline was full.",
+            [](const PipelineMetricsSnapshot& s) { return s.dropped_frames; });
+    counter("media_duplicate_frames_total", "Frames identical to the previous one, not encoded.",
+            [](const PipelineMetricsSnapshot& s) { return s.duplicate_frames; });
+
+    out += "# HELP media_stage_latency_seconds Time spent per frame or packet in each stage.\n";
+    out += "# TYPE media_stage_latency_seconds histogram\n";
+    for (const auto& s : snapshots) {
+        for (int i = 0; i < STAGE_COUNT; ++i) {
+            if (s.stages[i].count == 0) continue;
+            AppendHistogram(out, "media_stage_latency_seconds",
+                            session_label(s) + ",stage=\"" + PipelineStage2Str(i) + "\"", s.stages[i]);
+        }
+    }
+
+    out += "# HELP media_end_to_end_latency_seconds Time from submitting a frame to its packet being written.\n";
+    out += "# TYPE media_end_to_end_latency_seconds histogram\n";
+    for (const auto& s : snapshots) {
+        if (s.end_to_end.count == 0) continue;
+        AppendHistogram(out, "media_end_to_end_latency_seconds", session_label(s), s.end_to_end);
+    }
+
+    const char* ring_names[] = {"full", "empty"};
+    out += "# HELP media_ring_occupancy Frames currently queued in a ring.\n# TYPE media_ring_occupancy gauge\n";
+    for (const auto& s : snapshots) {
+        const RingSnapshot* rings[] = {&s.full_ring, &s.empty_ring};
+        for (int r = 0; r < 2; ++r) {
+            AppendF(out, "media_ring_occupancy{%s,ring=\"%s\"} %zu\n", session_label(s).c_str(), ring_names[r],
+                    rings[r]->occupancy);
+        }
+    }
+    out += "# HELP media_ring_capacity Ring size in frames.\n# TYPE media_ring_capacity gauge\n";
+    for (const auto& s : snapshots) {
+        const RingSnapshot* rings[] = {&s.full_ring, &s.empty_ring};
+        for (int r = 0; r < 2; ++r) {
+            AppendF(out, "media_ring_capacity{%s,ring=\"%s\"} %zu\n", session_label(s).c_str(), ring_names[r],
+                    rings[r]->capacity);
+        }
+    }
+    out += "# HELP media_ring_depth Frames circulating between a session's rings.\n# TYPE media_ring_depth gauge\n";
+    for (const auto& s : snapshots) {
+        AppendF(out, "media_ring_depth{%s} %d\n", session_label(s).c_str(), s.ring_depth);
+    }
+    out += "# HELP media_pinned_bytes Frame memory a session holds in its rings.\n# TYPE media_pinned_bytes gauge\n";
+    for (const auto& s : snapshots) {
+        AppendF(out, "media_pinned_bytes{%s} %" PRIu64 "\n", session_label(s).c_str(), s.pinned_bytes);
+    }
+    out += "# HELP media_session_placement_info Cores and NUMA node a session is placed on.\n";
+    out += "# TYPE media_session_placement_info gauge\n";
+    for (const auto& s : snapshots) {
+        AppendF(out, "media_session_placement_info{%s,cores=\"%s\",numa_node=\"%d\"} 1\n",
+                session_label(s).c_str(), EscapeLabelValue(s.cores).c_str(), s.numa_node);
+    }
+    AppendF(out,
+            "# HELP media_process_pinned_bytes Frame memory pinned by all sessions.\n"
+            "# TYPE media_process_pinned_bytes gauge\nmedia_process_pinned_bytes %zu\n"
+            "# HELP media_process_pinned_bytes_limit Frame memory budget, 0 when unlimited.\n"
+            "# TYPE media_process_pinned_bytes_limit gauge\nmedia_process_pinned_bytes_limit %zu\n",
+            FrameMemoryBudget::Instance()->Pinned(), FrameMemoryBudget::Instance()->Limit());
+    out += "# HELP media_ring_wait_seconds Time blocked putting into or getting from a ring.\n";
+    out += "# TYPE media_ring_wait_seconds histogram\n";
+    for (const auto& s : snapshots) {
+        const RingSnapshot* rings[] = {&s.full_ring, &s.empty_ring};
+        for (int r = 0; r < 2; ++r) {
+            std::string labels = session_label(s) + ",ring=\"" + ring_names[r] + "\"";
+            if (rings[r]->put_wait.count > 0) {
+                AppendHistogram(out, "media_ring_wait_seconds", labels + ",side=\"put\"", rings[r]->put_wait);
+            }
+            if (rings[r]->get_wait.count > 0) {
+                AppendHistogram(out, "media_ring_wait_seconds", labels + ",side=\"get\"", rings[r]->get_wait);
+            }
+        }
+    }
+    return out;
+}
+
+bool WritePrometheusFile(const std::string& path, const std::vector<PipelineMetricsSnapshot>& snapshots) {
+    std::string text = MetricsToPrometheus(snapshots);
+    std::string tmp_path = path + ".tmp";
+    FILE* fp = fopen(tmp_path.c_str(), "w");
+    if (fp == nullptr) {
+        log_error("Could not open metrics file %s", tmp_path.c_str());
+        return false;
+    }
+    bool ok = fwrite(text.data(), 1, text.size(), fp) == text.size();
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        log_error("Could not write metrics file %s", path.c_str());
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool WritePrometheusSocket(const std::string& socket_path, const std::vector<PipelineMetricsSnapshot>& snapshots) {
+    struct sockaddr_un addr;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        log_error("Metrics socket path too long: %s", socket_path.c_str());
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("Could not create metrics socket");
+        return false;
+    }
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+        log_error("Could not connect to metrics socket %s", socket_path.c_str());
+        close(fd);
+        return false;
+    }
+
+    std::string text = MetricsToPrometheus(snapshots);
+    size_t written = 0;
+    while (written < text.size()) {
+        ssize_t n = send(fd, text.data() + written, text.size() - written, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        written += n;
+    }
+    close(fd);
+    if (written != text.size()) {
+        log_error("Could not write to metrics socket %s", socket_path.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum PipelineStage {
+    STAGE_DEMUX = 0,
+    STAGE_DECODE,
+    STAGE_CONVERT,
+    STAGE_ENCODE,
+    STAGE_MUX,
+    STAGE_COUNT,
+};
+
+const char* PipelineStage2Str(int stage);
+
+inline int64_t MetricsNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+struct LatencySnapshot {
+    static const int bucket_count = 32;
+
+    uint64_t count = 0;
+    uint64_t sum_ns = 0;
+    uint64_t max_ns = 0;
+    // Estimated from the buckets, so they are within a factor of two of the real value.
+    uint64_t p50_ns = 0;
+    uint64_t p90_ns = 0;
+    uint64_t p99_ns = 0;
+    // buckets[0] counts samples below 1024ns, buckets[i] samples in [2^(i+9), 2^(i+10)) ns, the last one the rest.
+    uint64_t buckets[bucket_count] = {0};
+
+    // Upper bound of bucket |i| in nanoseconds, 0 for the last (unbounded) one.
+    static uint64_t BucketUpperBoundNs(int i);
+};
+
+// Log2 bucketed latency histogram. Recording is a few relaxed atomic adds, so it can stay on in production.
+class LatencyHistogram {
+public:
+    void Record(int64_t ns);
+    LatencySnapshot Snapshot() const;
+
+    LatencyHistogram();
+
+private:
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_ns_;
+    std::atomic<uint64_t> max_ns_;
+    std::atomic<uint64_t> buckets_[LatencySnapshot::bucket_count];
+};
+
+// Records the lifetime of the scope into a histogram.
+class ScopedLatency {
+public:
+    explicit ScopedLatency(LatencyHistogram* histogram) : histogram_(histogram), begin_ns_(MetricsNowNs()) {}
+    ~ScopedLatency() { histogram_->Record(MetricsNowNs() - begin_ns_); }
+
+private:
+    LatencyHistogram* histogram_;
+    int64_t begin_ns_;
+};
+
+struct RingSnapshot {
+    size_t capacity = 0;
+    size_t occupancy = 0;
+    LatencySnapshot put_wait;
+    LatencySnapshot get_wait;
+};
+
+struct RingMetrics {
+    LatencyHistogram put_wait;
+    LatencyHistogram get_wait;
+};
+
+struct PipelineMetricsSnapshot {
+    std::string session;
+    LatencySnapshot stages[STAGE_COUNT];
+    uint64_t frames_in = 0;
+    uint64_t frames_out = 0;
+    uint64_t dropped_frames = 0;
+    // Recorders only: frames identical to the previous one, not encoded.
+    uint64_t duplicate_frames = 0;
+    // Recorders only: from the Send call to the frame's packet being written.
+    LatencySnapshot end_to_end;
+    // Frames waiting for the consumer, and frames free for the producer.
+    RingSnapshot full_ring;
+    RingSnapshot empty_ring;
+    // Frames currently circulating between the rings, and the frame memory they pin.
+    int ring_depth = 0;
+    uint64_t pinned_bytes = 0;
+    // Where the session's threads run and its frames live (see ThreadPlacement): empty and -1 when floating.
+    std::string cores;
+    int numa_node = -1;
+};
+
+// Counters a decoder or recorder updates as frames move through it. Ring occupancy is filled in by the owner when a
+// snapshot is taken, since only it knows its rings.
+class PipelineMetrics {
+public:
+    LatencyHistogram stages[STAGE_COUNT];
+    std::atomic<uint64_t> frames_in;
+    std::atomic<uint64_t> frames_out;
+    std::atomic<uint64_t> dropped_frames;
+    std::atomic<uint64_t> duplicate_frames;
+    LatencyHistogram end_to_end;
+    RingMetrics full_ring;
+    RingMetrics empty_ring;
+
+    PipelineMetricsSnapshot Snapshot(const std::string& session) const;
+
+    PipelineMetrics();
+};
+
+// Prometheus text exposition format.
+std::string MetricsToPrometheus(const std::vector<PipelineMetricsSnapshot>& snapshots);
+// Writes to a temporary file and renames it over |path|, so scrapers (e.g. the node_exporter textfile collector)
+// never see a partial file.
+bool WritePrometheusFile(const std::string& path, const std::vector<PipelineMetricsSnapshot>& snapshots);
+// Connects to a unix stream socket and writes the text to it.
+bool WritePrometheusSocket(const std::string& socket_path, const std::vector<PipelineMetricsSnapshot>& snapshots);
@@ -0,0 +1,44 @@
+#include "readiness_notifier.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cstdint>
+
+#include "logger.h"
+
+ReadinessNotifier::ReadinessNotifier() : armed_(false) {
+    fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd_ < 0) {
+        log_error("Could not create eventfd");
+    }
+}
+
+ReadinessNotifier::~ReadinessNotifier() {
+    if (fd_ >= 0) close(fd_);
+}
+
+void ReadinessNotifier::Arm() {
+    if (fd_ < 0) return;
+    uint64_t value;
+    while (read(fd_, &value, sizeof(value)) == sizeof(value)) {
+    }
+    armed_.store(true, std::memory_order_relaxed);
+    // Pairs with the fence in NotifyIfArmed: either the waiter's retry sees the other side's change, or the other
+    // side sees armed_.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void ReadinessNotifier::NotifyIfArmed() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!armed_.load(std::memory_order_relaxed) || !armed_.exchange(false)) return;
+    Notify();
+}
+
+void ReadinessNotifier::Notify() {
+    if (fd_ < 0) return;
+    uint64_t value = 1;
+    if (write(fd_, &value, sizeof(value)) != sizeof(value)) {
+        log_warn("Could not signal eventfd");
+    }
+}
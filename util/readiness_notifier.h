@@ -0,0 +1,30 @@
+#pragma once
+
+#include <atomic>
+
+// Pollable "can make progress again" signal for one direction of a session, backed by an eventfd.
+//
+// The waiting side calls Arm() after an operation would have blocked and then retries it once; the other side calls
+// NotifyIfArmed() after every change that may unblock it. Only a waiter that armed costs the notifier a syscall, and
+// the fd stays quiet while the waiting side keeps up.
+class ReadinessNotifier {
+public:
+    // -1 if the eventfd could not be created.
+    int Fd() const { return fd_; }
+
+    // Clears a pending wakeup and requests the next one.
+    void Arm();
+    void NotifyIfArmed();
+    // Wakes unconditionally, for end of stream and shutdown.
+    void Notify();
+
+    ReadinessNotifier();
+    ~ReadinessNotifier();
+
+    ReadinessNotifier(const ReadinessNotifier&) = delete;
+    ReadinessNotifier& operator=(const ReadinessNotifier&) = delete;
+
+private:
+    int fd_;
+    std::atomic<bool> armed_;
+};
@@ -0,0 +1,73 @@
+#include "ring_depth.h"
+
+#include <algorithm>
+
+#include "logger.h"
+
+FrameMemoryBudget* FrameMemoryBudget::Instance() {
+    static FrameMemoryBudget* instance = new FrameMemoryBudget();
+    return instance;
+}
+
+FrameMemoryBudget::FrameMemoryBudget() : limit_(0), pinned_(0) {}
+
+void FrameMemoryBudget::SetLimit(size_t bytes) { limit_.store(bytes, std::memory_order_relaxed); }
+
+bool FrameMemoryBudget::TryReserve(size_t bytes) {
+    size_t limit = limit_.load(std::memory_order_relaxed);
+    size_t pinned = pinned_.load(std::memory_order_relaxed);
+    do {
+        if (limit != 0 && pinned + bytes > limit) return false;
+    } while (!pinned_.compare_exchange_weak(pinned, pinned + bytes, std::memory_order_relaxed));
+    return true;
+}
+
+void FrameMemoryBudget::Reserve(size_t bytes) {
+    size_t pinned = pinned_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    size_t limit = limit_.load(std::memory_order_relaxed);
+    if (limit != 0 && pinned > limit) {
+        log_warn("Frame memory over budget: %zu of %zu bytes pinned", pinned, limit);
+    }
+}
+
+void FrameMemoryBudget::Release(size_t bytes) { pinned_.fetch_sub(bytes, std::memory_order_relaxed); }
+
+void RingDepthController::Init(int min_depth, int max_depth, int idle_frames, size_t frame_bytes) {
+    Reset();
+    min_depth_ = std::max(1, min_depth);
+    max_depth_ = std::max(min_depth_, max_depth);
+    idle_frames_ = std::max(1, idle_frames);
+    frame_bytes_ = frame_bytes;
+    takes_since_stall_ = 0;
+    starved_.store(false, std::memory_order_relaxed);
+    FrameMemoryBudget::Instance()->Reserve(min_depth_ * frame_bytes_);
+    depth_.store(min_depth_, std::memory_order_relaxed);
+}
+
+void RingDepthController::Reset() {
+    int depth = depth_.exchange(0, std::memory_order_relaxed);
+    FrameMemoryBudget::Instance()->Release(depth * frame_bytes_);
+}
+
+bool RingDepthController::OnStall() {
+    takes_since_stall_ = 0;
+    int depth = depth_.load(std::memory_order_relaxed);
+    if (depth >= max_depth_ || !starved_.exchange(false, std::memory_order_relaxed)) return false;
+    if (!FrameMemoryBudget::Instance()->TryReserve(frame_bytes_)) {
+        log_debug("Ring stays at %d frames, frame memory budget exhausted", depth);
+        return false;
+    }
+    depth_.store(depth + 1, std::memory_order_relaxed);
+    return true;
+}
+
+bool RingDepthController::OnTake() {
+    if (++takes_since_stall_ < idle_frames_ || depth_.load(std::memory_order_relaxed) <= min_depth_) return false;
+    takes_since_stall_ = 0;
+    return true;
+}
+
+void RingDepthController::Shrink() {
+    depth_.fetch_sub(1, std::memory_order_relaxed);
+    FrameMemoryBudget::Instance()->Release(frame_bytes_);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// Process-wide cap on the bytes sessions pin in ring frames. Every session reserves its minimum depth regardless of
+// the cap, and every frame above it against the cap, so under memory pressure sessions run shallower instead of
+// failing to start.
+class FrameMemoryBudget {
+public:
+    static FrameMemoryBudget* Instance();
+
+    // 0 for no cap.
+    void SetLimit(size_t bytes);
+    size_t Limit() const { return limit_.load(std::memory_order_relaxed); }
+    size_t Pinned() const { return pinned_.load(std::memory_order_relaxed); }
+
+    // Fails instead of going over the limit.
+    bool TryReserve(size_t bytes);
+    void Reserve(size_t bytes);
+    void Release(size_t bytes);
+
+    FrameMemoryBudget(const FrameMemoryBudget&) = delete;
+    FrameMemoryBudget& operator=(const FrameMemoryBudget&) = delete;
+
+private:
+    std::atomic<size_t> limit_;
+    std::atomic<size_t> pinned_;
+
+    FrameMemoryBudget();
+};
+
+// Number of frames circulating between one session's empty and full rings. The producer (the side that takes empty
+// frames) grows the depth by one when it finds no empty frame and the consumer has been starved since the producer's
+// last stall: both sides took turns waiting, which a deeper ring absorbs. A producer that is simply faster stalls
+// without the consumer ever starving and gets no more frames. The depth shrinks by one after idle_frames takes in a
+// row that found a frame waiting.
+//
+// OnStall, OnTake and Shrink are for the producer thread, OnStarved for the consumer, the getters for anyone.
+class RingDepthController {
+public:
+    // Reserves min_depth frames of frame_bytes each, releasing what a previous Init reserved.
+    void Init(int min_depth, int max_depth, int idle_frames, size_t frame_bytes);
+    // Releases every frame, for Stop.
+    void Reset();
+
+    // No empty frame was available. True when the caller should add one; it is already counted, call Shrink if the
+    // allocation fails.
+    bool OnStall();
+    // An empty frame was available. True when the caller should free a spare one, then call Shrink if it found one.
+    bool OnTake();
+    void Shrink();
+    void OnStarved() { starved_.store(true, std::memory_order_relaxed); }
+
+    int Depth() const { return depth_.load(std::memory_order_relaxed); }
+    int MaxDepth() const { return max_depth_; }
+    size_t PinnedBytes() const { return (size_t)Depth() * frame_bytes_; }
+
+    RingDepthController() : depth_(0), starved_(false) {}
+    ~RingDepthController() { Reset(); }
+
+    RingDepthController(const RingDepthController&) = delete;
+    RingDepthController& operator=(const RingDepthController&) = delete;
+
+private:
+    int min_depth_ = 0;
+    int max_depth_ = 0;
+    int idle_frames_ = 0;
+    size_t frame_bytes_ = 0;
+    int takes_since_stall_ = 0;
+
+    std::atomic<int> depth_;
+    std::atomic<bool> starved_;
+};
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPSC_RING_CPU_RELAX() _mm_pause()
+#else
+#define SPSC_RING_CPU_RELAX() std::atomic_signal_fence(std::memory_order_seq_cst)
+#endif
+
+// Single-producer single-consumer ring. Exactly one thread may call the Put* methods and exactly one thread may call
+// the Get* methods. The fast path is lock free; a side only sleeps on a futex when the ring is full (producer) or
+// empty (consumer), and the opposite side only issues a wake syscall when someone is actually sleeping.
+template <typename T>
+class SpscRing {
+public:
+    // Blocks while full. Returns false if the ring was closed.
+    bool Put(T t);
+    bool PutNoWait(T t);
+    // Puts all |count| items, blocking while full. Returns how many were put before the ring was closed.
+    size_t PutBatch(const T* items, size_t count);
+
+    // Blocks while empty. Returns false once the ring is closed and drained.
+    bool Get(T& t);
+    bool GetNoWait(T& t);
+    // Blocks until at least one item is available, then takes up to |max_count|. Returns 0 once closed and drained.
+    size_t GetBatch(T* items, size_t max_count);
+
+    // Wakes both sides. Puts fail from now on, Gets keep returning queued items until the ring is empty.
+    void Close();
+    bool Closed() const;
+
+    size_t Size() const;
+    size_t Capacity() const;
+
+    SpscRing() = delete;
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+    // Capacity is rounded up to a power of two.
+    explicit SpscRing(size_t size);
+    ~SpscRing();
+
+    // Keeps the cache line padding intact for heap allocated rings, which C++14 new does not guarantee.
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
+
+private:
+    static const size_t cache_line_size_ = 64;
+    // Polls before falling back to the futex, so a side that is only briefly ahead does not pay two syscalls per item.
+    // Spinning is useless on a single core, where the other side cannot run until we sleep.
+    static const int max_spin_count_ = 512;
+    int spin_count_;
+
+    T* buffer_;
+    size_t capacity_;
+    size_t mask_;
+
+    // Producer side.
+    alignas(cache_line_size_) std::atomic<uint64_t> head_;
+    uint64_t cached_tail_;
+    std::atomic<uint32_t> not_full_seq_;
+    std::atomic<bool> producer_waiting_;
+
+    // Consumer side.
+    alignas(cache_line_size_) std::atomic<uint64_t> tail_;
+    uint64_t cached_head_;
+    std::atomic<uint32_t> not_empty_seq_;
+    std::atomic<bool> consumer_waiting_;
+
+    alignas(cache_line_size_) std::atomic<bool> closed_;
+
+    size_t WaitWritable(bool block);
+    size_t WaitReadable(bool block);
+    void WakeProducer();
+    void WakeConsumer();
+
+    static void FutexWait(std::atomic<uint32_t>* addr, uint32_t expected);
+    static void FutexWakeAll(std::atomic<uint32_t>* addr);
+};
+
+template <typename T>
+SpscRing<T>::SpscRing(size_t size)
+    : head_(0),
+      cached_tail_(0),
+      not_full_seq_(0),
+      producer_waiting_(false),
+      tail_(0),
+      cached_head_(0),
+      not_empty_seq_(0),
+      consumer_waiting_(false),
+      closed_(false) {
+    spin_count_ = std::thread::hardware_concurrency() > 1 ? max_spin_count_ : 0;
+    capacity_ = 1;
+    while (capacity_ < size) capacity_ <<= 1;
+    mask_ = capacity_ - 1;
+    buffer_ = new T[capacity_];
+}
+
+template <typename T>
+SpscRing<T>::~SpscRing() {
+    delete[] buffer_;
+}
+
+template <typename T>
+void* SpscRing<T>::operator new(size_t size) {
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, cache_line_size_, size) != 0) throw std::bad_alloc();
+    return ptr;
+}
+
+template <typename T>
+void SpscRing<T>::operator delete(void* ptr) {
+    free(ptr);
+}
+
+template <typename T>
+void SpscRing<T>::FutexWait(std::atomic<uint32_t>* addr, uint32_t expected) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+template <typename T>
+void SpscRing<T>::FutexWakeAll(std::atomic<uint32_t>* addr) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+template <typename T>
+void SpscRing<T>::WakeConsumer() {
+    // Pairs with the fence in WaitReadable: either the consumer sees our new head, or we see it waiting. Clearing the
+    // flag here keeps us from issuing a wake per item while the woken consumer has not been scheduled yet.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (consumer_waiting_.load(std::memory_order_relaxed) && consumer_waiting_.exchange(false)) {
+        not_empty_seq_.fetch_add(1, std::memory_order_release);
+        FutexWakeAll(&not_empty_seq_);
+    }
+}
+
+template <typename T>
+void SpscRing<T>::WakeProducer() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (producer_waiting_.load(std::memory_order_relaxed) && producer_waiting_.exchange(false)) {
+        not_full_seq_.fetch_add(1, std::memory_order_release);
+        FutexWakeAll(&not_full_seq_);
+    }
+}
+
+// Returns the number of free slots, waiting for at least one if |block|. Returns 0 if closed, or full and !block.
+template <typename T>
+size_t SpscRing<T>::WaitWritable(bool block) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    while (true) {
+        if (closed_.load(std::memory_order_acquire)) return 0;
+        if (head - cached_tail_ < capacity_) return capacity_ - (head - cached_tail_);
+        cached_tail_ = tail_.load(std::memory_order_acquire);
+        if (head - cached_tail_ < capacity_) return capacity_ - (head - cached_tail_);
+        if (!block) return 0;
+
+        for (int i = 0; i < spin_count_ && head - cached_tail_ >= capacity_; ++i) {
+            SPSC_RING_CPU_RELAX();
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+        }
+        if (head - cached_tail_ < capacity_) continue;
+
+        uint32_t seq = not_full_seq_.load(std::memory_order_acquire);
+        producer_waiting_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cached_tail_ = tail_.load(std::memory_order_acquire);
+        if (head - cached_tail_ >= capacity_ && !closed_.load(std::memory_order_acquire)) {
+            FutexWait(&not_full_seq_, seq);
+        }
+        producer_waiting_.store(false, std::memory_order_relaxed);
+    }
+}
+
+// Returns the number of queued items, waiting for at least one if |block|. Returns 0 if empty and (closed or !block).
+template <typename T>
+size_t SpscRing<T>::WaitReadable(bool block) {
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    while (true) {
+        if (cached_head_ != tail) return cached_head_ - tail;
+        cached_head_ = head_.load(std::memory_order_acquire);
+        if (cached_head_ != tail) return cached_head_ - tail;
+        if (!block || closed_.load(std::memory_order_acquire)) {
+            // The producer may have published its last items right before closing.
+            cached_head_ = head_.load(std::memory_order_acquire);
+            return cached_head_ - tail;
+        }
+
+        for (int i = 0; i < spin_count_ && cached_head_ == tail; ++i) {
+            SPSC_RING_CPU_RELAX();
+            cached_head_ = head_.load(std::memory_order_acquire);
+        }
+        if (cached_head_ != tail) continue;
+
+        uint32_t seq = not_empty_seq_.load(std::memory_order_acquire);
+        consumer_waiting_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cached_head_ = head_.load(std::memory_order_acquire);
+        if (cached_head_ == tail && !closed_.load(std::memory_order_acquire)) {
+            FutexWait(&not_empty_seq_, seq);
+        }
+        consumer_waiting_.store(false, std::memory_order_relaxed);
+    }
+}
+
+template <typename T>
+bool SpscRing<T>::Put(T t) {
+    return PutBatch(&t, 1) == 1;
+}
+
+template <typename T>
+bool SpscRing<T>::PutNoWait(T t) {
+    if (WaitWritable(false) == 0) return false;
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    buffer_[head & mask_] = t;
+    head_.store(head + 1, std::memory_order_release);
+    WakeConsumer();
+    return true;
+}
+
+template <typename T>
+size_t SpscRing<T>::PutBatch(const T* items, size_t count) {
+    size_t done = 0;
+    while (done < count) {
+        size_t free_slots = WaitWritable(true);
+        if (free_slots == 0) break;
+        size_t n = count - done < free_slots ? count - done : free_slots;
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < n; ++i) {
+            buffer_[(head + i) & mask_] = items[done + i];
+        }
+        head_.store(head + n, std::memory_order_release);
+        done += n;
+        WakeConsumer();
+    }
+    return done;
+}
+
+template <typename T>
+bool SpscRing<T>::Get(T& t) {
+    return GetBatch(&t, 1) == 1;
+}
+
+template <typename T>
+bool SpscRing<T>::GetNoWait(T& t) {
+    if (WaitReadable(false) == 0) return false;
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    t = buffer_[tail & mask_];
+    tail_.store(tail + 1, std::memory_order_release);
+    WakeProducer();
+    return true;
+}
+
+template <typename T>
+size_t SpscRing<T>::GetBatch(T* items, size_t max_count) {
+    if (max_count == 0) return 0;
+    size_t available = WaitReadable(true);
+    if (available == 0) return 0;
+    size_t n = max_count < available ? max_count : available;
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < n; ++i) {
+        items[i] = buffer_[(tail + i) & mask_];
+    }
+    tail_.store(tail + n, std::memory_order_release);
+    WakeProducer();
+    return n;
+}
+
+template <typename T>
+void SpscRing<T>::Close() {
+    closed_.store(true, std::memory_order_release);
+    not_full_seq_.fetch_add(1, std::memory_order_release);
+    not_empty_seq_.fetch_add(1, std::memory_order_release);
+    FutexWakeAll(&not_full_seq_);
+    FutexWakeAll(&not_empty_seq_);
+}
+
+template <typename T>
+bool SpscRing<T>::Closed() const {
+    return closed_.load(std::memory_order_acquire);
+}
+
+template <typename T>
+size_t SpscRing<T>::Size() const {
+    return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+}
+
+template <typename T>
+size_t SpscRing<T>::Capacity() const {
+    return capacity_;
+}
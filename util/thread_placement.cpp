@@ -0,0 +1,269 @@
+#include "thread_placement.h"
+
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+#include "logger.h"
+
+// From <linux/mempolicy.h>, which not every toolchain ships.
+static const int mpol_preferred = 1;
+static const unsigned mpol_mf_move = 1 << 1;
+static const int max_numa_nodes = 1024;
+
+namespace {
+
+bool ParseCpuList(const char* text, cpu_set_t* cpus) {
+    CPU_ZERO(cpus);
+    const char* p = text;
+    while (*p != '\0' && *p != '\n') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p) return false;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1) return false;
+            p = end;
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+            CPU_SET(cpu, cpus);
+        }
+        if (*p == ',') ++p;
+    }
+    return true;
+}
+
+// The cores the process could run on when placement was first used, before any session pinned a thread.
+const cpu_set_t& AllowedCpus() {
+    static cpu_set_t allowed;
+    static std::once_flag once;
+    std::call_once(once, [] {
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            CPU_ZERO(&allowed);
+            long count = sysconf(_SC_NPROCESSORS_CONF);
+            for (long cpu = 0; cpu < count && cpu < CPU_SETSIZE; ++cpu) {
+                CPU_SET(cpu, &allowed);
+            }
+        }
+    });
+    return allowed;
+}
+
+// The node's cores the process may run on. False when there are none.
+bool UsableNodeCpus(int node, cpu_set_t* cpus) {
+    cpu_set_t node_cpus;
+    if (!NumaNodeCpus(node, &node_cpus)) return false;
+    CPU_AND(cpus, &node_cpus, &AllowedCpus());
+    return CPU_COUNT(cpus) > 0;
+}
+
+// The node holding all of |cpus|, -1 when they span nodes.
+int NodeOf(const cpu_set_t& cpus) {
+    for (int node = 0; node < NumaNodeCount(); ++node) {
+        cpu_set_t node_cpus;
+        cpu_set_t common;
+        if (!NumaNodeCpus(node, &node_cpus)) continue;
+        CPU_AND(&common, &cpus, &node_cpus);
+        if (CPU_EQUAL(&common, &cpus)) return node;
+    }
+    return -1;
+}
+
+// Sessions AUTO placed on each node, and the node each group went to.
+std::mutex auto_mutex;
+std::map<int, int> auto_node_sessions;
+std::map<std::string, std::pair<int, int>> auto_groups;
+
+int AcquireAutoNode(const std::string& group) {
+    std::lock_guard<std::mutex> lock(auto_mutex);
+    if (!group.empty()) {
+        auto it = auto_groups.find(group);
+        if (it != auto_groups.end()) {
+            ++it->second.second;
+            ++auto_node_sessions[it->second.first];
+            return it->second.first;
+        }
+    }
+    int best = -1;
+    for (int node = 0; node < NumaNodeCount(); ++node) {
+        cpu_set_t cpus;
+        if (!UsableNodeCpus(node, &cpus)) continue;
+        if (best < 0 || auto_node_sessions[node] < auto_node_sessions[best]) best = node;
+    }
+    if (best < 0) return -1;
+    ++auto_node_sessions[best];
+    if (!group.empty()) auto_groups[group] = std::make_pair(best, 1);
+    return best;
+}
+
+void ReleaseAutoNode(const std::string& group, int node) {
+    std::lock_guard<std::mutex> lock(auto_mutex);
+    --auto_node_sessions[node];
+    auto it = auto_groups.find(group);
+    if (it != auto_groups.end() && --it->second.second == 0) auto_groups.erase(it);
+}
+
+}  // namespace
+
+int NumaNodeCount() {
+    static int count = [] {
+        int nodes = 0;
+        char path[64];
+        while (nodes < max_numa_nodes) {
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", nodes);
+            if (access(path, F_OK) != 0) break;
+            ++nodes;
+        }
+        return nodes > 0 ? nodes : 1;
+    }();
+    return count;
+}
+
+bool NumaNodeCpus(int node, cpu_set_t* cpus) {
+    if (node < 0 || node >= NumaNodeCount()) return false;
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE* file = fopen(path, "r");
+    if (file == nullptr) {
+        if (NumaNodeCount() > 1) return false;
+        // No sysfs topology, the whole host is one node.
+        CPU_ZERO(cpus);
+        long count = sysconf(_SC_NPROCESSORS_CONF);
+        for (long cpu = 0; cpu < count && cpu < CPU_SETSIZE; ++cpu) {
+            CPU_SET(cpu, cpus);
+        }
+        return true;
+    }
+    char text[4096] = {0};
+    bool ok = fgets(text, sizeof(text), file) != nullptr && ParseCpuList(text, cpus);
+    fclose(file);
+    return ok;
+}
+
+bool BindToNumaNode(void* addr, size_t size, int node) {
+    if (node < 0 || node >= max_numa_nodes) return false;
+    const int bits = 8 * sizeof(unsigned long);
+    unsigned long mask[max_numa_nodes / bits] = {0};
+    mask[node / bits] |= 1UL << (node % bits);
+    // The kernel reads one bit less than maxnode says.
+    if (syscall(SYS_mbind, addr, size, mpol_preferred, mask, (unsigned long)max_numa_nodes + 1, mpol_mf_move) != 0) {
+        log_debug("Could not bind %zu bytes to NUMA node %d: %s", size, node, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+ThreadPlacement::ThreadPlacement() { CPU_ZERO(&cpus_); }
+
+bool ThreadPlacement::Init(const ThreadPlacementParam& param) {
+    Reset();
+    pinned_ = false;
+    numa_node_ = -1;
+    CPU_ZERO(&cpus_);
+
+    switch (param.policy) {
+        case PLACEMENT_CORES:
+            for (int core : param.cores) {
+                if (core < 0 || core >= CPU_SETSIZE || !CPU_ISSET(core, &AllowedCpus())) {
+                    log_error("Core %d is not available to the process", core);
+                    return false;
+                }
+                CPU_SET(core, &cpus_);
+            }
+            if (CPU_COUNT(&cpus_) == 0) {
+                log_error("No cores to place the session on");
+                return false;
+            }
+            numa_node_ = NodeOf(cpus_);
+            break;
+        case PLACEMENT_NUMA_NODE:
+            if (!UsableNodeCpus(param.numa_node, &cpus_)) {
+                log_error("NUMA node %d has no cores available to the process", param.numa_node);
+                return false;
+            }
+            numa_node_ = param.numa_node;
+            break;
+        case PLACEMENT_AUTO: {
+            // Nothing to keep together on one node.
+            if (NumaNodeCount() < 2) return true;
+            int node = AcquireAutoNode(param.group);
+            if (node < 0) return true;
+            UsableNodeCpus(node, &cpus_);
+            numa_node_ = node;
+            auto_placed_ = true;
+            auto_group_ = param.group;
+            break;
+        }
+        default:
+            return true;
+    }
+    pinned_ = true;
+    // Binding buffers is pointless with a single node.
+    if (NumaNodeCount() < 2) numa_node_ = -1;
+    return true;
+}
+
+void ThreadPlacement::Reset() {
+    if (auto_placed_) {
+        ReleaseAutoNode(auto_group_, numa_node_);
+        auto_placed_ = false;
+        auto_group_.clear();
+    }
+    pinned_ = false;
+    numa_node_ = -1;
+}
+
+bool ThreadPlacement::Apply() const {
+    if (!pinned_) return true;
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus_), &cpus_);
+    if (ret != 0) {
+        log_warn("Could not pin thread to cores %s: %s", CoreList().c_str(), strerror(ret));
+        return false;
+    }
+    return true;
+}
+
+std::string ThreadPlacement::CoreList() const {
+    std::string list;
+    if (!pinned_) return list;
+    char range[32];
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &cpus_)) continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &cpus_)) ++last;
+        if (last == cpu) {
+            snprintf(range, sizeof(range), "%s%d", list.empty() ? "" : ",", cpu);
+        } else {
+            snprintf(range, sizeof(range), "%s%d-%d", list.empty() ? "" : ",", cpu, last);
+        }
+        list += range;
+        cpu = last;
+    }
+    return list;
+}
+
+std::string ThreadPlacement::Describe() const {
+    if (!pinned_) return "floating";
+    std::string text = "cores " + CoreList();
+    if (numa_node_ >= 0) text += " (NUMA node " + std::to_string(numa_node_) + ")";
+    return text;
+}
+
+ScopedThreadPlacement::ScopedThreadPlacement(const ThreadPlacement& placement) {
+    if (!placement.Pinned()) return;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(previous_), &previous_) != 0) return;
+    restore_ = placement.Apply();
+}
+
+ScopedThreadPlacement::~ScopedThreadPlacement() {
+    if (restore_) pthread_setaffinity_np(pthread_self(), sizeof(previous_), &previous_);
+}
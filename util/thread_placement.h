@@ -0,0 +1,83 @@
+#pragma once
+
+#include <sched.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+enum ThreadPlacementPolicy {
+    PLACEMENT_FLOATING = 0,  // wherever the scheduler puts them
+    PLACEMENT_CORES,         // pinned to |cores|
+    PLACEMENT_NUMA_NODE,     // pinned to the cores of |numa_node|
+    PLACEMENT_AUTO,          // pinned to the NUMA node with the fewest sessions, shared within a |group|
+};
+
+struct ThreadPlacementParam {
+    ThreadPlacementPolicy policy = PLACEMENT_FLOATING;
+    // PLACEMENT_CORES: CPU numbers as the kernel counts them.
+    std::vector<int> cores;
+    // PLACEMENT_NUMA_NODE.
+    int numa_node = -1;
+    // PLACEMENT_AUTO: sessions with the same non-empty group, say the decoder and the recorder of one transcode, land
+    // on the same node. A session without one is a group of its own.
+    std::string group;
+};
+
+// The cores and NUMA node one session's threads and frame buffers are placed on. Worker threads call Apply when they
+// start. Codec contexts are opened inside a ScopedThreadPlacement, because the x264 and libavcodec threads they create
+// inherit the affinity of the opening thread. Frame buffers are leased from FramePool for NumaNode(), which binds
+// their pages to that node.
+class ThreadPlacement {
+public:
+    // Resolves |param| against the host's topology and the cores the process may run on. False when it names cores
+    // or a node the process can not use. AUTO on a single node host stays floating.
+    bool Init(const ThreadPlacementParam& param);
+    // Gives back the session's share of an AUTO node.
+    void Reset();
+
+    bool Pinned() const { return pinned_; }
+    // -1 when floating, or when the cores span nodes.
+    int NumaNode() const { return numa_node_; }
+    // Pins the calling thread, a no-op when floating.
+    bool Apply() const;
+    // "0-15,32-47", empty when floating.
+    std::string CoreList() const;
+    // For the logs: "cores 0-15 (NUMA node 0)" or "floating".
+    std::string Describe() const;
+
+    ThreadPlacement();
+    ~ThreadPlacement() { Reset(); }
+
+    ThreadPlacement(const ThreadPlacement&) = delete;
+    ThreadPlacement& operator=(const ThreadPlacement&) = delete;
+
+private:
+    bool pinned_ = false;
+    int numa_node_ = -1;
+    cpu_set_t cpus_;
+    // Set while the session counts against an AUTO node.
+    bool auto_placed_ = false;
+    std::string auto_group_;
+};
+
+// Pins the calling thread for the lifetime of the scope and restores its previous affinity.
+class ScopedThreadPlacement {
+public:
+    explicit ScopedThreadPlacement(const ThreadPlacement& placement);
+    ~ScopedThreadPlacement();
+
+    ScopedThreadPlacement(const ScopedThreadPlacement&) = delete;
+    ScopedThreadPlacement& operator=(const ScopedThreadPlacement&) = delete;
+
+private:
+    bool restore_ = false;
+    cpu_set_t previous_;
+};
+
+// NUMA topology from sysfs. A host without it counts as one node holding every core.
+int NumaNodeCount();
+bool NumaNodeCpus(int node, cpu_set_t* cpus);
+// Sets the preferred node for the pages of [addr, addr + size), and moves the ones already faulted in. |addr| must be
+// page aligned.
+bool BindToNumaNode(void* addr, size_t size, int node);
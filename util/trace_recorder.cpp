@@ -0,0 +1,179 @@
+#include "trace_recorder.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+
+#include "logger.h"
+#include "pipeline_metrics.h"
+
+namespace {
+
+std::atomic<uint64_t> next_trace_recorder_id(1);
+
+// A thread usually records into one or two sessions (e.g. a decoder and a recorder), so a few cached buffers avoid
+// the session mutex on every event.
+const int thread_cache_size = 4;
+
+struct ThreadCacheEntry {
+    uint64_t recorder_id;
+    void* buffer;
+};
+
+thread_local ThreadCacheEntry thread_cache[thread_cache_size] = {};
+thread_local int thread_cache_next = 0;
+thread_local int thread_tid = 0;
+
+int CurrentTid() {
+    if (thread_tid == 0) thread_tid = syscall(SYS_gettid);
+    return thread_tid;
+}
+
+void AppendJsonString(std::string& out, const std::string& str) {
+    out += '"';
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            char tmp[8];
+            snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+            out += tmp;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+}  // namespace
+
+TraceRecorder::TraceRecorder(const std::string& session) : session_(session), id_(next_trace_recorder_id++) {}
+
+TraceRecorder::~TraceRecorder() {
+    for (auto& it : buffers_) {
+        delete it.second;
+    }
+}
+
+TraceRecorder::ThreadBuffer* TraceRecorder::GetThreadBuffer() {
+    for (int i = 0; i < thread_cache_size; ++i) {
+        if (thread_cache[i].recorder_id == id_) return reinterpret_cast<ThreadBuffer*>(thread_cache[i].buffer);
+    }
+
+    int tid = CurrentTid();
+    ThreadBuffer* buffer;
+    {
+        std::unique_lock<std::mutex> lock(mux_);
+        auto it = buffers_.find(tid);
+        if (it == buffers_.end()) {
+            buffer = new ThreadBuffer();
+            buffer->tid = tid;
+            buffer->events.reserve(4096);
+            buffers_[tid] = buffer;
+        } else {
+            buffer = it->second;
+        }
+    }
+    thread_cache[thread_cache_next].recorder_id = id_;
+    thread_cache[thread_cache_next].buffer = buffer;
+    thread_cache_next = (thread_cache_next + 1) % thread_cache_size;
+    return buffer;
+}
+
+void TraceRecorder::Record(const char* name, int64_t begin_ns, int64_t end_ns, int64_t frame) {
+    ThreadBuffer* buffer = GetThreadBuffer();
+    if (buffer->events.size() >= max_events_per_thread_) {
+        buffer->dropped_events++;
+        return;
+    }
+    buffer->events.push_back(TraceEvent{name, begin_ns, end_ns - begin_ns, frame});
+}
+
+void TraceRecorder::NameThread(const std::string& name) { GetThreadBuffer()->name = name; }
+
+bool TraceRecorder::Dump(const std::string& filename) {
+    std::unique_lock<std::mutex> lock(mux_);
+    FILE* fp = fopen(filename.c_str(), "w");
+    if (fp == nullptr) {
+        log_error("Could not open trace file %s", filename.c_str());
+        return false;
+    }
+
+    int pid = getpid();
+    std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    char line[256];
+    bool first = true;
+    auto separator = [&]() {
+        if (!first) out += ",\n";
+        first = false;
+    };
+
+    separator();
+    snprintf(line, sizeof(line), "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":", pid);
+    out += line;
+    AppendJsonString(out, session_);
+    out += "}}";
+
+    uint64_t dropped_events = 0;
+    for (auto& it : buffers_) {
+        ThreadBuffer* buffer = it.second;
+        dropped_events += buffer->dropped_events;
+        if (!buffer->name.empty()) {
+            separator();
+            snprintf(line, sizeof(line), "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                     pid, buffer->tid);
+            out += line;
+            AppendJsonString(out, buffer->name);
+            out += "}}";
+        }
+        for (const TraceEvent& event : buffer->events) {
+            separator();
+            // Chrome expects microseconds, fractional values keep the nanosecond resolution.
+            snprintf(line, sizeof(line), "{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                     event.name, pid, buffer->tid, event.begin_ns / 1000.0, event.duration_ns / 1000.0);
+            out += line;
+            if (event.frame >= 0) {
+                snprintf(line, sizeof(line), ",\"args\":{\"frame\":%" PRId64 "}", event.frame);
+                out += line;
+            }
+            out += "}";
+        }
+        if (out.size() > (1 << 20)) {
+            fwrite(out.data(), 1, out.size(), fp);
+            out.clear();
+        }
+    }
+    out += "\n]}\n";
+
+    bool ok = fwrite(out.data(), 1, out.size(), fp) == out.size();
+    ok = fclose(fp) == 0 && ok;
+    if (!ok) {
+        log_error("Could not write trace file %s", filename.c_str());
+        return false;
+    }
+    if (dropped_events > 0) {
+        log_warn("Trace %s dropped %" PRIu64 " events over the per-thread limit", filename.c_str(), dropped_events);
+    }
+    log_info("Trace written to %s", filename.c_str());
+    return true;
+}
+
+TraceScope::TraceScope(TraceRecorder* recorder, const char* name, int64_t frame)
+    : recorder_(recorder), name_(name), frame_(frame), begin_ns_(recorder ? MetricsNowNs() : 0) {}
+
+TraceScope::~TraceScope() {
+    if (recorder_ != nullptr) recorder_->Record(name_, begin_ns_, MetricsNowNs(), frame_);
+}
+
+ScopedStage::ScopedStage(LatencyHistogram* histogram, TraceRecorder* recorder, const char* name, int64_t frame)
+    : histogram_(histogram), recorder_(recorder), name_(name), frame_(frame), begin_ns_(MetricsNowNs()) {}
+
+ScopedStage::~ScopedStage() {
+    int64_t end_ns = MetricsNowNs();
+    histogram_->Record(end_ns - begin_ns_);
+    if (recorder_ != nullptr) recorder_->Record(name_, begin_ns_, end_ns, frame_);
+}
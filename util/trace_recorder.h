@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct TraceEvent {
+    const char* name;
+    int64_t begin_ns;
+    int64_t duration_ns;
+    int64_t frame;
+};
+
+// Per-session timeline of stage spans, dumped as Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev).
+// Every thread appends to its own buffer, so recording takes no lock after a thread's first event.
+class TraceRecorder {
+public:
+    void Record(const char* name, int64_t begin_ns, int64_t end_ns, int64_t frame);
+    // Labels the calling thread in the timeline.
+    void NameThread(const std::string& name);
+
+    // Must only be called once the threads that record into this session are done.
+    bool Dump(const std::string& filename);
+
+    explicit TraceRecorder(const std::string& session);
+    ~TraceRecorder();
+
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+private:
+    struct ThreadBuffer {
+        int tid;
+        std::string name;
+        std::vector<TraceEvent> events;
+        uint64_t dropped_events = 0;
+    };
+
+    // Caps memory for very long sessions, later events are counted but not kept.
+    static const size_t max_events_per_thread_ = 1 << 20;
+
+    std::string session_;
+    uint64_t id_;
+    std::mutex mux_;
+    std::map<int, ThreadBuffer*> buffers_;
+
+    ThreadBuffer* GetThreadBuffer();
+};
+
+// Records the lifetime of the scope as one span. A null recorder makes it a no-op.
+class TraceScope {
+public:
+    TraceScope(TraceRecorder* recorder, const char* name, int64_t frame = -1);
+    ~TraceScope();
+
+private:
+    TraceRecorder* recorder_;
+    const char* name_;
+    int64_t frame_;
+    int64_t begin_ns_;
+};
+
+class LatencyHistogram;
+
+// Times one stage into a latency histogram and, when tracing, into the timeline too, reading the clock once for both.
+class ScopedStage {
+public:
+    ScopedStage(LatencyHistogram* histogram, TraceRecorder* recorder, const char* name, int64_t frame = -1);
+    ~ScopedStage();
+
+private:
+    LatencyHistogram* histogram_;
+    TraceRecorder* recorder_;
+    const char* name_;
+    int64_t frame_;
+    int64_t begin_ns_;
+};
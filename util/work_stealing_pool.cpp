@@ -0,0 +1,92 @@
+#include "work_stealing_pool.h"
+
+#include <algorithm>
+
+namespace {
+
+// Lets Submit find the calling worker's own deque.
+thread_local WorkStealingPool* current_pool = nullptr;
+thread_local int current_index = -1;
+
+}  // namespace
+
+WorkStealingPool* WorkStealingPool::Shared() {
+    static WorkStealingPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return &pool;
+}
+
+WorkStealingPool::WorkStealingPool(int thread_count)
+    : thread_count_(std::max(1, thread_count)), pending_(0), next_queue_(0), stolen_tasks_(0) {
+    for (int i = 0; i < thread_count_; ++i) {
+        queues_.emplace_back(new WorkerQueue());
+    }
+    for (int i = 0; i < thread_count_; ++i) {
+        threads_.emplace_back(&WorkStealingPool::WorkerLoop, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::unique_lock<std::mutex> lock(idle_mux_);
+        stop_ = true;
+    }
+    idle_cond_.notify_all();
+    for (auto& t : threads_) {
+        t.join();
+    }
+}
+
+void WorkStealingPool::Submit(Task task) {
+    int index;
+    if (current_pool == this) {
+        index = current_index;
+    } else {
+        index = next_queue_.fetch_add(1, std::memory_order_relaxed) % thread_count_;
+    }
+    {
+        std::unique_lock<std::mutex> lock(queues_[index]->mux);
+        queues_[index]->tasks.push_back(std::move(task));
+    }
+    pending_.fetch_add(1);
+    // Taking the lock orders the increment before a sleeping worker's check, so the wakeup can not be lost.
+    { std::unique_lock<std::mutex> lock(idle_mux_); }
+    idle_cond_.notify_one();
+}
+
+bool WorkStealingPool::PopLocal(int index, Task& task) {
+    WorkerQueue* queue = queues_[index].get();
+    std::unique_lock<std::mutex> lock(queue->mux);
+    if (queue->tasks.empty()) return false;
+    task = std::move(queue->tasks.back());
+    queue->tasks.pop_back();
+    return true;
+}
+
+bool WorkStealingPool::Steal(int index, Task& task) {
+    for (int i = 1; i < thread_count_; ++i) {
+        WorkerQueue* queue = queues_[(index + i) % thread_count_].get();
+        std::unique_lock<std::mutex> lock(queue->mux);
+        if (queue->tasks.empty()) continue;
+        task = std::move(queue->tasks.front());
+        queue->tasks.pop_front();
+        stolen_tasks_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+void WorkStealingPool::WorkerLoop(int index) {
+    current_pool = this;
+    current_index = index;
+    while (true) {
+        Task task;
+        if (PopLocal(index, task) || Steal(index, task)) {
+            pending_.fetch_sub(1);
+            task();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(idle_mux_);
+        idle_cond_.wait(lock, [&]() { return pending_.load() > 0 || stop_; });
+        if (stop_ && pending_.load() == 0) break;
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads meant to be shared by everything in the process that has per-frame work to run. Every
+// worker owns a deque: tasks submitted from a worker go to the back of its own deque and are taken from there again
+// (the frame is still in its cache), idle workers steal from the front of the others. Tasks submitted from outside the
+// pool are spread round robin.
+class WorkStealingPool {
+public:
+    typedef std::function<void()> Task;
+
+    // One worker per hardware thread, lives as long as the process.
+    static WorkStealingPool* Shared();
+
+    void Submit(Task task);
+
+    int ThreadCount() const { return thread_count_; }
+    uint64_t StolenTasks() const { return stolen_tasks_.load(std::memory_order_relaxed); }
+
+    explicit WorkStealingPool(int thread_count);
+    // Runs the tasks still queued, then joins the workers.
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+private:
+    struct WorkerQueue {
+        std::mutex mux;
+        std::deque<Task> tasks;
+    };
+
+    int thread_count_;
+    std::vector<std::unique_ptr<WorkerQueue>> queues_;
+    std::vector<std::thread> threads_;
+
+    // Tasks queued but not taken yet, workers only sleep when it is zero.
+    std::atomic<int64_t> pending_;
+    std::atomic<uint64_t> next_queue_;
+    std::atomic<uint64_t> stolen_tasks_;
+
+    std::mutex idle_mux_;
+    std::condition_variable idle_cond_;
+    bool stop_ = false;
+
+    void WorkerLoop(int index);
+    bool PopLocal(int index, Task& task);
+    bool Steal(int index, Task& task);
+};